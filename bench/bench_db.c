@@ -0,0 +1,391 @@
+#if !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <ftw.h>
+#include <lmdb.h>
+#include <log.h>
+#include <mkdirp.h>
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "latency.h"
+
+// Storage microbenchmark: runs db_put, db_interactive_put on unchanged keys,
+// db_get and db_list_keys over every combination of sync mode, value size,
+// key count and keys per write transaction, each in a fresh environment.
+
+typedef struct sync_mode sync_mode;
+struct sync_mode {
+  char const* name;
+  unsigned int flags;
+};
+
+typedef struct op_result op_result;
+struct op_result {
+  double ops_per_s;
+  latency_summary latency;
+  uint64_t bytes_copied;
+};
+
+typedef struct db_config db_config;
+struct db_config {
+  sync_mode sync;
+  int value_size;
+  int num_keys;
+  int batch_size;
+};
+
+typedef struct db_results db_results;
+struct db_results {
+  db_config config;
+  op_result put;
+  op_result interactive_put;
+  op_result get;
+  op_result list_keys;
+};
+
+static sync_mode const sync_modes[] = {
+    {"sync", 0}, {"nometasync", MDB_NOMETASYNC}, {"nosync", MDB_NOSYNC}};
+
+static int remove_entry(char const* path, struct stat const* info, int flag,
+                        struct FTW* ftw);
+static int* parse_list(char const* text, int* count);
+static bool list_contains(char const* text, char const* name);
+static char* key_at(char* buffer, int i);
+static int run_writes(MDB_env* env, db_config const* config, char* value,
+                      bool interactive, op_result* result);
+static int run_gets(MDB_env* env, db_config const* config, op_result* result);
+static int run_list_keys(MDB_env* env, op_result* result);
+static int run_config(char const* root, db_config const* config,
+                      db_results* results);
+static sds cat_op(sds out, char const* name, op_result const* op);
+static void print_results(FILE* out, db_results const* results);
+
+static int remove_entry(char const* path, struct stat const* info, int flag,
+                        struct FTW* ftw) {
+  (void)info;
+  (void)flag;
+  (void)ftw;
+  return remove(path);
+}
+
+// Comma separated positive integers, "64,1024".
+static int* parse_list(char const* text, int* count) {
+  int* values = (void*)0;
+  *count = 0;
+  int num_parts = 0;
+  sds* parts = sdssplitlen(text, (ssize_t)strlen(text), ",", 1, &num_parts);
+  values = calloc((size_t)(num_parts > 0 ? num_parts : 1), sizeof(int));
+  for (int i = 0; values && i < num_parts; i += 1) {
+    int value = atoi(parts[i]);
+    if (value > 0) {
+      values[*count] = value;
+      *count += 1;
+    }
+  }
+  sdsfreesplitres(parts, num_parts);
+  return values;
+}
+
+static bool list_contains(char const* text, char const* name) {
+  int num_parts = 0;
+  sds* parts = sdssplitlen(text, (ssize_t)strlen(text), ",", 1, &num_parts);
+  bool found = false;
+  for (int i = 0; i < num_parts && !found; i += 1) {
+    found = strcmp(parts[i], name) == 0;
+  }
+  sdsfreesplitres(parts, num_parts);
+  return found;
+}
+
+static char* key_at(char* buffer, int i) {
+  snprintf(buffer, 32, "key%09d", i);
+  return buffer;
+}
+
+// Writes every key once, committing after batch_size puts. The latency is
+// per call, the throughput includes the commits.
+static int run_writes(MDB_env* env, db_config const* config, char* value,
+                      bool interactive, op_result* result) {
+  uint64_t* samples = calloc((size_t)config->num_keys, sizeof(uint64_t));
+  if (!samples) {
+    return -1;
+  }
+  int rc = 0;
+  char key[32];
+  uint64_t start_ns = latency_clock_ns();
+  for (int i = 0; rc == 0 && i < config->num_keys;) {
+    MDB_txn* txn = db_txn_init(env, false);
+    MDB_dbi db_handle = txn ? db_get_handle(txn, "bench", true) : 0;
+    if (db_handle == 0) {
+      db_txn_terminate(txn, false);
+      rc = -1;
+      break;
+    }
+    int end = i + config->batch_size;
+    for (; i < end && i < config->num_keys; i += 1) {
+      uint64_t op_ns = latency_clock_ns();
+      int put_rc = interactive
+                       ? db_interactive_put(txn, db_handle, key_at(key, i),
+                                            value)
+                       : db_put(txn, db_handle, key_at(key, i), value);
+      samples[i] = latency_clock_ns() - op_ns;
+      // A put hands the key and the value to LMDB, a repeated interactive
+      // put copies the new and the stored value into an sds each.
+      result->bytes_copied += interactive
+                                  ? 2 * (uint64_t)config->value_size
+                                  : strlen(key) + 1 + config->value_size + 1;
+      if (put_rc < 0 || (!interactive && put_rc != 0)) {
+        log_error("bench_db::run_writes put failed for %s", key);
+        rc = -1;
+        break;
+      }
+    }
+    if (db_txn_terminate(txn, rc == 0) != 0) {
+      rc = -1;
+    }
+  }
+  double total_s = latency_elapsed_ms(start_ns) / 1e3;
+  result->ops_per_s = total_s > 0 ? config->num_keys / total_s : 0;
+  result->latency = latency_summarize(samples, config->num_keys);
+  free(samples);
+  return rc;
+}
+
+// Random keys from one read transaction, every hit is copied into an sds.
+static int run_gets(MDB_env* env, db_config const* config, op_result* result) {
+  uint64_t* samples = calloc((size_t)config->num_keys, sizeof(uint64_t));
+  MDB_txn* txn = db_txn_init(env, true);
+  MDB_dbi db_handle = txn ? db_get_handle(txn, "bench", false) : 0;
+  if (!samples || db_handle == 0) {
+    free(samples);
+    db_txn_terminate(txn, false);
+    return -1;
+  }
+  int rc = 0;
+  char key[32];
+  uint64_t state = 0x2545f4914f6cdd1dull;
+  uint64_t start_ns = latency_clock_ns();
+  for (int i = 0; i < config->num_keys; i += 1) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    int k = (int)(state % (uint64_t)config->num_keys);
+    uint64_t op_ns = latency_clock_ns();
+    sds value = db_get(txn, db_handle, key_at(key, k));
+    samples[i] = latency_clock_ns() - op_ns;
+    if (!value) {
+      rc = -1;
+      break;
+    }
+    result->bytes_copied += sdslen(value);
+    sdsfree(value);
+  }
+  double total_s = latency_elapsed_ms(start_ns) / 1e3;
+  result->ops_per_s = total_s > 0 ? config->num_keys / total_s : 0;
+  result->latency = latency_summarize(samples, config->num_keys);
+  db_txn_terminate(txn, false);
+  free(samples);
+  return rc;
+}
+
+static int run_list_keys(MDB_env* env, op_result* result) {
+  enum { num_listings = 20 };
+  uint64_t samples[num_listings];
+  MDB_txn* txn = db_txn_init(env, true);
+  MDB_dbi db_handle = txn ? db_get_handle(txn, "bench", false) : 0;
+  if (db_handle == 0) {
+    db_txn_terminate(txn, false);
+    return -1;
+  }
+  int rc = 0;
+  uint64_t start_ns = latency_clock_ns();
+  for (int i = 0; i < num_listings; i += 1) {
+    uint64_t op_ns = latency_clock_ns();
+    sds listing = db_list_keys(txn, db_handle, false);
+    samples[i] = latency_clock_ns() - op_ns;
+    if (!listing) {
+      rc = -1;
+      break;
+    }
+    result->bytes_copied += sdslen(listing);
+    sdsfree(listing);
+  }
+  double total_s = latency_elapsed_ms(start_ns) / 1e3;
+  result->ops_per_s = total_s > 0 ? num_listings / total_s : 0;
+  result->latency = latency_summarize(samples, num_listings);
+  db_txn_terminate(txn, false);
+  return rc;
+}
+
+static int run_config(char const* root, db_config const* config,
+                      db_results* results) {
+  *results = (db_results){.config = *config};
+  sds dir = sdscatfmt(sdsempty(), "%s/%s_%i_%i_%i", root, config->sync.name,
+                      config->value_size, config->num_keys,
+                      config->batch_size);
+  char* value = malloc((size_t)config->value_size + 1);
+  MDB_env* env = (void*)0;
+  int rc = -1;
+  if (!value || mkdirp(dir, 0777) != 0) {
+    goto end;
+  }
+  for (int i = 0; i < config->value_size; i += 1) {
+    value[i] = (char)('a' + i % 26);
+  }
+  value[config->value_size] = '\0';
+  env = db_env_init(dir, false, 4);
+  if (!env || mdb_env_set_flags(env, config->sync.flags, 1) != 0) {
+    goto end;
+  }
+  // The second pass writes the same values again, which is the path an
+  // unchanged re-index takes through db_interactive_put.
+  if (run_writes(env, config, value, false, &results->put) != 0 ||
+      run_writes(env, config, value, true, &results->interactive_put) != 0 ||
+      run_gets(env, config, &results->get) != 0 ||
+      run_list_keys(env, &results->list_keys) != 0) {
+    goto end;
+  }
+  rc = 0;
+end:
+  if (rc != 0) {
+    log_error("bench_db::run_config failed for %s", dir);
+  }
+  if (env) {
+    db_env_terminate(env);
+  }
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  free(value);
+  sdsfree(dir);
+  return rc;
+}
+
+static sds cat_op(sds out, char const* name, op_result const* op) {
+  out = sdscatprintf(out, ", \"%s\": {\"ops_per_s\": %.1f, \"bytes_copied\": "
+                          "%llu, \"latency\": ",
+                     name, op->ops_per_s, (unsigned long long)op->bytes_copied);
+  out = latency_cat_json(out, &op->latency);
+  return sdscat(out, "}");
+}
+
+static void print_results(FILE* out, db_results const* r) {
+  struct {
+    char const* name;
+    op_result const* op;
+  } const rows[] = {{"put", &r->put},
+                    {"interactive_put", &r->interactive_put},
+                    {"get", &r->get},
+                    {"list_keys", &r->list_keys}};
+  fprintf(out, "%s, %d byte values, %d keys, %d per txn\n",
+          r->config.sync.name, r->config.value_size, r->config.num_keys,
+          r->config.batch_size);
+  for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i += 1) {
+    fprintf(out,
+            "  %-16s %12.0f ops/s  p50 %8.2f us  p99 %8.2f us  %llu bytes\n",
+            rows[i].name, rows[i].op->ops_per_s, rows[i].op->latency.p50_us,
+            rows[i].op->latency.p99_us,
+            (unsigned long long)rows[i].op->bytes_copied);
+  }
+}
+
+int main(int argc, char** argv) {
+  int num_sizes = 0;
+  int num_counts = 0;
+  int num_batches = 0;
+  int* sizes = parse_list("64,4096", &num_sizes);
+  int* counts = parse_list("5000", &num_counts);
+  int* batches = parse_list("1,1000", &num_batches);
+  char const* modes = "sync,nometasync,nosync";
+  char const* out_path = "bench_db.json";
+  char const* dir = "/tmp";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--sizes") == 0) {
+      free(sizes);
+      sizes = parse_list(argv[i + 1], &num_sizes);
+    } else if (strcmp(argv[i], "--keys") == 0) {
+      free(counts);
+      counts = parse_list(argv[i + 1], &num_counts);
+    } else if (strcmp(argv[i], "--batches") == 0) {
+      free(batches);
+      batches = parse_list(argv[i + 1], &num_batches);
+    } else if (strcmp(argv[i], "--sync") == 0) {
+      modes = argv[i + 1];
+    } else if (strcmp(argv[i], "--out") == 0) {
+      out_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--dir") == 0) {
+      dir = argv[i + 1];
+    } else {
+      log_error("bench_db::main unknown option %s", argv[i]);
+      return 2;
+    }
+  }
+  sds root = sdscatfmt(sdsempty(), "%s/scribe_bench_db_XXXXXX", dir);
+  if (!mkdtemp(root)) {
+    log_error("bench_db::main failed in creating a directory under %s", dir);
+    return 1;
+  }
+  // db_interactive_put reports every unchanged key on stdout.
+  FILE* report = stderr;
+  if (!freopen("/dev/null", "w", stdout)) {
+    log_error("bench_db::main failed in silencing stdout");
+  }
+  int rc = 0;
+  sds out = sdsnew("[");
+  int num_results = 0;
+  for (size_t m = 0; m < sizeof(sync_modes) / sizeof(sync_modes[0]); m += 1) {
+    if (!list_contains(modes, sync_modes[m].name)) {
+      continue;
+    }
+    for (int s = 0; s < num_sizes; s += 1) {
+      for (int c = 0; c < num_counts; c += 1) {
+        for (int b = 0; b < num_batches; b += 1) {
+          db_config config = {.sync = sync_modes[m],
+                              .value_size = sizes[s],
+                              .num_keys = counts[c],
+                              .batch_size = batches[b]};
+          db_results results;
+          if (run_config(root, &config, &results) != 0) {
+            rc = 1;
+            continue;
+          }
+          print_results(report, &results);
+          out = sdscatprintf(out,
+                             "%s\n  {\"sync\": \"%s\", \"value_size\": %d, "
+                             "\"keys\": %d, \"batch_size\": %d",
+                             num_results == 0 ? "" : ",", config.sync.name,
+                             config.value_size, config.num_keys,
+                             config.batch_size);
+          out = cat_op(out, "put", &results.put);
+          out = cat_op(out, "interactive_put", &results.interactive_put);
+          out = cat_op(out, "get", &results.get);
+          out = cat_op(out, "list_keys", &results.list_keys);
+          out = sdscat(out, "}");
+          num_results += 1;
+        }
+      }
+    }
+  }
+  out = sdscat(out, "\n]\n");
+  FILE* fp = fopen(out_path, "w");
+  if (!fp || fwrite(out, 1, sdslen(out), fp) != sdslen(out)) {
+    log_error("bench_db::main failed in writing %s", out_path);
+    rc = 1;
+  }
+  if (fp && fclose(fp) != 0) {
+    rc = 1;
+  }
+  rmdir(root);
+  sdsfree(out);
+  sdsfree(root);
+  free(sizes);
+  free(counts);
+  free(batches);
+  return rc;
+}
@@ -0,0 +1,299 @@
+#if !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <ftw.h>
+#include <log.h>
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "corpus.h"
+#include "indexer.h"
+#include "latency.h"
+#include "lisp.h"
+#include "query.h"
+#include "sink.h"
+#include "substitute.h"
+
+// End to end benchmark: generates a synthetic project, then times indexing,
+// re-indexing the unchanged tree, query latency with cold and warm session
+// caches, and rendering its document twice. Results go to a JSON file so
+// runs can be compared between releases.
+
+typedef struct bench_results bench_results;
+struct bench_results {
+  corpus_spec spec;
+  corpus_stats corpus;
+  double generate_ms;
+  double index_ms;
+  double reindex_ms;
+  latency_summary query_cold;
+  latency_summary query_warm;
+  int query_errors;
+  double render_cold_ms;
+  double render_warm_ms;
+};
+
+static int remove_entry(char const* path, struct stat const* info, int flag,
+                        struct FTW* ftw);
+static int run_index(void);
+static int run_queries(corpus_spec const* spec, int num_queries,
+                       bench_results* results);
+static int run_render(double* ms);
+static sds cat_latency(sds out, char const* name, latency_summary const* s);
+static int write_results(char const* path, bench_results const* results);
+static void print_results(FILE* out, bench_results const* results);
+
+static int remove_entry(char const* path, struct stat const* info, int flag,
+                        struct FTW* ftw) {
+  (void)info;
+  (void)flag;
+  (void)ftw;
+  return remove(path);
+}
+
+static int run_index(void) {
+  int rc = persist_project_details(".", false);
+  if (rc == 0) {
+    rc = index_files(".", false);
+  }
+  indexer_terminate();
+  return rc;
+}
+
+// The same random sample of functions is queried twice in one session, the
+// first pass parses and compiles, the second one is served from the caches.
+static int run_queries(corpus_spec const* spec, int num_queries,
+                       bench_results* results) {
+  uint64_t state = spec->seed ^ 0x5c0ffee;
+  sds* queries = calloc((size_t)num_queries, sizeof(sds));
+  uint64_t* samples = calloc((size_t)num_queries, sizeof(uint64_t));
+  if (!queries || !samples) {
+    free(queries);
+    free(samples);
+    return -1;
+  }
+  for (int i = 0; i < num_queries; i += 1) {
+    int file = (int)(corpus_random(&state) % (uint64_t)spec->num_files);
+    int function =
+        (int)(corpus_random(&state) % (uint64_t)spec->functions_per_file);
+    queries[i] = corpus_query(spec, file, function);
+  }
+  lisp_init_vm();
+  cache_enable("./scribe_db");
+  for (int pass = 0; pass < 2; pass += 1) {
+    for (int i = 0; i < num_queries; i += 1) {
+      bool ok = false;
+      uint64_t start_ns = latency_clock_ns();
+      sds value = evaluate_query_text(queries[i], &ok);
+      samples[i] = latency_clock_ns() - start_ns;
+      if (!ok) {
+        log_error("bench_e2e::run_queries %s failed: %s", queries[i], value);
+        results->query_errors += 1;
+      }
+      sdsfree(value);
+    }
+    latency_summary* summary =
+        pass == 0 ? &results->query_cold : &results->query_warm;
+    *summary = latency_summarize(samples, num_queries);
+  }
+  cache_terminate();
+  for (int i = 0; i < num_queries; i += 1) {
+    sdsfree(queries[i]);
+  }
+  free(queries);
+  free(samples);
+  return 0;
+}
+
+static int run_render(double* ms) {
+  int rc = -1;
+  uint64_t start_ns = latency_clock_ns();
+  char* contents = read_file_to_str("doc.md", (void*)0);
+  md_substitute_data d = {.code_text = sdsempty(),
+                          .output = sink_file_init("doc_out.md"),
+                          .doc_path = "doc.md"};
+  if (contents && d.output) {
+    rc = md_splice(contents, (MD_SIZE)strlen(contents), &d);
+  }
+  free(contents);
+  sdsfree(d.code_text);
+  if (sink_terminate(d.output) != 0) {
+    rc = -1;
+  }
+  *ms = latency_elapsed_ms(start_ns);
+  return rc;
+}
+
+static sds cat_latency(sds out, char const* name, latency_summary const* s) {
+  out = sdscatprintf(out, "  \"%s\": ", name);
+  out = latency_cat_json(out, s);
+  return sdscat(out, ",\n");
+}
+
+static int write_results(char const* path, bench_results const* results) {
+  corpus_spec const* spec = &results->spec;
+  corpus_stats const* corpus = &results->corpus;
+  double index_s = results->index_ms / 1e3;
+  sds out = sdscatprintf(
+      sdsempty(),
+      "{\n  \"spec\": {\"seed\": %llu, \"files\": %d, \"depth\": %d, "
+      "\"functions_per_file\": %d, \"statements_per_function\": %d, "
+      "\"blocks\": %d},\n"
+      "  \"corpus\": {\"files\": %zu, \"bytes\": %zu, \"functions\": %zu, "
+      "\"generate_ms\": %.3f},\n"
+      "  \"index\": {\"ms\": %.3f, \"files_per_s\": %.1f, "
+      "\"mb_per_s\": %.3f},\n"
+      "  \"reindex\": {\"ms\": %.3f},\n",
+      (unsigned long long)spec->seed, spec->num_files, spec->depth,
+      spec->functions_per_file, spec->statements_per_function,
+      spec->num_blocks, corpus->num_files, corpus->num_bytes,
+      corpus->num_functions, results->generate_ms, results->index_ms,
+      index_s > 0 ? corpus->num_files / index_s : 0.0,
+      index_s > 0 ? corpus->num_bytes / index_s / 1e6 : 0.0,
+      results->reindex_ms);
+  out = cat_latency(out, "query_cold", &results->query_cold);
+  out = cat_latency(out, "query_warm", &results->query_warm);
+  out = sdscatprintf(out,
+                     "  \"query_errors\": %d,\n"
+                     "  \"render\": {\"blocks\": %d, \"cold_ms\": %.3f, "
+                     "\"warm_ms\": %.3f}\n}\n",
+                     results->query_errors, spec->num_blocks,
+                     results->render_cold_ms, results->render_warm_ms);
+  int rc = -1;
+  FILE* fp = fopen(path, "w");
+  if (fp) {
+    size_t written = fwrite(out, 1, sdslen(out), fp);
+    rc = fclose(fp) == 0 && written == sdslen(out) ? 0 : -1;
+  }
+  if (rc != 0) {
+    log_error("bench_e2e::write_results failed in writing %s", path);
+  }
+  sdsfree(out);
+  return rc;
+}
+
+static void print_results(FILE* out, bench_results const* results) {
+  fprintf(out, "corpus   %zu files, %zu bytes, %zu functions\n",
+          results->corpus.num_files, results->corpus.num_bytes,
+          results->corpus.num_functions);
+  fprintf(out, "index    %10.3f ms\nreindex  %10.3f ms\n", results->index_ms,
+          results->reindex_ms);
+  latency_summary const* passes[2] = {&results->query_cold,
+                                      &results->query_warm};
+  char const* names[2] = {"cold", "warm"};
+  for (int i = 0; i < 2; i += 1) {
+    fprintf(out,
+            "query %s  p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+            names[i], passes[i]->p50_us, passes[i]->p90_us, passes[i]->p99_us,
+            passes[i]->max_us);
+  }
+  fprintf(out, "render   %10.3f ms cold, %.3f ms warm\n",
+          results->render_cold_ms, results->render_warm_ms);
+}
+
+int main(int argc, char** argv) {
+  bench_results results = {.spec = corpus_default_spec()};
+  corpus_spec* spec = &results.spec;
+  int num_queries = 200;
+  char const* out_path = "bench_e2e.json";
+  char const* dir = (void*)0;
+  bool generate_only = false;
+  for (int i = 1; i < argc; i += 1) {
+    char const* arg = argv[i];
+    char const* value = i + 1 < argc ? argv[i + 1] : (void*)0;
+    if (strcmp(arg, "--generate") == 0) {
+      generate_only = true;
+      continue;
+    }
+    if (!value) {
+      log_error("bench_e2e::main missing value for %s", arg);
+      return 2;
+    }
+    i += 1;
+    if (strcmp(arg, "--files") == 0) {
+      spec->num_files = atoi(value);
+    } else if (strcmp(arg, "--depth") == 0) {
+      spec->depth = atoi(value);
+    } else if (strcmp(arg, "--functions") == 0) {
+      spec->functions_per_file = atoi(value);
+    } else if (strcmp(arg, "--statements") == 0) {
+      spec->statements_per_function = atoi(value);
+    } else if (strcmp(arg, "--blocks") == 0) {
+      spec->num_blocks = atoi(value);
+    } else if (strcmp(arg, "--seed") == 0) {
+      spec->seed = strtoull(value, (void*)0, 10);
+    } else if (strcmp(arg, "--queries") == 0) {
+      num_queries = atoi(value);
+    } else if (strcmp(arg, "--out") == 0) {
+      out_path = value;
+    } else if (strcmp(arg, "--dir") == 0) {
+      dir = value;
+    } else {
+      log_error("bench_e2e::main unknown option %s", arg);
+      return 2;
+    }
+  }
+  // Without --dir the corpus lives in a fresh temporary directory that is
+  // removed again, so every run indexes from scratch.
+  char temp_dir[] = "/tmp/scribe_bench_XXXXXX";
+  if (!dir) {
+    dir = mkdtemp(temp_dir);
+    if (!dir) {
+      log_error("bench_e2e::main failed in creating a temporary directory");
+      return 1;
+    }
+  }
+  uint64_t start_ns = latency_clock_ns();
+  if (corpus_generate(dir, spec, &results.corpus) != 0) {
+    return 1;
+  }
+  results.generate_ms = latency_elapsed_ms(start_ns);
+  if (generate_only) {
+    fprintf(stderr, "generated %zu files in %s\n", results.corpus.num_files,
+            dir);
+    return 0;
+  }
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd)) || chdir(dir) != 0) {
+    log_error("bench_e2e::main failed in changing to %s", dir);
+    return 1;
+  }
+  sds results_path = out_path[0] == '/'
+                         ? sdsnew(out_path)
+                         : sdscatfmt(sdsempty(), "%s/%s", cwd, out_path);
+  // Re-indexing reports every unchanged key on stdout.
+  if (!freopen("/dev/null", "w", stdout)) {
+    log_error("bench_e2e::main failed in silencing stdout");
+  }
+  int rc = 0;
+  start_ns = latency_clock_ns();
+  rc |= run_index();
+  results.index_ms = latency_elapsed_ms(start_ns);
+  start_ns = latency_clock_ns();
+  rc |= run_index();
+  results.reindex_ms = latency_elapsed_ms(start_ns);
+  rc |= run_queries(spec, num_queries, &results);
+  rc |= run_render(&results.render_cold_ms);
+  rc |= run_render(&results.render_warm_ms);
+  lisp_terminate();
+  if (rc != 0 || results.query_errors > 0) {
+    log_error("bench_e2e::main a benchmark step failed");
+    rc = 1;
+  }
+  if (chdir(cwd) != 0 || write_results(results_path, &results) != 0) {
+    rc = 1;
+  }
+  print_results(stderr, &results);
+  if (dir == temp_dir) {
+    nftw(temp_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  sdsfree(results_path);
+  return rc;
+}
@@ -0,0 +1,194 @@
+#include "corpus.h"
+
+#include <log.h>
+#include <mkdirp.h>
+#include <sds.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+static int write_file(char const* dir, char const* name, sds contents);
+static sds cat_function(sds out, uint64_t* state, corpus_spec const* spec,
+                        int file, int function);
+static sds source_file(uint64_t* state, corpus_spec const* spec, int file);
+static sds header_file(corpus_spec const* spec, int file);
+static sds document(uint64_t* state, corpus_spec const* spec);
+
+corpus_spec corpus_default_spec(void) {
+  return (corpus_spec){.seed = 42,
+                       .num_files = 200,
+                       .depth = 3,
+                       .functions_per_file = 20,
+                       .statements_per_function = 8,
+                       .num_blocks = 100};
+}
+
+// splitmix64, small and the same on every platform.
+uint64_t corpus_random(uint64_t* state) {
+  *state += 0x9e3779b97f4a7c15ull;
+  uint64_t z = *state;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// Files are spread over a tree of four-way directories, depth levels deep.
+sds corpus_file_dir(corpus_spec const* spec, int file) {
+  sds dir = sdsnew("./src");
+  int rest = file;
+  for (int level = 0; level < spec->depth; level += 1) {
+    dir = sdscatfmt(dir, "/m%i", rest % 4);
+    rest /= 4;
+  }
+  return dir;
+}
+
+sds corpus_query(corpus_spec const* spec, int file, int function) {
+  sds dir = corpus_file_dir(spec, file);
+  sds query = sdscatfmt(sdsempty(),
+                        "(c/function-definition \"fn_%i_%i\" "
+                        "(core/file-src \"%S\" \"file%i.c\"))",
+                        file, function, dir, file);
+  sdsfree(dir);
+  return query;
+}
+
+static int write_file(char const* dir, char const* name, sds contents) {
+  if (mkdirp(dir, 0777) != 0) {
+    log_error("corpus::write_file failed in creating %s", dir);
+    return -1;
+  }
+  sds path = sdscatfmt(sdsempty(), "%s/%s", dir, name);
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    log_error("corpus::write_file failed in opening %s", path);
+    sdsfree(path);
+    return -1;
+  }
+  size_t written = fwrite(contents, 1, sdslen(contents), fp);
+  int rc = fclose(fp);
+  if (written != sdslen(contents) || rc != 0) {
+    log_error("corpus::write_file failed in writing %s", path);
+    rc = -1;
+  }
+  sdsfree(path);
+  return rc;
+}
+
+// Function bodies mix plain statements, branches, loops and calls so the
+// trees have some depth to them.
+static sds cat_function(sds out, uint64_t* state, corpus_spec const* spec,
+                        int file, int function) {
+  out = sdscatfmt(out, "int fn_%i_%i(int seed) {\n  int acc = seed;\n", file,
+                  function);
+  int limit = spec->statements_per_function * 2;
+  int num_statements = 1 + (int)(corpus_random(state) % (uint64_t)limit);
+  for (int i = 0; i < num_statements; i += 1) {
+    int n = (int)(corpus_random(state) % 1000);
+    switch (corpus_random(state) % 4) {
+      case 0:
+        out = sdscatfmt(out, "  acc += acc * %i;\n", n);
+        break;
+      case 1:
+        out = sdscatfmt(out, "  if (acc > %i) {\n    acc -= %i;\n  }\n", n,
+                        n / 2);
+        break;
+      case 2:
+        out = sdscatfmt(out,
+                        "  for (int i = 0; i < %i; i += 1) {\n"
+                        "    acc ^= i + %i;\n  }\n",
+                        n % 16, n);
+        break;
+      default:
+        if (function > 0) {
+          out = sdscatfmt(out, "  acc = fn_%i_%i(acc + %i);\n", file,
+                          function - 1, n);
+        } else {
+          out = sdscatfmt(out, "  acc = acc * 31 + %i;\n", n);
+        }
+        break;
+    }
+  }
+  return sdscat(out, "  return acc;\n}\n\n");
+}
+
+static sds source_file(uint64_t* state, corpus_spec const* spec, int file) {
+  sds out = sdscatfmt(sdsempty(),
+                      "// Generated benchmark source %i.\n\n"
+                      "#include \"file%i.h\"\n\n",
+                      file, file);
+  for (int i = 0; i < spec->functions_per_file; i += 1) {
+    out = cat_function(out, state, spec, file, i);
+  }
+  return out;
+}
+
+static sds header_file(corpus_spec const* spec, int file) {
+  sds out = sdscatfmt(sdsempty(), "#ifndef FILE%i_H\n#define FILE%i_H\n\n",
+                      file, file);
+  for (int i = 0; i < spec->functions_per_file; i += 1) {
+    out = sdscatfmt(out, "int fn_%i_%i(int seed);\n", file, i);
+  }
+  return sdscatfmt(out, "\n#endif  // FILE%i_H\n", file);
+}
+
+static sds document(uint64_t* state, corpus_spec const* spec) {
+  sds out = sdsnew("# Generated benchmark document\n\n");
+  for (int i = 0; i < spec->num_blocks; i += 1) {
+    int file = (int)(corpus_random(state) % (uint64_t)spec->num_files);
+    int function =
+        (int)(corpus_random(state) % (uint64_t)spec->functions_per_file);
+    sds query = corpus_query(spec, file, function);
+    out = sdscatfmt(out,
+                    "## Block %i\n\nThe definition of fn_%i_%i.\n\n"
+                    "```scribe\n%S\n```\n\n",
+                    i, file, function, query);
+    sdsfree(query);
+  }
+  return out;
+}
+
+// Writes the project under root: a .scribe file, one source and one header
+// per file and doc.md with the scribe blocks.
+int corpus_generate(char const* root, corpus_spec const* spec,
+                    corpus_stats* stats) {
+  uint64_t state = spec->seed;
+  *stats = (corpus_stats){0};
+  if (spec->num_files <= 0 || spec->functions_per_file <= 0 ||
+      spec->statements_per_function <= 0) {
+    log_error(
+        "corpus::corpus_generate needs files, functions and statements");
+    return -1;
+  }
+  sds scribe_file = sdsnew("(config/set-language \"c\")\n");
+  int rc = write_file(root, ".scribe", scribe_file);
+  sdsfree(scribe_file);
+  for (int i = 0; rc == 0 && i < spec->num_files; i += 1) {
+    sds dir = corpus_file_dir(spec, i);
+    sds full_dir = sdscatfmt(sdsempty(), "%s/%S", root, dir);
+    sds name = sdscatfmt(sdsempty(), "file%i.c", i);
+    sds source = source_file(&state, spec, i);
+    rc = write_file(full_dir, name, source);
+    stats->num_bytes += sdslen(source);
+    sdsclear(name);
+    name = sdscatfmt(name, "file%i.h", i);
+    sds header = header_file(spec, i);
+    if (rc == 0) {
+      rc = write_file(full_dir, name, header);
+    }
+    stats->num_bytes += sdslen(header);
+    stats->num_files += 2;
+    stats->num_functions += (size_t)spec->functions_per_file;
+    sdsfree(header);
+    sdsfree(source);
+    sdsfree(name);
+    sdsfree(full_dir);
+    sdsfree(dir);
+  }
+  if (rc == 0) {
+    sds doc = document(&state, spec);
+    rc = write_file(root, "doc.md", doc);
+    sdsfree(doc);
+  }
+  return rc;
+}
@@ -0,0 +1,34 @@
+#ifndef SCRIBE_CORPUS_H
+#define SCRIBE_CORPUS_H
+
+#include <sds.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Shape of a synthetic project. The same spec always produces the same
+// files byte for byte.
+typedef struct corpus_spec corpus_spec;
+struct corpus_spec {
+  uint64_t seed;
+  int num_files;
+  int depth;
+  int functions_per_file;
+  int statements_per_function;
+  int num_blocks;
+};
+
+typedef struct corpus_stats corpus_stats;
+struct corpus_stats {
+  size_t num_files;
+  size_t num_bytes;
+  size_t num_functions;
+};
+
+corpus_spec corpus_default_spec(void);
+uint64_t corpus_random(uint64_t* state);
+sds corpus_file_dir(corpus_spec const* spec, int file);
+sds corpus_query(corpus_spec const* spec, int file, int function);
+int corpus_generate(char const* root, corpus_spec const* spec,
+                    corpus_stats* stats);
+
+#endif  // SCRIBE_CORPUS_H
@@ -0,0 +1,35 @@
+#ifndef SCRIBE_ARENA_H
+#define SCRIBE_ARENA_H
+
+#include <sds.h>
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct arena arena;
+struct arena {
+  arena_chunk* first;
+  arena_chunk* current;
+  size_t chunk_size;
+};
+
+typedef struct arena_mark arena_mark;
+struct arena_mark {
+  arena_chunk* chunk;
+  size_t used;
+};
+
+void arena_init(arena* a, size_t chunk_size);
+void arena_destroy(arena* a);
+void* arena_alloc(arena* a, size_t size);
+sds arena_sdsnewlen(arena* a, void const* init, size_t len);
+arena_mark arena_save(arena const* a);
+void arena_restore(arena* a, arena_mark mark);
+
+arena* scratch_arena(void);
+arena_mark scratch_begin(void);
+void scratch_end(arena_mark mark);
+void scratch_reset(void);
+void scratch_release(void);
+
+#endif  // SCRIBE_ARENA_H
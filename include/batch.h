@@ -0,0 +1,8 @@
+#ifndef SCRIBE_BATCH_H
+#define SCRIBE_BATCH_H
+
+#include <stdio.h>
+
+int run_batch(char const* path, int num_workers, FILE* out);
+
+#endif  // SCRIBE_BATCH_H
@@ -0,0 +1,39 @@
+#ifndef SCRIBE_BUDGET_H
+#define SCRIBE_BUDGET_H
+
+#include <janet.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tree_sitter/api.h>
+
+typedef enum budget_status {
+  BUDGET_OK,
+  BUDGET_TIMED_OUT,
+  BUDGET_CANCELLED,
+} budget_status;
+
+// Limits for one query, a zero timeout or match limit means no limit. The
+// deadline is fixed by the first budget_begin, so a lazy cursor keeps the
+// deadline it was started with.
+typedef struct query_budget query_budget;
+struct query_budget {
+  uint64_t timeout_micros;
+  uint32_t match_limit;
+  uint32_t start_byte;
+  uint32_t end_byte;
+  uint64_t deadline_ns;
+};
+
+query_budget budget_defaults(void);
+query_budget budget_from_options(Janet* argv, int32_t argc, int32_t n);
+void budget_begin(query_budget* budget);
+budget_status budget_end(void);
+budget_status budget_check(void);
+char const* budget_status_text(budget_status status);
+void budget_apply_parser(TSParser* parser);
+void budget_apply_cursor(TSQueryCursor* cursor);
+bool budget_cancelled(void);
+void budget_arm_interrupt(void);
+void budget_disarm_interrupt(void);
+
+#endif  // SCRIBE_BUDGET_H
@@ -0,0 +1,23 @@
+#ifndef SCRIBE_CACHE_H
+#define SCRIBE_CACHE_H
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <tree_sitter/api.h>
+
+int cache_enable(char const* db_path);
+bool cache_enabled(void);
+char const* cache_generation(void);
+size_t cache_snapshot_id(void);
+void cache_refresh(void);
+void cache_terminate(void);
+void cache_print_stats(FILE* out);
+sds cache_peek_file_src(char const* path, char const* name);
+sds cache_file_src(char const* path, char const* name);
+TSTree* cache_acquire_tree(TSLanguage* lang, sds src);
+void cache_release_tree(TSTree* tree);
+TSQuery* cache_acquire_query(TSLanguage* lang, sds query_string);
+void cache_release_query(TSQuery* query);
+
+#endif  // SCRIBE_CACHE_H
@@ -0,0 +1,6 @@
+#ifndef SCRIBE_CHECK_H
+#define SCRIBE_CHECK_H
+
+int check_documents(char const** paths, int num_paths, int num_workers);
+
+#endif  // SCRIBE_CHECK_H
@@ -2,7 +2,17 @@
 #define SCRIBE_CORE_QUERIES_H
 
 #include <janet.h>
+#include <sds.h>
+#include <stdbool.h>
 
+typedef struct source_arg source_arg;
+struct source_arg {
+  sds text;
+  bool borrowed;
+};
+
+source_arg get_source_arg(Janet* argv, int32_t n);
+void release_source_arg(source_arg arg);
 void register_core_module(JanetTable* env);
 
 #endif  // SCRIBE_CORE_QUERIES_H
@@ -9,12 +9,18 @@ MDB_env* db_env_init(char const* path, bool read_only, MDB_dbi max_dbs);
 void db_env_terminate(MDB_env* env);
 MDB_txn* db_txn_init(MDB_env* env, bool read_only);
 int db_txn_terminate(MDB_txn* txn, bool commit);
+size_t db_txn_id(MDB_txn* txn);
+size_t db_env_last_txn_id(MDB_env* env);
 MDB_dbi db_get_handle(MDB_txn* txn, char const* name, bool create_if_not_exist);
 int db_put(MDB_txn* txn, MDB_dbi db_handle, char* key, char* value);
+int db_replace(MDB_txn* txn, MDB_dbi db_handle, char* key, char* value);
 int db_delete(MDB_txn* txn, MDB_dbi db_handle, char* key);
 int db_interactive_put(MDB_txn* txn, MDB_dbi db_handle, char* key, char* value);
 sds db_get(MDB_txn* txn, MDB_dbi db_handle, char* key);
 sds db_list_items(MDB_txn* txn, MDB_dbi db_handle);
 sds db_list_keys(MDB_txn* txn, MDB_dbi db_handle, bool omit_sub_keys);
+MDB_cursor* db_cursor_init(MDB_txn* txn, MDB_dbi db_handle);
+sds db_cursor_next_key(MDB_cursor* cursor, bool omit_sub_keys);
+void db_cursor_terminate(MDB_cursor* cursor);
 
 #endif  // SCRIBE_DB_H
@@ -452,6 +452,11 @@ CREDITS
 #define strreset    stbds_strreset
 #endif
 
+// scribe accounts arrays and hash maps under HEAP_STB_DS, see heap.h.
+#include "heap.h"
+#define STBDS_REALLOC(c,p,s) heap_realloc(HEAP_STB_DS,p,s)
+#define STBDS_FREE(c,p)      heap_free(HEAP_STB_DS,p)
+
 #if defined(STBDS_REALLOC) && !defined(STBDS_FREE) || !defined(STBDS_REALLOC) && defined(STBDS_FREE)
 #error "You must define both STBDS_REALLOC and STBDS_FREE, or neither."
 #endif
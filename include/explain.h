@@ -0,0 +1,8 @@
+#ifndef SCRIBE_EXPLAIN_H
+#define SCRIBE_EXPLAIN_H
+
+#include <janet.h>
+
+void register_explain_module(JanetTable* env);
+
+#endif  // SCRIBE_EXPLAIN_H
@@ -0,0 +1,17 @@
+#ifndef SCRIBE_HASH_H
+#define SCRIBE_HASH_H
+
+#include <sds.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct hash128 hash128;
+struct hash128 {
+  uint64_t lo;
+  uint64_t hi;
+};
+
+hash128 hash_bytes(void const* data, size_t len);
+sds hash_to_hex(hash128 hash);
+
+#endif  // SCRIBE_HASH_H
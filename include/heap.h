@@ -0,0 +1,36 @@
+#ifndef SCRIBE_HEAP_H
+#define SCRIBE_HEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum heap_tag {
+  HEAP_SDS,
+  HEAP_STB_DS,
+  HEAP_JANET,
+  HEAP_TREE_SITTER,
+  HEAP_NUM_TAGS
+} heap_tag;
+
+typedef struct heap_stats heap_stats;
+struct heap_stats {
+  size_t live_bytes;
+  size_t peak_bytes;
+  size_t allocations;
+};
+
+// The allocator hooks of sds (sdsalloc.h), stb_ds (STBDS_REALLOC), janet
+// (janetconf.h) and tree-sitter (ts_alloc.c) all land here. This header is
+// included by those vendored sources as well, so it sticks to headers that
+// do not pin any feature macros.
+void* heap_malloc(heap_tag tag, size_t size);
+void* heap_calloc(heap_tag tag, size_t count, size_t size);
+void* heap_realloc(heap_tag tag, void* buffer, size_t size);
+void heap_free(heap_tag tag, void* buffer);
+
+void heap_enable(void);
+bool heap_enabled(void);
+heap_stats heap_tag_stats(heap_tag tag);
+char const* heap_tag_name(heap_tag tag);
+
+#endif  // SCRIBE_HEAP_H
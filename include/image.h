@@ -0,0 +1,12 @@
+#ifndef SCRIBE_IMAGE_H
+#define SCRIBE_IMAGE_H
+
+#include <janet.h>
+
+JanetTable* image_build_env(JanetTable* core_env);
+JanetBuffer* image_marshal_env(JanetTable* env, JanetTable* core_env);
+JanetTable* image_env(void);
+JanetTable* image_lookup(void);
+JanetTable* image_reverse_lookup(void);
+
+#endif  // SCRIBE_IMAGE_H
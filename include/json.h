@@ -0,0 +1,12 @@
+#ifndef SCRIBE_JSON_H
+#define SCRIBE_JSON_H
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+sds json_cat_string(sds s, char const* str, size_t len);
+sds json_get_member(char const* text, size_t len, char const* key,
+                    bool* is_string);
+
+#endif  // SCRIBE_JSON_H
@@ -0,0 +1,22 @@
+#ifndef SCRIBE_LATENCY_H
+#define SCRIBE_LATENCY_H
+
+#include <sds.h>
+#include <stdint.h>
+
+typedef struct latency_summary latency_summary;
+struct latency_summary {
+  int count;
+  double mean_us;
+  double p50_us;
+  double p90_us;
+  double p99_us;
+  double max_us;
+};
+
+uint64_t latency_clock_ns(void);
+double latency_elapsed_ms(uint64_t start_ns);
+latency_summary latency_summarize(uint64_t* samples_ns, int count);
+sds latency_cat_json(sds out, latency_summary const* s);
+
+#endif  // SCRIBE_LATENCY_H
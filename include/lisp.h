@@ -3,10 +3,13 @@
 
 #include <janet.h>
 
+void lisp_init_vm(void);
+JanetTable* lisp_child_env(JanetTable* parent);
 JanetTable* lisp_init_env(void);
 void lisp_register_module(JanetTable* env, char const* module_name,
                           JanetReg* cfuns);
 void lisp_terminate(void);
 int lisp_execute_script(JanetTable* env, char const* src, Janet* out);
+int lisp_execute_form(JanetTable* env, Janet form, Janet* out);
 
 #endif  // SCRIBE_LISP_H
@@ -0,0 +1,58 @@
+#ifndef SCRIBE_METRICS_H
+#define SCRIBE_METRICS_H
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum metric_counter {
+  METRIC_FILES_INDEXED,
+  METRIC_BYTES_READ,
+  METRIC_LMDB_GETS,
+  METRIC_LMDB_PUTS,
+  METRIC_QUERY_COMPILES,
+  METRIC_SOURCE_CACHE_HITS,
+  METRIC_SOURCE_CACHE_MISSES,
+  METRIC_TREE_CACHE_HITS,
+  METRIC_TREE_CACHE_MISSES,
+  METRIC_QUERY_CACHE_HITS,
+  METRIC_QUERY_CACHE_MISSES,
+  METRIC_CACHE_INVALIDATIONS,
+  METRIC_VM_BOOTS,
+  METRIC_BLOCKS_RENDERED,
+  METRIC_PARSE_ALLOCATIONS,
+  METRIC_PARSE_ALLOCATED_BYTES,
+  METRIC_PARSE_POOL_REUSES,
+  METRIC_NUM_COUNTERS
+} metric_counter;
+
+typedef enum metric_gauge {
+  METRIC_LIVE_VMS,
+  METRIC_CACHED_SOURCE_BYTES,
+  METRIC_NUM_GAUGES
+} metric_gauge;
+
+typedef enum metric_histogram {
+  METRIC_COMPILE_TIME,
+  METRIC_EVAL_TIME,
+  METRIC_LMDB_TIME,
+  METRIC_PARSE_TIME,
+  METRIC_QUERY_TIME,
+  METRIC_QUERY_COMPILE_TIME,
+  METRIC_BLOCK_TIME,
+  METRIC_NUM_HISTOGRAMS
+} metric_histogram;
+
+typedef enum metrics_format { METRICS_JSON, METRICS_PROMETHEUS } metrics_format;
+
+void metrics_enable(void);
+bool metrics_enabled(void);
+void metrics_add(metric_counter counter, uint64_t n);
+void metrics_gauge_add(metric_gauge gauge, int64_t delta);
+void metrics_observe(metric_histogram histogram, uint64_t ns);
+sds metrics_json(void);
+sds metrics_prometheus(void);
+void metrics_dump(FILE* out, metrics_format format);
+
+#endif  // SCRIBE_METRICS_H
@@ -0,0 +1,9 @@
+#ifndef SCRIBE_PARALLEL_H
+#define SCRIBE_PARALLEL_H
+
+#include <janet.h>
+
+void register_parallel_module(JanetTable* env);
+void parallel_terminate(void);
+
+#endif  // SCRIBE_PARALLEL_H
@@ -0,0 +1,66 @@
+#ifndef SCRIBE_PROFILE_H
+#define SCRIBE_PROFILE_H
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum profile_phase {
+  PROFILE_COMPILE,
+  PROFILE_EVAL,
+  PROFILE_LMDB,
+  PROFILE_PARSE,
+  PROFILE_QUERY,
+  PROFILE_QUERY_COMPILE,
+  PROFILE_NUM_PHASES
+} profile_phase;
+
+typedef enum profile_cache {
+  PROFILE_CACHE_HANDLE,
+  PROFILE_CACHE_SOURCE,
+  PROFILE_CACHE_TREE,
+  PROFILE_CACHE_QUERY,
+  PROFILE_NUM_CACHES
+} profile_cache;
+
+typedef struct profile_record profile_record;
+struct profile_record {
+  sds doc_path;
+  unsigned int line;
+  uint64_t total_ns;
+  uint64_t phase_ns[PROFILE_NUM_PHASES];
+  uint64_t phase_bytes[PROFILE_NUM_PHASES];
+  uint64_t bytes_copied;
+  uint64_t cache_hits[PROFILE_NUM_CACHES];
+  uint64_t cache_misses[PROFILE_NUM_CACHES];
+  uint64_t matches_scanned;
+  uint64_t matches_returned;
+  uint64_t tree_nodes;
+  uint64_t tree_bytes;
+  bool count_nodes;
+};
+
+void profile_enable(void);
+uint64_t profile_start(void);
+void profile_add_time(profile_phase phase, uint64_t start_ns);
+void profile_add_bytes(profile_phase phase, uint64_t bytes);
+void profile_cache_hit(profile_cache cache);
+void profile_cache_miss(profile_cache cache);
+void profile_add_matches(uint64_t scanned, uint64_t returned);
+bool profile_counting_nodes(void);
+void profile_add_tree(uint64_t nodes, uint64_t bytes);
+void profile_block_begin(char const* doc_path, unsigned int line);
+void profile_block_end(void);
+int profile_write_json(char const* path);
+void profile_print_summary(FILE* out);
+void profile_terminate(void);
+char const* profile_phase_name(profile_phase phase);
+char const* profile_cache_name(profile_cache cache);
+profile_record* profile_explain_begin(profile_record* record);
+void profile_explain_end(profile_record* outer);
+char const* profile_enter(char const* label);
+void profile_leave(char const* outer);
+char const* profile_label(void);
+
+#endif  // SCRIBE_PROFILE_H
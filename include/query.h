@@ -6,7 +6,11 @@
 #include <stdbool.h>
 
 bool db_exists(char const* path);
-void register_modules(JanetTable* env);
 sds get_language(void);
+sds get_generation(void);
+sds evaluate_query(char const* src);
+sds evaluate_query_text(char const* src, bool* ok);
+sds normalize_query(char const* src, size_t len);
+sds query_key(char const* src, size_t len);
 
 #endif  // SCRIBE_QUERIER_H
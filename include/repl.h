@@ -1,6 +1,6 @@
 #ifndef SCRIBE_REPL_H
 #define SCRIBE_REPL_H
 
-int launch_repl(int argc, char** argv);
+int launch_repl(int argc, char** argv, char const* record_path);
 
 #endif  // SCRIBE_REPL_H
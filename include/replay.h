@@ -0,0 +1,13 @@
+#ifndef SCRIBE_REPLAY_H
+#define SCRIBE_REPLAY_H
+
+#include <stddef.h>
+
+int replay_record_start(char const* path);
+void replay_record_input(char const* text, size_t len);
+void replay_record_prompt(void);
+void replay_record_discard(void);
+void replay_record_stop(void);
+int run_replay(char const* log_path, char const* out_path, int num_passes);
+
+#endif  // SCRIBE_REPLAY_H
@@ -0,0 +1,7 @@
+#ifndef SCRIBE_SAMPLER_H
+#define SCRIBE_SAMPLER_H
+
+int sampler_start(char const* out_path);
+int sampler_stop(void);
+
+#endif  // SCRIBE_SAMPLER_H
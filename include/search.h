@@ -0,0 +1,8 @@
+#ifndef SCRIBE_SEARCH_H
+#define SCRIBE_SEARCH_H
+
+#include <janet.h>
+
+void register_search_module(JanetTable* env);
+
+#endif  // SCRIBE_SEARCH_H
@@ -0,0 +1,9 @@
+#ifndef SCRIBE_SERVER_H
+#define SCRIBE_SERVER_H
+
+#include <sds.h>
+
+sds server_handle_request(char const* line, size_t len);
+int serve(char const* socket_path, int num_workers);
+
+#endif  // SCRIBE_SERVER_H
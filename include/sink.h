@@ -0,0 +1,28 @@
+#ifndef SCRIBE_SINK_H
+#define SCRIBE_SINK_H
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum sink_kind { SINK_FD, SINK_SDS } sink_kind;
+
+typedef struct output_sink output_sink;
+struct output_sink {
+  sink_kind kind;
+  int fd;
+  bool owns_fd;
+  char* buffer;
+  size_t buffered;
+  size_t written;
+  sds str;
+};
+
+output_sink* sink_file_init(char const* path);
+output_sink* sink_fd_init(int fd);
+output_sink* sink_sds_init(void);
+int sink_write(output_sink* sink, char const* data, size_t len);
+int sink_flush(output_sink* sink);
+int sink_terminate(output_sink* sink);
+
+#endif  // SCRIBE_SINK_H
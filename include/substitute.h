@@ -5,15 +5,27 @@
 #include <sds.h>
 #include <stdbool.h>
 
+#include "sink.h"
+
 typedef struct md_substitute_data md_substitute_data;
 struct md_substitute_data {
-  sds output;
+  output_sink* output;
   sds code_text;
-  bool is_ordered_list;
-  unsigned int current_index;
+  char const* doc_path;
+  unsigned int block_line;
+};
+
+typedef struct scribe_block scribe_block;
+struct scribe_block {
+  MD_OFFSET start;
+  MD_OFFSET end;
+  MD_OFFSET code_start;
+  MD_SIZE code_size;
+  unsigned int line;
 };
 
-int md_substitute(const MD_CHAR* input, MD_SIZE input_size,
-                  md_substitute_data* data);
+scribe_block* find_scribe_blocks(const MD_CHAR* input, MD_SIZE input_size);
+int md_splice(const MD_CHAR* input, MD_SIZE input_size,
+              md_substitute_data* data);
 
 #endif  // SCRIBE_SUBSTITUTE_H
@@ -0,0 +1,11 @@
+#ifndef SCRIBE_SYNTAX_TREE_H
+#define SCRIBE_SYNTAX_TREE_H
+
+#include <janet.h>
+#include <sds.h>
+#include <tree_sitter/api.h>
+
+Janet syntax_tree_wrap(TSTree* tree, sds src);
+void register_node_module(JanetTable* env);
+
+#endif  // SCRIBE_SYNTAX_TREE_H
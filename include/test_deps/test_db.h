@@ -0,0 +1,69 @@
+#ifndef SCRIBE_TEST_DB_H
+#define SCRIBE_TEST_DB_H
+
+// A scratch directory holding an empty scribe db, made current for the
+// length of a test. Needs _POSIX_C_SOURCE 200809L for mkdtemp.
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "db.h"
+
+typedef struct test_db test_db;
+struct test_db {
+  char dir[32];
+  char cwd[1024];
+};
+
+// Leaves the current directory as it was when any step fails, so a test
+// that asserts on the result never writes next to the sources.
+static inline bool test_db_enter(test_db* db) {
+  strcpy(db->dir, "/tmp/scribe_test_XXXXXX");
+  if (!getcwd(db->cwd, sizeof(db->cwd)) || !mkdtemp(db->dir)) {
+    return false;
+  }
+  if (chdir(db->dir) != 0) {
+    rmdir(db->dir);
+    return false;
+  }
+  if (mkdir("scribe_db", 0755) != 0) {
+    chdir(db->cwd);
+    rmdir(db->dir);
+    return false;
+  }
+  return true;
+}
+
+static inline int test_db_put(char const* db_name, char const* key,
+                              char const* value) {
+  MDB_env* env = db_env_init("./scribe_db", false, 100);
+  MDB_txn* txn = env ? db_txn_init(env, false) : (void*)0;
+  MDB_dbi db_handle = txn ? db_get_handle(txn, db_name, true) : 0;
+  int rc = db_handle == 0 ? -1
+                          : db_replace(txn, db_handle, (char*)key,
+                                       (char*)value);
+  db_txn_terminate(txn, rc == 0);
+  db_env_terminate(env);
+  return rc;
+}
+
+// Files the test wrote itself outside scribe_db are its own to remove.
+static inline void test_db_leave(test_db* db) {
+  sds data = sdscatfmt(sdsempty(), "%s/scribe_db/data.mdb", db->dir);
+  sds lock = sdscatfmt(sdsempty(), "%s/scribe_db/lock.mdb", db->dir);
+  sds db_dir = sdscatfmt(sdsempty(), "%s/scribe_db", db->dir);
+  unlink(data);
+  unlink(lock);
+  rmdir(db_dir);
+  chdir(db->cwd);
+  rmdir(db->dir);
+  sdsfree(data);
+  sdsfree(lock);
+  sdsfree(db_dir);
+}
+
+#endif  // SCRIBE_TEST_DB_H
@@ -1,13 +1,25 @@
 #ifndef SCRIBE_TRACE_H
 #define SCRIBE_TRACE_H
 
-#include <TracyC.h>
 #include <log.h>
+#include <stdint.h>
+
+#include "profile.h"
 
-#define INIT_TRACE TracyCZoneCtx ctx
+// Zones keep their context in a local of the enclosing block, so nested
+// zones and recursive calls each end their own zone. A zone is named after
+// its function unless a name is given, and has to end in the block it was
+// started in. Building with -Dtracing=false leaves TRACY_ENABLE undefined
+// and every macro here compiles to nothing.
+#if defined(TRACY_ENABLE)
+
+#include <TracyC.h>
 
-#define START_ZONE TracyCZoneS(ctx, 10, 1)
-#define END_ZONE TracyCZoneEnd(ctx)
+#define INIT_TRACE struct scribe_trace_unit
+
+#define START_ZONE TracyCZone(trace_zone, 1)
+#define START_NAMED_ZONE(NAME) TracyCZoneN(trace_zone, (NAME), 1)
+#define END_ZONE TracyCZoneEnd(trace_zone)
 
 #define MESSAGE_TRACE(TXT) TracyCMessageLC((TXT), 0xffffff)
 #define MESSAGE_DEBUG(TXT) TracyCMessageLC((TXT), 0xff1493)
@@ -17,9 +29,43 @@
 #define MESSAGE_FATAL(TXT) TracyCMessageLC((TXT), 0xff0000)
 
 #define RECORD_VALUE(NAME, VALUE) TracyCPlot((NAME), (VALUE))
+#define RECORD_ALLOC(PTR, SIZE, NAME) TracyCAllocN((PTR), (SIZE), (NAME))
+#define RECORD_FREE(PTR, NAME) TracyCFreeN((PTR), (NAME))
 
 #define MARK_FRAME(NAME) TracyCFrameMarkNamed((NAME))
 
+#else
+
+#define INIT_TRACE struct scribe_trace_unit
+
+#define START_ZONE (void)0
+#define START_NAMED_ZONE(NAME) (void)0
+#define END_ZONE (void)0
+
+#define MESSAGE_TRACE(TXT) (void)0
+#define MESSAGE_DEBUG(TXT) (void)0
+#define MESSAGE_INFO(TXT) (void)0
+#define MESSAGE_WARN(TXT) (void)0
+#define MESSAGE_ERROR(TXT) (void)0
+#define MESSAGE_FATAL(TXT) (void)0
+
+#define RECORD_VALUE(NAME, VALUE) (void)0
+#define RECORD_ALLOC(PTR, SIZE, NAME) (void)0
+#define RECORD_FREE(PTR, NAME) (void)0
+
+#define MARK_FRAME(NAME) (void)0
+
+#endif
+
+#define START_PHASE_ZONE(PHASE)              \
+  START_NAMED_ZONE(#PHASE);                  \
+  uint64_t phase_start_ns = profile_start(); \
+  char const* outer_label = profile_enter(profile_phase_name(PHASE))
+#define END_PHASE_ZONE(PHASE)                \
+  profile_leave(outer_label);                \
+  profile_add_time((PHASE), phase_start_ns); \
+  END_ZONE
+
 #define message_trace(TXT) \
   MESSAGE_TRACE((TXT));    \
   log_trace((TXT));
@@ -2,12 +2,15 @@
 #define SCRIBE_TREE_SITTER_H
 
 #include <sds.h>
+#include <stdint.h>
 #include <tree_sitter/api.h>
 
 TSParser* create_parser(TSLanguage* lang);
 TSTree* parse_string(TSParser* parser, sds src);
-sds* query_tree(sds src, TSLanguage* lang, TSTree* tree, sds query_string);
-sds query_filter_tree(sds src, TSLanguage* lang, TSTree* tree, sds query_string,
+TSQuery* create_query(TSLanguage* lang, sds query_string);
+sds* query_tree(sds src, TSQuery* query, TSTree* tree);
+sds query_filter_tree(sds src, TSQuery* query, TSTree* tree,
                       char const* filter_string, int filter_index);
+uint64_t tree_node_count(TSTree* tree);
 
 #endif  // SCRIBE_TREE_SITTER_H
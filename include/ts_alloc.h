@@ -0,0 +1,26 @@
+#ifndef SCRIBE_TS_ALLOC_H
+#define SCRIBE_TS_ALLOC_H
+
+#include <stddef.h>
+
+typedef struct ts_alloc_stats ts_alloc_stats;
+struct ts_alloc_stats {
+  size_t allocations;
+  size_t bytes;
+  size_t reuses;
+};
+
+// tree-sitter is compiled with its ts_malloc family pointed at these and
+// this header force included, see subprojects/tree_sitter/meson.build. It
+// sticks to stddef.h so that tree-sitter still picks its own feature macros.
+// Anything tree-sitter hands out for the caller to free, like
+// ts_node_string, goes back through scribe_ts_free.
+void* scribe_ts_malloc(size_t size);
+void* scribe_ts_calloc(size_t count, size_t size);
+void* scribe_ts_realloc(void* buffer, size_t size);
+void scribe_ts_free(void* buffer);
+
+ts_alloc_stats ts_alloc_thread_stats(void);
+void ts_alloc_release(void);
+
+#endif  // SCRIBE_TS_ALLOC_H
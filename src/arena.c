@@ -0,0 +1,218 @@
+#include "arena.h"
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+INIT_TRACE;
+
+#define ARENA_ALIGNMENT 16
+#define SCRATCH_CHUNK_SIZE (64 * 1024)
+
+// Chunks stay in the list when an arena is restored and are bumped into
+// again, so a steady stream of blocks or queries stops calling malloc once
+// the arena has grown to fit the largest of them. Only chunks made for a
+// single oversized allocation are given back on restore.
+struct arena_chunk {
+  arena_chunk* next;
+  size_t size;
+  size_t used;
+  bool oversized;
+  _Alignas(ARENA_ALIGNMENT) unsigned char data[];
+};
+
+static arena_chunk* new_chunk(size_t size, bool oversized);
+static size_t align_up(size_t n);
+
+// Scratch memory of the calling thread, see scratch_begin.
+static _Thread_local arena scratch = {0};
+
+static arena_chunk* new_chunk(size_t size, bool oversized) {
+  arena_chunk* chunk = malloc(sizeof(arena_chunk) + size);
+  if (!chunk) {
+    message_fatal("arena::new_chunk failed in allocating memory");
+    return (void*)0;
+  }
+  *chunk = (arena_chunk){.size = size, .oversized = oversized};
+  return chunk;
+}
+
+static size_t align_up(size_t n) {
+  return (n + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+void arena_init(arena* a, size_t chunk_size) {
+  *a = (arena){.chunk_size = chunk_size};
+}
+
+void arena_destroy(arena* a) {
+  START_ZONE;
+  arena_chunk* chunk = a->first;
+  while (chunk) {
+    arena_chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena_init(a, a->chunk_size);
+  END_ZONE;
+}
+
+// Memory is 16 byte aligned and lives until the arena is restored to a mark
+// taken before it, or destroyed.
+void* arena_alloc(arena* a, size_t size) {
+  size = align_up(size == 0 ? 1 : size);
+  arena_chunk* chunk = a->current;
+  if (chunk && chunk->size - chunk->used >= size) {
+    void* p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+  }
+  // Move on to the next kept chunk, or put a new one after the current one.
+  arena_chunk* next = chunk ? chunk->next : a->first;
+  if (!next || next->used != 0 || next->size < size) {
+    bool oversized = size > a->chunk_size;
+    next = new_chunk(oversized ? size : a->chunk_size, oversized);
+    if (!next) {
+      return (void*)0;
+    }
+    if (chunk) {
+      next->next = chunk->next;
+      chunk->next = next;
+    } else {
+      next->next = a->first;
+      a->first = next;
+    }
+  }
+  a->current = next;
+  next->used = size;
+  return next->data;
+}
+
+// The copy is a read-only sds: sdslen and friends work, but it must never be
+// grown or handed to sdsfree, the arena owns it.
+sds arena_sdsnewlen(arena* a, void const* init, size_t len) {
+  struct sdshdr64* header = arena_alloc(a, sizeof(struct sdshdr64) + len + 1);
+  if (!header) {
+    return (void*)0;
+  }
+  header->len = len;
+  header->alloc = len;
+  header->flags = SDS_TYPE_64;
+  if (len > 0) {
+    memcpy(header->buf, init, len);
+  }
+  header->buf[len] = '\0';
+  return header->buf;
+}
+
+arena_mark arena_save(arena const* a) {
+  return (arena_mark){.chunk = a->current,
+                      .used = a->current ? a->current->used : 0};
+}
+
+// Everything allocated since the mark is released in one step.
+void arena_restore(arena* a, arena_mark mark) {
+  arena_chunk* prev = mark.chunk;
+  arena_chunk* chunk = prev ? prev->next : a->first;
+  while (chunk && chunk->used != 0) {
+    arena_chunk* next = chunk->next;
+    if (chunk->oversized) {
+      free(chunk);
+      if (prev) {
+        prev->next = next;
+      } else {
+        a->first = next;
+      }
+    } else {
+      chunk->used = 0;
+      prev = chunk;
+    }
+    chunk = next;
+  }
+  if (mark.chunk) {
+    mark.chunk->used = mark.used;
+  }
+  a->current = mark.chunk;
+}
+
+arena* scratch_arena(void) {
+  if (scratch.chunk_size == 0) {
+    arena_init(&scratch, SCRATCH_CHUNK_SIZE);
+  }
+  return &scratch;
+}
+
+// Scratch scopes nest. A scope left by a janet panic is not a leak, the
+// enclosing scope takes its memory along when it ends.
+arena_mark scratch_begin(void) { return arena_save(scratch_arena()); }
+
+void scratch_end(arena_mark mark) { arena_restore(scratch_arena(), mark); }
+
+// For places where nothing can be live anymore, like the repl prompt.
+void scratch_reset(void) {
+  arena_restore(scratch_arena(), (arena_mark){.chunk = (void*)0});
+}
+
+void scratch_release(void) { arena_destroy(scratch_arena()); }
+
+#ifdef UNIT_TEST_ARENA
+
+#include "test_deps/utest.h"
+
+UTEST(arena, restore_reuses_chunks) {
+  arena a;
+  arena_init(&a, 128);
+  char* first = arena_alloc(&a, 8);
+  ASSERT_TRUE(((uintptr_t)first % ARENA_ALIGNMENT) == 0);
+  arena_mark mark = arena_save(&a);
+  char* second = arena_alloc(&a, 100);
+  arena_alloc(&a, 100);
+  ASSERT_TRUE(a.current != mark.chunk);
+  arena_alloc(&a, 1000);
+  ASSERT_TRUE(a.current->oversized);
+  arena_restore(&a, mark);
+  ASSERT_TRUE(a.current == mark.chunk);
+  ASSERT_TRUE(arena_alloc(&a, 100) == second);
+  arena_alloc(&a, 100);
+  int num_chunks = 0;
+  for (arena_chunk* c = a.first; c; c = c->next) {
+    ASSERT_FALSE(c->oversized);
+    num_chunks += 1;
+  }
+  ASSERT_EQ(num_chunks, 2);
+  arena_destroy(&a);
+}
+
+UTEST(arena, read_only_sds) {
+  arena a;
+  arena_init(&a, 64);
+  sds s = arena_sdsnewlen(&a, "scribe", 6);
+  ASSERT_EQ(sdslen(s), (size_t)6);
+  ASSERT_STREQ(s, "scribe");
+  sds empty = arena_sdsnewlen(&a, (void*)0, 0);
+  ASSERT_EQ(sdslen(empty), (size_t)0);
+  sds copy = sdsdup(s);
+  ASSERT_STREQ(copy, "scribe");
+  sdsfree(copy);
+  arena_destroy(&a);
+}
+
+UTEST(arena, scratch_scopes_nest) {
+  arena_mark outer = scratch_begin();
+  arena_alloc(scratch_arena(), 32);
+  arena_mark inner = scratch_begin();
+  void* p = arena_alloc(scratch_arena(), 32);
+  scratch_end(inner);
+  ASSERT_TRUE(arena_alloc(scratch_arena(), 32) == p);
+  scratch_end(outer);
+  scratch_release();
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,469 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "batch.h"
+
+#include <ctype.h>
+#include <deps/stb_ds.h>
+#include <janet.h>
+#include <pthread.h>
+#include <sds.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "indexer.h"
+#include "json.h"
+#include "lisp.h"
+#include "query.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// One query of the input, line is where it starts. Repeated queries are
+// evaluated once, a repeat points at the first occurrence and is reported
+// as a duplicate.
+typedef struct batch_query batch_query;
+struct batch_query {
+  unsigned int line;
+  sds text;
+  int first;
+  sds result;
+  bool ok;
+  uint64_t elapsed_us;
+};
+
+typedef struct seen_query seen_query;
+struct seen_query {
+  char* key;
+  int value;
+};
+
+// Every worker reads through a snapshot of its own. A batch is only
+// reported when they all saw the same one, a batch that ran across an
+// index commit is run again.
+enum { BATCH_SNAPSHOT_ATTEMPTS = 3 };
+
+typedef struct batch_run batch_run;
+struct batch_run {
+  batch_query* queries;
+  int* unique;
+  atomic_int next;
+  atomic_size_t snapshot;
+  atomic_bool mixed_snapshots;
+};
+
+static uint64_t clock_us(void);
+static sds read_input(char const* path);
+static void add_query(batch_run* run, seen_query** seen, unsigned int line,
+                      char const* text, size_t len);
+static void collect_lines(batch_run* run, seen_query** seen, sds input);
+static void collect_forms(batch_run* run, seen_query** seen, sds input);
+static void collect_queries(batch_run* run, sds input, bool whole_forms);
+static void note_snapshot(batch_run* run, size_t snapshot);
+static void run_queries(batch_run* run);
+static void* batch_worker(void* arg);
+static void evaluate_queries(batch_run* run, int num_workers);
+static void clear_results(batch_run* run);
+static void write_result(FILE* out, batch_query const* query, bool duplicate);
+
+static uint64_t clock_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static sds read_input(char const* path) {
+  START_ZONE;
+  if (path) {
+    char* contents = read_file_to_str(path, (void*)0);
+    sds input = contents ? sdsnew(contents) : (void*)0;
+    free(contents);
+    END_ZONE;
+    return input;
+  }
+  sds input = sdsempty();
+  char chunk[4096];
+  size_t n = 0;
+  while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+    input = sdscatlen(input, chunk, n);
+  }
+  END_ZONE;
+  return input;
+}
+
+static void add_query(batch_run* run, seen_query** seen, unsigned int line,
+                      char const* text, size_t len) {
+  sds trimmed = sdstrim(sdsnewlen(text, len), " \t\r\n");
+  if (sdslen(trimmed) == 0) {
+    sdsfree(trimmed);
+    return;
+  }
+  batch_query query = {.line = line, .text = trimmed, .first = -1};
+  sds key = query_key(trimmed, sdslen(trimmed));
+  int index = shgeti(*seen, key);
+  if (index >= 0) {
+    query.first = (*seen)[index].value;
+  } else {
+    shput(*seen, key, (int)arrlen(run->queries));
+    arrput(run->unique, (int)arrlen(run->queries));
+  }
+  sdsfree(key);
+  arrput(run->queries, query);
+}
+
+// Every non-blank line is a query, lines starting with # are comments.
+static void collect_lines(batch_run* run, seen_query** seen, sds input) {
+  int num_lines = 0;
+  sds* lines = sdssplitlen(input, (ssize_t)sdslen(input), "\n", 1, &num_lines);
+  for (int i = 0; i < num_lines; i += 1) {
+    sdstrim(lines[i], " \t\r");
+    if (sdslen(lines[i]) == 0 || lines[i][0] == '#') {
+      continue;
+    }
+    add_query(run, seen, (unsigned int)i + 1, lines[i], sdslen(lines[i]));
+  }
+  sdsfreesplitres(lines, num_lines);
+}
+
+// Every top-level form is a query, however many lines it spans. A fresh
+// parser is used per form, as in replay.c, so no janet values are built.
+// A bare symbol or number only ends at the character after it, which is
+// left out of the form and, when it opens a new one, fed to the next
+// parser. Text that fails to parse, or is cut off at the end, becomes one
+// last query so that its error shows up in the results.
+static void collect_forms(batch_run* run, seen_query** seen, sds input) {
+  size_t len = sdslen(input);
+  size_t start = 0;
+  unsigned int line = 1;
+  unsigned int start_line = 1;
+  bool in_form = false;
+  bool in_comment = false;
+  JanetParser parser;
+  janet_parser_init(&parser);
+  for (size_t i = 0; i < len; i += 1) {
+    char c = input[i];
+    if (!in_form && !in_comment) {
+      if (c == '#') {
+        in_comment = true;
+      } else if (!isspace((unsigned char)c)) {
+        in_form = true;
+        start = i;
+        start_line = line;
+      }
+    }
+    if (c == '\n') {
+      line += 1;
+      in_comment = false;
+    }
+    janet_parser_consume(&parser, (uint8_t)c);
+    if (janet_parser_status(&parser) == JANET_PARSE_ERROR) {
+      break;
+    }
+    if (!janet_parser_has_more(&parser)) {
+      continue;
+    }
+    bool opens_next = c == '(' || c == '[' || c == '{';
+    add_query(run, seen, start_line, input + start,
+              (opens_next ? i : i + 1) - start);
+    janet_parser_deinit(&parser);
+    janet_parser_init(&parser);
+    in_form = false;
+    if (opens_next) {
+      in_form = true;
+      start = i;
+      start_line = line;
+      janet_parser_consume(&parser, (uint8_t)c);
+    }
+  }
+  if (in_form) {
+    add_query(run, seen, start_line, input + start, len - start);
+  }
+  janet_parser_deinit(&parser);
+}
+
+// Queries read from a file are whole forms, stdin keeps the one query per
+// line format that scripts already pipe in.
+static void collect_queries(batch_run* run, sds input, bool whole_forms) {
+  START_ZONE;
+  seen_query* seen = (void*)0;
+  sh_new_strdup(seen);
+  if (whole_forms) {
+    collect_forms(run, &seen, input);
+  } else {
+    collect_lines(run, &seen, input);
+  }
+  shfree(seen);
+  END_ZONE;
+}
+
+// The first snapshot noted is the one of the batch, a worker on any other
+// marks the whole run as mixed.
+static void note_snapshot(batch_run* run, size_t snapshot) {
+  size_t expected = 0;
+  if (snapshot == 0 ||
+      atomic_compare_exchange_strong(&run->snapshot, &expected, snapshot)) {
+    return;
+  }
+  if (expected != snapshot) {
+    atomic_store(&run->mixed_snapshots, true);
+  }
+}
+
+// The session cache is never refreshed during a batch, so every query of a
+// worker sees the snapshot the worker started with. A worker stops early
+// once the run is known to be mixed, its results are thrown away anyway.
+// Scratch memory is reset before each query, a query that raised may have
+// left a scope open.
+static void run_queries(batch_run* run) {
+  START_ZONE;
+  bool own_cache = !cache_enabled() && cache_enable("./scribe_db") == 0;
+  note_snapshot(run, cache_snapshot_id());
+  int num_unique = (int)arrlen(run->unique);
+  while (!atomic_load(&run->mixed_snapshots)) {
+    int i = atomic_fetch_add(&run->next, 1);
+    if (i >= num_unique) {
+      break;
+    }
+    batch_query* query = &run->queries[run->unique[i]];
+    scratch_reset();
+    uint64_t start_us = clock_us();
+    query->result = evaluate_query_text(query->text, &query->ok);
+    query->elapsed_us = clock_us() - start_us;
+  }
+  if (own_cache) {
+    cache_terminate();
+  }
+  END_ZONE;
+}
+
+static void* batch_worker(void* arg) {
+  lisp_init_vm();
+  run_queries((batch_run*)arg);
+  lisp_terminate();
+  return (void*)0;
+}
+
+static void evaluate_queries(batch_run* run, int num_workers) {
+  START_ZONE;
+  pthread_t* threads = (void*)0;
+  for (int i = 0; num_workers > 1 && i < num_workers; i += 1) {
+    pthread_t thread;
+    if (pthread_create(&thread, (void*)0, batch_worker, run) != 0) {
+      message_error("batch::evaluate_queries failed in creating worker");
+      break;
+    }
+    arrput(threads, thread);
+  }
+  if (arrlen(threads) == 0) {
+    run_queries(run);
+  }
+  for (int i = 0; i < arrlen(threads); i += 1) {
+    pthread_join(threads[i], (void*)0);
+  }
+  arrfree(threads);
+  END_ZONE;
+}
+
+static void clear_results(batch_run* run) {
+  for (int i = 0; i < arrlen(run->queries); i += 1) {
+    sdsfree(run->queries[i].result);
+    run->queries[i].result = (void*)0;
+    run->queries[i].ok = false;
+    run->queries[i].elapsed_us = 0;
+  }
+  atomic_store(&run->next, 0);
+  atomic_store(&run->snapshot, 0);
+  atomic_store(&run->mixed_snapshots, false);
+}
+
+static void write_result(FILE* out, batch_query const* query, bool duplicate) {
+  sds line = sdscatfmt(sdsempty(), "{\"id\":%u,\"ok\":%s,\"%s\":",
+                       query->line, query->ok ? "true" : "false",
+                       query->ok ? "value" : "error");
+  line = json_cat_string(line, query->result, sdslen(query->result));
+  line = sdscatfmt(line, ",\"elapsed_us\":%U,\"duplicate\":%s}\n",
+                   duplicate ? (uint64_t)0 : query->elapsed_us,
+                   duplicate ? "true" : "false");
+  fwrite(line, 1, sdslen(line), out);
+  sdsfree(line);
+}
+
+// Evaluates every form of path, or every line of stdin when path is NULL,
+// and writes one JSON object per query in input order, with the line the
+// query starts on as its id.
+int run_batch(char const* path, int num_workers, FILE* out) {
+  START_ZONE;
+  int rc = 0;
+  batch_run run = {.queries = (void*)0};
+  atomic_init(&run.next, 0);
+  atomic_init(&run.snapshot, 0);
+  atomic_init(&run.mixed_snapshots, false);
+  if (!db_exists(".")) {
+    message_fatal(
+        "batch::run_batch failed because scribe db not found in the current "
+        "directory");
+    END_ZONE;
+    return -1;
+  }
+  sds input = read_input(path);
+  if (!input) {
+    log_fatal("batch::run_batch failed in reading %s", path);
+    END_ZONE;
+    return -1;
+  }
+  // The janet parser allocates the forms it reads on the VM of the thread.
+  lisp_init_vm();
+  collect_queries(&run, input, path != (void*)0);
+  sdsfree(input);
+  if (num_workers > arrlen(run.unique)) {
+    num_workers = (int)arrlen(run.unique);
+  }
+  for (int attempt = 1; true; attempt += 1) {
+    evaluate_queries(&run, num_workers);
+    if (!atomic_load(&run.mixed_snapshots)) {
+      break;
+    }
+    if (attempt == BATCH_SNAPSHOT_ATTEMPTS) {
+      message_fatal(
+          "batch::run_batch failed because the index kept changing under the "
+          "workers");
+      rc = -1;
+      goto end;
+    }
+    log_info("batch::run_batch workers saw different snapshots, retrying");
+    clear_results(&run);
+  }
+  for (int i = 0; i < arrlen(run.queries); i += 1) {
+    batch_query* query = &run.queries[i];
+    bool duplicate = query->first >= 0;
+    batch_query const* source = duplicate ? &run.queries[query->first] : query;
+    batch_query shown = *source;
+    shown.line = query->line;
+    write_result(out, &shown, duplicate);
+    if (!shown.ok) {
+      rc = 1;
+    }
+  }
+  fflush(out);
+end:
+  for (int i = 0; i < arrlen(run.queries); i += 1) {
+    sdsfree(run.queries[i].text);
+    sdsfree(run.queries[i].result);
+  }
+  arrfree(run.queries);
+  arrfree(run.unique);
+  lisp_terminate();
+  END_ZONE;
+  return rc;
+}
+
+#ifdef UNIT_TEST_BATCH
+
+#include "test_deps/utest.h"
+
+UTEST(batch, file_queries_are_forms) {
+  lisp_init_vm();
+  batch_run run = {.queries = (void*)0};
+  sds input = sdsnew(
+      "(+ 1 2)\n"
+      "# a comment (+ 3 4)\n"
+      "(string\n"
+      "  \"a\" \"b\")\n"
+      "\n"
+      "(+ 1 2) :done(+ 5 6)\n");
+  collect_queries(&run, input, true);
+  ASSERT_EQ((int)arrlen(run.queries), 5);
+  ASSERT_STREQ("(+ 1 2)", run.queries[0].text);
+  ASSERT_EQ(run.queries[0].line, 1u);
+  ASSERT_STREQ("(string\n  \"a\" \"b\")", run.queries[1].text);
+  ASSERT_EQ(run.queries[1].line, 3u);
+  ASSERT_EQ(run.queries[2].first, 0);
+  ASSERT_EQ(run.queries[2].line, 6u);
+  ASSERT_STREQ(":done", run.queries[3].text);
+  ASSERT_STREQ("(+ 5 6)", run.queries[4].text);
+  ASSERT_EQ((int)arrlen(run.unique), 4);
+  for (int i = 0; i < arrlen(run.queries); i += 1) {
+    sdsfree(run.queries[i].text);
+  }
+  arrfree(run.queries);
+  arrfree(run.unique);
+  sdsfree(input);
+  lisp_terminate();
+}
+
+UTEST(batch, unparsable_rest_is_one_query) {
+  lisp_init_vm();
+  batch_run run = {.queries = (void*)0};
+  sds input = sdsnew("(+ 1 2)\n(+ 1\n(]\n(+ 3 4)\n");
+  collect_queries(&run, input, true);
+  ASSERT_EQ((int)arrlen(run.queries), 2);
+  ASSERT_STREQ("(+ 1\n(]\n(+ 3 4)", run.queries[1].text);
+  ASSERT_EQ(run.queries[1].line, 2u);
+  for (int i = 0; i < arrlen(run.queries); i += 1) {
+    sdsfree(run.queries[i].text);
+  }
+  arrfree(run.queries);
+  arrfree(run.unique);
+  sdsfree(input);
+  lisp_terminate();
+}
+
+UTEST(batch, structured_results_are_printed) {
+  lisp_init_vm();
+  bool ok = false;
+  sds text = evaluate_query_text("[1 \"a\" :b]", &ok);
+  ASSERT_TRUE(ok);
+  ASSERT_STREQ("(1 \"a\" :b)", text);
+  sdsfree(text);
+  text = evaluate_query_text("{:path \"src\" :lines [1 2]}", &ok);
+  ASSERT_TRUE(ok);
+  ASSERT_STREQ("{:lines (1 2) :path \"src\"}", text);
+  sdsfree(text);
+  text = evaluate_query_text("(string \"a\" \"b\")", &ok);
+  ASSERT_STREQ("ab", text);
+  sdsfree(text);
+  lisp_terminate();
+}
+
+UTEST(batch, workers_on_other_snapshots_mix_the_run) {
+  batch_run run = {.queries = (void*)0};
+  atomic_init(&run.snapshot, 0);
+  atomic_init(&run.mixed_snapshots, false);
+  note_snapshot(&run, 0);
+  note_snapshot(&run, 7);
+  note_snapshot(&run, 7);
+  ASSERT_FALSE(atomic_load(&run.mixed_snapshots));
+  note_snapshot(&run, 8);
+  ASSERT_TRUE(atomic_load(&run.mixed_snapshots));
+  clear_results(&run);
+  ASSERT_FALSE(atomic_load(&run.mixed_snapshots));
+  ASSERT_EQ(atomic_load(&run.snapshot), (size_t)0);
+}
+
+UTEST(batch, stdin_queries_are_lines) {
+  batch_run run = {.queries = (void*)0};
+  sds input = sdsnew("(+ 1 2)\n# comment\n\n(+ 1\n2)\n");
+  collect_queries(&run, input, false);
+  ASSERT_EQ((int)arrlen(run.queries), 3);
+  ASSERT_EQ(run.queries[1].line, 4u);
+  ASSERT_STREQ("(+ 1", run.queries[1].text);
+  for (int i = 0; i < arrlen(run.queries); i += 1) {
+    sdsfree(run.queries[i].text);
+  }
+  arrfree(run.queries);
+  arrfree(run.unique);
+  sdsfree(input);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,274 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "budget.h"
+
+#include <deps/cute_files.h>
+#include <janet.h>
+#include <lmdb.h>
+#include <pthread.h>
+#include <sds.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <tree_sitter/api.h>
+
+#include "db.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+typedef struct active_budget active_budget;
+struct active_budget {
+  bool active;
+  query_budget budget;
+  budget_status status;
+};
+
+static uint64_t clock_ns(void);
+static uint32_t read_setting(MDB_txn* txn, MDB_dbi db_handle, char* key);
+static void read_project_budget(void);
+static uint32_t get_option(JanetDictView opts, char const* key,
+                           uint32_t fallback);
+static void handle_interrupt(int signal);
+
+// The limits from the scribe file only change when the project is
+// re-indexed, so they are read from the db once per process.
+static pthread_mutex_t project_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool project_read = false;
+static query_budget project_budget = {.end_byte = UINT32_MAX};
+
+// Set from the SIGINT handler and read by every thread, tree-sitter polls
+// it while parsing.
+static volatile size_t cancel_flag = 0;
+static bool interrupt_armed = false;
+static struct sigaction previous_action;
+// The VM of the thread that armed the handler, the signal may be delivered
+// to any thread.
+static JanetVM* interrupt_vm = (void*)0;
+
+static _Thread_local active_budget current = {0};
+
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t read_setting(MDB_txn* txn, MDB_dbi db_handle, char* key) {
+  sds value = db_get(txn, db_handle, key);
+  if (!value) {
+    return 0;
+  }
+  unsigned long setting = strtoul(value, (void*)0, 10);
+  sdsfree(value);
+  return setting > UINT32_MAX ? UINT32_MAX : (uint32_t)setting;
+}
+
+static void read_project_budget(void) {
+  START_ZONE;
+  if (cf_file_exists("./scribe_db") != 1) {
+    END_ZONE;
+    return;
+  }
+  MDB_env* env = db_env_init("./scribe_db", false, 100);
+  MDB_txn* txn = env ? db_txn_init(env, true) : (void*)0;
+  MDB_dbi db_handle = txn ? db_get_handle(txn, "project", false) : 0;
+  if (db_handle == 0) {
+    message_error("budget::read_project_budget failed in reading the project");
+    goto end;
+  }
+  project_budget.timeout_micros =
+      (uint64_t)read_setting(txn, db_handle, "query_timeout_ms") * 1000;
+  project_budget.match_limit = read_setting(txn, db_handle, "match_limit");
+end:
+  if (txn) {
+    db_txn_terminate(txn, false);
+  }
+  db_env_terminate(env);
+  END_ZONE;
+}
+
+query_budget budget_defaults(void) {
+  pthread_mutex_lock(&project_lock);
+  if (!project_read) {
+    read_project_budget();
+    project_read = true;
+  }
+  query_budget budget = project_budget;
+  pthread_mutex_unlock(&project_lock);
+  return budget;
+}
+
+static uint32_t get_option(JanetDictView opts, char const* key,
+                           uint32_t fallback) {
+  Janet value = janet_dictionary_get(opts.kvs, opts.cap, janet_ckeywordv(key));
+  if (janet_checktype(value, JANET_NIL)) {
+    return fallback;
+  }
+  if (!janet_checkint(value) || janet_unwrap_integer(value) < 0) {
+    janet_panicf("expected a non-negative integer for :%s, got %v", key,
+                 value);
+  }
+  return (uint32_t)janet_unwrap_integer(value);
+}
+
+// Options given per call override the limits from the scribe file.
+query_budget budget_from_options(Janet* argv, int32_t argc, int32_t n) {
+  query_budget budget = budget_defaults();
+  if (argc <= n || janet_checktype(argv[n], JANET_NIL)) {
+    return budget;
+  }
+  JanetDictView opts = janet_getdictionary(argv, n);
+  uint32_t timeout_ms = get_option(
+      opts, "timeout-ms", (uint32_t)(budget.timeout_micros / 1000));
+  budget.timeout_micros = (uint64_t)timeout_ms * 1000;
+  budget.match_limit = get_option(opts, "match-limit", budget.match_limit);
+  budget.start_byte = get_option(opts, "start-byte", budget.start_byte);
+  budget.end_byte = get_option(opts, "end-byte", budget.end_byte);
+  if (budget.end_byte < budget.start_byte) {
+    janet_panicf(":end-byte %d is before :start-byte %d",
+                 (int32_t)budget.end_byte, (int32_t)budget.start_byte);
+  }
+  return budget;
+}
+
+void budget_begin(query_budget* budget) {
+  if (budget->timeout_micros && !budget->deadline_ns) {
+    budget->deadline_ns = clock_ns() + budget->timeout_micros * 1000;
+  }
+  current = (active_budget){.active = true, .budget = *budget};
+}
+
+budget_status budget_end(void) {
+  budget_status status = budget_check();
+  current = (active_budget){0};
+  return status;
+}
+
+// Once a budget is exceeded it stays exceeded until budget_end, so every
+// loop on the way out sees the same status.
+budget_status budget_check(void) {
+  if (current.status != BUDGET_OK) {
+    return current.status;
+  }
+  budget_status status = BUDGET_OK;
+  if (cancel_flag) {
+    status = BUDGET_CANCELLED;
+  } else if (current.active && current.budget.deadline_ns &&
+             clock_ns() >= current.budget.deadline_ns) {
+    status = BUDGET_TIMED_OUT;
+  }
+  if (current.active) {
+    current.status = status;
+  }
+  return status;
+}
+
+char const* budget_status_text(budget_status status) {
+  switch (status) {
+    case BUDGET_TIMED_OUT:
+      return "query timed out";
+    case BUDGET_CANCELLED:
+      return "query cancelled";
+    default:
+      return "ok";
+  }
+}
+
+// Parsing is only interrupted through tree-sitter's own timeout and
+// cancellation flag, the parser is left resumable so the caller has to
+// reset it.
+void budget_apply_parser(TSParser* parser) {
+  uint64_t timeout_micros = 0;
+  if (current.active && current.budget.deadline_ns) {
+    uint64_t now = clock_ns();
+    timeout_micros = now < current.budget.deadline_ns
+                         ? (current.budget.deadline_ns - now) / 1000 + 1
+                         : 1;
+  }
+  ts_parser_set_timeout_micros(parser, timeout_micros);
+  ts_parser_set_cancellation_flag(parser, (size_t const*)&cancel_flag);
+}
+
+void budget_apply_cursor(TSQueryCursor* cursor) {
+  if (!current.active) {
+    return;
+  }
+  if (current.budget.match_limit) {
+    ts_query_cursor_set_match_limit(cursor, current.budget.match_limit);
+  }
+  if (current.budget.start_byte || current.budget.end_byte != UINT32_MAX) {
+    ts_query_cursor_set_byte_range(cursor, current.budget.start_byte,
+                                   current.budget.end_byte);
+  }
+}
+
+bool budget_cancelled(void) { return cancel_flag != 0; }
+
+// The first Ctrl-C cancels whatever is being evaluated, a query at its next
+// check and janet code at its next call or backward jump, where the VM stops
+// and hands the fiber back to the event loop of the repl. A second one falls
+// back to the previous handler in case the evaluation never reaches either.
+static void handle_interrupt(int signal) {
+  if (cancel_flag) {
+    sigaction(SIGINT, &previous_action, (void*)0);
+    raise(signal);
+    return;
+  }
+  cancel_flag = 1;
+  if (interrupt_vm) {
+    janet_loop1_interrupt(interrupt_vm);
+  }
+}
+
+void budget_arm_interrupt(void) {
+  cancel_flag = 0;
+  interrupt_vm = janet_local_vm();
+  if (interrupt_armed) {
+    return;
+  }
+  struct sigaction action = {0};
+  action.sa_handler = handle_interrupt;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGINT, &action, &previous_action) == 0) {
+    interrupt_armed = true;
+  }
+}
+
+void budget_disarm_interrupt(void) {
+  if (interrupt_armed) {
+    sigaction(SIGINT, &previous_action, (void*)0);
+    interrupt_armed = false;
+  }
+  interrupt_vm = (void*)0;
+  cancel_flag = 0;
+}
+
+#ifdef UNIT_TEST_BUDGET
+
+#include "test_deps/utest.h"
+
+UTEST(budget, expired_deadline_times_out) {
+  query_budget budget = {.timeout_micros = 1, .end_byte = UINT32_MAX};
+  budget_begin(&budget);
+  struct timespec pause = {.tv_nsec = 1000000};
+  nanosleep(&pause, (void*)0);
+  ASSERT_EQ(budget_check(), BUDGET_TIMED_OUT);
+  ASSERT_EQ(budget_end(), BUDGET_TIMED_OUT);
+  ASSERT_EQ(budget_check(), BUDGET_OK);
+}
+
+UTEST(budget, no_timeout_never_expires) {
+  query_budget budget = {.end_byte = UINT32_MAX};
+  budget_begin(&budget);
+  ASSERT_EQ(budget.deadline_ns, (uint64_t)0);
+  ASSERT_EQ(budget_end(), BUDGET_OK);
+}
+
+UTEST_MAIN();
+
+#endif
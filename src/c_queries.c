@@ -2,8 +2,14 @@
 #include <janet.h>
 #include <tree_sitter/api.h>
 
+#include "arena.h"
+#include "budget.h"
+#include "cache.h"
+#include "core_queries.h"
 #include "lisp.h"
 #include "query.h"
+#include "profile.h"
+#include "syntax_tree.h"
 #include "trace.h"
 #include "tree_sitter.h"
 
@@ -11,42 +17,96 @@ INIT_TRACE;
 
 TSLanguage* tree_sitter_c();
 
-sds c_function_definition(JanetString name, JanetString src) {
-  sds src_sds = sdsnew(src);
-  sds query_sds = sdsnew(
-      "(function_definition (function_declarator (identifier) @func_name)) "
-      "@func_def");
-  TSParser* parser = (void*)0;
-  TSTree* tree = (void*)0;
-  parser = create_parser(tree_sitter_c());
-  if (!parser) {
-    message_fatal("c_queries::c_function_definition failed in creating parser");
-    goto end;
+// A live query over one source. Everything in here is owned, the session
+// cache may be refreshed while the captures are still being pulled.
+typedef struct query_cursor query_cursor;
+struct query_cursor {
+  TSQueryCursor* cursor;
+  TSQuery* query;
+  TSTree* tree;
+  sds src;
+  query_budget budget;
+};
+
+static void close_query_cursor(query_cursor* cursor);
+static int query_cursor_gc(void* data, size_t len);
+static void end_budget(void);
+
+static const JanetAbstractType query_cursor_type = {
+    "scribe/query-cursor", query_cursor_gc, JANET_ATEND_GC};
+
+static void close_query_cursor(query_cursor* cursor) {
+  START_ZONE;
+  if (cursor->cursor) {
+    ts_query_cursor_delete(cursor->cursor);
   }
-  tree = parse_string(parser, src_sds);
+  ts_query_delete(cursor->query);
+  ts_tree_delete(cursor->tree);
+  sdsfree(cursor->src);
+  *cursor = (query_cursor){0};
+  END_ZONE;
+}
+
+static int query_cursor_gc(void* data, size_t len) {
+  (void)len;
+  close_query_cursor((query_cursor*)data);
+  return 0;
+}
+
+// Ends the budget begun by a cfun and raises when it was exceeded.
+static void end_budget(void) {
+  budget_status status = budget_end();
+  if (status != BUDGET_OK) {
+    janet_panicf("%s", budget_status_text(status));
+  }
+}
+
+sds c_function_definition(char const* name, sds src) {
+  START_ZONE;
+  static char const query_text[] =
+      "(function_definition (function_declarator (identifier) @func_name)) "
+      "@func_def";
+  arena_mark scratch = scratch_begin();
+  sds query_sds =
+      arena_sdsnewlen(scratch_arena(), query_text, sizeof(query_text) - 1);
+  sds func_def = (void*)0;
+  TSQuery* query = (void*)0;
+  TSTree* tree = cache_acquire_tree(tree_sitter_c(), src);
   if (!tree) {
     message_fatal("c_queries::c_function_definition failed in parsing");
     goto end;
   }
-  sds func_def =
-      query_filter_tree(src_sds, tree_sitter_c(), tree, query_sds, name, 1);
+  query = cache_acquire_query(tree_sitter_c(), query_sds);
+  if (!query) {
+    message_fatal("c_queries::c_function_definition failed in creating query");
+    goto end;
+  }
+  func_def = query_filter_tree(src, query, tree, name, 1);
 end:
-  sdsfree(src_sds);
-  sdsfree(query_sds);
-  ts_parser_delete(parser);
-  ts_tree_delete(tree);
+  cache_release_query(query);
+  cache_release_tree(tree);
+  scratch_end(scratch);
   END_ZONE;
   return func_def;
 }
 
 static Janet cfun_c_function_definition(int32_t argc, Janet* argv) {
-  janet_fixarity(argc, 2);
+  janet_arity(argc, 2, 3);
   if (!db_exists(".")) {
     janet_panicf("scribe db not found in the current directory");
   }
   JanetString name = janet_getstring(argv, 0);
-  JanetString src = janet_getstring(argv, 1);
-  sds func_def = c_function_definition(name, src);
+  query_budget budget = budget_from_options(argv, argc, 2);
+  arena_mark scratch = scratch_begin();
+  source_arg src = get_source_arg(argv, 1);
+  budget_begin(&budget);
+  sds func_def = c_function_definition((char const*)name, src.text);
+  release_source_arg(src);
+  scratch_end(scratch);
+  if (budget_check() != BUDGET_OK) {
+    sdsfree(func_def);
+  }
+  end_budget();
   if (!func_def) {
     janet_panicf("no result to display");
   }
@@ -55,65 +115,179 @@ static Janet cfun_c_function_definition(int32_t argc, Janet* argv) {
   return janet_wrap_string(jstr);
 }
 
-sds* c_tree_sitter_query(JanetString query, JanetString src) {
+// The captures live in the scratch arena, only the array itself is the
+// caller's to free.
+sds* c_tree_sitter_query(JanetString query, sds src) {
   START_ZONE;
-  sds src_sds = sdsnew(src);
-  sds query_sds = sdsnew(query);
+  sds query_sds = arena_sdsnewlen(scratch_arena(), query,
+                                  (size_t)janet_string_length(query));
   sds* strs = (void*)0;
-  TSParser* parser = (void*)0;
-  TSTree* tree = (void*)0;
-  parser = create_parser(tree_sitter_c());
-  if (!parser) {
-    message_fatal("c_queries::c_tree_sitter_query failed in creating parser");
-    goto end;
-  }
-  tree = parse_string(parser, src_sds);
+  TSQuery* ts_query = (void*)0;
+  TSTree* tree = cache_acquire_tree(tree_sitter_c(), src);
   if (!tree) {
     message_fatal("c_queries::c_tree_sitter_query failed in parsing");
     goto end;
   }
-  strs = query_tree(src_sds, tree_sitter_c(), tree, query_sds);
+  ts_query = cache_acquire_query(tree_sitter_c(), query_sds);
+  if (!ts_query) {
+    message_fatal("c_queries::c_tree_sitter_query failed in creating query");
+    goto end;
+  }
+  strs = query_tree(src, ts_query, tree);
 end:
-  sdsfree(src_sds);
-  sdsfree(query_sds);
-  ts_parser_delete(parser);
-  ts_tree_delete(tree);
+  cache_release_query(ts_query);
+  cache_release_tree(tree);
   END_ZONE;
   return strs;
 }
 
 static Janet cfun_c_tree_sitter_query(int32_t argc, Janet* argv) {
-  janet_fixarity(argc, 2);
+  janet_arity(argc, 2, 3);
   if (!db_exists(".")) {
     janet_panicf("scribe db not found in the current directory");
   }
   JanetString query = janet_getstring(argv, 0);
-  JanetString src = janet_getstring(argv, 1);
-  sds* strs = c_tree_sitter_query(query, src);
-  if (!strs) {
+  query_budget budget = budget_from_options(argv, argc, 2);
+  arena_mark scratch = scratch_begin();
+  source_arg src = get_source_arg(argv, 1);
+  budget_begin(&budget);
+  sds* strs = c_tree_sitter_query(query, src.text);
+  release_source_arg(src);
+  // The captures are copied out before the budget may raise, so that the
+  // array and the scratch scope holding the captures are always let go.
+  JanetArray* jarr = (void*)0;
+  if (strs) {
+    int num_strs = arrlen(strs);
+    jarr = janet_array(num_strs);
+    jarr->count = num_strs;
+    for (int i = 0; i < num_strs; i += 1) {
+      const uint8_t* jstr = janet_string(strs[i], sdslen(strs[i]));
+      jarr->data[i] = janet_wrap_string(jstr);
+    }
+  }
+  arrfree(strs);
+  scratch_end(scratch);
+  end_budget();
+  if (!jarr) {
     janet_panicf("no results to display");
   }
-  int num_strs = arrlen(strs);
-  JanetArray* jarr = janet_array(num_strs);
-  jarr->count = num_strs;
-  for (int i = 0; i < num_strs; i += 1) {
-    const uint8_t* jstr = janet_string(strs[i], sdslen(strs[i]));
-    jarr->data[i] = janet_wrap_string(jstr);
+  return janet_wrap_array(jarr);
+}
+
+// The tree comes from the session cache when there is one, so parsing the
+// same file again is free.
+static Janet cfun_c_parse(int32_t argc, Janet* argv) {
+  janet_arity(argc, 1, 2);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
   }
-  for (int i = 0; i < num_strs; i += 1) {
-    sdsfree(strs[i]);
+  query_budget budget = budget_from_options(argv, argc, 1);
+  arena_mark scratch = scratch_begin();
+  source_arg src = get_source_arg(argv, 0);
+  budget_begin(&budget);
+  TSTree* tree = cache_acquire_tree(tree_sitter_c(), src.text);
+  if (!tree) {
+    release_source_arg(src);
+    scratch_end(scratch);
+    end_budget();
+    janet_panicf("failed in parsing");
   }
-  arrfree(strs);
-  return janet_wrap_array(jarr);
+  budget_end();
+  TSTree* owned_tree = ts_tree_copy(tree);
+  cache_release_tree(tree);
+  sds owned_src = src.borrowed ? sdsdup(src.text) : src.text;
+  scratch_end(scratch);
+  return syntax_tree_wrap(owned_tree, owned_src);
+}
+
+static Janet cfun_c_query_cursor(int32_t argc, Janet* argv) {
+  janet_arity(argc, 2, 3);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
+  }
+  query_budget budget = budget_from_options(argv, argc, 2);
+  JanetString query_string = janet_getstring(argv, 0);
+  arena_mark scratch = scratch_begin();
+  sds query_sds = arena_sdsnewlen(scratch_arena(), query_string,
+                                  janet_string_length(query_string));
+  source_arg src = get_source_arg(argv, 1);
+  TSQuery* query = create_query(tree_sitter_c(), query_sds);
+  if (!query) {
+    release_source_arg(src);
+    scratch_end(scratch);
+    janet_panicf("failed in creating query");
+  }
+  budget_begin(&budget);
+  TSTree* tree = cache_acquire_tree(tree_sitter_c(), src.text);
+  if (!tree) {
+    release_source_arg(src);
+    ts_query_delete(query);
+    scratch_end(scratch);
+    end_budget();
+    janet_panicf("failed in parsing");
+  }
+  query_cursor* cursor =
+      (query_cursor*)janet_abstract(&query_cursor_type, sizeof(query_cursor));
+  cursor->query = query;
+  cursor->tree = ts_tree_copy(tree);
+  cache_release_tree(tree);
+  cursor->src = src.borrowed ? sdsdup(src.text) : src.text;
+  scratch_end(scratch);
+  cursor->budget = budget;
+  cursor->cursor = ts_query_cursor_new();
+  budget_apply_cursor(cursor->cursor);
+  ts_query_cursor_exec(cursor->cursor, cursor->query,
+                       ts_tree_root_node(cursor->tree));
+  budget_end();
+  return janet_wrap_abstract(cursor);
+}
+
+static Janet cfun_c_query_cursor_next(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  query_cursor* cursor = janet_getabstract(argv, 0, &query_cursor_type);
+  if (!cursor->cursor) {
+    return janet_wrap_nil();
+  }
+  // The deadline was fixed when the cursor was started, so pulling the
+  // captures lazily does not stretch the budget.
+  budget_begin(&cursor->budget);
+  TSQueryMatch match = {0};
+  while (budget_check() == BUDGET_OK &&
+         ts_query_cursor_next_match(cursor->cursor, &match)) {
+    profile_add_matches(1, match.capture_count != 0);
+    if (match.capture_count != 0) {
+      TSNode captured_node = match.captures->node;
+      uint32_t start_byte = ts_node_start_byte(captured_node);
+      uint32_t end_byte = ts_node_end_byte(captured_node);
+      budget_end();
+      return janet_stringv((uint8_t*)cursor->src + start_byte,
+                           end_byte - start_byte);
+    }
+  }
+  close_query_cursor(cursor);
+  end_budget();
+  return janet_wrap_nil();
 }
 
 static const JanetReg c_cfuns[] = {
+    {"parse", cfun_c_parse,
+     "(c/parse src &opt opts)\n\nParse C source, a string or a core/file "
+     "handle, into a tree for the node/ functions. opts may hold "
+     ":timeout-ms."},
     {"tree-sitter-query", cfun_c_tree_sitter_query,
-     "(c/tree-sitter-query)\n\nExecute a tree-sitter query which captures one "
-     "node"},
+     "(c/tree-sitter-query query src &opt opts)\n\nExecute a tree-sitter "
+     "query which captures one node. opts may hold :timeout-ms, :match-limit, "
+     ":start-byte and :end-byte, the defaults come from the scribe file."},
+    {"query-cursor", cfun_c_query_cursor,
+     "(c/query-cursor query src &opt opts)\n\nStart a tree-sitter query over "
+     "src, see c/captures. opts are the same as for c/tree-sitter-query."},
+    {"query-cursor-next", cfun_c_query_cursor_next,
+     "(c/query-cursor-next cursor)\n\nText of the next capture, nil once the "
+     "query is exhausted."},
     {"function-definition", cfun_c_function_definition,
-     "(c/function-definition)\n\nReturn function defined by name"
-     "node"},
+     "(c/function-definition name src &opt opts)\n\nReturn function "
+     "defined by name. opts are the same as for c/tree-sitter-query."},
+    {(void*)0, (void*)0, (void*)0},
 };
 
 void register_c_module(JanetTable* env) {
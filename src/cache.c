@@ -0,0 +1,624 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "cache.h"
+
+#include <deps/stb_ds.h>
+#include <lmdb.h>
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <tree_sitter/api.h>
+
+#include "db.h"
+#include "hash.h"
+#include "metrics.h"
+#include "profile.h"
+#include "trace.h"
+#include "tree_sitter.h"
+
+INIT_TRACE;
+
+// Trees are bounded by the size of the sources they were parsed from, which
+// is cheap to track and roughly proportional to the memory of the tree.
+#define CACHE_MAX_TREE_SRC_BYTES (16 * 1024 * 1024)
+#define CACHE_MAX_SOURCE_BYTES (16 * 1024 * 1024)
+#define CACHE_MAX_QUERIES 256
+
+typedef struct source_entry source_entry;
+struct source_entry {
+  char* key;
+  sds value;
+  uint64_t last_used;
+};
+
+typedef struct tree_entry tree_entry;
+struct tree_entry {
+  char* key;
+  TSTree* value;
+  size_t src_size;
+  uint64_t last_used;
+};
+
+typedef struct query_entry query_entry;
+struct query_entry {
+  char* key;
+  TSQuery* value;
+  sds text;
+  uint64_t last_used;
+};
+
+typedef struct cache_counter cache_counter;
+struct cache_counter {
+  size_t hits;
+  size_t misses;
+};
+
+// Everything in here is owned by the session that enabled it. Sources are
+// tied to the index generation they were read under, trees and queries are
+// keyed by their content so they stay valid on their own, but they are
+// dropped together with the sources. On top of that the least recently used
+// sources, trees and queries are evicted once their caps are reached.
+typedef struct session_cache session_cache;
+struct session_cache {
+  bool enabled;
+  MDB_env* env;
+  MDB_txn* snapshot;
+  sds generation;
+  TSParser* parser;
+  source_entry* sources;
+  tree_entry* trees;
+  query_entry* queries;
+  uint64_t clock;
+  size_t source_bytes;
+  size_t max_source_bytes;
+  size_t tree_src_bytes;
+  size_t max_tree_src_bytes;
+  int max_queries;
+  size_t evictions;
+  cache_counter source_stats;
+  cache_counter tree_stats;
+  cache_counter query_stats;
+  size_t invalidations;
+};
+
+static sds read_generation(void);
+static void drop_entries(void);
+static void evict_sources(size_t incoming_bytes);
+static void evict_trees(size_t incoming_bytes);
+static void evict_queries(void);
+static sds language_key(TSLanguage* lang, char const* text, size_t len);
+static void record_tree_size(TSTree* tree, sds src);
+
+static _Thread_local session_cache cache = {0};
+
+static sds read_generation(void) {
+  START_ZONE;
+  MDB_dbi db_handle = db_get_handle(cache.snapshot, "project", false);
+  if (db_handle == 0) {
+    message_error(
+        "cache::read_generation failed in creating db handle for name: "
+        "project");
+    END_ZONE;
+    return (void*)0;
+  }
+  sds generation = db_get(cache.snapshot, db_handle, "generation");
+  END_ZONE;
+  return generation;
+}
+
+static void drop_entries(void) {
+  START_ZONE;
+  for (int i = 0; i < shlen(cache.sources); i += 1) {
+    metrics_gauge_add(METRIC_CACHED_SOURCE_BYTES,
+                      -(int64_t)sdslen(cache.sources[i].value));
+    sdsfree(cache.sources[i].value);
+  }
+  shfree(cache.sources);
+  sh_new_strdup(cache.sources);
+  cache.source_bytes = 0;
+  for (int i = 0; i < shlen(cache.trees); i += 1) {
+    ts_tree_delete(cache.trees[i].value);
+  }
+  shfree(cache.trees);
+  sh_new_strdup(cache.trees);
+  cache.tree_src_bytes = 0;
+  for (int i = 0; i < shlen(cache.queries); i += 1) {
+    ts_query_delete(cache.queries[i].value);
+    sdsfree(cache.queries[i].text);
+  }
+  shfree(cache.queries);
+  sh_new_strdup(cache.queries);
+  END_ZONE;
+}
+
+// Callers borrow at most one source, one tree and one query at a time and
+// give them back before acquiring another, so evicting right before an
+// insert never frees anything still in use. A single source or tree bigger
+// than its cap is still kept.
+static void evict_sources(size_t incoming_bytes) {
+  START_ZONE;
+  while (shlen(cache.sources) > 0 &&
+         cache.source_bytes + incoming_bytes > cache.max_source_bytes) {
+    int oldest = 0;
+    for (int i = 1; i < shlen(cache.sources); i += 1) {
+      if (cache.sources[i].last_used < cache.sources[oldest].last_used) {
+        oldest = i;
+      }
+    }
+    size_t size = sdslen(cache.sources[oldest].value);
+    cache.source_bytes -= size;
+    metrics_gauge_add(METRIC_CACHED_SOURCE_BYTES, -(int64_t)size);
+    sdsfree(cache.sources[oldest].value);
+    (void)shdel(cache.sources, cache.sources[oldest].key);
+    cache.evictions += 1;
+  }
+  END_ZONE;
+}
+
+static void evict_trees(size_t incoming_bytes) {
+  START_ZONE;
+  while (shlen(cache.trees) > 0 &&
+         cache.tree_src_bytes + incoming_bytes > cache.max_tree_src_bytes) {
+    int oldest = 0;
+    for (int i = 1; i < shlen(cache.trees); i += 1) {
+      if (cache.trees[i].last_used < cache.trees[oldest].last_used) {
+        oldest = i;
+      }
+    }
+    cache.tree_src_bytes -= cache.trees[oldest].src_size;
+    ts_tree_delete(cache.trees[oldest].value);
+    (void)shdel(cache.trees, cache.trees[oldest].key);
+    cache.evictions += 1;
+  }
+  END_ZONE;
+}
+
+static void evict_queries(void) {
+  START_ZONE;
+  while (shlen(cache.queries) > 0 &&
+         shlen(cache.queries) >= cache.max_queries) {
+    int oldest = 0;
+    for (int i = 1; i < shlen(cache.queries); i += 1) {
+      if (cache.queries[i].last_used < cache.queries[oldest].last_used) {
+        oldest = i;
+      }
+    }
+    ts_query_delete(cache.queries[oldest].value);
+    sdsfree(cache.queries[oldest].text);
+    (void)shdel(cache.queries, cache.queries[oldest].key);
+    cache.evictions += 1;
+  }
+  END_ZONE;
+}
+
+static sds language_key(TSLanguage* lang, char const* text, size_t len) {
+  hash128 hash = hash_bytes(text, len);
+  hash.hi ^= (uint64_t)(uintptr_t)lang;
+  return hash_to_hex(hash);
+}
+
+int cache_enable(char const* db_path) {
+  START_ZONE;
+  if (cache.enabled) {
+    END_ZONE;
+    return 0;
+  }
+  cache.env = db_env_init(db_path, false, 100);
+  if (!cache.env) {
+    message_error("cache::cache_enable failed in creating db environment");
+    goto error_end;
+  }
+  cache.snapshot = db_txn_init(cache.env, true);
+  if (!cache.snapshot) {
+    message_error("cache::cache_enable failed in creating transaction");
+    goto error_end;
+  }
+  cache.parser = ts_parser_new();
+  cache.generation = read_generation();
+  sh_new_strdup(cache.sources);
+  sh_new_strdup(cache.trees);
+  sh_new_strdup(cache.queries);
+  cache.max_source_bytes = CACHE_MAX_SOURCE_BYTES;
+  cache.max_tree_src_bytes = CACHE_MAX_TREE_SRC_BYTES;
+  cache.max_queries = CACHE_MAX_QUERIES;
+  cache.enabled = true;
+  END_ZONE;
+  return 0;
+error_end:
+  db_txn_terminate(cache.snapshot, false);
+  db_env_terminate(cache.env);
+  cache = (session_cache){0};
+  END_ZONE;
+  return -1;
+}
+
+bool cache_enabled(void) { return cache.enabled; }
+
+char const* cache_generation(void) { return cache.generation; }
+
+// Transaction id of the snapshot every cached read goes through, 0 while the
+// cache is off.
+size_t cache_snapshot_id(void) {
+  return cache.enabled ? db_txn_id(cache.snapshot) : 0;
+}
+
+// Moves the snapshot forward when anything was committed since it was taken,
+// and drops the cached entries when the index itself was rebuilt.
+void cache_refresh(void) {
+  START_ZONE;
+  if (!cache.enabled) {
+    END_ZONE;
+    return;
+  }
+  if (db_env_last_txn_id(cache.env) == db_txn_id(cache.snapshot)) {
+    END_ZONE;
+    return;
+  }
+  db_txn_terminate(cache.snapshot, false);
+  cache.snapshot = db_txn_init(cache.env, true);
+  if (!cache.snapshot) {
+    message_error("cache::cache_refresh failed in renewing the snapshot");
+    cache_terminate();
+    END_ZONE;
+    return;
+  }
+  sds generation = read_generation();
+  if (!generation || !cache.generation ||
+      sdscmp(generation, cache.generation) != 0) {
+    drop_entries();
+    cache.invalidations += 1;
+    metrics_add(METRIC_CACHE_INVALIDATIONS, 1);
+  }
+  sdsfree(cache.generation);
+  cache.generation = generation;
+  END_ZONE;
+}
+
+void cache_terminate(void) {
+  START_ZONE;
+  if (!cache.enabled) {
+    END_ZONE;
+    return;
+  }
+  drop_entries();
+  shfree(cache.sources);
+  shfree(cache.trees);
+  shfree(cache.queries);
+  ts_parser_delete(cache.parser);
+  sdsfree(cache.generation);
+  db_txn_terminate(cache.snapshot, false);
+  db_env_terminate(cache.env);
+  cache = (session_cache){0};
+  END_ZONE;
+}
+
+void cache_print_stats(FILE* out) {
+  START_ZONE;
+  if (!cache.enabled) {
+    fprintf(out, "cache disabled\n");
+    END_ZONE;
+    return;
+  }
+  fprintf(out,
+          "snapshot: txn %zu, index generation %s, %zu invalidations, "
+          "%zu evictions\n",
+          db_txn_id(cache.snapshot),
+          cache.generation ? cache.generation : "-", cache.invalidations,
+          cache.evictions);
+  fprintf(out, "sources: %d entries, %zu bytes, %zu hits, %zu misses\n",
+          (int)shlen(cache.sources), cache.source_bytes,
+          cache.source_stats.hits,
+          cache.source_stats.misses);
+  for (int i = 0; i < shlen(cache.sources); i += 1) {
+    fprintf(out, "  %s (%zu bytes)\n", cache.sources[i].key,
+            sdslen(cache.sources[i].value));
+  }
+  fprintf(out, "trees: %d entries, %zu source bytes, %zu hits, %zu misses\n",
+          (int)shlen(cache.trees), cache.tree_src_bytes,
+          cache.tree_stats.hits, cache.tree_stats.misses);
+  for (int i = 0; i < shlen(cache.trees); i += 1) {
+    fprintf(out, "  %s (%zu source bytes)\n", cache.trees[i].key,
+            cache.trees[i].src_size);
+  }
+  fprintf(out, "queries: %d entries, %zu hits, %zu misses\n",
+          (int)shlen(cache.queries), cache.query_stats.hits,
+          cache.query_stats.misses);
+  for (int i = 0; i < shlen(cache.queries); i += 1) {
+    fprintf(out, "  %s\n", cache.queries[i].text);
+  }
+  END_ZONE;
+}
+
+// The returned source belongs to the cache and stays valid until the next
+// source is read or the next cache_refresh, whichever comes first.
+sds cache_peek_file_src(char const* path, char const* name) {
+  START_ZONE;
+  sds key = sdscatfmt(sdsempty(), "%s/%s", path, name);
+  int index = shgeti(cache.sources, key);
+  if (index >= 0) {
+    cache.source_stats.hits += 1;
+    metrics_add(METRIC_SOURCE_CACHE_HITS, 1);
+    profile_cache_hit(PROFILE_CACHE_SOURCE);
+    sdsfree(key);
+    cache.clock += 1;
+    cache.sources[index].last_used = cache.clock;
+    END_ZONE;
+    return cache.sources[index].value;
+  }
+  cache.source_stats.misses += 1;
+  metrics_add(METRIC_SOURCE_CACHE_MISSES, 1);
+  profile_cache_miss(PROFILE_CACHE_SOURCE);
+  MDB_dbi db_handle = db_get_handle(cache.snapshot, path, false);
+  if (db_handle == 0) {
+    log_error(
+        "cache::cache_peek_file_src failed in creating db handle for name: %s",
+        path);
+    sdsfree(key);
+    END_ZONE;
+    return (void*)0;
+  }
+  sds src = db_get(cache.snapshot, db_handle, (char*)name);
+  if (!src) {
+    log_error("cache::cache_peek_file_src failed in getting key: %s", name);
+    sdsfree(key);
+    END_ZONE;
+    return (void*)0;
+  }
+  evict_sources(sdslen(src));
+  cache.clock += 1;
+  source_entry entry = {.key = key, .value = src, .last_used = cache.clock};
+  shputs(cache.sources, entry);
+  cache.source_bytes += sdslen(src);
+  metrics_gauge_add(METRIC_CACHED_SOURCE_BYTES, (int64_t)sdslen(src));
+  sdsfree(key);
+  END_ZONE;
+  return src;
+}
+
+sds cache_file_src(char const* path, char const* name) {
+  START_ZONE;
+  sds src = cache_peek_file_src(path, name);
+  END_ZONE;
+  return src ? sdsdup(src) : (void*)0;
+}
+
+// Explained forms report the size of every tree they use, cached or not.
+static void record_tree_size(TSTree* tree, sds src) {
+  if (tree && profile_counting_nodes()) {
+    profile_add_tree(tree_node_count(tree), sdslen(src));
+  }
+}
+
+// Outside of a session every caller gets a tree of its own, which
+// cache_release_tree deletes again.
+TSTree* cache_acquire_tree(TSLanguage* lang, sds src) {
+  START_ZONE;
+  if (!cache.enabled) {
+    TSParser* parser = create_parser(lang);
+    if (!parser) {
+      END_ZONE;
+      return (void*)0;
+    }
+    TSTree* tree = parse_string(parser, src);
+    ts_parser_delete(parser);
+    record_tree_size(tree, src);
+    END_ZONE;
+    return tree;
+  }
+  sds key = language_key(lang, src, sdslen(src));
+  int index = shgeti(cache.trees, key);
+  if (index >= 0) {
+    cache.tree_stats.hits += 1;
+    metrics_add(METRIC_TREE_CACHE_HITS, 1);
+    profile_cache_hit(PROFILE_CACHE_TREE);
+    sdsfree(key);
+    cache.clock += 1;
+    cache.trees[index].last_used = cache.clock;
+    record_tree_size(cache.trees[index].value, src);
+    END_ZONE;
+    return cache.trees[index].value;
+  }
+  cache.tree_stats.misses += 1;
+  metrics_add(METRIC_TREE_CACHE_MISSES, 1);
+  profile_cache_miss(PROFILE_CACHE_TREE);
+  if (!ts_parser_set_language(cache.parser, lang)) {
+    message_error("cache::cache_acquire_tree failed in setting language");
+    sdsfree(key);
+    END_ZONE;
+    return (void*)0;
+  }
+  TSTree* tree = parse_string(cache.parser, src);
+  if (tree) {
+    evict_trees(sdslen(src));
+    cache.clock += 1;
+    tree_entry entry = {.key = key,
+                        .value = tree,
+                        .src_size = sdslen(src),
+                        .last_used = cache.clock};
+    shputs(cache.trees, entry);
+    cache.tree_src_bytes += sdslen(src);
+  }
+  sdsfree(key);
+  record_tree_size(tree, src);
+  END_ZONE;
+  return tree;
+}
+
+void cache_release_tree(TSTree* tree) {
+  if (!cache.enabled) {
+    ts_tree_delete(tree);
+  }
+}
+
+TSQuery* cache_acquire_query(TSLanguage* lang, sds query_string) {
+  START_ZONE;
+  if (!cache.enabled) {
+    TSQuery* query = create_query(lang, query_string);
+    END_ZONE;
+    return query;
+  }
+  sds key = language_key(lang, query_string, sdslen(query_string));
+  int index = shgeti(cache.queries, key);
+  if (index >= 0) {
+    cache.query_stats.hits += 1;
+    metrics_add(METRIC_QUERY_CACHE_HITS, 1);
+    profile_cache_hit(PROFILE_CACHE_QUERY);
+    sdsfree(key);
+    cache.clock += 1;
+    cache.queries[index].last_used = cache.clock;
+    END_ZONE;
+    return cache.queries[index].value;
+  }
+  cache.query_stats.misses += 1;
+  metrics_add(METRIC_QUERY_CACHE_MISSES, 1);
+  profile_cache_miss(PROFILE_CACHE_QUERY);
+  TSQuery* query = create_query(lang, query_string);
+  if (query) {
+    evict_queries();
+    cache.clock += 1;
+    query_entry entry = {.key = key,
+                         .value = query,
+                         .text = sdsdup(query_string),
+                         .last_used = cache.clock};
+    shputs(cache.queries, entry);
+  }
+  sdsfree(key);
+  END_ZONE;
+  return query;
+}
+
+void cache_release_query(TSQuery* query) {
+  if (!cache.enabled) {
+    ts_query_delete(query);
+  }
+}
+
+#ifdef UNIT_TEST_CACHE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_deps/utest.h"
+
+TSLanguage* tree_sitter_c();
+
+UTEST(cache, disabled_acquire_is_owned) {
+  ASSERT_FALSE(cache_enabled());
+  sds src = sdsnew("int main(void) { return 0; }\n");
+  TSTree* first = cache_acquire_tree(tree_sitter_c(), src);
+  TSTree* second = cache_acquire_tree(tree_sitter_c(), src);
+  ASSERT_TRUE(first != (void*)0);
+  ASSERT_TRUE(first != second);
+  cache_release_tree(first);
+  cache_release_tree(second);
+  sdsfree(src);
+}
+
+// A scratch db holding nothing but the generation the cache keys on.
+static void write_generation(char const* db_path, char* generation) {
+  MDB_env* env = db_env_init(db_path, false, 100);
+  MDB_txn* txn = db_txn_init(env, false);
+  MDB_dbi db_handle = db_get_handle(txn, "project", true);
+  db_replace(txn, db_handle, "generation", generation);
+  db_txn_terminate(txn, true);
+  db_env_terminate(env);
+}
+
+static void remove_db(char const* db_path) {
+  sds data = sdscatfmt(sdsempty(), "%s/data.mdb", db_path);
+  sds lock = sdscatfmt(sdsempty(), "%s/lock.mdb", db_path);
+  unlink(data);
+  unlink(lock);
+  rmdir(db_path);
+  sdsfree(data);
+  sdsfree(lock);
+}
+
+UTEST(cache, hit_and_generation_drop) {
+  char db_path[] = "/tmp/scribe_cache_XXXXXX";
+  ASSERT_TRUE(mkdtemp(db_path) != (void*)0);
+  write_generation(db_path, "1");
+  ASSERT_EQ(cache_enable(db_path), 0);
+  sds src = sdsnew("int main(void) { return 0; }\n");
+  TSTree* first = cache_acquire_tree(tree_sitter_c(), src);
+  cache_release_tree(first);
+  TSTree* second = cache_acquire_tree(tree_sitter_c(), src);
+  cache_release_tree(second);
+  ASSERT_TRUE(first == second);
+  ASSERT_EQ(cache.tree_stats.hits, (size_t)1);
+  ASSERT_EQ(cache.tree_stats.misses, (size_t)1);
+  write_generation(db_path, "2");
+  cache_refresh();
+  ASSERT_STREQ("2", cache_generation());
+  ASSERT_EQ(cache.invalidations, (size_t)1);
+  ASSERT_EQ((int)shlen(cache.trees), 0);
+  cache_release_tree(cache_acquire_tree(tree_sitter_c(), src));
+  ASSERT_EQ(cache.tree_stats.misses, (size_t)2);
+  cache_terminate();
+  sdsfree(src);
+  remove_db(db_path);
+}
+
+UTEST(cache, least_recently_used_tree_is_evicted) {
+  char db_path[] = "/tmp/scribe_cache_XXXXXX";
+  ASSERT_TRUE(mkdtemp(db_path) != (void*)0);
+  write_generation(db_path, "1");
+  ASSERT_EQ(cache_enable(db_path), 0);
+  sds first = sdsnew("int first;\n");
+  sds second = sdsnew("int second;\n");
+  sds third = sdsnew("int third;\n");
+  cache.max_tree_src_bytes = sdslen(first) + sdslen(second);
+  cache_release_tree(cache_acquire_tree(tree_sitter_c(), first));
+  cache_release_tree(cache_acquire_tree(tree_sitter_c(), second));
+  cache_release_tree(cache_acquire_tree(tree_sitter_c(), first));
+  cache_release_tree(cache_acquire_tree(tree_sitter_c(), third));
+  ASSERT_EQ((int)shlen(cache.trees), 2);
+  ASSERT_EQ(cache.evictions, (size_t)1);
+  ASSERT_TRUE(cache.tree_src_bytes <= cache.max_tree_src_bytes);
+  cache_release_tree(cache_acquire_tree(tree_sitter_c(), first));
+  ASSERT_EQ(cache.tree_stats.hits, (size_t)2);
+  cache_release_tree(cache_acquire_tree(tree_sitter_c(), second));
+  ASSERT_EQ(cache.tree_stats.misses, (size_t)4);
+  cache_terminate();
+  sdsfree(first);
+  sdsfree(second);
+  sdsfree(third);
+  remove_db(db_path);
+}
+
+UTEST(cache, least_recently_used_source_is_evicted) {
+  char db_path[] = "/tmp/scribe_cache_XXXXXX";
+  ASSERT_TRUE(mkdtemp(db_path) != (void*)0);
+  write_generation(db_path, "1");
+  MDB_env* env = db_env_init(db_path, false, 100);
+  MDB_txn* txn = db_txn_init(env, false);
+  MDB_dbi db_handle = db_get_handle(txn, "src", true);
+  db_replace(txn, db_handle, "first.c", "int first;\n");
+  db_replace(txn, db_handle, "second.c", "int second;\n");
+  db_replace(txn, db_handle, "third.c", "int third;\n");
+  db_txn_terminate(txn, true);
+  db_env_terminate(env);
+  ASSERT_EQ(cache_enable(db_path), 0);
+  cache.max_source_bytes = strlen("int first;\n") + strlen("int second;\n");
+  ASSERT_STREQ("int first;\n", cache_peek_file_src("src", "first.c"));
+  ASSERT_STREQ("int second;\n", cache_peek_file_src("src", "second.c"));
+  ASSERT_STREQ("int first;\n", cache_peek_file_src("src", "first.c"));
+  ASSERT_STREQ("int third;\n", cache_peek_file_src("src", "third.c"));
+  ASSERT_EQ((int)shlen(cache.sources), 2);
+  ASSERT_EQ(cache.evictions, (size_t)1);
+  ASSERT_TRUE(cache.source_bytes <= cache.max_source_bytes);
+  cache_peek_file_src("src", "first.c");
+  ASSERT_EQ(cache.source_stats.hits, (size_t)2);
+  cache_peek_file_src("src", "second.c");
+  ASSERT_EQ(cache.source_stats.misses, (size_t)4);
+  cache_terminate();
+  remove_db(db_path);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,299 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "check.h"
+
+#include <deps/stb_ds.h>
+#include <lmdb.h>
+#include <pthread.h>
+#include <sds.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "hash.h"
+#include "indexer.h"
+#include "lisp.h"
+#include "query.h"
+#include "substitute.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+typedef enum check_status {
+  CHECK_OK,
+  CHECK_DRIFT,
+  CHECK_MISSING,
+  CHECK_ERROR
+} check_status;
+
+typedef struct check_job check_job;
+struct check_job {
+  char const* doc_path;
+  unsigned int line;
+  sds code_text;
+  sds old_hash;
+  sds new_hash;
+  check_status status;
+};
+
+typedef struct check_pool check_pool;
+struct check_pool {
+  check_job* jobs;
+  atomic_int next;
+  MDB_env* env;
+};
+
+static char const* status_names[] = {"ok", "drift", "missing", "error"};
+
+static int collect_jobs(char const* doc_path, check_job** jobs);
+static sds stored_result_hash(MDB_env* env, sds code_text);
+static void run_job(check_pool* pool, check_job* job);
+static void* check_worker(void* arg);
+
+static int collect_jobs(char const* doc_path, check_job** jobs) {
+  START_ZONE;
+  unsigned int length = 0;
+  char* contents = read_file_to_str(doc_path, &length);
+  if (!contents) {
+    log_error("check::collect_jobs failed in reading %s", doc_path);
+    END_ZONE;
+    return -1;
+  }
+  scribe_block* blocks = find_scribe_blocks(contents, length - 1);
+  for (int i = 0; i < arrlen(blocks); i += 1) {
+    check_job job = {
+        .doc_path = doc_path,
+        .line = blocks[i].line,
+        .code_text =
+            sdsnewlen(contents + blocks[i].code_start, blocks[i].code_size),
+        .status = CHECK_ERROR};
+    arrput(*jobs, job);
+  }
+  arrfree(blocks);
+  free(contents);
+  END_ZONE;
+  return 0;
+}
+
+static sds stored_result_hash(MDB_env* env, sds code_text) {
+  START_ZONE;
+  sds hex = (void*)0;
+  sds key = (void*)0;
+  MDB_txn* txn = db_txn_init(env, true);
+  if (!txn) {
+    message_error("check::stored_result_hash failed in creating transaction");
+    goto end;
+  }
+  MDB_dbi db_handle = db_get_handle(txn, "query", false);
+  if (db_handle == 0) {
+    goto end;
+  }
+  key = query_key(code_text, sdslen(code_text));
+  key = sdscat(key, "::result_hash");
+  hex = db_get(txn, db_handle, key);
+end:
+  sdsfree(key);
+  db_txn_terminate(txn, false);
+  END_ZONE;
+  return hex;
+}
+
+static void run_job(check_pool* pool, check_job* job) {
+  START_ZONE;
+  job->old_hash = stored_result_hash(pool->env, job->code_text);
+  sds result = evaluate_query(job->code_text);
+  if (!result) {
+    job->status = CHECK_ERROR;
+    END_ZONE;
+    return;
+  }
+  job->new_hash = hash_to_hex(hash_bytes(result, sdslen(result)));
+  sdsfree(result);
+  if (!job->old_hash) {
+    job->status = CHECK_MISSING;
+  } else if (sdscmp(job->old_hash, job->new_hash) != 0) {
+    job->status = CHECK_DRIFT;
+  } else {
+    job->status = CHECK_OK;
+  }
+  END_ZONE;
+}
+
+static void* check_worker(void* arg) {
+  check_pool* pool = (check_pool*)arg;
+  int count = (int)arrlen(pool->jobs);
+  while (true) {
+    int i = atomic_fetch_add(&pool->next, 1);
+    if (i >= count) {
+      break;
+    }
+    run_job(pool, &pool->jobs[i]);
+  }
+  lisp_terminate();
+  return (void*)0;
+}
+
+int check_documents(char const** paths, int num_paths, int num_workers) {
+  START_ZONE;
+  int rc = 0;
+  pthread_t* threads = (void*)0;
+  check_pool pool = {.jobs = (void*)0};
+  atomic_init(&pool.next, 0);
+  if (!db_exists(".")) {
+    message_fatal(
+        "check::check_documents failed because scribe db not found in the "
+        "current directory");
+    END_ZONE;
+    return -1;
+  }
+  // The stored hashes came from the sources as they were at the last render,
+  // so the index is brought up to date first or an edited source would
+  // still be checked in its old form. Nothing is asked on the way, stored
+  // query results are left alone.
+  rc = persist_project_details(".", false);
+  if (rc == 0) {
+    rc = index_files(".", false);
+  }
+  indexer_terminate();
+  if (rc != 0) {
+    message_fatal("check::check_documents failed in re-indexing the sources");
+    rc = -1;
+    goto end;
+  }
+  for (int i = 0; i < num_paths; i += 1) {
+    if (collect_jobs(paths[i], &pool.jobs) != 0) {
+      rc = -1;
+      goto end;
+    }
+  }
+  // Workers share one environment so its db handles stay warm for the run.
+  pool.env = db_env_init("./scribe_db", false, 100);
+  if (!pool.env) {
+    message_fatal("check::check_documents failed in creating db environment");
+    rc = -1;
+    goto end;
+  }
+  if (num_workers <= 0) {
+    num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_workers > arrlen(pool.jobs)) {
+    num_workers = (int)arrlen(pool.jobs);
+  }
+  for (int i = 0; i < num_workers; i += 1) {
+    pthread_t thread;
+    if (pthread_create(&thread, (void*)0, check_worker, &pool) != 0) {
+      message_error("check::check_documents failed in creating worker");
+      break;
+    }
+    arrput(threads, thread);
+  }
+  if (arrlen(threads) == 0) {
+    check_worker(&pool);
+  }
+  for (int i = 0; i < arrlen(threads); i += 1) {
+    pthread_join(threads[i], (void*)0);
+  }
+  for (int i = 0; i < arrlen(pool.jobs); i += 1) {
+    check_job job = pool.jobs[i];
+    printf("%s\t%u\t%s\t%s\t%s\n", job.doc_path, job.line,
+           job.old_hash ? job.old_hash : "-",
+           job.new_hash ? job.new_hash : "-", status_names[job.status]);
+    if (job.status != CHECK_OK) {
+      rc = 1;
+    }
+  }
+  fflush(stdout);
+end:
+  db_env_terminate(pool.env);
+  for (int i = 0; i < arrlen(pool.jobs); i += 1) {
+    sdsfree(pool.jobs[i].code_text);
+    sdsfree(pool.jobs[i].old_hash);
+    sdsfree(pool.jobs[i].new_hash);
+  }
+  arrfree(pool.jobs);
+  arrfree(threads);
+  END_ZONE;
+  return rc;
+}
+
+#ifdef UNIT_TEST_CHECK
+
+#include <fcntl.h>
+
+#include "sink.h"
+#include "test_deps/test_db.h"
+#include "test_deps/utest.h"
+
+static int write_file(char const* path, char const* contents) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return -1;
+  }
+  int rc = fputs(contents, file) < 0 ? -1 : 0;
+  return fclose(file) == 0 ? rc : -1;
+}
+
+// What check_documents printed for the document goes to output.
+static int check_document(char const* doc_path, sds* output) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int fd = open("check.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+  int rc = check_documents(&doc_path, 1, 1);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  char* contents = read_file_to_str("check.out", (void*)0);
+  *output = sdsnew(contents ? contents : "");
+  free(contents);
+  unlink("check.out");
+  return rc;
+}
+
+UTEST(check, edited_source_drifts) {
+  test_db db;
+  ASSERT_TRUE(test_db_enter(&db));
+  ASSERT_EQ(mkdir("src", 0755), 0);
+  ASSERT_EQ(write_file(".scribe", "(config/set-language \"c\")\n"), 0);
+  ASSERT_EQ(write_file("src/a.c", "int a(void) { return 1; }\n"), 0);
+  ASSERT_EQ(write_file("doc.md",
+                       "# doc\n\n```scribe\n(c/function-definition \"a\" "
+                       "(core/file-src \"./src\" \"a.c\"))\n```\n"),
+            0);
+  ASSERT_EQ(persist_project_details(".", false), 0);
+  ASSERT_EQ(index_files(".", false), 0);
+  indexer_terminate();
+  char* doc = read_file_to_str("doc.md", (void*)0);
+  md_substitute_data d = {.code_text = sdsempty(),
+                          .output = sink_sds_init(),
+                          .doc_path = "doc.md"};
+  ASSERT_EQ(md_splice(doc, strlen(doc), &d), 0);
+  free(doc);
+  sdsfree(d.code_text);
+  sink_terminate(d.output);
+  sds output = (void*)0;
+  ASSERT_EQ(check_document("doc.md", &output), 0);
+  ASSERT_TRUE(strstr(output, "\tok\n") != (void*)0);
+  sdsfree(output);
+  ASSERT_EQ(write_file("src/a.c", "int a(void) { return 2; }\n"), 0);
+  ASSERT_EQ(check_document("doc.md", &output), 1);
+  ASSERT_TRUE(strstr(output, "\tdrift\n") != (void*)0);
+  sdsfree(output);
+  lisp_terminate();
+  unlink("src/a.c");
+  rmdir("src");
+  unlink("doc.md");
+  unlink(".scribe");
+  test_db_leave(&db);
+}
+
+UTEST_MAIN();
+
+#endif
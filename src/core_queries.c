@@ -1,10 +1,20 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "core_queries.h"
+
 #include <deps/cute_files.h>
 #include <deps/cute_path.h>
 #include <janet.h>
 #include <lmdb.h>
+#include <sds.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "arena.h"
+#include "cache.h"
 #include "db.h"
 #include "lisp.h"
 #include "query.h"
@@ -12,6 +22,15 @@
 
 INIT_TRACE;
 
+// A file handle names an indexed file without carrying its text, which is
+// only read when a function actually needs it.
+typedef struct file_handle file_handle;
+struct file_handle {
+  sds path;
+  sds name;
+  sds generation;
+};
+
 static sds list_files(JanetString path);
 static sds list_paths(void);
 static sds get_file_src(JanetString path, JanetString name);
@@ -22,20 +41,54 @@ static long int get_file_num_lines(JanetString path, JanetString name);
 static sds get_file_src_slice(JanetString path, JanetString name,
                               int64_t start_line, int64_t end_line);
 static Janet cfun_file_src_slice(int32_t argc, Janet* argv);
+static int file_handle_gc(void* data, size_t len);
+static int file_handle_get(void* data, Janet key, Janet* out);
+static void file_handle_marshal(void* p, JanetMarshalContext* ctx);
+static void* file_handle_unmarshal(JanetMarshalContext* ctx);
+static void file_handle_tostring(void* p, JanetBuffer* buffer);
+static void marshal_sds(JanetMarshalContext* ctx, sds value);
+static sds unmarshal_sds(JanetMarshalContext* ctx);
+static bool file_handle_is_current(file_handle* handle);
+
+// A read transaction and cursor over one named db, kept open while the keys
+// are streamed out and closed as soon as they run out.
+typedef struct key_cursor key_cursor;
+struct key_cursor {
+  MDB_env* env;
+  MDB_txn* txn;
+  MDB_cursor* cursor;
+  bool omit_sub_keys;
+};
+
+static int open_key_cursor(key_cursor* cursor, char const* db_name,
+                           bool omit_sub_keys);
+static void close_key_cursor(key_cursor* cursor);
+static int key_cursor_gc(void* data, size_t len);
+
+static const JanetAbstractType key_cursor_type = {
+    "scribe/key-cursor", key_cursor_gc, JANET_ATEND_GC};
+
+static const JanetAbstractType file_handle_type = {
+    "scribe/file",         file_handle_gc,
+    (void*)0,              file_handle_get,
+    (void*)0,              file_handle_marshal,
+    file_handle_unmarshal, file_handle_tostring,
+    JANET_ATEND_TOSTRING};
 
 static sds list_files(JanetString path) {
   START_ZONE;
+  MDB_txn* txn = (void*)0;
   MDB_env* env = db_env_init("./scribe_db", false, 100);
   if (!env) {
     message_fatal("core_queries::list_files failed in creating db environment");
     goto error_end;
   }
-  MDB_txn* txn = db_txn_init(env, false);
+  txn = db_txn_init(env, true);
   if (!txn) {
     message_fatal("core_queries::list_files failed in creating transaction");
     goto error_end;
   }
-  MDB_dbi db_handle = db_get_handle(txn, path, true);
+  MDB_dbi db_handle = db_get_handle(txn, path, false);
   if (db_handle == 0) {
     log_fatal(
         "core_queries::list_files failed in creating db handle for name: %s",
@@ -60,17 +113,18 @@ error_end:
 
 static sds list_paths(void) {
   START_ZONE;
+  MDB_txn* txn = (void*)0;
   MDB_env* env = db_env_init("./scribe_db", false, 100);
   if (!env) {
     message_fatal("core_queries::list_paths failed in creating db environment");
     goto error_end;
   }
-  MDB_txn* txn = db_txn_init(env, false);
+  txn = db_txn_init(env, true);
   if (!txn) {
     message_fatal("core_queries::list_paths failed in creating transaction");
     goto error_end;
   }
-  MDB_dbi db_handle = db_get_handle(txn, "paths", true);
+  MDB_dbi db_handle = db_get_handle(txn, "paths", false);
   if (db_handle == 0) {
     log_fatal(
         "core_queries::list_paths failed in creating db handle for name: "
@@ -95,18 +149,24 @@ error_end:
 
 static sds get_file_src(JanetString path, JanetString name) {
   START_ZONE;
+  if (cache_enabled()) {
+    sds src = cache_file_src((char const*)path, (char const*)name);
+    END_ZONE;
+    return src;
+  }
+  MDB_txn* txn = (void*)0;
   MDB_env* env = db_env_init("./scribe_db", false, 100);
   if (!env) {
     message_fatal(
         "core_queries::get_file_src failed in creating db environment");
     goto error_end;
   }
-  MDB_txn* txn = db_txn_init(env, false);
+  txn = db_txn_init(env, true);
   if (!txn) {
     message_fatal("core_queries::get_file_src failed in creating transaction");
     goto error_end;
   }
-  MDB_dbi db_handle = db_get_handle(txn, path, true);
+  MDB_dbi db_handle = db_get_handle(txn, path, false);
   if (db_handle == 0) {
     log_fatal(
         "core_queries::get_file_src failed in creating db handle for name: %s",
@@ -133,19 +193,20 @@ static long int get_file_num_lines(JanetString path, JanetString name) {
   START_ZONE;
   sds num_lines_key = sdsempty();
   sds num_lines = sdsempty();
+  MDB_txn* txn = (void*)0;
   MDB_env* env = db_env_init("./scribe_db", false, 100);
   if (!env) {
     message_fatal(
         "core_queries::get_file_num_lines failed in creating db environment");
     goto error_end;
   }
-  MDB_txn* txn = db_txn_init(env, false);
+  txn = db_txn_init(env, true);
   if (!txn) {
     message_fatal(
         "core_queries::get_file_num_lines failed in creating transaction");
     goto error_end;
   }
-  MDB_dbi db_handle = db_get_handle(txn, path, true);
+  MDB_dbi db_handle = db_get_handle(txn, path, false);
   if (db_handle == 0) {
     log_fatal(
         "core_queries::get_file_num_lines failed in creating db handle for "
@@ -183,98 +244,267 @@ error_end:
   return -1;
 }
 
-static int print_lines(JanetString src) {
+static int print_lines(sds src) {
   START_ZONE;
   if (!src) {
     END_ZONE;
     return -1;
   }
-  sds* lines = (void*)0;
-  sds src_sds = sdsnew(src);
-  sds numbered_src_slice = sdsempty();
-  int count = 0;
-  lines = sdssplitlen(src_sds, sdslen(src_sds), "\n", 1, &count);
-  for (int i = 0; i < count; i += 1) {
-    numbered_src_slice =
-        sdscatfmt(numbered_src_slice, "%i. %S\n", i + 1, lines[i]);
-  }
-  printf("%s", numbered_src_slice);
-  sdsfree(src_sds);
-  sdsfree(numbered_src_slice);
-  sdsfreesplitres(lines, count);
+  size_t len = sdslen(src);
+  size_t offset = 0;
+  for (int i = 1; len > 0; i += 1) {
+    char const* eol = memchr(src + offset, '\n', len - offset);
+    size_t size = eol ? (size_t)(eol - (src + offset)) : len - offset;
+    printf("%d. %.*s\n", i, (int)size, src + offset);
+    if (!eol) {
+      break;
+    }
+    offset += size + 1;
+  }
   END_ZONE;
   return 0;
 }
 
-static sds get_src_slice(JanetString src, int64_t start_line,
-                         int64_t end_line) {
+// Byte range of lines start_line to end_line of src, both 1 based and
+// inclusive. The lines are found by scanning, src is never split.
+static bool find_src_slice(sds src, int64_t start_line, int64_t end_line,
+                           size_t* begin, size_t* size) {
   START_ZONE;
-  sds* lines = (void*)0;
-  sds src_sds = sdsnew(src);
-  sds src_slice = sdsempty();
-  int count = 0;
-  lines = sdssplitlen(src_sds, sdslen(src_sds), "\n", 1, &count);
-  if (end_line > count) {
-    log_fatal(
-        "core_queries::get_src_slice invalid argument: end_line=%d is "
-        "greater than number of lines=%d",
-        (int)end_line, (int)count);
-    goto error_end;
-  }
-  for (int i = (start_line - 1); i < (end_line - 1); i += 1) {
-    src_slice = sdscatfmt(src_slice, "%S\n", lines[i]);
-  }
-  src_slice = sdscatfmt(src_slice, "%S", lines[end_line - 1]);
-  sdsfree(src_sds);
-  sdsfreesplitres(lines, count);
-  END_ZONE;
-  return src_slice;
-error_end:
-  sdsfree(src_sds);
-  sdsfreesplitres(lines, count);
+  size_t len = sdslen(src);
+  size_t offset = 0;
+  for (int64_t line = 1; len > 0; line += 1) {
+    char const* eol = memchr(src + offset, '\n', len - offset);
+    if (line == start_line) {
+      *begin = offset;
+    }
+    if (line == end_line) {
+      *size = (eol ? (size_t)(eol - src) : len) - *begin;
+      END_ZONE;
+      return true;
+    }
+    if (!eol) {
+      break;
+    }
+    offset = (size_t)(eol - src) + 1;
+  }
+  log_fatal(
+      "core_queries::find_src_slice invalid argument: end_line=%d is past the "
+      "last line",
+      (int)end_line);
   END_ZONE;
-  return (void*)0;
+  return false;
 }
 
+// The slice lives in the scratch arena.
 static sds get_file_src_slice(JanetString path, JanetString name,
                               int64_t start_line, int64_t end_line) {
   START_ZONE;
-  sds* lines = (void*)0;
-  sds file_src_slice = sdsempty();
-  int count = 0;
+  sds file_src_slice = (void*)0;
   sds file_src = get_file_src(path, name);
   if (!file_src) {
     message_fatal(
         "core_queries::get_file_src_slice failed in getting file source");
-    goto error_end;
+    goto end;
   }
   long int num_lines = get_file_num_lines(path, name);
   if (num_lines == -1) {
     message_fatal(
         "core_queries::get_file_src_slice failed in getting number of lines");
-    goto error_end;
+    goto end;
   }
   if (end_line > num_lines) {
     log_fatal(
         "core_queries::get_file_src_slice invalid argument: end_line=%d is "
         "greater than num_lines=%d",
         (int)end_line, (int)num_lines);
-    goto error_end;
+    goto end;
   }
-  lines = sdssplitlen(file_src, sdslen(file_src), "\n", 1, &count);
-  for (int i = (start_line - 1); i < (end_line - 1); i += 1) {
-    file_src_slice = sdscatfmt(file_src_slice, "%S\n", lines[i]);
+  size_t begin = 0;
+  size_t size = 0;
+  if (find_src_slice(file_src, start_line, end_line, &begin, &size)) {
+    file_src_slice = arena_sdsnewlen(scratch_arena(), file_src + begin, size);
   }
-  file_src_slice = sdscatfmt(file_src_slice, "%S", lines[end_line - 1]);
+end:
   sdsfree(file_src);
-  sdsfreesplitres(lines, count);
   END_ZONE;
   return file_src_slice;
+}
+
+static int open_key_cursor(key_cursor* cursor, char const* db_name,
+                           bool omit_sub_keys) {
+  START_ZONE;
+  *cursor = (key_cursor){.omit_sub_keys = omit_sub_keys};
+  cursor->env = db_env_init("./scribe_db", false, 100);
+  if (!cursor->env) {
+    message_fatal(
+        "core_queries::open_key_cursor failed in creating db environment");
+    goto error_end;
+  }
+  cursor->txn = db_txn_init(cursor->env, true);
+  if (!cursor->txn) {
+    message_fatal(
+        "core_queries::open_key_cursor failed in creating transaction");
+    goto error_end;
+  }
+  MDB_dbi db_handle = db_get_handle(cursor->txn, db_name, false);
+  if (db_handle == 0) {
+    log_fatal(
+        "core_queries::open_key_cursor failed in creating db handle for "
+        "name: %s",
+        db_name);
+    goto error_end;
+  }
+  cursor->cursor = db_cursor_init(cursor->txn, db_handle);
+  if (!cursor->cursor) {
+    message_fatal("core_queries::open_key_cursor failed in creating cursor");
+    goto error_end;
+  }
+  END_ZONE;
+  return 0;
 error_end:
-  sdsfree(file_src);
-  sdsfreesplitres(lines, count);
+  close_key_cursor(cursor);
   END_ZONE;
-  return (void*)0;
+  return -1;
+}
+
+static void close_key_cursor(key_cursor* cursor) {
+  START_ZONE;
+  db_cursor_terminate(cursor->cursor);
+  if (cursor->txn) {
+    db_txn_terminate(cursor->txn, false);
+  }
+  db_env_terminate(cursor->env);
+  *cursor = (key_cursor){0};
+  END_ZONE;
+}
+
+static int key_cursor_gc(void* data, size_t len) {
+  (void)len;
+  close_key_cursor((key_cursor*)data);
+  return 0;
+}
+
+static int file_handle_gc(void* data, size_t len) {
+  (void)len;
+  file_handle* handle = (file_handle*)data;
+  sdsfree(handle->path);
+  sdsfree(handle->name);
+  sdsfree(handle->generation);
+  return 0;
+}
+
+static int file_handle_get(void* data, Janet key, Janet* out) {
+  file_handle* handle = (file_handle*)data;
+  if (!janet_checktype(key, JANET_KEYWORD)) {
+    return 0;
+  }
+  JanetKeyword field = janet_unwrap_keyword(key);
+  sds value = (void*)0;
+  if (janet_cstrcmp(field, "path") == 0) {
+    value = handle->path;
+  } else if (janet_cstrcmp(field, "name") == 0) {
+    value = handle->name;
+  } else if (janet_cstrcmp(field, "generation") == 0) {
+    value = handle->generation;
+  } else {
+    return 0;
+  }
+  *out = janet_wrap_string(janet_string((uint8_t*)value, sdslen(value)));
+  return 1;
+}
+
+static void marshal_sds(JanetMarshalContext* ctx, sds value) {
+  janet_marshal_int(ctx, (int32_t)sdslen(value));
+  janet_marshal_bytes(ctx, (uint8_t*)value, sdslen(value));
+}
+
+static sds unmarshal_sds(JanetMarshalContext* ctx) {
+  int32_t len = janet_unmarshal_int(ctx);
+  sds value = sdsnewlen((void*)0, len);
+  janet_unmarshal_bytes(ctx, (uint8_t*)value, len);
+  return value;
+}
+
+// Handles travel between VMs as plain strings, the text is never part of it.
+static void file_handle_marshal(void* p, JanetMarshalContext* ctx) {
+  file_handle* handle = (file_handle*)p;
+  janet_marshal_abstract(ctx, p);
+  marshal_sds(ctx, handle->path);
+  marshal_sds(ctx, handle->name);
+  marshal_sds(ctx, handle->generation);
+}
+
+static void* file_handle_unmarshal(JanetMarshalContext* ctx) {
+  file_handle* handle = (file_handle*)janet_unmarshal_abstract(
+      ctx, sizeof(file_handle));
+  handle->path = unmarshal_sds(ctx);
+  handle->name = unmarshal_sds(ctx);
+  handle->generation = unmarshal_sds(ctx);
+  return handle;
+}
+
+static void file_handle_tostring(void* p, JanetBuffer* buffer) {
+  file_handle* handle = (file_handle*)p;
+  janet_buffer_push_bytes(buffer, (uint8_t*)handle->path,
+                          sdslen(handle->path));
+  janet_buffer_push_u8(buffer, '/');
+  janet_buffer_push_bytes(buffer, (uint8_t*)handle->name,
+                          sdslen(handle->name));
+}
+
+static bool file_handle_is_current(file_handle* handle) {
+  START_ZONE;
+  if (cache_enabled()) {
+    char const* generation = cache_generation();
+    END_ZONE;
+    return generation && strcmp(generation, handle->generation) == 0;
+  }
+  sds generation = get_generation();
+  bool current = generation && sdscmp(generation, handle->generation) == 0;
+  sdsfree(generation);
+  END_ZONE;
+  return current;
+}
+
+// Reads the source argument at index n, which can be a string or a file
+// handle. Handle sources come straight out of the session cache when there
+// is one and string sources are copied into the scratch arena, both are
+// borrowed and release_source_arg leaves them alone.
+source_arg get_source_arg(Janet* argv, int32_t n) {
+  START_ZONE;
+  source_arg arg = {.text = (void*)0, .borrowed = false};
+  file_handle* handle =
+      (file_handle*)janet_checkabstract(argv[n], &file_handle_type);
+  if (!handle) {
+    JanetString src = janet_getstring(argv, n);
+    arg.text = arena_sdsnewlen(scratch_arena(), src, janet_string_length(src));
+    arg.borrowed = true;
+    END_ZONE;
+    return arg;
+  }
+  if (!file_handle_is_current(handle)) {
+    END_ZONE;
+    janet_panicf("%s/%s was re-indexed, open it again with core/file",
+                 handle->path, handle->name);
+  }
+  if (cache_enabled()) {
+    arg.text = cache_peek_file_src(handle->path, handle->name);
+    arg.borrowed = true;
+  } else {
+    arg.text = get_file_src((uint8_t*)handle->path, (uint8_t*)handle->name);
+  }
+  if (!arg.text) {
+    END_ZONE;
+    janet_panicf("failed in reading %s/%s", handle->path, handle->name);
+  }
+  END_ZONE;
+  return arg;
+}
+
+void release_source_arg(source_arg arg) {
+  if (!arg.borrowed) {
+    sdsfree(arg.text);
+  }
 }
 
 static Janet cfun_list_files(int32_t argc, Janet* argv) {
@@ -306,13 +536,85 @@ static Janet cfun_list_paths(int32_t argc, Janet* argv) {
   return janet_wrap_string(jstr);
 }
 
-static Janet cfun_file_src(int32_t argc, Janet* argv) {
+static Janet cfun_file_cursor(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
+  }
+  JanetString path = janet_getstring(argv, 0);
+  key_cursor* cursor =
+      (key_cursor*)janet_abstract(&key_cursor_type, sizeof(key_cursor));
+  if (open_key_cursor(cursor, (char const*)path, true) != 0) {
+    janet_panicf("failed in opening a cursor over %s", path);
+  }
+  return janet_wrap_abstract(cursor);
+}
+
+static Janet cfun_path_cursor(int32_t argc, Janet* argv) {
+  (void)argv;
+  janet_fixarity(argc, 0);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
+  }
+  key_cursor* cursor =
+      (key_cursor*)janet_abstract(&key_cursor_type, sizeof(key_cursor));
+  if (open_key_cursor(cursor, "paths", false) != 0) {
+    janet_panicf("failed in opening a cursor over paths");
+  }
+  return janet_wrap_abstract(cursor);
+}
+
+static Janet cfun_cursor_next(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  key_cursor* cursor = janet_getabstract(argv, 0, &key_cursor_type);
+  if (!cursor->cursor) {
+    return janet_wrap_nil();
+  }
+  sds key = db_cursor_next_key(cursor->cursor, cursor->omit_sub_keys);
+  if (!key) {
+    close_key_cursor(cursor);
+    return janet_wrap_nil();
+  }
+  const uint8_t* jstr = janet_string((uint8_t*)key, sdslen(key));
+  sdsfree(key);
+  return janet_wrap_string(jstr);
+}
+
+static Janet cfun_file(int32_t argc, Janet* argv) {
   janet_fixarity(argc, 2);
   if (!db_exists(".")) {
     janet_panicf("scribe db not found in the current directory");
   }
   JanetString path = janet_getstring(argv, 0);
   JanetString name = janet_getstring(argv, 1);
+  sds generation = cache_enabled() ? sdsnew(cache_generation())
+                                   : get_generation();
+  if (!generation) {
+    janet_panicf("failed in reading the index generation");
+  }
+  file_handle* handle =
+      (file_handle*)janet_abstract(&file_handle_type, sizeof(file_handle));
+  handle->path = sdsnew((char const*)path);
+  handle->name = sdsnew((char const*)name);
+  handle->generation = generation;
+  return janet_wrap_abstract(handle);
+}
+
+static Janet cfun_file_src(int32_t argc, Janet* argv) {
+  janet_arity(argc, 1, 2);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
+  }
+  if (argc == 1) {
+    arena_mark scratch = scratch_begin();
+    source_arg arg = get_source_arg(argv, 0);
+    const uint8_t* jstr = janet_string((uint8_t*)arg.text, sdslen(arg.text));
+    release_source_arg(arg);
+    scratch_end(scratch);
+    return janet_wrap_string(jstr);
+  }
+  JanetString path = janet_getstring(argv, 0);
+  JanetString name = janet_getstring(argv, 1);
   sds src = get_file_src(path, name);
   if (!src) {
     janet_panicf("failed in getting value for the specified key");
@@ -340,12 +642,13 @@ static Janet cfun_file_src_slice(int32_t argc, Janet* argv) {
   if (end_line < start_line) {
     janet_panicf("end-line needs to be >= start-line");
   }
+  arena_mark scratch = scratch_begin();
   sds src_slice = get_file_src_slice(path, name, start_line, end_line);
   if (!src_slice) {
     janet_panicf("failed in getting the slice");
   }
   const uint8_t* jstr = janet_string(src_slice, sdslen(src_slice));
-  sdsfree(src_slice);
+  scratch_end(scratch);
   return janet_wrap_string(jstr);
 }
 
@@ -354,7 +657,6 @@ static Janet cfun_src_slice(int32_t argc, Janet* argv) {
   if (!db_exists(".")) {
     janet_panicf("scribe db not found in the current directory");
   }
-  JanetString src = janet_getstring(argv, 0);
   int64_t start_line = janet_getinteger64(argv, 1);
   int64_t end_line = janet_getinteger64(argv, 2);
   if (start_line <= 0) {
@@ -366,12 +668,19 @@ static Janet cfun_src_slice(int32_t argc, Janet* argv) {
   if (end_line < start_line) {
     janet_panicf("end-line needs to be >= start-line");
   }
-  sds src_slice = get_src_slice(src, start_line, end_line);
-  if (!src_slice) {
+  arena_mark scratch = scratch_begin();
+  source_arg src = get_source_arg(argv, 0);
+  size_t begin = 0;
+  size_t size = 0;
+  bool found = find_src_slice(src.text, start_line, end_line, &begin, &size);
+  const uint8_t* jstr =
+      found ? janet_string((uint8_t*)src.text + begin, (int32_t)size)
+            : (void*)0;
+  release_source_arg(src);
+  scratch_end(scratch);
+  if (!jstr) {
     janet_panicf("failed in getting the slice");
   }
-  const uint8_t* jstr = janet_string(src_slice, sdslen(src_slice));
-  sdsfree(src_slice);
   return janet_wrap_string(jstr);
 }
 
@@ -380,8 +689,11 @@ static Janet cfun_print_lines(int32_t argc, Janet* argv) {
   if (!db_exists(".")) {
     janet_panicf("scribe db not found in the current directory");
   }
-  JanetString src = janet_getstring(argv, 0);
-  int rc = print_lines(src);
+  arena_mark scratch = scratch_begin();
+  source_arg src = get_source_arg(argv, 0);
+  int rc = print_lines(src.text);
+  release_source_arg(src);
+  scratch_end(scratch);
   if (rc == -1) {
     janet_panicf("failed in printing src");
   }
@@ -389,29 +701,104 @@ static Janet cfun_print_lines(int32_t argc, Janet* argv) {
 }
 
 static const JanetReg core_cfuns[] = {
-    {"file-src", cfun_file_src, "(core/file-src)\n\nGet the file source."},
+    {"file", cfun_file,
+     "(core/file path name)\n\nGet a handle to an indexed file, accepted in "
+     "place of its source by the core/ and c/ functions."},
+    {"file-src", cfun_file_src,
+     "(core/file-src path name)\n(core/file-src handle)\n\nGet the file "
+     "source."},
     {"list-paths", cfun_list_paths,
      "(core/list-paths)\n\nList the indexed paths."},
     {"list-files", cfun_list_files,
      "(core/list-files)\n\nList the files in the directory."},
+    {"file-cursor", cfun_file_cursor,
+     "(core/file-cursor path)\n\nOpen a cursor over the files indexed under "
+     "path, see core/files."},
+    {"path-cursor", cfun_path_cursor,
+     "(core/path-cursor)\n\nOpen a cursor over the indexed paths, see "
+     "core/paths."},
+    {"cursor-next", cfun_cursor_next,
+     "(core/cursor-next cursor)\n\nNext key of a cursor, nil once it is "
+     "exhausted."},
     {"file-src-slice", cfun_file_src_slice,
      "(core/file-src-slice)\n\nGet the file source sliced by line nums."},
     {"src-slice", cfun_src_slice,
      "(core/src-slice)\n\nGet the source sliced by line nums."},
     {"print-lines", cfun_print_lines,
      "(core/print-lines)\n\nPrint the source with linums"},
+    {(void*)0, (void*)0, (void*)0},
 };
 
 void register_core_module(JanetTable* env) {
+  janet_register_abstract_type(&file_handle_type);
   lisp_register_module(env, "core", core_cfuns);
 }
 
 #ifdef UNIT_TEST_CORE_QUERIES
 
+#include "c_queries.h"
+#include "test_deps/test_db.h"
 #include "test_deps/utest.h"
 
 UTEST(core_queries, sample_test) { ASSERT_TRUE(true); }
 
+UTEST(core_queries, file_handle_round_trip) {
+  lisp_init_vm();
+  janet_register_abstract_type(&file_handle_type);
+  file_handle* handle =
+      (file_handle*)janet_abstract(&file_handle_type, sizeof(file_handle));
+  handle->path = sdsnew("src");
+  handle->name = sdsnew("main.c");
+  handle->generation = sdsnew("7");
+  JanetBuffer* buffer = janet_buffer(0);
+  janet_marshal(buffer, janet_wrap_abstract(handle), (void*)0, 0);
+  Janet loaded =
+      janet_unmarshal(buffer->data, buffer->count, 0, (void*)0, (void*)0);
+  file_handle* loaded_handle =
+      (file_handle*)janet_checkabstract(loaded, &file_handle_type);
+  ASSERT_TRUE(loaded_handle != (void*)0);
+  ASSERT_STREQ("src", loaded_handle->path);
+  ASSERT_STREQ("main.c", loaded_handle->name);
+  ASSERT_STREQ("7", loaded_handle->generation);
+  lisp_terminate();
+}
+
+UTEST(core_queries, cursors_drain_to_nil) {
+  test_db db;
+  ASSERT_TRUE(test_db_enter(&db));
+  ASSERT_EQ(test_db_put("project", "generation", "1"), 0);
+  ASSERT_EQ(test_db_put("paths", "src", ""), 0);
+  ASSERT_EQ(test_db_put("paths", "lib", ""), 0);
+  ASSERT_EQ(test_db_put("src", "a.c",
+                        "int a(void) { return 1; }\n"
+                        "int b(void) { return 2; }\n"),
+            0);
+  lisp_init_vm();
+  JanetTable* env = lisp_init_env();
+  register_core_module(env);
+  register_c_module(env);
+  Janet drained = janet_wrap_nil();
+  ASSERT_EQ(lisp_execute_script(
+                env,
+                "(defn drain [next cursor]"
+                "  (def items @[])"
+                "  (while (def item (next cursor)) (array/push items item))"
+                "  [;items (next cursor)])"
+                "(def query \"(function_declarator (identifier) @name)\")"
+                "(string/format \"%j\""
+                " [(drain core/cursor-next (core/path-cursor))"
+                " (drain c/query-cursor-next"
+                "        (c/query-cursor query (core/file \"src\" \"a.c\")))"
+                " (drain c/query-cursor-next"
+                "        (c/query-cursor query \"int c;\"))])",
+                &drained),
+            0);
+  ASSERT_STREQ("((\"lib\" \"src\" nil) (\"a\" \"b\" nil) (nil))",
+               (char const*)janet_unwrap_string(drained));
+  lisp_terminate();
+  test_db_leave(&db);
+}
+
 UTEST_MAIN();
 
 #endif
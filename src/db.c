@@ -1,23 +1,114 @@
 #include "db.h"
 
+#include <deps/stb_ds.h>
 #include <errno.h>
 #include <lmdb.h>
+#include <pthread.h>
 #include <sds.h>
 #include <stdbool.h>
 #include <string.h>
 
+#include "metrics.h"
 #include "trace.h"
 
 INIT_TRACE;
 
-MDB_env* db_env_init(char const* path, bool read_only, MDB_dbi max_dbs) {
+// LMDB environments must be opened only once per process, so environments
+// are shared by path and reference counted. Named database handles are
+// opened once when an environment is first opened and then reused, which
+// lets concurrent transactions look them up without calling mdb_dbi_open.
+typedef struct shared_env shared_env;
+struct shared_env {
+  char* key;
+  MDB_env* env;
+  int refs;
+  struct {
+    char* key;
+    MDB_dbi value;
+  } * handles;
+};
+
+static void preload_handles(shared_env* shared);
+static shared_env* find_shared_env(MDB_env* env);
+
+static shared_env* shared_envs = (void*)0;
+static pthread_mutex_t shared_envs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void preload_handles(shared_env* shared) {
   START_ZONE;
+  MDB_txn* txn = (void*)0;
+  MDB_cursor* cursor = (void*)0;
+  MDB_dbi main_handle = 0;
+  sh_new_strdup(shared->handles);
+  int rc = mdb_txn_begin(shared->env, (void*)0, MDB_RDONLY, &txn);
+  if (rc != 0) {
+    message_error("db::preload_handles failed in creating a transaction");
+    END_ZONE;
+    return;
+  }
+  rc = mdb_dbi_open(txn, (void*)0, 0, &main_handle);
+  if (rc == 0) {
+    rc = mdb_cursor_open(txn, main_handle, &cursor);
+  }
+  if (rc != 0) {
+    mdb_txn_abort(txn);
+    END_ZONE;
+    return;
+  }
+  MDB_val key = {0};
+  MDB_val data = {0};
+  sds name = sdsempty();
+  while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+    name = sdscpylen(name, key.mv_data, key.mv_size);
+    MDB_dbi db_handle = 0;
+    rc = mdb_dbi_open(txn, name, 0, &db_handle);
+    if (rc == MDB_DBS_FULL) {
+      break;
+    }
+    if (rc == 0) {
+      shput(shared->handles, name, db_handle);
+    }
+  }
+  sdsfree(name);
+  mdb_cursor_close(cursor);
+  rc = mdb_txn_commit(txn);
+  if (rc != 0) {
+    message_error("db::preload_handles failed in publishing db handles");
+    shfree(shared->handles);
+    sh_new_strdup(shared->handles);
+  }
+  END_ZONE;
+}
+
+static shared_env* find_shared_env(MDB_env* env) {
+  for (int i = 0; i < shlen(shared_envs); i += 1) {
+    if (shared_envs[i].env == env) {
+      return &shared_envs[i];
+    }
+  }
+  return (void*)0;
+}
+
+MDB_env* db_env_init(char const* path, bool read_only, MDB_dbi max_dbs) {
+  START_PHASE_ZONE(PROFILE_LMDB);
   int rc = 0;
-  unsigned int flags = 0;
+  unsigned int flags = MDB_NOTLS;
   if (read_only) {
-    flags = MDB_RDONLY;
+    flags |= MDB_RDONLY;
   }
   MDB_env* env = (void*)0;
+  pthread_mutex_lock(&shared_envs_lock);
+  if (!shared_envs) {
+    sh_new_strdup(shared_envs);
+  }
+  int index = shgeti(shared_envs, path);
+  if (index >= 0) {
+    shared_envs[index].refs += 1;
+    env = shared_envs[index].env;
+    pthread_mutex_unlock(&shared_envs_lock);
+    END_PHASE_ZONE(PROFILE_LMDB);
+    return env;
+  }
   rc = mdb_env_create(&env);
   if (rc != 0) {
     message_fatal("db::db_env_init failed in creating LMDB environment handle");
@@ -43,18 +134,44 @@ MDB_env* db_env_init(char const* path, bool read_only, MDB_dbi max_dbs) {
     message_fatal("db::db_env_init failed in opening the environment handle");
     goto error_end;
   }
-  END_ZONE;
+  shared_env shared = {.key = (char*)path, .env = env, .refs = 1};
+  preload_handles(&shared);
+  shputs(shared_envs, shared);
+  pthread_mutex_unlock(&shared_envs_lock);
+  END_PHASE_ZONE(PROFILE_LMDB);
   return env;
 error_end:
   mdb_env_close(env);
-  END_ZONE;
+  pthread_mutex_unlock(&shared_envs_lock);
+  END_PHASE_ZONE(PROFILE_LMDB);
   return (void*)0;
 }
 
-void db_env_terminate(MDB_env* env) { mdb_env_close(env); }
+void db_env_terminate(MDB_env* env) {
+  START_PHASE_ZONE(PROFILE_LMDB);
+  if (!env) {
+    END_PHASE_ZONE(PROFILE_LMDB);
+    return;
+  }
+  pthread_mutex_lock(&shared_envs_lock);
+  shared_env* shared = find_shared_env(env);
+  if (shared) {
+    shared->refs -= 1;
+    if (shared->refs > 0) {
+      pthread_mutex_unlock(&shared_envs_lock);
+      END_PHASE_ZONE(PROFILE_LMDB);
+      return;
+    }
+    shfree(shared->handles);
+    (void)shdel(shared_envs, shared->key);
+  }
+  mdb_env_close(env);
+  pthread_mutex_unlock(&shared_envs_lock);
+  END_PHASE_ZONE(PROFILE_LMDB);
+}
 
 MDB_txn* db_txn_init(MDB_env* env, bool read_only) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   MDB_txn* txn = (void*)0;
   int rc = 0;
   unsigned int flags = 0;
@@ -90,17 +207,15 @@ MDB_txn* db_txn_init(MDB_env* env, bool read_only) {
         goto error_end;
     }
   }
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return txn;
 error_end:
-  mdb_txn_abort(txn);
-  mdb_env_close(env);
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return (void*)0;
 }
 
 int db_txn_terminate(MDB_txn* txn, bool commit) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   int rc = 0;
   if (commit) {
     rc = mdb_txn_commit(txn);
@@ -108,17 +223,38 @@ int db_txn_terminate(MDB_txn* txn, bool commit) {
       message_fatal(
           "db::db_txn_terminate failed in committing the transaction");
     }
-    END_ZONE;
+    END_PHASE_ZONE(PROFILE_LMDB);
     return rc;
   }
   mdb_txn_abort(txn);
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return rc;
 }
 
+size_t db_txn_id(MDB_txn* txn) {
+  START_ZONE;
+  size_t id = mdb_txn_id(txn);
+  END_ZONE;
+  return id;
+}
+
+// Id of the last committed write transaction, by any process.
+size_t db_env_last_txn_id(MDB_env* env) {
+  START_ZONE;
+  MDB_envinfo info = {0};
+  int rc = mdb_env_info(env, &info);
+  if (rc != 0) {
+    message_error("db::db_env_last_txn_id failed in getting env info");
+    END_ZONE;
+    return 0;
+  }
+  END_ZONE;
+  return info.me_last_txnid;
+}
+
 MDB_dbi db_get_handle(MDB_txn* txn, char const* name,
                       bool create_if_not_exist) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   int rc = 0;
   MDB_env* txn_env = mdb_txn_env(txn);
   MDB_dbi db_handle = 0;
@@ -126,7 +262,21 @@ MDB_dbi db_get_handle(MDB_txn* txn, char const* name,
   if (create_if_not_exist) {
     flags = MDB_CREATE;
   }
+  pthread_mutex_lock(&shared_envs_lock);
+  shared_env* shared = find_shared_env(txn_env);
+  if (shared) {
+    int index = shgeti(shared->handles, name);
+    if (index >= 0) {
+      db_handle = shared->handles[index].value;
+      pthread_mutex_unlock(&shared_envs_lock);
+      profile_cache_hit(PROFILE_CACHE_HANDLE);
+      END_PHASE_ZONE(PROFILE_LMDB);
+      return db_handle;
+    }
+  }
   rc = mdb_dbi_open(txn, name, flags, &db_handle);
+  pthread_mutex_unlock(&shared_envs_lock);
+  profile_cache_miss(PROFILE_CACHE_HANDLE);
   if (rc != 0) {
     switch (rc) {
       case MDB_NOTFOUND:
@@ -144,38 +294,51 @@ MDB_dbi db_get_handle(MDB_txn* txn, char const* name,
         goto error_end;
     }
   }
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return db_handle;
 error_end:
-  mdb_txn_abort(txn);
-  mdb_env_close(txn_env);
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return 0;
 }
 
 int db_put(MDB_txn* txn, MDB_dbi db_handle, char* key, char* value) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   int rc = 0;
   unsigned int flags = MDB_NOOVERWRITE;
   MDB_val key_val = {.mv_size = strlen(key) + 1, .mv_data = (void*)key};
   MDB_val data_val = {.mv_size = strlen(value) + 1, .mv_data = (void*)value};
   rc = mdb_put(txn, db_handle, &key_val, &data_val, flags);
+  metrics_add(METRIC_LMDB_PUTS, 1);
   if (rc != 0 && rc != MDB_KEYEXIST) {
     message_error("db::db_put put failed");
   }
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
+  return rc;
+}
+
+int db_replace(MDB_txn* txn, MDB_dbi db_handle, char* key, char* value) {
+  START_PHASE_ZONE(PROFILE_LMDB);
+  int rc = 0;
+  MDB_val key_val = {.mv_size = strlen(key) + 1, .mv_data = (void*)key};
+  MDB_val data_val = {.mv_size = strlen(value) + 1, .mv_data = (void*)value};
+  rc = mdb_put(txn, db_handle, &key_val, &data_val, 0);
+  metrics_add(METRIC_LMDB_PUTS, 1);
+  if (rc != 0) {
+    message_error("db::db_replace put failed");
+  }
+  END_PHASE_ZONE(PROFILE_LMDB);
   return rc;
 }
 
 int db_delete(MDB_txn* txn, MDB_dbi db_handle, char* key) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   int rc = 0;
   MDB_val key_val = {.mv_size = strlen(key) + 1, .mv_data = (void*)key};
   rc = mdb_del(txn, db_handle, &key_val, (void*)0);
   if (rc == MDB_NOTFOUND) {
     message_error("db::db_delete specified key is not in the database");
   }
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return rc;
 }
 
@@ -260,11 +423,12 @@ error_end:
 }
 
 sds db_get(MDB_txn* txn, MDB_dbi db_handle, char* key) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   int rc = 0;
   MDB_val key_val = {.mv_size = strlen(key) + 1, .mv_data = (void*)key};
   MDB_val data = {0};
   rc = mdb_get(txn, db_handle, &key_val, &data);
+  metrics_add(METRIC_LMDB_GETS, 1);
   if (rc != 0) {
     if (rc == MDB_NOTFOUND) {
       message_error("db::db_get the key was not in the database");
@@ -275,19 +439,22 @@ sds db_get(MDB_txn* txn, MDB_dbi db_handle, char* key) {
     }
   }
   sds value = sdsnew((char*)data.mv_data);
-  END_ZONE;
+  profile_add_bytes(PROFILE_LMDB, data.mv_size);
+  END_PHASE_ZONE(PROFILE_LMDB);
   return value;
 error_end:
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return (void*)0;
 }
 
 sds db_list_items(MDB_txn* txn, MDB_dbi db_handle) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   MDB_cursor* cursor = {0};
+  sds listing = (void*)0;
   int rc = mdb_cursor_open(txn, db_handle, &cursor);
   if (rc != 0) {
     message_error("db::db_list failed in creating a cursor handle");
+    END_PHASE_ZONE(PROFILE_LMDB);
     return (void*)0;
   }
   MDB_val key = {0};
@@ -297,24 +464,26 @@ sds db_list_items(MDB_txn* txn, MDB_dbi db_handle) {
     message_error("db::db_list failed in retrieving the first key/data pair");
     goto error_end;
   }
-  sds listing = sdscatfmt(sdsempty(), "%s -- %s\n", key.mv_data, data.mv_data);
+  listing = sdscatfmt(sdsempty(), "%s -- %s\n", key.mv_data, data.mv_data);
   while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
     listing = sdscatfmt(listing, "%s -- %s\n", key.mv_data, data.mv_data);
   }
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   return listing;
 error_end:
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   sdsfree(listing);
   return (void*)0;
 }
 
 sds db_list_keys(MDB_txn* txn, MDB_dbi db_handle, bool omit_sub_keys) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_LMDB);
   MDB_cursor* cursor = {0};
+  sds listing = (void*)0;
   int rc = mdb_cursor_open(txn, db_handle, &cursor);
   if (rc != 0) {
     message_error("db::db_list failed in creating a cursor handle");
+    END_PHASE_ZONE(PROFILE_LMDB);
     return (void*)0;
   }
   MDB_val key = {0};
@@ -324,17 +493,55 @@ sds db_list_keys(MDB_txn* txn, MDB_dbi db_handle, bool omit_sub_keys) {
     message_error("db::db_list failed in retrieving the first key/data pair");
     goto error_end;
   }
-  sds listing = sdscatfmt(sdsempty(), "%s\n", key.mv_data);
+  listing = sdscatfmt(sdsempty(), "%s\n", key.mv_data);
   while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
     if (omit_sub_keys && strstr(key.mv_data, "::")) {
       continue;
     }
     listing = sdscatfmt(listing, "%s\n", key.mv_data);
   }
-  END_ZONE;
+  profile_add_bytes(PROFILE_LMDB, sdslen(listing));
+  END_PHASE_ZONE(PROFILE_LMDB);
   return listing;
 error_end:
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_LMDB);
   sdsfree(listing);
   return (void*)0;
 }
+
+MDB_cursor* db_cursor_init(MDB_txn* txn, MDB_dbi db_handle) {
+  START_PHASE_ZONE(PROFILE_LMDB);
+  MDB_cursor* cursor = (void*)0;
+  int rc = mdb_cursor_open(txn, db_handle, &cursor);
+  if (rc != 0) {
+    message_error("db::db_cursor_init failed in creating a cursor handle");
+    END_PHASE_ZONE(PROFILE_LMDB);
+    return (void*)0;
+  }
+  END_PHASE_ZONE(PROFILE_LMDB);
+  return cursor;
+}
+
+// Steps the cursor forward one key at a time, the first call returns the
+// first key. Returns NULL once the database is exhausted.
+sds db_cursor_next_key(MDB_cursor* cursor, bool omit_sub_keys) {
+  START_PHASE_ZONE(PROFILE_LMDB);
+  MDB_val key = {0};
+  MDB_val data = {0};
+  while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+    if (omit_sub_keys && strstr(key.mv_data, "::")) {
+      continue;
+    }
+    profile_add_bytes(PROFILE_LMDB, key.mv_size);
+    END_PHASE_ZONE(PROFILE_LMDB);
+    return sdsnew(key.mv_data);
+  }
+  END_PHASE_ZONE(PROFILE_LMDB);
+  return (void*)0;
+}
+
+void db_cursor_terminate(MDB_cursor* cursor) {
+  if (cursor) {
+    mdb_cursor_close(cursor);
+  }
+}
@@ -0,0 +1,248 @@
+#include "explain.h"
+
+#include <janet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lisp.h"
+#include "profile.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// What evaluating a form cost, next to what it returned. The record keeps
+// the raw numbers for the table, data the same numbers for janet code.
+typedef struct explain_report explain_report;
+struct explain_report {
+  profile_record record;
+  Janet data;
+};
+
+static int explain_report_gcmark(void* p, size_t len);
+static int explain_report_get(void* p, Janet key, Janet* out);
+static Janet explain_report_next(void* p, Janet key);
+static void explain_report_tostring(void* p, JanetBuffer* buffer);
+static uint64_t janet_ns(profile_record const* record);
+static uint64_t total_ns(profile_record const* record);
+static Janet name_keyword(char const* name);
+static Janet pair_struct(char const* first, double first_value,
+                         char const* second, double second_value);
+static Janet report_data(profile_record const* record, Janet result);
+static void push_phase_row(JanetBuffer* buffer, char const* name,
+                           uint64_t ns, uint64_t bytes, uint64_t total);
+static Janet cfun_explain_form(int32_t argc, Janet* argv);
+
+static const JanetAbstractType explain_report_type = {
+    "scribe/explain",        (void*)0,
+    explain_report_gcmark,   explain_report_get,
+    (void*)0,                (void*)0,
+    (void*)0,                explain_report_tostring,
+    (void*)0,                (void*)0,
+    explain_report_next,     JANET_ATEND_NEXT};
+
+static int explain_report_gcmark(void* p, size_t len) {
+  (void)len;
+  janet_mark(((explain_report*)p)->data);
+  return 0;
+}
+
+static int explain_report_get(void* p, Janet key, Janet* out) {
+  Janet value = janet_get(((explain_report*)p)->data, key);
+  if (janet_checktype(value, JANET_NIL)) {
+    return 0;
+  }
+  *out = value;
+  return 1;
+}
+
+static Janet explain_report_next(void* p, Janet key) {
+  return janet_next(((explain_report*)p)->data, key);
+}
+
+// The lmdb reads, parses and queries of a form all run inside its eval, so
+// they are taken out to leave the time spent in janet itself.
+static uint64_t janet_ns(profile_record const* record) {
+  uint64_t nested_ns = 0;
+  for (int p = 0; p < PROFILE_NUM_PHASES; p += 1) {
+    if (p != PROFILE_COMPILE && p != PROFILE_EVAL) {
+      nested_ns += record->phase_ns[p];
+    }
+  }
+  uint64_t eval_ns = record->phase_ns[PROFILE_EVAL];
+  return eval_ns > nested_ns ? eval_ns - nested_ns : 0;
+}
+
+static uint64_t total_ns(profile_record const* record) {
+  return record->phase_ns[PROFILE_COMPILE] + record->phase_ns[PROFILE_EVAL];
+}
+
+// Phase and cache names use underscores, keywords use dashes.
+static Janet name_keyword(char const* name) {
+  char keyword[32] = {0};
+  size_t len = strlen(name);
+  if (len > sizeof(keyword)) {
+    len = sizeof(keyword);
+  }
+  for (size_t i = 0; i < len; i += 1) {
+    keyword[i] = name[i] == '_' ? '-' : name[i];
+  }
+  return janet_keywordv((uint8_t const*)keyword, (int32_t)len);
+}
+
+static Janet pair_struct(char const* first, double first_value,
+                         char const* second, double second_value) {
+  JanetKV* pair = janet_struct_begin(2);
+  janet_struct_put(pair, janet_ckeywordv(first),
+                   janet_wrap_number(first_value));
+  janet_struct_put(pair, janet_ckeywordv(second),
+                   janet_wrap_number(second_value));
+  return janet_wrap_struct(janet_struct_end(pair));
+}
+
+static Janet report_data(profile_record const* record, Janet result) {
+  START_ZONE;
+  JanetKV* phases = janet_struct_begin(PROFILE_NUM_PHASES + 1);
+  for (int p = 0; p < PROFILE_NUM_PHASES; p += 1) {
+    janet_struct_put(phases, name_keyword(profile_phase_name(p)),
+                     pair_struct("ms", record->phase_ns[p] / 1e6, "bytes",
+                                 (double)record->phase_bytes[p]));
+  }
+  janet_struct_put(phases, janet_ckeywordv("janet"),
+                   pair_struct("ms", janet_ns(record) / 1e6, "bytes", 0));
+  JanetKV* caches = janet_struct_begin(PROFILE_NUM_CACHES);
+  for (int c = 0; c < PROFILE_NUM_CACHES; c += 1) {
+    janet_struct_put(caches, name_keyword(profile_cache_name(c)),
+                     pair_struct("hits", (double)record->cache_hits[c],
+                                 "misses", (double)record->cache_misses[c]));
+  }
+  JanetKV* data = janet_struct_begin(6);
+  janet_struct_put(data, janet_ckeywordv("result"), result);
+  janet_struct_put(data, janet_ckeywordv("total-ms"),
+                   janet_wrap_number(total_ns(record) / 1e6));
+  janet_struct_put(data, janet_ckeywordv("phases"),
+                   janet_wrap_struct(janet_struct_end(phases)));
+  janet_struct_put(data, janet_ckeywordv("caches"),
+                   janet_wrap_struct(janet_struct_end(caches)));
+  janet_struct_put(data, janet_ckeywordv("matches"),
+                   pair_struct("scanned", (double)record->matches_scanned,
+                               "returned", (double)record->matches_returned));
+  janet_struct_put(data, janet_ckeywordv("tree"),
+                   pair_struct("nodes", (double)record->tree_nodes, "bytes",
+                               (double)record->tree_bytes));
+  END_ZONE;
+  return janet_wrap_struct(janet_struct_end(data));
+}
+
+static void push_phase_row(JanetBuffer* buffer, char const* name,
+                           uint64_t ns, uint64_t bytes, uint64_t total) {
+  char bytes_text[24] = "-";
+  if (bytes != 0) {
+    snprintf(bytes_text, sizeof(bytes_text), "%llu",
+             (unsigned long long)bytes);
+  }
+  char row[96];
+  snprintf(row, sizeof(row), "%-14s %10.3f %6.1f%% %12s\n", name, ns / 1e6,
+           total == 0 ? 0.0 : 100.0 * ns / total, bytes_text);
+  janet_buffer_push_cstring(buffer, row);
+}
+
+// Printed by the repl in place of the value, one row per phase followed by
+// the caches, the matches and the trees the form went through.
+static void explain_report_tostring(void* p, JanetBuffer* buffer) {
+  profile_record const* record = &((explain_report*)p)->record;
+  uint64_t total = total_ns(record);
+  char row[96];
+  snprintf(row, sizeof(row), "\n%-14s %10s %7s %12s\n", "phase", "time_ms",
+           "share", "bytes");
+  janet_buffer_push_cstring(buffer, row);
+  for (int p = 0; p < PROFILE_NUM_PHASES; p += 1) {
+    if (p == PROFILE_EVAL) {
+      push_phase_row(buffer, "janet", janet_ns(record), 0, total);
+    } else {
+      push_phase_row(buffer, profile_phase_name(p), record->phase_ns[p],
+                     record->phase_bytes[p], total);
+    }
+  }
+  push_phase_row(buffer, "total", total, record->bytes_copied, total);
+  snprintf(row, sizeof(row), "\n%-14s %10s %8s\n", "cache", "hits",
+           "misses");
+  janet_buffer_push_cstring(buffer, row);
+  for (int c = 0; c < PROFILE_NUM_CACHES; c += 1) {
+    snprintf(row, sizeof(row), "%-14s %10llu %8llu\n", profile_cache_name(c),
+             (unsigned long long)record->cache_hits[c],
+             (unsigned long long)record->cache_misses[c]);
+    janet_buffer_push_cstring(buffer, row);
+  }
+  snprintf(row, sizeof(row), "\n%-14s %llu scanned, %llu returned\n",
+           "matches", (unsigned long long)record->matches_scanned,
+           (unsigned long long)record->matches_returned);
+  janet_buffer_push_cstring(buffer, row);
+  snprintf(row, sizeof(row), "%-14s %llu nodes, %llu bytes\n", "trees",
+           (unsigned long long)record->tree_nodes,
+           (unsigned long long)record->tree_bytes);
+  janet_buffer_push_cstring(buffer, row);
+}
+
+// The form is compiled and run in env under a profile record of its own,
+// the report is only allocated once the nested run can no longer collect
+// it.
+static Janet cfun_explain_form(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 2);
+  JanetTable* env = janet_gettable(argv, 1);
+  profile_record record = {.count_nodes = true};
+  profile_record* outer = profile_explain_begin(&record);
+  Janet result = janet_wrap_nil();
+  int rc = lisp_execute_form(env, argv[0], &result);
+  profile_explain_end(outer);
+  if (rc != 0) {
+    janet_panicv(result);
+  }
+  explain_report* report = (explain_report*)janet_abstract(
+      &explain_report_type, sizeof(explain_report));
+  report->record = record;
+  report->data = report_data(&record, result);
+  return janet_wrap_abstract(report);
+}
+
+static const JanetReg explain_cfuns[] = {
+    {"explain-form", cfun_explain_form,
+     "(core/explain-form form env)\n\nEvaluate form in env and report the "
+     "time and bytes of every phase, the cache hits, the matches scanned "
+     "and returned and the size of the trees used. See core/explain."},
+    {(void*)0, (void*)0, (void*)0},
+};
+
+void register_explain_module(JanetTable* env) {
+  lisp_register_module(env, "core", explain_cfuns);
+}
+
+#ifdef UNIT_TEST_EXPLAIN
+
+#include "test_deps/utest.h"
+
+UTEST(explain, pure_janet_form) {
+  lisp_init_vm();
+  JanetTable* env = lisp_init_env();
+  register_explain_module(env);
+  Janet report = janet_wrap_nil();
+  ASSERT_EQ(lisp_execute_script(
+                env, "(core/explain-form '(+ 1 2) (curenv))", &report),
+            0);
+  ASSERT_TRUE(janet_checkabstract(report, &explain_report_type) !=
+              (void*)0);
+  Janet result = janet_get(report, janet_ckeywordv("result"));
+  ASSERT_EQ(janet_unwrap_number(result), 3.0);
+  Janet matches = janet_get(report, janet_ckeywordv("matches"));
+  ASSERT_EQ(janet_unwrap_number(
+                janet_get(matches, janet_ckeywordv("scanned"))),
+            0.0);
+  JanetString table = janet_to_string(report);
+  ASSERT_TRUE(strstr((char const*)table, "query_compile") != (void*)0);
+  ASSERT_TRUE(strstr((char const*)table, "janet") != (void*)0);
+  lisp_terminate();
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,140 @@
+#include "hash.h"
+
+#include <sds.h>
+#include <stdint.h>
+#include <string.h>
+
+// MurmurHash3 x64 128-bit variant by Austin Appleby (public domain), with a
+// fixed seed so hashes can be persisted and compared across runs.
+
+#define HASH_SEED 0x5c71beULL
+
+static inline uint64_t rotl64(uint64_t x, int8_t r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static inline uint64_t load64(uint8_t const* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+hash128 hash_bytes(void const* data, size_t len) {
+  uint8_t const* bytes = (uint8_t const*)data;
+  size_t nblocks = len / 16;
+  uint64_t h1 = HASH_SEED;
+  uint64_t h2 = HASH_SEED;
+  uint64_t const c1 = 0x87c37b91114253d5ULL;
+  uint64_t const c2 = 0x4cf5ad432745937fULL;
+  for (size_t i = 0; i < nblocks; i += 1) {
+    uint64_t k1 = load64(bytes + i * 16);
+    uint64_t k2 = load64(bytes + i * 16 + 8);
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+  uint8_t const* tail = bytes + nblocks * 16;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  switch (len & 15) {
+    case 15:
+      k2 ^= ((uint64_t)tail[14]) << 48;  // fallthrough
+    case 14:
+      k2 ^= ((uint64_t)tail[13]) << 40;  // fallthrough
+    case 13:
+      k2 ^= ((uint64_t)tail[12]) << 32;  // fallthrough
+    case 12:
+      k2 ^= ((uint64_t)tail[11]) << 24;  // fallthrough
+    case 11:
+      k2 ^= ((uint64_t)tail[10]) << 16;  // fallthrough
+    case 10:
+      k2 ^= ((uint64_t)tail[9]) << 8;  // fallthrough
+    case 9:
+      k2 ^= ((uint64_t)tail[8]);
+      k2 *= c2;
+      k2 = rotl64(k2, 33);
+      k2 *= c1;
+      h2 ^= k2;  // fallthrough
+    case 8:
+      k1 ^= ((uint64_t)tail[7]) << 56;  // fallthrough
+    case 7:
+      k1 ^= ((uint64_t)tail[6]) << 48;  // fallthrough
+    case 6:
+      k1 ^= ((uint64_t)tail[5]) << 40;  // fallthrough
+    case 5:
+      k1 ^= ((uint64_t)tail[4]) << 32;  // fallthrough
+    case 4:
+      k1 ^= ((uint64_t)tail[3]) << 24;  // fallthrough
+    case 3:
+      k1 ^= ((uint64_t)tail[2]) << 16;  // fallthrough
+    case 2:
+      k1 ^= ((uint64_t)tail[1]) << 8;  // fallthrough
+    case 1:
+      k1 ^= ((uint64_t)tail[0]);
+      k1 *= c1;
+      k1 = rotl64(k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+  }
+  h1 ^= (uint64_t)len;
+  h2 ^= (uint64_t)len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  hash128 hash = {.lo = h1, .hi = h2};
+  return hash;
+}
+
+sds hash_to_hex(hash128 hash) {
+  static char const digits[] = "0123456789abcdef";
+  char hex[32];
+  for (int i = 0; i < 16; i += 1) {
+    hex[i] = digits[(hash.hi >> (60 - 4 * i)) & 0xf];
+    hex[16 + i] = digits[(hash.lo >> (60 - 4 * i)) & 0xf];
+  }
+  return sdsnewlen(hex, 32);
+}
+
+#ifdef UNIT_TEST_HASH
+
+#include "test_deps/utest.h"
+
+UTEST(hash, stable_hex) {
+  char const* text = "(core/list-paths)";
+  sds a = hash_to_hex(hash_bytes(text, strlen(text)));
+  sds b = hash_to_hex(hash_bytes(text, strlen(text)));
+  sds c = hash_to_hex(hash_bytes(text, strlen(text) - 1));
+  ASSERT_EQ(sdslen(a), 32u);
+  ASSERT_STREQ(a, b);
+  ASSERT_STRNE(a, c);
+  sdsfree(a);
+  sdsfree(b);
+  sdsfree(c);
+}
+
+UTEST_MAIN();
+
+#endif
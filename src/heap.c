@@ -0,0 +1,172 @@
+#include "heap.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+INIT_TRACE;
+
+// Every block carries its size in front of it, so frees can be accounted
+// without asking malloc. The header keeps the 16 byte alignment malloc
+// gives janet and tree-sitter.
+typedef struct heap_header heap_header;
+struct heap_header {
+  _Alignas(16) size_t size;
+  bool counted;
+};
+
+typedef struct heap_counters heap_counters;
+struct heap_counters {
+  atomic_size_t live_bytes;
+  atomic_size_t peak_bytes;
+  atomic_size_t allocations;
+};
+
+static void count_alloc(heap_tag tag, heap_header* header);
+static void count_free(heap_tag tag, heap_header* header);
+static void out_of_memory(heap_tag tag, size_t size);
+
+static char const* tag_names[HEAP_NUM_TAGS] = {"sds", "stb_ds", "janet",
+                                               "tree_sitter"};
+
+// Like metrics, nothing is counted until accounting is enabled, except in
+// traced builds where the tags show up as memory pools in Tracy. Blocks
+// remember whether they were counted, so the ones allocated before are
+// never subtracted.
+#if defined(TRACY_ENABLE)
+static bool enabled = true;
+#else
+static bool enabled = false;
+#endif
+static heap_counters counters[HEAP_NUM_TAGS];
+
+static void count_alloc(heap_tag tag, heap_header* header) {
+  header->counted = enabled;
+  if (!enabled) {
+    return;
+  }
+  heap_counters* c = &counters[tag];
+  atomic_fetch_add_explicit(&c->allocations, 1, memory_order_relaxed);
+  size_t live = atomic_fetch_add_explicit(&c->live_bytes, header->size,
+                                          memory_order_relaxed) +
+                header->size;
+  size_t peak = atomic_load_explicit(&c->peak_bytes, memory_order_relaxed);
+  while (live > peak && !atomic_compare_exchange_weak_explicit(
+                            &c->peak_bytes, &peak, live, memory_order_relaxed,
+                            memory_order_relaxed)) {
+  }
+  RECORD_ALLOC(header + 1, header->size, tag_names[tag]);
+}
+
+static void count_free(heap_tag tag, heap_header* header) {
+  if (!header->counted) {
+    return;
+  }
+  atomic_fetch_sub_explicit(&counters[tag].live_bytes, header->size,
+                            memory_order_relaxed);
+  RECORD_FREE(header + 1, tag_names[tag]);
+}
+
+// None of the hooked libraries can recover from a failed allocation.
+static void out_of_memory(heap_tag tag, size_t size) {
+  log_fatal("heap::heap_malloc failed in allocating %zu bytes for %s", size,
+            tag_names[tag]);
+  exit(1);
+}
+
+void* heap_malloc(heap_tag tag, size_t size) {
+  heap_header* header = malloc(sizeof(heap_header) + size);
+  if (!header) {
+    out_of_memory(tag, size);
+  }
+  header->size = size;
+  count_alloc(tag, header);
+  return header + 1;
+}
+
+void* heap_calloc(heap_tag tag, size_t count, size_t size) {
+  if (size != 0 && count > (SIZE_MAX - sizeof(heap_header)) / size) {
+    out_of_memory(tag, SIZE_MAX);
+  }
+  heap_header* header = calloc(1, sizeof(heap_header) + count * size);
+  if (!header) {
+    out_of_memory(tag, count * size);
+  }
+  header->size = count * size;
+  count_alloc(tag, header);
+  return header + 1;
+}
+
+void* heap_realloc(heap_tag tag, void* buffer, size_t size) {
+  if (!buffer) {
+    return heap_malloc(tag, size);
+  }
+  heap_header* header = (heap_header*)buffer - 1;
+  count_free(tag, header);
+  header = realloc(header, sizeof(heap_header) + size);
+  if (!header) {
+    out_of_memory(tag, size);
+  }
+  header->size = size;
+  count_alloc(tag, header);
+  return header + 1;
+}
+
+void heap_free(heap_tag tag, void* buffer) {
+  if (!buffer) {
+    return;
+  }
+  heap_header* header = (heap_header*)buffer - 1;
+  count_free(tag, header);
+  free(header);
+}
+
+void heap_enable(void) { enabled = true; }
+
+bool heap_enabled(void) { return enabled; }
+
+heap_stats heap_tag_stats(heap_tag tag) {
+  heap_counters* c = &counters[tag];
+  return (heap_stats){.live_bytes = atomic_load(&c->live_bytes),
+                      .peak_bytes = atomic_load(&c->peak_bytes),
+                      .allocations = atomic_load(&c->allocations)};
+}
+
+char const* heap_tag_name(heap_tag tag) { return tag_names[tag]; }
+
+#ifdef UNIT_TEST_HEAP
+
+#include "test_deps/utest.h"
+
+UTEST(heap, live_and_peak_bytes) {
+  bool counted_from_start = heap_enabled();
+  char* before = heap_malloc(HEAP_SDS, 100);
+  heap_enable();
+  heap_stats start = heap_tag_stats(HEAP_SDS);
+  char* first = heap_malloc(HEAP_SDS, 100);
+  ASSERT_TRUE(((uintptr_t)first % 16) == 0);
+  char* second = heap_calloc(HEAP_SDS, 10, 10);
+  ASSERT_EQ(second[99], 0);
+  heap_free(HEAP_SDS, first);
+  second = heap_realloc(HEAP_SDS, second, 300);
+  // Traced builds count from the start, otherwise a block from before
+  // accounting was enabled is never subtracted.
+  heap_free(HEAP_SDS, before);
+  size_t before_bytes = counted_from_start ? 100 : 0;
+  heap_stats end = heap_tag_stats(HEAP_SDS);
+  ASSERT_EQ(end.live_bytes + before_bytes - start.live_bytes, (size_t)300);
+  ASSERT_EQ(end.peak_bytes, (size_t)300 + before_bytes);
+  ASSERT_EQ(end.allocations - start.allocations, (size_t)3);
+  heap_free(HEAP_SDS, second);
+  ASSERT_EQ(heap_tag_stats(HEAP_SDS).live_bytes + before_bytes,
+            start.live_bytes);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,220 @@
+#include "image.h"
+
+#include <janet.h>
+#include <stddef.h>
+
+#include "c_queries.h"
+#include "core_queries.h"
+#include "explain.h"
+#include "lisp.h"
+#include "parallel.h"
+#include "search.h"
+#include "syntax_tree.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+#ifdef SCRIBE_IMAGE
+// Emitted at build time by scribe_image_gen.
+extern unsigned char const scribe_image_embed[];
+extern size_t const scribe_image_embed_size;
+#endif
+
+static JanetTable* scribe_lookup(JanetTable* core_env);
+static JanetTable* invert_lookup(JanetTable* lookup);
+static JanetTable* load_env(JanetTable* core_env);
+
+// Pure Janet helpers shipped alongside the C modules. They are compiled once
+// into the image instead of on every startup.
+static char const* const helpers_src =
+    "(defn core/indexed-files\n"
+    "  \"List the indexed files under path as an array.\"\n"
+    "  [path]\n"
+    "  (filter (fn [name] (not (empty? name)))\n"
+    "          (string/split \"\\n\" (core/list-files path))))\n"
+    "\n"
+    "(defn core/files\n"
+    "  \"Lazily yield the files indexed under path.\"\n"
+    "  [path]\n"
+    "  (def cursor (core/file-cursor path))\n"
+    "  (generate [name :iterate (core/cursor-next cursor)] name))\n"
+    "\n"
+    "(defn core/paths\n"
+    "  \"Lazily yield the indexed paths.\"\n"
+    "  []\n"
+    "  (def cursor (core/path-cursor))\n"
+    "  (generate [path :iterate (core/cursor-next cursor)] path))\n"
+    "\n"
+    "(defn c/captures\n"
+    "  \"Lazily yield the text captured by a tree-sitter query over src.\"\n"
+    "  [query src &opt opts]\n"
+    "  (def cursor (c/query-cursor query src opts))\n"
+    "  (generate [text :iterate (c/query-cursor-next cursor)] text))\n"
+    "\n"
+    "(defn c/search-all\n"
+    "  \"Lazily yield the matches of pattern across the indexed files.\"\n"
+    "  [pattern &opt path-prefix limit opts]\n"
+    "  (def search (c/search-start pattern path-prefix limit nil opts))\n"
+    "  (generate [found :iterate (c/search-next search)] found))\n"
+    "\n"
+    "(defn c/file-function-definition\n"
+    "  \"Return the function defined by fn-name in an indexed file.\"\n"
+    "  [path name fn-name]\n"
+    "  (c/function-definition fn-name (core/file path name)))\n"
+    "\n"
+    "(defmacro core/explain\n"
+    "  \"Evaluate form and break down what it cost phase by phase.\"\n"
+    "  [form]\n"
+    "  ~(core/explain-form ',form (curenv)))\n";
+
+// Symbol -> value table covering everything the image may reference but
+// does not carry itself: the core env and the scribe cfuns.
+static JanetTable* scribe_lookup(JanetTable* core_env) {
+  START_ZONE;
+  JanetTable* lookup = janet_env_lookup(core_env);
+  JanetTable* modules = janet_table(0);
+  register_core_module(modules);
+  register_c_module(modules);
+  register_node_module(modules);
+  register_parallel_module(modules);
+  register_search_module(modules);
+  register_explain_module(modules);
+  janet_env_lookup_into(lookup, modules, (void*)0, 0);
+  END_ZONE;
+  return lookup;
+}
+
+static JanetTable* invert_lookup(JanetTable* lookup) {
+  START_ZONE;
+  JanetTable* rreg = janet_table(lookup->count);
+  for (int32_t i = 0; i < lookup->capacity; i += 1) {
+    JanetKV kv = lookup->data[i];
+    if (!janet_checktype(kv.key, JANET_NIL)) {
+      janet_table_put(rreg, kv.value, kv.key);
+    }
+  }
+  END_ZONE;
+  return rreg;
+}
+
+JanetTable* image_build_env(JanetTable* core_env) {
+  START_ZONE;
+  JanetTable* env = janet_table(0);
+  env->proto = core_env;
+  register_core_module(env);
+  register_c_module(env);
+  register_node_module(env);
+  register_parallel_module(env);
+  register_search_module(env);
+  register_explain_module(env);
+  int rc = lisp_execute_script(env, helpers_src, (void*)0);
+  if (rc != 0) {
+    message_fatal("image::image_build_env failed in compiling the helpers");
+    END_ZONE;
+    return (void*)0;
+  }
+  END_ZONE;
+  return env;
+}
+
+JanetBuffer* image_marshal_env(JanetTable* env, JanetTable* core_env) {
+  START_ZONE;
+  JanetTable* rreg = invert_lookup(scribe_lookup(core_env));
+  // The core env is rebuilt by janet itself, only scribe's bindings go in.
+  JanetTable* proto = env->proto;
+  env->proto = (void*)0;
+  JanetBuffer* image = janet_buffer(0);
+  janet_marshal(image, janet_wrap_table(env), rreg, 0);
+  env->proto = proto;
+  END_ZONE;
+  return image;
+}
+
+static JanetTable* load_env(JanetTable* core_env) {
+  START_ZONE;
+#ifdef SCRIBE_IMAGE
+  JanetTable* lookup = scribe_lookup(core_env);
+  Janet image = janet_unmarshal(scribe_image_embed, scribe_image_embed_size,
+                                0, lookup, (void*)0);
+  if (!janet_checktype(image, JANET_TABLE)) {
+    message_fatal("image::load_env embedded image is not an environment");
+    END_ZONE;
+    return (void*)0;
+  }
+  JanetTable* env = janet_unwrap_table(image);
+  env->proto = core_env;
+#else
+  JanetTable* env = image_build_env(core_env);
+#endif
+  END_ZONE;
+  return env;
+}
+
+// The scribe env is cached on the core env, which janet memoizes per VM, so
+// it is loaded once per thread and dropped together with the VM.
+JanetTable* image_env(void) {
+  START_ZONE;
+  lisp_init_vm();
+  JanetTable* core_env = janet_core_env((void*)0);
+  Janet key = janet_ckeywordv("scribe-image");
+  Janet cached = janet_table_rawget(core_env, key);
+  if (janet_checktype(cached, JANET_TABLE)) {
+    END_ZONE;
+    return janet_unwrap_table(cached);
+  }
+  JanetTable* env = load_env(core_env);
+  if (env) {
+    janet_table_put(core_env, key, janet_wrap_table(env));
+  }
+  END_ZONE;
+  return env;
+}
+
+// Tables for moving values between VMs, core and scribe functions, the
+// Janet helpers included, travel by name and everything else by value.
+JanetTable* image_lookup(void) {
+  START_ZONE;
+  JanetTable* env = image_env();
+  JanetTable* lookup = scribe_lookup(janet_core_env((void*)0));
+  if (env) {
+    janet_env_lookup_into(lookup, env, (void*)0, 0);
+  }
+  END_ZONE;
+  return lookup;
+}
+
+JanetTable* image_reverse_lookup(void) {
+  return invert_lookup(image_lookup());
+}
+
+#ifdef UNIT_TEST_IMAGE
+
+#include "test_deps/utest.h"
+
+UTEST(image, round_trip) {
+  lisp_init_vm();
+  JanetTable* core_env = janet_core_env((void*)0);
+  JanetTable* env = image_build_env(core_env);
+  ASSERT_TRUE(env != (void*)0);
+  JanetBuffer* image = image_marshal_env(env, core_env);
+  Janet loaded = janet_unmarshal(image->data, image->count, 0,
+                                 scribe_lookup(core_env), (void*)0);
+  ASSERT_TRUE(janet_checktype(loaded, JANET_TABLE));
+  JanetTable* loaded_env = janet_unwrap_table(loaded);
+  loaded_env->proto = core_env;
+  Janet file_src = janet_wrap_nil();
+  Janet loaded_file_src = janet_wrap_nil();
+  janet_resolve(env, janet_csymbol("core/file-src"), &file_src);
+  janet_resolve(loaded_env, janet_csymbol("core/file-src"), &loaded_file_src);
+  ASSERT_TRUE(janet_checktype(loaded_file_src, JANET_CFUNCTION));
+  ASSERT_TRUE(janet_equals(file_src, loaded_file_src));
+  Janet helper = janet_wrap_nil();
+  janet_resolve(loaded_env, janet_csymbol("c/file-function-definition"),
+                &helper);
+  ASSERT_TRUE(janet_checktype(helper, JANET_FUNCTION));
+  lisp_terminate();
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,50 @@
+// Build step which compiles the scribe env once and writes it out as a C
+// array, so startup only has to unmarshal it.
+#include <janet.h>
+#include <stdio.h>
+
+#include "image.h"
+#include "lisp.h"
+#include "trace.h"
+
+static int write_image(char const* path, JanetBuffer* image) {
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    log_fatal("image_gen::write_image failed in opening %s", path);
+    return -1;
+  }
+  fprintf(out,
+          "// Generated by scribe_image_gen, do not edit.\n"
+          "#include <stddef.h>\n\n"
+          "unsigned char const scribe_image_embed[] = {");
+  for (int32_t i = 0; i < image->count; i += 1) {
+    fprintf(out, "%s0x%02x,", (i % 12 == 0) ? "\n    " : " ",
+            image->data[i]);
+  }
+  fprintf(out,
+          "\n};\n\n"
+          "size_t const scribe_image_embed_size = %d;\n",
+          image->count);
+  if (fclose(out) != 0) {
+    log_fatal("image_gen::write_image failed in writing %s", path);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <output.c>\n", argv[0]);
+    return 1;
+  }
+  lisp_init_vm();
+  JanetTable* core_env = janet_core_env((void*)0);
+  JanetTable* env = image_build_env(core_env);
+  if (!env) {
+    lisp_terminate();
+    return 1;
+  }
+  int rc = write_image(argv[1], image_marshal_env(env, core_env));
+  lisp_terminate();
+  return rc == 0 ? 0 : 1;
+}
@@ -12,6 +12,8 @@
 
 #include "db.h"
 #include "lisp.h"
+#include "metrics.h"
+#include "profile.h"
 #include "trace.h"
 
 INIT_TRACE;
@@ -30,11 +32,19 @@ static void collect_file_info(char const* path);
 static char* read_scribe_file(char const* path);
 static int set_language(char const* lang);
 static Janet cfun_set_language(int32_t argc, Janet* argv);
+static Janet cfun_set_query_timeout(int32_t argc, Janet* argv);
+static Janet cfun_set_match_limit(int32_t argc, Janet* argv);
+static int persist_setting(MDB_txn* txn, MDB_dbi db_handle, char* key,
+                           int32_t value);
 static int execute_scribe_file(char const* path);
+static int put_value(MDB_txn* txn, MDB_dbi db_handle, char* key, char* value,
+                     bool interactive);
 
 static char** exts = (void*)0;
 static file_info* finfos = (void*)0;
 static char const* language = "";
+static int32_t query_timeout_ms = 0;
+static int32_t match_limit = 0;
 static struct {
   char* key;
   bool value;
@@ -48,6 +58,7 @@ char* read_file_to_str(const char* path, unsigned int* file_len_out) {
   file = fopen(path, "rb");
   if (!file) {
     log_error("indexer::read_file_to_str unable to open file %s", path);
+    END_ZONE;
     return (void*)0;
   }
 
@@ -55,6 +66,7 @@ char* read_file_to_str(const char* path, unsigned int* file_len_out) {
   if (-1 == e) {
     log_error("indexer::read_file_to_str unable to seek file %s", path);
     fclose(file);
+    END_ZONE;
     return (void*)0;
   }
 
@@ -62,6 +74,7 @@ char* read_file_to_str(const char* path, unsigned int* file_len_out) {
   if (-1 == file_len) {
     log_error("indexer::read_file_to_str unable to ftell() file %s", path);
     fclose(file);
+    END_ZONE;
     return (void*)0;
   }
 
@@ -69,6 +82,7 @@ char* read_file_to_str(const char* path, unsigned int* file_len_out) {
   if (-1 == e) {
     log_error("indexer::read_file_to_str unable to seek file %s", path);
     fclose(file);
+    END_ZONE;
     return (void*)0;
   }
 
@@ -76,6 +90,7 @@ char* read_file_to_str(const char* path, unsigned int* file_len_out) {
   if (!contents) {
     log_error("indexer::read_file_to_str memory error!");
     fclose(file);
+    END_ZONE;
     return (void*)0;
   }
 
@@ -84,11 +99,13 @@ char* read_file_to_str(const char* path, unsigned int* file_len_out) {
     log_error("indexer::read_file_to_str read error");
     free(contents);
     fclose(file);
+    END_ZONE;
     return (void*)0;
   }
   fclose(file);
 
   contents[file_len] = '\0';
+  metrics_add(METRIC_BYTES_READ, (uint64_t)file_len);
 
   if (file_len_out) *file_len_out = file_len + 1;
 
@@ -168,9 +185,28 @@ static Janet cfun_set_language(int32_t argc, Janet* argv) {
   return janet_wrap_nil();
 }
 
+static Janet cfun_set_query_timeout(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  query_timeout_ms = janet_getnat(argv, 0);
+  return janet_wrap_nil();
+}
+
+static Janet cfun_set_match_limit(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  match_limit = janet_getnat(argv, 0);
+  return janet_wrap_nil();
+}
+
 static const JanetReg config_cfuns[] = {
     {"set-language", cfun_set_language,
      "(config/set-language)\n\nSet the language."},
+    {"set-query-timeout", cfun_set_query_timeout,
+     "(config/set-query-timeout ms)\n\nDefault time limit for parsing and "
+     "querying one source, 0 for none."},
+    {"set-match-limit", cfun_set_match_limit,
+     "(config/set-match-limit n)\n\nDefault limit on the matches a query "
+     "keeps in progress, 0 for tree-sitter's own limit."},
+    {(void*)0, (void*)0, (void*)0},
 };
 
 static int execute_scribe_file(char const* path) {
@@ -186,13 +222,22 @@ static int execute_scribe_file(char const* path) {
   lisp_register_module(env, "config", config_cfuns);
   int rc = lisp_execute_script(env, contents, (void*)0);
   free(contents);
-  lisp_terminate();
   END_ZONE;
   return rc;
 }
 
-int index_files(char const* path) {
+// Without a terminal to ask, a key that changed is simply overwritten.
+static int put_value(MDB_txn* txn, MDB_dbi db_handle, char* key, char* value,
+                     bool interactive) {
+  if (interactive) {
+    return db_interactive_put(txn, db_handle, key, value);
+  }
+  return db_replace(txn, db_handle, key, value) == 0 ? 0 : -1;
+}
+
+int index_files(char const* path, bool interactive) {
   START_ZONE;
+  char const* outer_label = profile_enter("index");
   int rc = 0;
   shdefault(pathset, false);
   sds length_key = sdsempty();
@@ -230,11 +275,12 @@ int index_files(char const* path) {
           finfo.path);
       goto error_end;
     }
-    rc = db_interactive_put(txn, db_handle, finfo.name, finfo.contents);
+    rc = put_value(txn, db_handle, finfo.name, finfo.contents, interactive);
     if (rc < 0) {
       log_fatal("indexer::index_files failed in putting key: %s", finfo.name);
       goto error_end;
     }
+    metrics_add(METRIC_FILES_INDEXED, 1);
     sdsclear(length_key);
     sdsclear(length_value);
     sdsclear(num_lines_key);
@@ -243,12 +289,13 @@ int index_files(char const* path) {
     length_value = sdscatfmt(length_value, "%u", finfo.length);
     num_lines_key = sdscatfmt(num_lines_key, "%S::%s", finfo.name, "num_lines");
     num_lines_value = sdscatfmt(num_lines_value, "%u", finfo.num_lines);
-    rc = db_interactive_put(txn, db_handle, length_key, length_value);
+    rc = put_value(txn, db_handle, length_key, length_value, interactive);
     if (rc < 0) {
       log_fatal("indexer::index_files failed in putting key: %s", length_key);
       goto error_end;
     }
-    rc = db_interactive_put(txn, db_handle, num_lines_key, num_lines_value);
+    rc = put_value(txn, db_handle, num_lines_key, num_lines_value,
+                   interactive);
     if (rc < 0) {
       log_fatal("indexer::index_files failed in putting key: %s",
                 num_lines_key);
@@ -262,13 +309,28 @@ int index_files(char const* path) {
     goto error_end;
   }
   for (int i = 0; i < shlen(pathset); i += 1) {
-    rc = db_interactive_put(txn, db_handle_paths, pathset[i].key, "");
+    rc = put_value(txn, db_handle_paths, pathset[i].key, "", interactive);
     if (rc < 0) {
       log_fatal("indexer::index_files failed in putting key: %s",
                 pathset[i].key);
       goto error_end;
     }
   }
+  // Readers holding on to indexed data compare this against their own copy
+  // to find out the index was rebuilt under them.
+  MDB_dbi db_handle_project = db_get_handle(txn, "project", true);
+  if (db_handle_project == 0) {
+    log_fatal(
+        "indexer::index_files failed in creating db handle for name: project");
+    goto error_end;
+  }
+  sds generation = sdsfromlonglong((long long)db_txn_id(txn));
+  rc = db_replace(txn, db_handle_project, "generation", generation);
+  sdsfree(generation);
+  if (rc != 0) {
+    message_fatal("indexer::index_files failed in putting key: generation");
+    goto error_end;
+  }
   rc = db_txn_terminate(txn, true);
   if (rc != 0) {
     goto error_end;
@@ -278,6 +340,7 @@ int index_files(char const* path) {
   sdsfree(length_value);
   sdsfree(num_lines_key);
   sdsfree(num_lines_value);
+  profile_leave(outer_label);
   END_ZONE;
   return 0;
 error_end:
@@ -287,11 +350,27 @@ error_end:
   sdsfree(length_value);
   sdsfree(num_lines_key);
   sdsfree(num_lines_value);
+  profile_leave(outer_label);
   END_ZONE;
   return -1;
 }
 
-int persist_project_details(char const* path) {
+// Settings are always written, so a line removed from the scribe file does
+// not leave its old limit behind.
+static int persist_setting(MDB_txn* txn, MDB_dbi db_handle, char* key,
+                           int32_t value) {
+  START_ZONE;
+  sds value_str = sdsfromlonglong(value);
+  int rc = db_replace(txn, db_handle, key, value_str);
+  if (rc != 0) {
+    log_fatal("indexer::persist_setting failed in putting key: %s", key);
+  }
+  sdsfree(value_str);
+  END_ZONE;
+  return rc;
+}
+
+int persist_project_details(char const* path, bool interactive) {
   START_ZONE;
   MDB_env* env = (void*)0;
   MDB_txn* txn = (void*)0;
@@ -328,12 +407,17 @@ int persist_project_details(char const* path) {
         "name: project");
     goto error_end;
   }
-  rc = db_interactive_put(txn, db_handle, "language", language);
+  rc = put_value(txn, db_handle, "language", (char*)language, interactive);
   if (rc < 0) {
     log_fatal(
         "indexer::persist_project_details failed in putting key: language");
     goto error_end;
   }
+  if (persist_setting(txn, db_handle, "query_timeout_ms", query_timeout_ms) !=
+          0 ||
+      persist_setting(txn, db_handle, "match_limit", match_limit) != 0) {
+    goto error_end;
+  }
   rc = db_txn_terminate(txn, true);
   if (rc != 0) {
     goto error_end;
@@ -0,0 +1,262 @@
+#include "json.h"
+
+#include <sds.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+static size_t skip_space(char const* text, size_t len, size_t i);
+static int hex_value(char c);
+static long read_hex4(char const* text, size_t len, size_t i);
+static sds cat_utf8(sds s, unsigned long code);
+static sds read_string(char const* text, size_t len, size_t* i);
+static bool skip_value(char const* text, size_t len, size_t* i);
+
+sds json_cat_string(sds s, char const* str, size_t len) {
+  static char const digits[] = "0123456789abcdef";
+  s = sdscatlen(s, "\"", 1);
+  size_t run = 0;
+  for (size_t i = 0; i < len; i += 1) {
+    unsigned char c = (unsigned char)str[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    s = sdscatlen(s, str + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"':
+        s = sdscatlen(s, "\\\"", 2);
+        break;
+      case '\\':
+        s = sdscatlen(s, "\\\\", 2);
+        break;
+      case '\n':
+        s = sdscatlen(s, "\\n", 2);
+        break;
+      case '\r':
+        s = sdscatlen(s, "\\r", 2);
+        break;
+      case '\t':
+        s = sdscatlen(s, "\\t", 2);
+        break;
+      default: {
+        char escaped[6] = {'\\', 'u', '0', '0', digits[c >> 4],
+                           digits[c & 0xf]};
+        s = sdscatlen(s, escaped, 6);
+        break;
+      }
+    }
+  }
+  s = sdscatlen(s, str + run, len - run);
+  return sdscatlen(s, "\"", 1);
+}
+
+static size_t skip_space(char const* text, size_t len, size_t i) {
+  while (i < len && (text[i] == ' ' || text[i] == '\t' || text[i] == '\n' ||
+                     text[i] == '\r')) {
+    i += 1;
+  }
+  return i;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+static long read_hex4(char const* text, size_t len, size_t i) {
+  if (i + 4 > len) {
+    return -1;
+  }
+  long value = 0;
+  for (size_t j = i; j < i + 4; j += 1) {
+    int digit = hex_value(text[j]);
+    if (digit < 0) {
+      return -1;
+    }
+    value = value * 16 + digit;
+  }
+  return value;
+}
+
+static sds cat_utf8(sds s, unsigned long code) {
+  char bytes[4];
+  size_t n = 0;
+  if (code < 0x80) {
+    bytes[n++] = (char)code;
+  } else if (code < 0x800) {
+    bytes[n++] = (char)(0xc0 | (code >> 6));
+    bytes[n++] = (char)(0x80 | (code & 0x3f));
+  } else if (code < 0x10000) {
+    bytes[n++] = (char)(0xe0 | (code >> 12));
+    bytes[n++] = (char)(0x80 | ((code >> 6) & 0x3f));
+    bytes[n++] = (char)(0x80 | (code & 0x3f));
+  } else {
+    bytes[n++] = (char)(0xf0 | (code >> 18));
+    bytes[n++] = (char)(0x80 | ((code >> 12) & 0x3f));
+    bytes[n++] = (char)(0x80 | ((code >> 6) & 0x3f));
+    bytes[n++] = (char)(0x80 | (code & 0x3f));
+  }
+  return sdscatlen(s, bytes, n);
+}
+
+// Reads the string starting at the quote at *i and moves *i past it.
+static sds read_string(char const* text, size_t len, size_t* i) {
+  sds s = sdsempty();
+  size_t run = *i + 1;
+  for (size_t j = run; j < len; j += 1) {
+    char c = text[j];
+    if (c == '"') {
+      s = sdscatlen(s, text + run, j - run);
+      *i = j + 1;
+      return s;
+    }
+    if (c != '\\') {
+      continue;
+    }
+    s = sdscatlen(s, text + run, j - run);
+    if (j + 1 >= len) {
+      break;
+    }
+    j += 1;
+    char const* simple = strchr("\"\\/bfnrt", text[j]);
+    if (simple && text[j] != '\0') {
+      static char const decoded[] = "\"\\/\b\f\n\r\t";
+      s = sdscatlen(s, &decoded[simple - "\"\\/bfnrt"], 1);
+    } else if (text[j] == 'u') {
+      long code = read_hex4(text, len, j + 1);
+      j += 4;
+      if (code >= 0xd800 && code < 0xdc00 && j + 2 < len &&
+          text[j + 1] == '\\' && text[j + 2] == 'u') {
+        long low = read_hex4(text, len, j + 3);
+        if (low >= 0xdc00 && low < 0xe000) {
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          j += 6;
+        }
+      }
+      if (code < 0) {
+        break;
+      }
+      s = cat_utf8(s, (unsigned long)code);
+    } else {
+      break;
+    }
+    run = j + 1;
+  }
+  sdsfree(s);
+  return (void*)0;
+}
+
+// Moves *i past the value starting there without decoding it.
+static bool skip_value(char const* text, size_t len, size_t* i) {
+  int depth = 0;
+  size_t j = *i;
+  while (j < len) {
+    char c = text[j];
+    if (c == '"') {
+      sds s = read_string(text, len, &j);
+      if (!s) {
+        return false;
+      }
+      sdsfree(s);
+      if (depth == 0) {
+        break;
+      }
+      continue;
+    }
+    if (depth == 0 && (c == ',' || c == '}' || c == ']')) {
+      break;
+    }
+    j += 1;
+    if (c == '{' || c == '[') {
+      depth += 1;
+    } else if ((c == '}' || c == ']') && --depth == 0) {
+      break;
+    }
+  }
+  while (j > *i && strchr(" \t\n\r", text[j - 1])) {
+    j -= 1;
+  }
+  *i = j;
+  return depth == 0;
+}
+
+// Value of key in a JSON object, strings come back unescaped and anything
+// else as its literal text. NULL when the key is absent or the text is not
+// an object.
+sds json_get_member(char const* text, size_t len, char const* key,
+                    bool* is_string) {
+  size_t i = skip_space(text, len, 0);
+  if (i >= len || text[i] != '{') {
+    return (void*)0;
+  }
+  i = skip_space(text, len, i + 1);
+  while (i < len && text[i] == '"') {
+    sds name = read_string(text, len, &i);
+    if (!name) {
+      return (void*)0;
+    }
+    i = skip_space(text, len, i);
+    if (i >= len || text[i] != ':') {
+      sdsfree(name);
+      return (void*)0;
+    }
+    i = skip_space(text, len, i + 1);
+    bool found = strcmp(name, key) == 0;
+    sdsfree(name);
+    if (found && i < len && text[i] == '"') {
+      if (is_string) {
+        *is_string = true;
+      }
+      return read_string(text, len, &i);
+    }
+    size_t start = i;
+    if (!skip_value(text, len, &i)) {
+      return (void*)0;
+    }
+    if (found) {
+      if (is_string) {
+        *is_string = false;
+      }
+      return sdsnewlen(text + start, i - start);
+    }
+    i = skip_space(text, len, i);
+    if (i < len && text[i] == ',') {
+      i = skip_space(text, len, i + 1);
+    }
+  }
+  return (void*)0;
+}
+
+#ifdef UNIT_TEST_JSON
+
+#include "test_deps/utest.h"
+
+UTEST(json, get_member) {
+  char const text[] =
+      "{\"tags\": [1, {\"id\": 2}], \"id\": 42 , \"query\": "
+      "\"(print \\\"a\\\\tb\\\")\\n\\u00e9\"}";
+  bool is_string = true;
+  sds id = json_get_member(text, sizeof(text) - 1, "id", &is_string);
+  ASSERT_STREQ("42", id);
+  ASSERT_FALSE(is_string);
+  sds query = json_get_member(text, sizeof(text) - 1, "query", &is_string);
+  ASSERT_STREQ("(print \"a\\tb\")\n\xc3\xa9", query);
+  ASSERT_TRUE(is_string);
+  ASSERT_TRUE(json_get_member(text, sizeof(text) - 1, "missing",
+                              (void*)0) == (void*)0);
+  sdsfree(id);
+  sdsfree(query);
+}
+
+UTEST_MAIN();
+
+#endif
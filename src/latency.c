@@ -0,0 +1,55 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "latency.h"
+
+#include <sds.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static int compare_u64(void const* a, void const* b);
+
+uint64_t latency_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+double latency_elapsed_ms(uint64_t start_ns) {
+  return (double)(latency_clock_ns() - start_ns) / 1e6;
+}
+
+static int compare_u64(void const* a, void const* b) {
+  uint64_t x = *(uint64_t const*)a;
+  uint64_t y = *(uint64_t const*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentiles, the samples are sorted in place.
+latency_summary latency_summarize(uint64_t* samples_ns, int count) {
+  latency_summary s = {.count = count};
+  if (count == 0) {
+    return s;
+  }
+  qsort(samples_ns, (size_t)count, sizeof(uint64_t), compare_u64);
+  double total = 0;
+  for (int i = 0; i < count; i += 1) {
+    total += (double)samples_ns[i];
+  }
+  s.mean_us = total / count / 1e3;
+  s.p50_us = samples_ns[(count - 1) * 50 / 100] / 1e3;
+  s.p90_us = samples_ns[(count - 1) * 90 / 100] / 1e3;
+  s.p99_us = samples_ns[(count - 1) * 99 / 100] / 1e3;
+  s.max_us = samples_ns[count - 1] / 1e3;
+  return s;
+}
+
+sds latency_cat_json(sds out, latency_summary const* s) {
+  return sdscatprintf(out,
+                      "{\"count\": %d, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+                      "\"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+                      s->count, s->mean_us, s->p50_us, s->p90_us, s->p99_us,
+                      s->max_us);
+}
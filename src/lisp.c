@@ -1,20 +1,55 @@
 #include <janet.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+#include "arena.h"
+#include "metrics.h"
+#include "profile.h"
 #include "trace.h"
+#include "ts_alloc.h"
 
 INIT_TRACE;
 
+// Each thread keeps its VM warm between scripts, a fresh env per script is
+// enough to keep their definitions apart.
+static _Thread_local bool vm_started = false;
+
+void lisp_init_vm(void) {
+  START_ZONE;
+  if (!vm_started) {
+    janet_init();
+    vm_started = true;
+    metrics_add(METRIC_VM_BOOTS, 1);
+    metrics_gauge_add(METRIC_LIVE_VMS, 1);
+  }
+  END_ZONE;
+}
+
+JanetTable* lisp_child_env(JanetTable* parent) {
+  START_ZONE;
+  JanetTable* env = janet_table(0);
+  env->proto = parent;
+  END_ZONE;
+  return env;
+}
+
 JanetTable* lisp_init_env(void) {
   START_ZONE;
-  janet_init();
-  JanetTable* env = janet_core_env(NULL);
+  lisp_init_vm();
+  JanetTable* env = lisp_child_env(janet_core_env(NULL));
   END_ZONE;
   return env;
 }
 
 void lisp_terminate(void) {
   START_ZONE;
-  janet_deinit();
+  if (vm_started) {
+    janet_deinit();
+    scratch_release();
+    ts_alloc_release();
+    vm_started = false;
+    metrics_gauge_add(METRIC_LIVE_VMS, -1);
+  }
   END_ZONE;
 }
 
@@ -25,9 +60,110 @@ void lisp_register_module(JanetTable* env, char const* module_name,
   END_ZONE;
 }
 
+static int execute_form(JanetTable* env, Janet form, JanetString where,
+                        Janet* ret) {
+  START_ZONE;
+  uint64_t compile_start_ns = profile_start();
+  char const* outer_label = profile_enter(profile_phase_name(PROFILE_COMPILE));
+  JanetCompileResult cres = janet_compile(form, env, where);
+  profile_leave(outer_label);
+  profile_add_time(PROFILE_COMPILE, compile_start_ns);
+  if (cres.status != JANET_COMPILE_OK) {
+    *ret = janet_wrap_string(cres.error);
+    if (cres.macrofiber) {
+      janet_eprintf("compile error in main: ");
+      janet_stacktrace(cres.macrofiber, *ret);
+    } else {
+      janet_eprintf("compile error in main: %s\n", (char const*)cres.error);
+    }
+    END_ZONE;
+    return 0x02;
+  }
+  uint64_t eval_start_ns = profile_start();
+  JanetFunction* f = janet_thunk(cres.funcdef);
+  JanetFiber* fiber = janet_fiber(f, 64, 0, (void*)0);
+  fiber->env = env;
+  // Only the root fiber is marked, a form run from inside a cfun would
+  // otherwise have its fiber collected under it.
+  janet_gcroot(janet_wrap_fiber(fiber));
+  outer_label = profile_enter(profile_phase_name(PROFILE_EVAL));
+  JanetSignal status = janet_continue(fiber, janet_wrap_nil(), ret);
+  profile_leave(outer_label);
+  janet_gcunroot(janet_wrap_fiber(fiber));
+  profile_add_time(PROFILE_EVAL, eval_start_ns);
+  if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_EVENT) {
+    janet_stacktrace(fiber, *ret);
+    END_ZONE;
+    return 0x01;
+  }
+  END_ZONE;
+  return 0;
+}
+
+// Mirrors janet_dostring, but compiles and runs each form separately so the
+// time spent in the compiler and in the VM can be profiled on their own.
+// Scratch memory taken by the cfuns the script calls is released in one step
+// when the script is done, even when one of them panicked.
 int lisp_execute_script(JanetTable* env, char const* src, Janet* out) {
   START_ZONE;
-  int rc = janet_dostring(env, src, "main", out);
+  arena_mark scratch = scratch_begin();
+  JanetParser parser;
+  int rc = 0;
+  bool done = false;
+  Janet ret = janet_wrap_nil();
+  JanetString where = janet_cstring("main");
+  janet_gcroot(janet_wrap_string(where));
+  janet_parser_init(&parser);
+  while (!done) {
+    while (!done && janet_parser_has_more(&parser)) {
+      rc = execute_form(env, janet_parser_produce(&parser), where, &ret);
+      done = rc != 0;
+    }
+    if (done) {
+      break;
+    }
+    switch (janet_parser_status(&parser)) {
+      case JANET_PARSE_DEAD:
+        done = true;
+        break;
+      case JANET_PARSE_ERROR:
+        ret = janet_cstringv(janet_parser_error(&parser));
+        janet_eprintf("main:%lu:%lu: parse error: %s\n",
+                      (unsigned long)parser.line, (unsigned long)parser.column,
+                      janet_unwrap_string(ret));
+        rc = 0x04;
+        done = true;
+        break;
+      case JANET_PARSE_ROOT:
+      case JANET_PARSE_PENDING:
+        if (*src == '\0') {
+          janet_parser_eof(&parser);
+        } else {
+          janet_parser_consume(&parser, (uint8_t)*src);
+          src += 1;
+        }
+        break;
+    }
+  }
+  janet_parser_deinit(&parser);
+  janet_gcunroot(janet_wrap_string(where));
+  if (out) {
+    *out = ret;
+  }
+  scratch_end(scratch);
+  END_ZONE;
+  return rc;
+}
+
+// A single form, compiled and run with the same profiling as the forms of a
+// script. Errors have already been reported when this returns non zero and
+// out holds the error value.
+int lisp_execute_form(JanetTable* env, Janet form, Janet* out) {
+  START_ZONE;
+  JanetString where = janet_cstring("main");
+  janet_gcroot(janet_wrap_string(where));
+  int rc = execute_form(env, form, where, out);
+  janet_gcunroot(janet_wrap_string(where));
   END_ZONE;
   return rc;
-}
\ No newline at end of file
+}
@@ -1,24 +1,257 @@
 #include <malloc.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "batch.h"
+#include "check.h"
 #include "indexer.h"
+#include "lisp.h"
+#include "metrics.h"
+#include "profile.h"
 #include "repl.h"
+#include "replay.h"
+#include "sampler.h"
+#include "server.h"
+#include "sink.h"
 #include "substitute.h"
 
-int main(int argc, char** argv) {
-  persist_project_details(".");
-  index_files(".");
+static int render_document(char const* in_path, char const* out_path) {
+  int rc = -1;
+  persist_project_details(".", true);
+  index_files(".", true);
   indexer_terminate();
-  char* contents = read_file_to_str("./doc_in.md", (void*)0);
+  char* contents = read_file_to_str(in_path, (void*)0);
   md_substitute_data d = {.code_text = sdsempty(),
-                          .output = sdsempty(),
-                          .is_ordered_list = false,
-                          .current_index = 0};
-  md_substitute(contents, strlen(contents), &d);
+                          .output = sink_file_init(out_path),
+                          .doc_path = in_path};
+  if (contents && d.output) {
+    rc = md_splice(contents, strlen(contents), &d);
+  }
   free(contents);
-  FILE* fp = fopen("doc_out.md", "w");
-  fprintf(fp, d.output);
-  fclose(fp);
-  return launch_repl(argc, argv);
+  sdsfree(d.code_text);
+  if (sink_terminate(d.output) != 0) {
+    rc = -1;
+  }
+  lisp_terminate();
+  return rc;
+}
+
+static int run_render(int argc, char** argv) {
+  char const* profile_path = (void*)0;
+  char const* paths[2] = {"./doc_in.md", "doc_out.md"};
+  int num_paths = 0;
+  for (int i = 0; i < argc; i += 1) {
+    if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_path = argv[i + 1];
+      i += 1;
+      continue;
+    }
+    if (num_paths < 2) {
+      paths[num_paths] = argv[i];
+      num_paths += 1;
+    }
+  }
+  if (profile_path) {
+    profile_enable();
+  }
+  int rc = render_document(paths[0], paths[1]);
+  if (profile_path) {
+    if (profile_write_json(profile_path) != 0) {
+      rc = -1;
+    }
+    profile_print_summary(stderr);
+    profile_terminate();
+  }
+  return rc == 0 ? 0 : 1;
+}
+
+static int run_check(int argc, char** argv) {
+  int num_workers = 0;
+  int num_paths = 0;
+  char const** paths = calloc(argc + 1, sizeof(char const*));
+  for (int i = 0; i < argc; i += 1) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_workers = atoi(argv[i + 1]);
+      i += 1;
+      continue;
+    }
+    paths[num_paths] = argv[i];
+    num_paths += 1;
+  }
+  if (num_paths == 0) {
+    paths[num_paths] = "./doc_in.md";
+    num_paths += 1;
+  }
+  int rc = check_documents(paths, num_paths, num_workers);
+  free(paths);
+  return rc == 0 ? 0 : 1;
+}
+
+static int run_serve(int argc, char** argv) {
+  char const* socket_path = "./scribe.sock";
+  int num_workers = 0;
+  for (int i = 0; i < argc; i += 1) {
+    if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[i + 1];
+      i += 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_workers = atoi(argv[i + 1]);
+      i += 1;
+      continue;
+    }
+  }
+  int rc = serve(socket_path, num_workers);
+  return rc == 0 ? 0 : 1;
+}
+
+static int run_query(int argc, char** argv) {
+  char const* path = (void*)0;
+  int num_workers = 1;
+  for (int i = 0; i < argc; i += 1) {
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      path = argv[i + 1];
+      i += 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_workers = atoi(argv[i + 1]);
+      i += 1;
+      continue;
+    }
+  }
+  int rc = run_batch(path, num_workers, stdout);
+  return rc == 0 ? 0 : 1;
+}
+
+static int run_replay_command(int argc, char** argv) {
+  char const* log_path = (void*)0;
+  char const* out_path = (void*)0;
+  int num_passes = 2;
+  for (int i = 0; i < argc; i += 1) {
+    if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      out_path = argv[i + 1];
+      i += 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--passes") == 0 && i + 1 < argc) {
+      num_passes = atoi(argv[i + 1]);
+      i += 1;
+      continue;
+    }
+    if (!log_path) {
+      log_path = argv[i];
+    }
+  }
+  if (!log_path) {
+    fprintf(stderr, "usage: scribe replay LOG [--out FILE] [--passes N]\n");
+    return 2;
+  }
+  int rc = run_replay(log_path, out_path, num_passes);
+  return rc == 0 ? 0 : 1;
+}
+
+// --record PATH starts the repl with a session log, it is taken out of argv
+// so the repl never sees it.
+static char const* take_record_flag(int* argc, char** argv) {
+  char const* path = (void*)0;
+  int kept = 0;
+  for (int i = 0; i < *argc; i += 1) {
+    if (strcmp(argv[i], "--record") == 0 && i + 1 < *argc) {
+      path = argv[i + 1];
+      i += 1;
+      continue;
+    }
+    argv[kept] = argv[i];
+    kept += 1;
+  }
+  *argc = kept;
+  return path;
+}
+
+// --stats, or --stats=prometheus, works with every command. It is taken out
+// of argv before the command sees it and the metrics go to stderr once the
+// command is done.
+static bool take_stats_flag(int* argc, char** argv, metrics_format* format) {
+  bool found = false;
+  int kept = 0;
+  for (int i = 0; i < *argc; i += 1) {
+    if (strcmp(argv[i], "--stats") == 0 ||
+        strcmp(argv[i], "--stats=json") == 0) {
+      *format = METRICS_JSON;
+      found = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--stats=prometheus") == 0) {
+      *format = METRICS_PROMETHEUS;
+      found = true;
+      continue;
+    }
+    argv[kept] = argv[i];
+    kept += 1;
+  }
+  *argc = kept;
+  return found;
+}
+
+// --cpu-profile PATH samples the command on CPU time and writes the stacks
+// to PATH in folded form once it is done.
+static char const* take_cpu_profile_flag(int* argc, char** argv) {
+  char const* path = (void*)0;
+  int kept = 0;
+  for (int i = 0; i < *argc; i += 1) {
+    if (strcmp(argv[i], "--cpu-profile") == 0 && i + 1 < *argc) {
+      path = argv[i + 1];
+      i += 1;
+      continue;
+    }
+    argv[kept] = argv[i];
+    kept += 1;
+  }
+  *argc = kept;
+  return path;
+}
+
+static int run_command(int argc, char** argv) {
+  if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+    return run_check(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && strcmp(argv[1], "render") == 0) {
+    return run_render(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+    return run_serve(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && strcmp(argv[1], "query") == 0) {
+    return run_query(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && strcmp(argv[1], "replay") == 0) {
+    return run_replay_command(argc - 2, argv + 2);
+  }
+  char const* record_path = take_record_flag(&argc, argv);
+  render_document("./doc_in.md", "doc_out.md");
+  return launch_repl(argc, argv, record_path);
+}
+
+int main(int argc, char** argv) {
+  metrics_format stats_format = METRICS_JSON;
+  bool stats = take_stats_flag(&argc, argv, &stats_format);
+  if (stats) {
+    metrics_enable();
+  }
+  char const* cpu_profile_path = take_cpu_profile_flag(&argc, argv);
+  if (cpu_profile_path && sampler_start(cpu_profile_path) != 0) {
+    return 1;
+  }
+  int rc = run_command(argc, argv);
+  if (cpu_profile_path && sampler_stop() != 0 && rc == 0) {
+    rc = 1;
+  }
+  if (stats) {
+    metrics_dump(stderr, stats_format);
+  }
+  return rc;
 }
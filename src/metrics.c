@@ -0,0 +1,249 @@
+#include "metrics.h"
+
+#include <sds.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "heap.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// Bucket b counts observations below 2^(10 + b) ns, so the first bucket ends
+// at about a microsecond and the last at about 34 seconds. Slower ones only
+// show up in the count and the sum.
+#define METRIC_NUM_BUCKETS 26
+#define METRIC_FIRST_BUCKET_SHIFT 10
+
+typedef struct metric_histogram_data metric_histogram_data;
+struct metric_histogram_data {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum_ns;
+  atomic_uint_fast64_t buckets[METRIC_NUM_BUCKETS];
+};
+
+static int bucket_index(uint64_t ns);
+static uint64_t bucket_bound_ns(int bucket);
+
+static char const* counter_names[METRIC_NUM_COUNTERS] = {
+    "files_indexed",         "bytes_read",            "lmdb_gets",
+    "lmdb_puts",             "query_compiles",        "source_cache_hits",
+    "source_cache_misses",   "tree_cache_hits",       "tree_cache_misses",
+    "query_cache_hits",      "query_cache_misses",    "cache_invalidations",
+    "vm_boots",              "blocks_rendered",       "parse_allocations",
+    "parse_allocated_bytes", "parse_pool_reuses"};
+
+static char const* gauge_names[METRIC_NUM_GAUGES] = {"live_vms",
+                                                     "cached_source_bytes"};
+
+static char const* histogram_names[METRIC_NUM_HISTOGRAMS] = {
+    "compile", "eval", "lmdb", "parse", "query", "query_compile", "block"};
+
+// Like profiling, nothing is recorded until metrics are enabled and every
+// hook is a cheap no-op otherwise. Updates are relaxed atomics, the registry
+// is shared by all threads and only read when it is dumped.
+static bool enabled = false;
+static atomic_uint_fast64_t counters[METRIC_NUM_COUNTERS];
+static atomic_int_fast64_t gauges[METRIC_NUM_GAUGES];
+static metric_histogram_data histograms[METRIC_NUM_HISTOGRAMS];
+
+static int bucket_index(uint64_t ns) {
+  int bucket = 0;
+  while (bucket < METRIC_NUM_BUCKETS && ns >= bucket_bound_ns(bucket)) {
+    bucket += 1;
+  }
+  return bucket;
+}
+
+static uint64_t bucket_bound_ns(int bucket) {
+  return (uint64_t)1 << (METRIC_FIRST_BUCKET_SHIFT + bucket);
+}
+
+// Heap accounting comes with metrics, it costs a few atomics per
+// allocation.
+void metrics_enable(void) {
+  enabled = true;
+  heap_enable();
+}
+
+bool metrics_enabled(void) { return enabled; }
+
+void metrics_add(metric_counter counter, uint64_t n) {
+  if (enabled) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+  }
+}
+
+void metrics_gauge_add(metric_gauge gauge, int64_t delta) {
+  if (enabled) {
+    atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+  }
+}
+
+void metrics_observe(metric_histogram histogram, uint64_t ns) {
+  if (!enabled) {
+    return;
+  }
+  metric_histogram_data* h = &histograms[histogram];
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+  int bucket = bucket_index(ns);
+  if (bucket < METRIC_NUM_BUCKETS) {
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+  }
+}
+
+// Buckets are listed with their upper bound and only when they are not
+// empty.
+sds metrics_json(void) {
+  START_ZONE;
+  sds out = sdsnew("{\"counters\": {");
+  for (int i = 0; i < METRIC_NUM_COUNTERS; i += 1) {
+    out = sdscatprintf(out, "%s\"%s\": %llu", i == 0 ? "" : ", ",
+                       counter_names[i],
+                       (unsigned long long)atomic_load(&counters[i]));
+  }
+  out = sdscat(out, "},\n \"gauges\": {");
+  for (int i = 0; i < METRIC_NUM_GAUGES; i += 1) {
+    out = sdscatprintf(out, "%s\"%s\": %lld", i == 0 ? "" : ", ",
+                       gauge_names[i], (long long)atomic_load(&gauges[i]));
+  }
+  out = sdscat(out, "},\n \"histograms\": {");
+  for (int i = 0; i < METRIC_NUM_HISTOGRAMS; i += 1) {
+    metric_histogram_data* h = &histograms[i];
+    out = sdscatprintf(out,
+                       "%s\n  \"%s_ns\": {\"count\": %llu, \"sum_ns\": %llu, "
+                       "\"buckets\": [",
+                       i == 0 ? "" : ",", histogram_names[i],
+                       (unsigned long long)atomic_load(&h->count),
+                       (unsigned long long)atomic_load(&h->sum_ns));
+    bool first = true;
+    for (int b = 0; b < METRIC_NUM_BUCKETS; b += 1) {
+      uint64_t count = atomic_load(&h->buckets[b]);
+      if (count == 0) {
+        continue;
+      }
+      out = sdscatprintf(out, "%s{\"le_ns\": %llu, \"count\": %llu}",
+                         first ? "" : ", ",
+                         (unsigned long long)bucket_bound_ns(b),
+                         (unsigned long long)count);
+      first = false;
+    }
+    out = sdscat(out, "]}");
+  }
+  out = sdscat(out, "\n },\n \"heap\": {");
+  for (int i = 0; i < HEAP_NUM_TAGS; i += 1) {
+    heap_stats stats = heap_tag_stats(i);
+    out = sdscatprintf(out,
+                       "%s\n  \"%s\": {\"live_bytes\": %zu, \"peak_bytes\": "
+                       "%zu, \"allocations\": %zu}",
+                       i == 0 ? "" : ",", heap_tag_name(i), stats.live_bytes,
+                       stats.peak_bytes, stats.allocations);
+  }
+  out = sdscat(out, "\n}}\n");
+  END_ZONE;
+  return out;
+}
+
+// Text exposition format, durations in seconds and buckets cumulative.
+sds metrics_prometheus(void) {
+  START_ZONE;
+  sds out = sdsempty();
+  for (int i = 0; i < METRIC_NUM_COUNTERS; i += 1) {
+    out = sdscatprintf(out,
+                       "# TYPE scribe_%s_total counter\n"
+                       "scribe_%s_total %llu\n",
+                       counter_names[i], counter_names[i],
+                       (unsigned long long)atomic_load(&counters[i]));
+  }
+  for (int i = 0; i < METRIC_NUM_GAUGES; i += 1) {
+    out = sdscatprintf(out, "# TYPE scribe_%s gauge\nscribe_%s %lld\n",
+                       gauge_names[i], gauge_names[i],
+                       (long long)atomic_load(&gauges[i]));
+  }
+  for (int i = 0; i < METRIC_NUM_HISTOGRAMS; i += 1) {
+    metric_histogram_data* h = &histograms[i];
+    char const* name = histogram_names[i];
+    out = sdscatprintf(out, "# TYPE scribe_%s_seconds histogram\n", name);
+    uint64_t cumulative = 0;
+    for (int b = 0; b < METRIC_NUM_BUCKETS; b += 1) {
+      cumulative += atomic_load(&h->buckets[b]);
+      out = sdscatprintf(out, "scribe_%s_seconds_bucket{le=\"%.9g\"} %llu\n",
+                         name, bucket_bound_ns(b) / 1e9,
+                         (unsigned long long)cumulative);
+    }
+    uint64_t count = atomic_load(&h->count);
+    out = sdscatprintf(out,
+                       "scribe_%s_seconds_bucket{le=\"+Inf\"} %llu\n"
+                       "scribe_%s_seconds_sum %.9f\n"
+                       "scribe_%s_seconds_count %llu\n",
+                       name, (unsigned long long)count, name,
+                       atomic_load(&h->sum_ns) / 1e9, name,
+                       (unsigned long long)count);
+  }
+  out = sdscat(out, "# TYPE scribe_heap_live_bytes gauge\n");
+  for (int i = 0; i < HEAP_NUM_TAGS; i += 1) {
+    out = sdscatprintf(out, "scribe_heap_live_bytes{subsystem=\"%s\"} %zu\n",
+                       heap_tag_name(i), heap_tag_stats(i).live_bytes);
+  }
+  out = sdscat(out, "# TYPE scribe_heap_peak_bytes gauge\n");
+  for (int i = 0; i < HEAP_NUM_TAGS; i += 1) {
+    out = sdscatprintf(out, "scribe_heap_peak_bytes{subsystem=\"%s\"} %zu\n",
+                       heap_tag_name(i), heap_tag_stats(i).peak_bytes);
+  }
+  out = sdscat(out, "# TYPE scribe_heap_allocations_total counter\n");
+  for (int i = 0; i < HEAP_NUM_TAGS; i += 1) {
+    out = sdscatprintf(out,
+                       "scribe_heap_allocations_total{subsystem=\"%s\"} %zu\n",
+                       heap_tag_name(i), heap_tag_stats(i).allocations);
+  }
+  END_ZONE;
+  return out;
+}
+
+void metrics_dump(FILE* out, metrics_format format) {
+  START_ZONE;
+  sds text = format == METRICS_PROMETHEUS ? metrics_prometheus()
+                                          : metrics_json();
+  fwrite(text, 1, sdslen(text), out);
+  fflush(out);
+  sdsfree(text);
+  END_ZONE;
+}
+
+#ifdef UNIT_TEST_METRICS
+
+#include <string.h>
+
+#include "test_deps/utest.h"
+
+UTEST(metrics, histogram_buckets) {
+  metrics_enable();
+  metrics_add(METRIC_LMDB_GETS, 3);
+  metrics_observe(METRIC_PARSE_TIME, 500);
+  metrics_observe(METRIC_PARSE_TIME, 3000);
+  metrics_observe(METRIC_PARSE_TIME, 3000);
+  sds json = metrics_json();
+  ASSERT_TRUE(strstr(json, "\"lmdb_gets\": 3") != (void*)0);
+  ASSERT_TRUE(strstr(json,
+                     "\"parse_ns\": {\"count\": 3, \"sum_ns\": 6500, "
+                     "\"buckets\": [{\"le_ns\": 1024, \"count\": 1}, "
+                     "{\"le_ns\": 4096, \"count\": 2}]}") != (void*)0);
+  sds text = metrics_prometheus();
+  ASSERT_TRUE(strstr(text,
+                     "scribe_parse_seconds_bucket{le=\"2.048e-06\"} 1\n"
+                     "scribe_parse_seconds_bucket{le=\"4.096e-06\"} 3\n") !=
+              (void*)0);
+  ASSERT_TRUE(strstr(text, "scribe_parse_seconds_count 3\n") != (void*)0);
+  ASSERT_TRUE(strstr(json, "\"sds\": {\"live_bytes\": ") != (void*)0);
+  ASSERT_TRUE(strstr(text, "scribe_heap_live_bytes{subsystem=\"janet\"} ") !=
+              (void*)0);
+  sdsfree(json);
+  sdsfree(text);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,533 @@
+#include "parallel.h"
+
+#include <deps/stb_ds.h>
+#include <janet.h>
+#include <pthread.h>
+#include <sds.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "image.h"
+#include "lisp.h"
+#include "query.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// A contiguous run of items handled by one worker, its result comes back
+// marshalled since workers do not share a VM with the caller.
+typedef struct parallel_chunk parallel_chunk;
+struct parallel_chunk {
+  int32_t start;
+  int32_t end;
+  uint8_t* result;
+  int32_t result_size;
+  sds error;
+};
+
+// The function, items and initial value are marshalled once by the caller
+// and unmarshalled by every worker into its own VM.
+typedef struct parallel_run parallel_run;
+struct parallel_run {
+  uint8_t* payload;
+  int32_t payload_size;
+  bool reduce;
+  parallel_chunk* chunks;
+  atomic_int next;
+};
+
+// Workers are started on the first run and live for the session, waiting
+// for the next run between calls. A run is handed out by bumping run_id,
+// at most wanted workers join it and the caller waits until all of them
+// have left before the run can be freed.
+typedef struct parallel_pool parallel_pool;
+struct parallel_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_t* threads;
+  parallel_run* run;
+  uint64_t run_id;
+  int wanted;
+  int joined;
+  int left;
+  bool stopping;
+  bool exit_armed;
+};
+
+static parallel_pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                             .work = PTHREAD_COND_INITIALIZER,
+                             .done = PTHREAD_COND_INITIALIZER};
+static _Thread_local bool in_pool_worker = false;
+
+static sds error_text(Janet error);
+static void store_result(parallel_chunk* chunk, Janet value, JanetTable* rreg);
+static Janet load_payload(parallel_run* run, JanetTable* lookup);
+static void run_chunk(parallel_run* run, parallel_chunk* chunk,
+                      JanetFunction* fn, Janet const* items, Janet init,
+                      JanetTable* rreg);
+static void run_chunks(parallel_run* run, JanetTable* lookup,
+                       JanetTable* rreg);
+static parallel_run* join_run(uint64_t* last_run);
+static void leave_run(void);
+static void* parallel_worker(void* arg);
+static int run_parallel(parallel_run* run, int num_workers);
+static JanetArray* collect_results(parallel_run* run);
+static Janet combine_results(JanetArray* results, JanetFunction* combine,
+                             Janet init);
+static void free_run(parallel_run* run);
+static Janet parallel_apply(bool reduce, JanetFunction* fn,
+                            JanetFunction* combine, Janet init, Janet items,
+                            int num_workers);
+
+static sds error_text(Janet error) {
+  JanetString text = janet_to_string(error);
+  return sdsnewlen(text, janet_string_length(text));
+}
+
+// The janet_try blocks live in helpers of their own, where no local is
+// assigned between the setjmp and the longjmp that could come back to it.
+static void store_result(parallel_chunk* chunk, Janet value,
+                         JanetTable* rreg) {
+  JanetTryState state;
+  if (janet_try(&state) == JANET_SIGNAL_OK) {
+    JanetBuffer* buffer = janet_buffer(0);
+    janet_marshal(buffer, value, rreg, 0);
+    chunk->result = malloc(buffer->count);
+    memcpy(chunk->result, buffer->data, buffer->count);
+    chunk->result_size = buffer->count;
+  } else {
+    chunk->error = error_text(state.payload);
+  }
+  janet_restore(&state);
+}
+
+static Janet load_payload(parallel_run* run, JanetTable* lookup) {
+  JanetTryState state;
+  if (janet_try(&state) == JANET_SIGNAL_OK) {
+    Janet payload = janet_unmarshal(run->payload, run->payload_size, 0,
+                                    lookup, (void*)0);
+    janet_restore(&state);
+    return payload;
+  }
+  janet_restore(&state);
+  return janet_wrap_nil();
+}
+
+static void run_chunk(parallel_run* run, parallel_chunk* chunk,
+                      JanetFunction* fn, Janet const* items, Janet init,
+                      JanetTable* rreg) {
+  START_ZONE;
+  Janet acc = init;
+  for (int32_t i = chunk->start; i < chunk->end; i += 1) {
+    Janet args[2] = {acc, items[i]};
+    Janet out = janet_wrap_nil();
+    JanetSignal signal =
+        run->reduce ? janet_pcall(fn, 2, args, &out, (void*)0)
+                    : janet_pcall(fn, 1, &items[i], &out, (void*)0);
+    if (signal != JANET_SIGNAL_OK) {
+      chunk->error = error_text(out);
+      END_ZONE;
+      return;
+    }
+    acc = out;
+  }
+  store_result(chunk, acc, rreg);
+  END_ZONE;
+}
+
+// Chunks are claimed even when the payload fails to load, so every one of
+// them ends up with a result or an error and the caller is never left
+// waiting on chunks no worker will take.
+static void run_chunks(parallel_run* run, JanetTable* lookup,
+                       JanetTable* rreg) {
+  START_ZONE;
+  int num_chunks = (int)arrlen(run->chunks);
+  Janet payload = load_payload(run, lookup);
+  bool loaded = janet_checktype(payload, JANET_TUPLE);
+  if (!loaded) {
+    message_error("parallel::run_chunks failed in loading the payload");
+  }
+  janet_gcroot(payload);
+  Janet const* parts = loaded ? janet_unwrap_tuple(payload) : (void*)0;
+  while (true) {
+    int i = atomic_fetch_add(&run->next, 1);
+    if (i >= num_chunks) {
+      break;
+    }
+    if (!loaded) {
+      run->chunks[i].error = sdsnew("failed in loading the payload");
+      continue;
+    }
+    run_chunk(run, &run->chunks[i], janet_unwrap_function(parts[0]),
+              janet_unwrap_tuple(parts[1]), parts[2], rreg);
+  }
+  janet_gcunroot(payload);
+  END_ZONE;
+}
+
+// A worker waits for a run it has not taken part in yet, as long as the
+// run still wants more workers. Returns null once the pool is stopping.
+static parallel_run* join_run(uint64_t* last_run) {
+  pthread_mutex_lock(&pool.lock);
+  while (!pool.stopping &&
+         !(pool.run && pool.run_id != *last_run &&
+           pool.joined < pool.wanted)) {
+    pthread_cond_wait(&pool.work, &pool.lock);
+  }
+  parallel_run* run = pool.stopping ? (void*)0 : pool.run;
+  if (run) {
+    *last_run = pool.run_id;
+    pool.joined += 1;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return run;
+}
+
+static void leave_run(void) {
+  pthread_mutex_lock(&pool.lock);
+  pool.left += 1;
+  pthread_cond_broadcast(&pool.done);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Each worker loads the scribe env into its own VM and reads through its
+// own session cache once, and keeps both for every later run, so parsers,
+// trees and the read snapshot are never shared between threads and never
+// rebuilt per call. The snapshot is refreshed at the start of each run.
+static void* parallel_worker(void* arg) {
+  (void)arg;
+  in_pool_worker = true;
+  JanetTable* lookup = image_lookup();
+  JanetTable* rreg = image_reverse_lookup();
+  janet_gcroot(janet_wrap_table(lookup));
+  janet_gcroot(janet_wrap_table(rreg));
+  uint64_t last_run = 0;
+  parallel_run* run = (void*)0;
+  while ((run = join_run(&last_run))) {
+    if (!cache_enabled()) {
+      cache_enable("./scribe_db");
+    } else {
+      cache_refresh();
+    }
+    run_chunks(run, lookup, rreg);
+    leave_run();
+  }
+  janet_gcunroot(janet_wrap_table(rreg));
+  janet_gcunroot(janet_wrap_table(lookup));
+  cache_terminate();
+  lisp_terminate();
+  return (void*)0;
+}
+
+// Grows the pool to the workers this run asks for, publishes the run and
+// waits until every chunk is claimed and every worker that joined has
+// left. Runs from different callers take turns on the pool, a run started
+// from inside a pool worker is handled on that worker alone since the pool
+// is busy with its caller.
+static int run_parallel(parallel_run* run, int num_workers) {
+  START_ZONE;
+  if (in_pool_worker) {
+    JanetTable* lookup = image_lookup();
+    JanetTable* rreg = image_reverse_lookup();
+    janet_gcroot(janet_wrap_table(lookup));
+    janet_gcroot(janet_wrap_table(rreg));
+    run_chunks(run, lookup, rreg);
+    janet_gcunroot(janet_wrap_table(rreg));
+    janet_gcunroot(janet_wrap_table(lookup));
+    END_ZONE;
+    return 0;
+  }
+  int num_chunks = (int)arrlen(run->chunks);
+  if (num_workers > num_chunks) {
+    num_workers = num_chunks;
+  }
+  pthread_mutex_lock(&pool.lock);
+  while (pool.run) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  if (!pool.exit_armed) {
+    atexit(parallel_terminate);
+    pool.exit_armed = true;
+  }
+  while (arrlen(pool.threads) < num_workers) {
+    pthread_t thread;
+    if (pthread_create(&thread, (void*)0, parallel_worker, (void*)0) != 0) {
+      message_error("parallel::run_parallel failed in creating worker");
+      break;
+    }
+    arrput(pool.threads, thread);
+  }
+  int rc = arrlen(pool.threads) == 0 ? -1 : 0;
+  if (rc == 0) {
+    pool.run = run;
+    pool.run_id += 1;
+    pool.wanted = num_workers < arrlen(pool.threads)
+                      ? num_workers
+                      : (int)arrlen(pool.threads);
+    pool.joined = 0;
+    pool.left = 0;
+    pthread_cond_broadcast(&pool.work);
+    while (atomic_load(&run->next) < num_chunks || pool.left < pool.joined) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.run = (void*)0;
+    pthread_cond_broadcast(&pool.done);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  END_ZONE;
+  return rc;
+}
+
+void parallel_terminate(void) {
+  START_ZONE;
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = true;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  for (int i = 0; i < arrlen(pool.threads); i += 1) {
+    pthread_join(pool.threads[i], (void*)0);
+  }
+  arrfree(pool.threads);
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = false;
+  pthread_mutex_unlock(&pool.lock);
+  END_ZONE;
+}
+
+// Results are unmarshalled back in item order, so pmap keeps the order of
+// its input and preduce only needs an associative combine. Frees the run
+// before raising the first failure.
+static JanetArray* collect_results(parallel_run* run) {
+  START_ZONE;
+  JanetTable* lookup = image_lookup();
+  JanetArray* results = janet_array((int32_t)arrlen(run->chunks));
+  for (int i = 0; i < arrlen(run->chunks); i += 1) {
+    parallel_chunk* chunk = &run->chunks[i];
+    if (!chunk->result) {
+      Janet error = janet_wrap_string(
+          janet_formatc("failed at item %d: %s", chunk->start,
+                        chunk->error ? chunk->error : "not run"));
+      free_run(run);
+      END_ZONE;
+      janet_panicv(error);
+    }
+    janet_array_push(results,
+                     janet_unmarshal(chunk->result, chunk->result_size, 0,
+                                     lookup, (void*)0));
+  }
+  END_ZONE;
+  return results;
+}
+
+static Janet combine_results(JanetArray* results, JanetFunction* combine,
+                             Janet init) {
+  START_ZONE;
+  Janet acc = init;
+  janet_gcroot(janet_wrap_array(results));
+  for (int32_t i = 0; i < results->count; i += 1) {
+    Janet args[2] = {acc, results->data[i]};
+    if (janet_pcall(combine, 2, args, &acc, (void*)0) != JANET_SIGNAL_OK) {
+      janet_gcunroot(janet_wrap_array(results));
+      END_ZONE;
+      janet_panicv(acc);
+    }
+  }
+  janet_gcunroot(janet_wrap_array(results));
+  END_ZONE;
+  return acc;
+}
+
+static void free_run(parallel_run* run) {
+  for (int i = 0; i < arrlen(run->chunks); i += 1) {
+    free(run->chunks[i].result);
+    sdsfree(run->chunks[i].error);
+  }
+  arrfree(run->chunks);
+  free(run->payload);
+  *run = (parallel_run){0};
+}
+
+static Janet parallel_apply(bool reduce, JanetFunction* fn,
+                            JanetFunction* combine, Janet init, Janet items,
+                            int num_workers) {
+  START_ZONE;
+  Janet const* data = (void*)0;
+  int32_t len = 0;
+  janet_indexed_view(items, &data, &len);
+  if (len == 0) {
+    END_ZONE;
+    return reduce ? init : janet_wrap_array(janet_array(0));
+  }
+  if (num_workers <= 0) {
+    num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  parallel_run run = {.reduce = reduce};
+  atomic_init(&run.next, 0);
+  // pmap hands out one item at a time, preduce folds a few runs per worker
+  // and combines them afterwards.
+  int32_t num_runs = num_workers * 4;
+  int32_t chunk_size = reduce ? (len + num_runs - 1) / num_runs : 1;
+  for (int32_t start = 0; start < len; start += chunk_size) {
+    int32_t end = start + chunk_size < len ? start + chunk_size : len;
+    parallel_chunk chunk = {.start = start, .end = end};
+    arrput(run.chunks, chunk);
+  }
+  Janet parts[3] = {janet_wrap_function(fn),
+                    janet_wrap_tuple(janet_tuple_n(data, len)), init};
+  JanetBuffer* payload = janet_buffer(0);
+  janet_marshal(payload, janet_wrap_tuple(janet_tuple_n(parts, 3)),
+                image_reverse_lookup(), 0);
+  run.payload = malloc(payload->count);
+  memcpy(run.payload, payload->data, payload->count);
+  run.payload_size = payload->count;
+  if (run_parallel(&run, num_workers) != 0) {
+    free_run(&run);
+    END_ZONE;
+    janet_panicf("failed in starting workers");
+  }
+  JanetArray* results = collect_results(&run);
+  free_run(&run);
+  END_ZONE;
+  return reduce ? combine_results(results, combine, init)
+                : janet_wrap_array(results);
+}
+
+static Janet cfun_pmap(int32_t argc, Janet* argv) {
+  janet_arity(argc, 2, 3);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
+  }
+  JanetFunction* fn = janet_getfunction(argv, 0);
+  if (!janet_checktypes(argv[1], JANET_TFLAG_INDEXED)) {
+    janet_panic_type(argv[1], 1, JANET_TFLAG_INDEXED);
+  }
+  int num_workers = (int)janet_optnat(argv, argc, 2, 0);
+  return parallel_apply(false, fn, (void*)0, janet_wrap_nil(), argv[1],
+                        num_workers);
+}
+
+static Janet cfun_preduce(int32_t argc, Janet* argv) {
+  janet_arity(argc, 4, 5);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
+  }
+  JanetFunction* fn = janet_getfunction(argv, 0);
+  JanetFunction* combine = janet_getfunction(argv, 1);
+  if (!janet_checktypes(argv[3], JANET_TFLAG_INDEXED)) {
+    janet_panic_type(argv[3], 3, JANET_TFLAG_INDEXED);
+  }
+  int num_workers = (int)janet_optnat(argv, argc, 4, 0);
+  return parallel_apply(true, fn, combine, argv[2], argv[3], num_workers);
+}
+
+static const JanetReg parallel_cfuns[] = {
+    {"pmap", cfun_pmap,
+     "(core/pmap f items &opt workers)\n\nCall f on every item on a pool of "
+     "workers, each with its own VM, and return the results in item order. "
+     "f, the items and the results are marshalled between VMs."},
+    {"preduce", cfun_preduce,
+     "(core/preduce f combine init items &opt workers)\n\nFold runs of items "
+     "with f starting from init on a pool of workers, then fold the partial "
+     "results in order with combine. init has to be an identity for "
+     "combine."},
+    {(void*)0, (void*)0, (void*)0},
+};
+
+void register_parallel_module(JanetTable* env) {
+  lisp_register_module(env, "core", parallel_cfuns);
+}
+
+#ifdef UNIT_TEST_PARALLEL
+
+#include "test_deps/utest.h"
+
+static Janet test_function(JanetTable* env, char const* src) {
+  Janet fn = janet_wrap_nil();
+  lisp_execute_script(env, src, &fn);
+  janet_gcroot(fn);
+  return fn;
+}
+
+static Janet test_items(int32_t count) {
+  JanetArray* items = janet_array(count);
+  for (int32_t i = 0; i < count; i += 1) {
+    janet_array_push(items, janet_wrap_integer(i));
+  }
+  return janet_wrap_array(items);
+}
+
+UTEST(parallel, pmap_keeps_item_order) {
+  JanetTable* env = image_env();
+  Janet square = test_function(env, "(fn [x] (* x x))");
+  ASSERT_TRUE(janet_checktype(square, JANET_FUNCTION));
+  Janet items = test_items(50);
+  janet_gcroot(items);
+  Janet results = parallel_apply(false, janet_unwrap_function(square),
+                                 (void*)0, janet_wrap_nil(), items, 3);
+  JanetArray* squares = janet_unwrap_array(results);
+  ASSERT_EQ(squares->count, 50);
+  for (int32_t i = 0; i < squares->count; i += 1) {
+    ASSERT_EQ(janet_unwrap_integer(squares->data[i]), i * i);
+  }
+  janet_gcunroot(items);
+  janet_gcunroot(square);
+  lisp_terminate();
+}
+
+// Concatenation is associative but not commutative, so the result also
+// shows that the partial results are combined in item order.
+UTEST(parallel, preduce_combines_in_order) {
+  JanetTable* env = image_env();
+  Janet fold = test_function(env, "(fn [acc x] (string acc x))");
+  Janet combine = test_function(env, "(fn [a b] (string a b))");
+  Janet items = test_items(12);
+  janet_gcroot(items);
+  Janet result = parallel_apply(true, janet_unwrap_function(fold),
+                                janet_unwrap_function(combine),
+                                janet_cstringv(""), items, 2);
+  ASSERT_STREQ("01234567891011", (char const*)janet_unwrap_string(result));
+  janet_gcunroot(items);
+  janet_gcunroot(combine);
+  janet_gcunroot(fold);
+  lisp_terminate();
+}
+
+UTEST(parallel, workers_outlive_a_run) {
+  JanetTable* env = image_env();
+  Janet square = test_function(env, "(fn [x] (* x x))");
+  Janet items = test_items(8);
+  janet_gcroot(items);
+  parallel_apply(false, janet_unwrap_function(square), (void*)0,
+                 janet_wrap_nil(), items, 2);
+  ASSERT_GE(arrlen(pool.threads), 2);
+  pthread_t* threads = (void*)0;
+  for (int i = 0; i < arrlen(pool.threads); i += 1) {
+    arrput(threads, pool.threads[i]);
+  }
+  Janet results = parallel_apply(false, janet_unwrap_function(square),
+                                 (void*)0, janet_wrap_nil(), items, 2);
+  ASSERT_EQ(janet_unwrap_array(results)->count, 8);
+  ASSERT_EQ(arrlen(pool.threads), arrlen(threads));
+  for (int i = 0; i < arrlen(threads); i += 1) {
+    ASSERT_TRUE(pthread_equal(threads[i], pool.threads[i]));
+  }
+  arrfree(threads);
+  parallel_terminate();
+  ASSERT_EQ(arrlen(pool.threads), 0);
+  results = parallel_apply(false, janet_unwrap_function(square), (void*)0,
+                           janet_wrap_nil(), items, 2);
+  ASSERT_EQ(janet_unwrap_integer(janet_unwrap_array(results)->data[7]), 49);
+  janet_gcunroot(items);
+  janet_gcunroot(square);
+  lisp_terminate();
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,323 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "profile.h"
+
+#include <deps/stb_ds.h>
+#include <pthread.h>
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "json.h"
+#include "metrics.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// Time spent per document, keyed by its path.
+typedef struct file_total file_total;
+struct file_total {
+  char* key;
+  uint64_t value;
+};
+
+static uint64_t clock_ns(void);
+static int compare_records(void const* a, void const* b);
+static int compare_file_totals(void const* a, void const* b);
+static uint64_t total_cache_count(uint64_t const* counts);
+static void merge_record(profile_record* into, profile_record const* from);
+
+static char const* phase_names[PROFILE_NUM_PHASES] = {
+    "compile", "eval", "lmdb", "parse", "query", "query_compile"};
+
+static metric_histogram const phase_histograms[PROFILE_NUM_PHASES] = {
+    METRIC_COMPILE_TIME, METRIC_EVAL_TIME,  METRIC_LMDB_TIME,
+    METRIC_PARSE_TIME,   METRIC_QUERY_TIME, METRIC_QUERY_COMPILE_TIME};
+
+static char const* cache_names[PROFILE_NUM_CACHES] = {"handle", "source",
+                                                      "tree", "query"};
+
+// Records are only collected once profiling is enabled, every hook below is
+// a cheap no-op otherwise. The block being evaluated is tracked per thread.
+// Phase and block times also feed the metrics histograms when those are on.
+static bool enabled = false;
+static _Thread_local profile_record* current = (void*)0;
+static _Thread_local uint64_t block_start_ns = 0;
+static profile_record** records = (void*)0;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+// The innermost phase or activity of each thread, labelled whether or not
+// profiling is enabled. The sampling profiler reads it from its signal
+// handler, so it is only ever pointed at string literals.
+static _Thread_local char const* volatile current_label = (void*)0;
+
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void profile_enable(void) { enabled = true; }
+
+uint64_t profile_start(void) {
+  if (!current && !metrics_enabled()) {
+    return 0;
+  }
+  return clock_ns();
+}
+
+void profile_add_time(profile_phase phase, uint64_t start_ns) {
+  if (start_ns == 0) {
+    return;
+  }
+  uint64_t elapsed_ns = clock_ns() - start_ns;
+  metrics_observe(phase_histograms[phase], elapsed_ns);
+  if (current) {
+    current->phase_ns[phase] += elapsed_ns;
+  }
+}
+
+void profile_add_bytes(profile_phase phase, uint64_t bytes) {
+  if (current) {
+    current->phase_bytes[phase] += bytes;
+    current->bytes_copied += bytes;
+  }
+}
+
+void profile_cache_hit(profile_cache cache) {
+  if (current) {
+    current->cache_hits[cache] += 1;
+  }
+}
+
+void profile_cache_miss(profile_cache cache) {
+  if (current) {
+    current->cache_misses[cache] += 1;
+  }
+}
+
+void profile_add_matches(uint64_t scanned, uint64_t returned) {
+  if (current) {
+    current->matches_scanned += scanned;
+    current->matches_returned += returned;
+  }
+}
+
+// Counting nodes walks the whole tree, so only records that ask for it get
+// tree sizes.
+bool profile_counting_nodes(void) { return current && current->count_nodes; }
+
+void profile_add_tree(uint64_t nodes, uint64_t bytes) {
+  if (current) {
+    current->tree_nodes += nodes;
+    current->tree_bytes += bytes;
+  }
+}
+
+void profile_block_begin(char const* doc_path, unsigned int line) {
+  if (metrics_enabled()) {
+    block_start_ns = clock_ns();
+  }
+  if (!enabled) {
+    return;
+  }
+  profile_record* record = calloc(1, sizeof(profile_record));
+  if (!record) {
+    message_error("profile::profile_block_begin out of memory");
+    return;
+  }
+  record->doc_path = sdsnew(doc_path ? doc_path : "");
+  record->line = line;
+  record->total_ns = clock_ns();
+  pthread_mutex_lock(&records_lock);
+  arrput(records, record);
+  pthread_mutex_unlock(&records_lock);
+  current = record;
+}
+
+void profile_block_end(void) {
+  if (block_start_ns != 0) {
+    metrics_add(METRIC_BLOCKS_RENDERED, 1);
+    metrics_observe(METRIC_BLOCK_TIME, clock_ns() - block_start_ns);
+    block_start_ns = 0;
+  }
+  if (!current) {
+    return;
+  }
+  current->total_ns = clock_ns() - current->total_ns;
+  current = (void*)0;
+}
+
+static uint64_t total_cache_count(uint64_t const* counts) {
+  uint64_t total = 0;
+  for (int c = 0; c < PROFILE_NUM_CACHES; c += 1) {
+    total += counts[c];
+  }
+  return total;
+}
+
+static void merge_record(profile_record* into, profile_record const* from) {
+  for (int p = 0; p < PROFILE_NUM_PHASES; p += 1) {
+    into->phase_ns[p] += from->phase_ns[p];
+    into->phase_bytes[p] += from->phase_bytes[p];
+  }
+  into->bytes_copied += from->bytes_copied;
+  for (int c = 0; c < PROFILE_NUM_CACHES; c += 1) {
+    into->cache_hits[c] += from->cache_hits[c];
+    into->cache_misses[c] += from->cache_misses[c];
+  }
+  into->matches_scanned += from->matches_scanned;
+  into->matches_returned += from->matches_returned;
+  into->tree_nodes += from->tree_nodes;
+  into->tree_bytes += from->tree_bytes;
+}
+
+static int compare_records(void const* a, void const* b) {
+  profile_record const* ra = *(profile_record const**)a;
+  profile_record const* rb = *(profile_record const**)b;
+  if (ra->total_ns == rb->total_ns) {
+    return 0;
+  }
+  return ra->total_ns < rb->total_ns ? 1 : -1;
+}
+
+static int compare_file_totals(void const* a, void const* b) {
+  file_total const* fa = (file_total const*)a;
+  file_total const* fb = (file_total const*)b;
+  if (fa->value == fb->value) {
+    return 0;
+  }
+  return fa->value < fb->value ? 1 : -1;
+}
+
+int profile_write_json(char const* path) {
+  START_ZONE;
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    log_error("profile::profile_write_json failed in opening %s", path);
+    END_ZONE;
+    return -1;
+  }
+  sds out = sdsnew("{\"blocks\": [");
+  for (int i = 0; i < arrlen(records); i += 1) {
+    profile_record* r = records[i];
+    out = sdscat(out, i == 0 ? "\n  {\"file\": " : ",\n  {\"file\": ");
+    out = json_cat_string(out, r->doc_path, sdslen(r->doc_path));
+    out = sdscatprintf(out, ", \"line\": %u, \"total_ns\": %llu", r->line,
+                       (unsigned long long)r->total_ns);
+    for (int p = 0; p < PROFILE_NUM_PHASES; p += 1) {
+      out = sdscatprintf(out, ", \"%s_ns\": %llu", phase_names[p],
+                         (unsigned long long)r->phase_ns[p]);
+    }
+    out = sdscatprintf(out,
+                       ", \"bytes_copied\": %llu, \"cache_hits\": %llu, "
+                       "\"cache_misses\": %llu}",
+                       (unsigned long long)r->bytes_copied,
+                       (unsigned long long)total_cache_count(r->cache_hits),
+                       (unsigned long long)total_cache_count(r->cache_misses));
+  }
+  out = sdscat(out, "\n]}\n");
+  size_t written = fwrite(out, 1, sdslen(out), fp);
+  int rc = fclose(fp);
+  if (written != sdslen(out) || rc != 0) {
+    log_error("profile::profile_write_json failed in writing %s", path);
+    rc = -1;
+  }
+  sdsfree(out);
+  END_ZONE;
+  return rc;
+}
+
+void profile_print_summary(FILE* out) {
+  START_ZONE;
+  int count = (int)arrlen(records);
+  profile_record** sorted = (void*)0;
+  file_total* file_totals = (void*)0;
+  sh_new_strdup(file_totals);
+  for (int i = 0; i < count; i += 1) {
+    arrput(sorted, records[i]);
+    uint64_t total = shget(file_totals, records[i]->doc_path);
+    shput(file_totals, records[i]->doc_path, total + records[i]->total_ns);
+  }
+  qsort(sorted, count, sizeof(profile_record*), compare_records);
+  // The map's own storage backs its hash index, so the totals are sorted as
+  // a copy, slowest file first like the blocks. Keys stay owned by the map.
+  file_total* sorted_totals = (void*)0;
+  for (int i = 0; i < shlen(file_totals); i += 1) {
+    arrput(sorted_totals, file_totals[i]);
+  }
+  qsort(sorted_totals, (size_t)arrlen(sorted_totals), sizeof(file_total),
+        compare_file_totals);
+  fprintf(out, "%10s %10s %10s %10s %10s %10s %16s %12s  %s\n",
+          "total_ms", "compile_ms", "eval_ms", "lmdb_ms", "parse_ms",
+          "query_ms", "query_compile_ms", "bytes", "block");
+  for (int i = 0; i < count && i < 10; i += 1) {
+    profile_record* r = sorted[i];
+    fprintf(out,
+            "%10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %16.3f %12llu  %s:%u\n",
+            r->total_ns / 1e6, r->phase_ns[PROFILE_COMPILE] / 1e6,
+            r->phase_ns[PROFILE_EVAL] / 1e6, r->phase_ns[PROFILE_LMDB] / 1e6,
+            r->phase_ns[PROFILE_PARSE] / 1e6, r->phase_ns[PROFILE_QUERY] / 1e6,
+            r->phase_ns[PROFILE_QUERY_COMPILE] / 1e6,
+            (unsigned long long)r->bytes_copied, r->doc_path, r->line);
+  }
+  fprintf(out, "\n%10s  %s\n", "total_ms", "file");
+  for (int i = 0; i < arrlen(sorted_totals); i += 1) {
+    fprintf(out, "%10.3f  %s\n", sorted_totals[i].value / 1e6,
+            sorted_totals[i].key);
+  }
+  arrfree(sorted_totals);
+  shfree(file_totals);
+  arrfree(sorted);
+  END_ZONE;
+}
+
+void profile_terminate(void) {
+  pthread_mutex_lock(&records_lock);
+  for (int i = 0; i < arrlen(records); i += 1) {
+    sdsfree(records[i]->doc_path);
+    free(records[i]);
+  }
+  arrfree(records);
+  pthread_mutex_unlock(&records_lock);
+  enabled = false;
+}
+
+char const* profile_phase_name(profile_phase phase) {
+  return phase_names[phase];
+}
+
+char const* profile_cache_name(profile_cache cache) {
+  return cache_names[cache];
+}
+
+// Collects into record until profile_explain_end, whatever the thread was
+// recording before is handed back to be restored.
+profile_record* profile_explain_begin(profile_record* record) {
+  profile_record* outer = current;
+  current = record;
+  return outer;
+}
+
+// The explained costs still count towards the record they were nested in.
+void profile_explain_end(profile_record* outer) {
+  if (outer) {
+    merge_record(outer, current);
+  }
+  current = outer;
+}
+
+// Returns the label to hand back to profile_leave once the activity is done.
+char const* profile_enter(char const* label) {
+  char const* outer = current_label;
+  current_label = label;
+  return outer;
+}
+
+void profile_leave(char const* outer) { current_label = outer; }
+
+char const* profile_label(void) { return current_label; }
@@ -1,17 +1,29 @@
+#include <ctype.h>
 #include <deps/cute_files.h>
 #include <deps/cute_path.h>
 #include <janet.h>
 #include <lmdb.h>
+#include <pthread.h>
 #include <sds.h>
 #include <stdbool.h>
+#include <string.h>
 
-#include "c_queries.h"
-#include "core_queries.h"
 #include "db.h"
+#include "hash.h"
+#include "image.h"
+#include "lisp.h"
 #include "trace.h"
 
 INIT_TRACE;
 
+static sds read_project_key(char const* key);
+static sds trim_line_end(sds text);
+
+// The language only changes when the project is re-indexed, so it is read
+// from the db once per process.
+static pthread_mutex_t language_lock = PTHREAD_MUTEX_INITIALIZER;
+static sds cached_language = (void*)0;
+
 bool db_exists(char const* path) {
   START_ZONE;
   char db_dir_path[1024];
@@ -25,39 +37,43 @@ bool db_exists(char const* path) {
   return false;
 }
 
-sds get_language(void) {
+static sds read_project_key(char const* key) {
   START_ZONE;
+  MDB_env* env = (void*)0;
+  MDB_txn* txn = (void*)0;
   if (!db_exists(".")) {
     message_fatal(
-        "querier::get_language failed because scribe db not found in the "
+        "querier::read_project_key failed because scribe db not found in the "
         "current directory");
     goto error_end;
   }
-  MDB_env* env = db_env_init("./scribe_db", false, 100);
+  env = db_env_init("./scribe_db", false, 100);
   if (!env) {
-    message_fatal("querier::get_language failed in creating db environment");
+    message_fatal(
+        "querier::read_project_key failed in creating db environment");
     goto error_end;
   }
-  MDB_txn* txn = db_txn_init(env, false);
+  txn = db_txn_init(env, true);
   if (!txn) {
-    message_fatal("querier::get_language failed in creating transaction");
+    message_fatal("querier::read_project_key failed in creating transaction");
     goto error_end;
   }
-  MDB_dbi db_handle = db_get_handle(txn, "project", true);
+  MDB_dbi db_handle = db_get_handle(txn, "project", false);
   if (db_handle == 0) {
     message_fatal(
-        "querier::get_language failed in creating db handle for name: project");
+        "querier::read_project_key failed in creating db handle for name: "
+        "project");
     goto error_end;
   }
-  sds lang = db_get(txn, db_handle, "language");
-  if (!lang) {
-    message_fatal("querier::get_language failed in getting key: language");
+  sds value = db_get(txn, db_handle, (char*)key);
+  if (!value) {
+    log_fatal("querier::read_project_key failed in getting key: %s", key);
     goto error_end;
   }
   db_txn_terminate(txn, false);
   db_env_terminate(env);
   END_ZONE;
-  return lang;
+  return value;
 error_end:
   db_txn_terminate(txn, false);
   db_env_terminate(env);
@@ -65,17 +81,204 @@ error_end:
   return (void*)0;
 }
 
-void register_modules(JanetTable* env) {
-  sds lang = get_language();
-  sds c_lang = sdsnew("c");
-  if (!lang) {
-    message_fatal("querier::register_modules failed in getting language");
-    return;
+sds get_language(void) {
+  START_ZONE;
+  sds lang = (void*)0;
+  pthread_mutex_lock(&language_lock);
+  if (!cached_language) {
+    cached_language = read_project_key("language");
+  }
+  if (cached_language) {
+    lang = sdsdup(cached_language);
+  }
+  pthread_mutex_unlock(&language_lock);
+  END_ZONE;
+  return lang;
+}
+
+// Unlike the language this changes with every index run, so it is not cached.
+sds get_generation(void) {
+  START_ZONE;
+  sds generation = read_project_key("generation");
+  END_ZONE;
+  return generation;
+}
+
+sds evaluate_query(char const* src) {
+  START_ZONE;
+  sds result = (void*)0;
+  JanetTable* base = image_env();
+  if (!base) {
+    message_error("querier::evaluate_query failed in loading the scribe env");
+    END_ZONE;
+    return (void*)0;
+  }
+  JanetTable* env = lisp_child_env(base);
+  Janet out = {0};
+  int rc = lisp_execute_script(env, src, &out);
+  if (rc != 0) {
+    message_error("querier::evaluate_query failed in code execution");
+    goto end;
+  }
+  JanetByteView view = {0};
+  if (!janet_bytes_view(out, &view.bytes, &view.len)) {
+    message_error("querier::evaluate_query result is not a string");
+    goto end;
+  }
+  result = sdsnewlen(view.bytes, view.len);
+end:
+  END_ZONE;
+  return result;
+}
+
+// Like evaluate_query but for callers that report results rather than
+// splice them, any value is formatted and a failure comes back as the error
+// text with ok set to false. Values that are not strings are printed on one
+// line the way the repl prints them, so tuples and structs show their
+// contents instead of an address.
+sds evaluate_query_text(char const* src, bool* ok) {
+  START_ZONE;
+  *ok = false;
+  JanetTable* base = image_env();
+  if (!base) {
+    message_error(
+        "querier::evaluate_query_text failed in loading the scribe env");
+    END_ZONE;
+    return sdsnew("scribe env not loaded");
+  }
+  Janet out = janet_wrap_nil();
+  int rc = lisp_execute_script(lisp_child_env(base), src, &out);
+  *ok = rc == 0;
+  sds text = (void*)0;
+  JanetByteView view = {0};
+  if (janet_bytes_view(out, &view.bytes, &view.len)) {
+    text = sdsnewlen(view.bytes, view.len);
+  } else {
+    JanetBuffer* printed =
+        janet_pretty((void*)0, JANET_RECURSION_GUARD,
+                     JANET_PRETTY_ONELINE | JANET_PRETTY_NOTRUNC, out);
+    text = sdsnewlen(printed->data, printed->count);
+  }
+  END_ZONE;
+  return text;
+}
+
+static sds trim_line_end(sds text) {
+  size_t end = sdslen(text);
+  while (end > 0 && text[end - 1] != '\n' &&
+         isspace((unsigned char)text[end - 1])) {
+    end -= 1;
   }
-  if (sdscmp(lang, c_lang) == 0) {
-    register_core_module(env);
-    register_c_module(env);
+  sdsIncrLen(text, -(ssize_t)(sdslen(text) - end));
+  return text;
+}
+
+// Trailing whitespace, carriage returns and surrounding blank lines do not
+// change what a query evaluates to, so they are dropped before hashing.
+// Inside string literals, "..." with its escapes and `...` long strings,
+// they do, so those are copied as they are. A # comment runs to the end of
+// its line and quotes in it open nothing.
+sds normalize_query(char const* src, size_t len) {
+  START_ZONE;
+  sds normalized = sdsMakeRoomFor(sdsempty(), len);
+  size_t start = 0;
+  for (size_t i = 0; i < len && isspace((unsigned char)src[i]); i += 1) {
+    if (src[i] == '\n') {
+      start = i + 1;
+    }
+  }
+  bool in_string = false;
+  bool in_comment = false;
+  size_t fence = 0;
+  for (size_t i = start; i < len; i += 1) {
+    char c = src[i];
+    if (in_string) {
+      size_t size = c == '\\' && i + 1 < len ? 2 : 1;
+      normalized = sdscatlen(normalized, src + i, size);
+      in_string = c != '"';
+      i += size - 1;
+      continue;
+    }
+    if (c == '`' && !in_comment) {
+      size_t run = 1;
+      while (i + run < len && src[i + run] == '`') {
+        run += 1;
+      }
+      normalized = sdscatlen(normalized, src + i, run);
+      fence = fence == 0 ? run : fence == run ? 0 : fence;
+      i += run - 1;
+      continue;
+    }
+    if (fence > 0) {
+      normalized = sdscatlen(normalized, &c, 1);
+      continue;
+    }
+    if (c == '\n') {
+      normalized = sdscatlen(trim_line_end(normalized), "\n", 1);
+      in_comment = false;
+      continue;
+    }
+    in_string = c == '"' && !in_comment;
+    in_comment = in_comment || c == '#';
+    normalized = sdscatlen(normalized, &c, 1);
   }
-  sdsfree(lang);
-  sdsfree(c_lang);
+  if (!in_string && fence == 0) {
+    size_t end = sdslen(normalized);
+    while (end > 0 && isspace((unsigned char)normalized[end - 1])) {
+      end -= 1;
+    }
+    sdsIncrLen(normalized, -(ssize_t)(sdslen(normalized) - end));
+  }
+  END_ZONE;
+  return normalized;
+}
+
+sds query_key(char const* src, size_t len) {
+  START_ZONE;
+  sds normalized = normalize_query(src, len);
+  sds key = hash_to_hex(hash_bytes(normalized, sdslen(normalized)));
+  sdsfree(normalized);
+  END_ZONE;
+  return key;
+}
+
+#ifdef UNIT_TEST_QUERY
+
+#include "test_deps/utest.h"
+
+static bool normalizes_to(char const* src, char const* expected) {
+  sds normalized = normalize_query(src, strlen(src));
+  bool same = strcmp(normalized, expected) == 0;
+  sdsfree(normalized);
+  return same;
 }
+
+UTEST(query, whitespace_around_lines_is_dropped) {
+  ASSERT_TRUE(normalizes_to("\n \n  (+ 1 2)   \r\n(+ 3 4)\t\n\n",
+                            "  (+ 1 2)\n(+ 3 4)"));
+  ASSERT_TRUE(normalizes_to("(+ 1 2) # \"quoted  \n(+ 3 4)",
+                            "(+ 1 2) # \"quoted\n(+ 3 4)"));
+  sds a = query_key("(+ 1 2)  \n", strlen("(+ 1 2)  \n"));
+  sds b = query_key("(+ 1 2)", strlen("(+ 1 2)"));
+  ASSERT_STREQ(a, b);
+  sdsfree(a);
+  sdsfree(b);
+}
+
+UTEST(query, string_literals_are_kept) {
+  ASSERT_TRUE(normalizes_to("(string \"a  \n b\")  \n",
+                            "(string \"a  \n b\")"));
+  ASSERT_TRUE(normalizes_to("(string \"\\\"  \n\")", "(string \"\\\"  \n\")"));
+  ASSERT_TRUE(normalizes_to("(string ``a  \n`b  \n``)  ",
+                            "(string ``a  \n`b  \n``)"));
+  ASSERT_TRUE(normalizes_to("(string \"open  \n", "(string \"open  \n"));
+  sds a = query_key("(string \"a  \nb\")", strlen("(string \"a  \nb\")"));
+  sds b = query_key("(string \"a\nb\")", strlen("(string \"a\nb\")"));
+  ASSERT_STRNE(a, b);
+  sdsfree(a);
+  sdsfree(b);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -1,6 +1,12 @@
 #include "repl.h"
 
+#include "arena.h"
+#include "budget.h"
+#include "cache.h"
+#include "image.h"
+#include "lisp.h"
 #include "query.h"
+#include "replay.h"
 /*
  * Copyright (c) 2021 Calvin Rose
  *
@@ -51,18 +57,53 @@ static JANET_THREAD_LOCAL int gbl_cancel_current_repl_form = 0;
 
 static JANET_THREAD_LOCAL JanetTable* gbl_complete_env;
 
+/* Scribe commands are typed at the prompt but never reach the evaluator, the
+ * line is swapped for a newline so the repl just prompts again */
+static void run_scribe_command(JanetBuffer* buf, int32_t start) {
+  const char* line = (const char*)buf->data + start;
+  int32_t len = buf->count - start;
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                     line[len - 1] == ' ')) {
+    len--;
+  }
+  static const char cache_stats[] = ",cache-stats";
+  if (len == (int32_t)(sizeof(cache_stats) - 1) &&
+      memcmp(line, cache_stats, len) == 0) {
+    cache_print_stats(stdout);
+    fflush(stdout);
+    buf->count = start;
+    janet_buffer_push_u8(buf, '\n');
+  }
+}
+
 /* Common */
 Janet janet_line_getter(int32_t argc, Janet* argv) {
   janet_arity(argc, 0, 3);
   const char* str = (argc >= 1) ? (const char*)janet_getstring(argv, 0) : "";
   JanetBuffer* buf = (argc >= 2) ? janet_getbuffer(argv, 1) : janet_buffer(10);
   gbl_complete_env = (argc >= 3) ? janet_gettable(argv, 2) : NULL;
+  /* Nothing is being evaluated while waiting for input, so this is where the
+   * session cache catches up with the index and scratch memory left by the
+   * last form is released */
+  cache_refresh();
+  scratch_reset();
+  /* The last recorded form, if any, has been evaluated by now */
+  replay_record_prompt();
+  /* Ctrl-C at the prompt keeps its usual meaning, while a form is being
+   * evaluated it cancels the running query instead */
+  budget_disarm_interrupt();
+  int32_t start = buf->count;
   janet_line_get(str, buf);
+  run_scribe_command(buf, start);
+  replay_record_input((const char*)buf->data + start,
+                      (size_t)(buf->count - start));
   gbl_complete_env = NULL;
+  budget_arm_interrupt();
 
   Janet result;
   if (gbl_cancel_current_repl_form) {
     gbl_cancel_current_repl_form = 0;
+    replay_record_discard();
 
     /* Signal that the user bailed out of the current form */
     result = janet_ckeywordv("cancel");
@@ -964,7 +1005,7 @@ void janet_line_get(const char* p, JanetBuffer* buffer) {
  * Entry
  */
 
-int launch_repl(int argc, char** argv) {
+int launch_repl(int argc, char** argv, char const* record_path) {
   int i, status;
   JanetArray* args;
   JanetTable* env;
@@ -1000,8 +1041,15 @@ int launch_repl(int argc, char** argv) {
   janet_init_hash_key(hash_key);
 #endif
 
-  /* Set up VM */
-  janet_init();
+  /* Every evaluated form goes to the session log for scribe replay */
+  if (record_path && replay_record_start(record_path) != 0) {
+    return 1;
+  }
+
+  /* Set up a fresh VM, the core env is memoized per VM and the getline
+   * replacement only takes effect when it is first built */
+  lisp_terminate();
+  lisp_init_vm();
 
   /* Replace original getline with new line getter */
   JanetTable* replacements = janet_table(0);
@@ -1009,10 +1057,15 @@ int launch_repl(int argc, char** argv) {
                   janet_wrap_cfunction(janet_line_getter));
   janet_line_init();
 
-  /* Get core env */
+  /* Get core env, cli-main derives the repl env from it so the bindings
+   * preloaded from the scribe image are merged in */
   env = janet_core_env(replacements);
+  janet_table_merge_table(env, image_env());
 
-  register_modules(env);
+  /* Keep sources, trees and queries around for the whole session */
+  if (db_exists(".")) {
+    cache_enable("./scribe_db");
+  }
 
   /* Create args tuple */
   args = janet_array(argc);
@@ -1029,11 +1082,25 @@ int launch_repl(int argc, char** argv) {
       janet_fiber(janet_unwrap_function(mainfun), 64, 1, mainargs);
   fiber->env = env;
 
-  /* Run the fiber in an event loop */
-  status = janet_loop_fiber(fiber);
+  /* Run the fiber in an event loop. Ctrl-C interrupts the VM, the form
+   * being evaluated runs in a child fiber of the repl and is cancelled, the
+   * repl itself is just resumed */
+  janet_schedule(fiber, janet_wrap_nil());
+  while (!janet_loop_done()) {
+    JanetFiber* interrupted = janet_loop1();
+    if (interrupted && interrupted->child) {
+      janet_cancel(interrupted,
+                   janet_cstringv(budget_status_text(BUDGET_CANCELLED)));
+    } else if (interrupted) {
+      janet_schedule(interrupted, janet_wrap_nil());
+    }
+  }
+  status = janet_fiber_status(fiber);
 
   /* Deinitialize vm */
-  janet_deinit();
+  replay_record_stop();
+  cache_terminate();
+  lisp_terminate();
   janet_line_deinit();
 
   return status;
@@ -0,0 +1,483 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "replay.h"
+
+#include <ctype.h>
+#include <deps/stb_ds.h>
+#include <janet.h>
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "image.h"
+#include "indexer.h"
+#include "json.h"
+#include "latency.h"
+#include "lisp.h"
+#include "query.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// A session log has one JSON object per evaluated form:
+//   {"ts_ms":1700000000000,"recorded_us":1234,"form":"(c/function ...)"}
+// ts_ms is the wall clock time the form was submitted and recorded_us how
+// long the repl took until it prompted again, printing included.
+
+typedef struct replay_form replay_form;
+struct replay_form {
+  unsigned int line;
+  sds text;
+  long long recorded_us;
+  bool cold;
+  bool ok;
+};
+
+typedef struct replay_results replay_results;
+struct replay_results {
+  replay_form* forms;
+  int num_passes;
+  uint64_t* samples_ns;
+  int num_errors;
+};
+
+static bool is_blank(char const* text, size_t len);
+static enum JanetParserStatus parse_status(char const* text, size_t len);
+static int64_t wall_clock_ms(void);
+static void collect_forms(replay_results* results, char const* log);
+static void run_pass(replay_results* results, int pass);
+static void mark_cold_forms(replay_results* results);
+static latency_summary summarize(replay_results const* results, int which);
+static void print_results(FILE* out, replay_results const* results);
+static int write_results(char const* path, replay_results const* results);
+
+// Recording state of the repl, the form being typed and the last complete
+// form, which is written once the repl asks for the next one.
+static FILE* record_out = (void*)0;
+static sds record_pending = (void*)0;
+static sds record_form = (void*)0;
+static int64_t record_ts_ms = 0;
+static uint64_t record_start_ns = 0;
+
+static bool is_blank(char const* text, size_t len) {
+  for (size_t i = 0; i < len; i += 1) {
+    if (!isspace((unsigned char)text[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The text is parsed from scratch every time, so no half built janet values
+// are kept around between lines while the repl runs the collector. The
+// parser raises when fed past an error, so it stops at the first one.
+static enum JanetParserStatus parse_status(char const* text, size_t len) {
+  JanetParser parser;
+  janet_parser_init(&parser);
+  for (size_t i = 0;
+       i < len && janet_parser_status(&parser) != JANET_PARSE_ERROR; i += 1) {
+    janet_parser_consume(&parser, (uint8_t)text[i]);
+  }
+  enum JanetParserStatus status = janet_parser_status(&parser);
+  janet_parser_deinit(&parser);
+  return status;
+}
+
+static int64_t wall_clock_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int replay_record_start(char const* path) {
+  START_ZONE;
+  record_out = fopen(path, "w");
+  if (!record_out) {
+    log_error("replay::replay_record_start failed in opening %s", path);
+    END_ZONE;
+    return -1;
+  }
+  record_pending = sdsempty();
+  END_ZONE;
+  return 0;
+}
+
+// Called with every line read at the prompt. Forms spanning several lines
+// are recorded once they are complete, a line holding several forms is
+// recorded as one entry. Text that does not parse is dropped, the repl
+// reports the error and starts over with the next line as well.
+void replay_record_input(char const* text, size_t len) {
+  if (!record_out) {
+    return;
+  }
+  START_ZONE;
+  record_pending = sdscatlen(record_pending, text, len);
+  size_t pending_len = sdslen(record_pending);
+  enum JanetParserStatus status = parse_status(record_pending, pending_len);
+  if (is_blank(record_pending, pending_len) || status == JANET_PARSE_ERROR) {
+    sdsclear(record_pending);
+  } else if (status == JANET_PARSE_ROOT) {
+    sdsfree(record_form);
+    record_form = sdstrim(record_pending, " \t\r\n");
+    record_pending = sdsempty();
+    record_ts_ms = wall_clock_ms();
+    record_start_ns = latency_clock_ns();
+  }
+  END_ZONE;
+}
+
+// The repl is about to prompt again, so the last complete form is done.
+void replay_record_prompt(void) {
+  if (!record_out || !record_form) {
+    return;
+  }
+  START_ZONE;
+  uint64_t recorded_us = (latency_clock_ns() - record_start_ns) / 1000;
+  sds line = sdscatprintf(sdsempty(), "{\"ts_ms\":%lld,\"recorded_us\":%llu,",
+                          (long long)record_ts_ms,
+                          (unsigned long long)recorded_us);
+  line = sdscat(line, "\"form\":");
+  line = json_cat_string(line, record_form, sdslen(record_form));
+  line = sdscat(line, "}\n");
+  if (fwrite(line, 1, sdslen(line), record_out) != sdslen(line) ||
+      fflush(record_out) != 0) {
+    message_error("replay::replay_record_prompt failed in writing the log");
+  }
+  sdsfree(line);
+  sdsfree(record_form);
+  record_form = (void*)0;
+  END_ZONE;
+}
+
+// The form being typed was cancelled with Ctrl-C.
+void replay_record_discard(void) {
+  if (record_pending) {
+    sdsclear(record_pending);
+  }
+}
+
+void replay_record_stop(void) {
+  if (!record_out) {
+    return;
+  }
+  START_ZONE;
+  replay_record_prompt();
+  if (fclose(record_out) != 0) {
+    message_error("replay::replay_record_stop failed in closing the log");
+  }
+  record_out = (void*)0;
+  sdsfree(record_pending);
+  record_pending = (void*)0;
+  END_ZONE;
+}
+
+// Lines that are not objects with a form member are skipped, so logs can be
+// annotated with blank lines or # comments when they are checked in.
+static void collect_forms(replay_results* results, char const* log) {
+  START_ZONE;
+  int num_lines = 0;
+  sds* lines = sdssplitlen(log, (ssize_t)strlen(log), "\n", 1, &num_lines);
+  for (int i = 0; i < num_lines; i += 1) {
+    size_t len = sdslen(lines[i]);
+    bool is_string = false;
+    sds text = json_get_member(lines[i], len, "form", &is_string);
+    if (!text || !is_string || is_blank(text, sdslen(text))) {
+      sdsfree(text);
+      continue;
+    }
+    replay_form form = {
+        .line = (unsigned int)i + 1, .text = text, .recorded_us = -1};
+    sds recorded = json_get_member(lines[i], len, "recorded_us", &is_string);
+    if (recorded && !is_string) {
+      form.recorded_us = strtoll(recorded, (void*)0, 10);
+    }
+    sdsfree(recorded);
+    arrput(results->forms, form);
+  }
+  sdsfreesplitres(lines, num_lines);
+  END_ZONE;
+}
+
+// The first evaluation of a form in the replay is cold, every other one,
+// repeats within the session and all of the later passes, is warm.
+static void mark_cold_forms(replay_results* results) {
+  struct {
+    char* key;
+    int value;
+  }* seen = (void*)0;
+  sh_new_strdup(seen);
+  for (int i = 0; i < arrlen(results->forms); i += 1) {
+    replay_form* form = &results->forms[i];
+    sds key = query_key(form->text, sdslen(form->text));
+    form->cold = shgeti(seen, key) < 0;
+    shput(seen, key, i);
+    sdsfree(key);
+  }
+  shfree(seen);
+}
+
+// Each pass runs the whole log in a fresh env on top of the scribe image,
+// like a new repl, so definitions made by earlier forms carry over within the
+// pass. The session cache is kept across passes and refreshed before every
+// form, and scratch memory reset, as the repl does at its prompt.
+static void run_pass(replay_results* results, int pass) {
+  START_ZONE;
+  JanetTable* env = lisp_child_env(image_env());
+  janet_gcroot(janet_wrap_table(env));
+  int num_forms = (int)arrlen(results->forms);
+  for (int i = 0; i < num_forms; i += 1) {
+    replay_form* form = &results->forms[i];
+    cache_refresh();
+    scratch_reset();
+    Janet out = janet_wrap_nil();
+    uint64_t start_ns = latency_clock_ns();
+    int rc = lisp_execute_script(env, form->text, &out);
+    results->samples_ns[pass * num_forms + i] = latency_clock_ns() - start_ns;
+    form->ok = rc == 0;
+    if (rc != 0) {
+      JanetString error = janet_to_string(out);
+      log_error("replay::run_pass form on line %u failed: %s", form->line,
+                (char const*)error);
+      results->num_errors += 1;
+    }
+  }
+  janet_gcunroot(janet_wrap_table(env));
+  END_ZONE;
+}
+
+// which is 0 for cold evaluations, 1 for warm ones and 2 for all of them.
+static latency_summary summarize(replay_results const* results, int which) {
+  int num_forms = (int)arrlen(results->forms);
+  int total = num_forms * results->num_passes;
+  uint64_t* samples = malloc(sizeof(uint64_t) * (size_t)(total + 1));
+  int count = 0;
+  for (int i = 0; samples && i < total; i += 1) {
+    bool cold = i < num_forms && results->forms[i].cold;
+    if (which == 2 || (which == 0) == cold) {
+      samples[count] = results->samples_ns[i];
+      count += 1;
+    }
+  }
+  latency_summary s = latency_summarize(samples, count);
+  free(samples);
+  return s;
+}
+
+static void print_results(FILE* out, replay_results const* results) {
+  char const* names[3] = {"cold", "warm", "all"};
+  fprintf(out, "%d forms, %d passes, %d errors\n",
+          (int)arrlen(results->forms), results->num_passes,
+          results->num_errors);
+  for (int i = 0; i < 3; i += 1) {
+    latency_summary s = summarize(results, i);
+    fprintf(out,
+            "%-5s %5d  p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+            names[i], s.count, s.p50_us, s.p90_us, s.p99_us, s.max_us);
+  }
+}
+
+// Per form results keep the log line so a regression can be traced back to
+// the form that caused it.
+static int write_results(char const* path, replay_results const* results) {
+  START_ZONE;
+  char const* names[3] = {"cold", "warm", "all"};
+  int num_forms = (int)arrlen(results->forms);
+  sds out =
+      sdscatprintf(sdsempty(), "{\n  \"passes\": %d,\n  \"errors\": %d,\n",
+                   results->num_passes, results->num_errors);
+  for (int i = 0; i < 3; i += 1) {
+    latency_summary s = summarize(results, i);
+    out = sdscatprintf(out, "  \"%s\": ", names[i]);
+    out = latency_cat_json(out, &s);
+    out = sdscat(out, ",\n");
+  }
+  out = sdscat(out, "  \"forms\": [");
+  for (int i = 0; i < num_forms; i += 1) {
+    replay_form const* form = &results->forms[i];
+    out = sdscatprintf(out, "%s\n    {\"line\": %u, \"ok\": %s, \"cold\": %s, ",
+                       i == 0 ? "" : ",", form->line,
+                       form->ok ? "true" : "false",
+                       form->cold ? "true" : "false");
+    if (form->recorded_us >= 0) {
+      out = sdscatprintf(out, "\"recorded_us\": %lld, ", form->recorded_us);
+    }
+    out = sdscat(out, "\"elapsed_us\": [");
+    for (int pass = 0; pass < results->num_passes; pass += 1) {
+      out = sdscatprintf(out, "%s%.1f", pass == 0 ? "" : ", ",
+                         results->samples_ns[pass * num_forms + i] / 1e3);
+    }
+    out = sdscat(out, "], \"form\": ");
+    out = json_cat_string(out, form->text, sdslen(form->text));
+    out = sdscat(out, "}");
+  }
+  out = sdscat(out, "\n  ]\n}\n");
+  int rc = -1;
+  FILE* fp = fopen(path, "w");
+  if (fp) {
+    size_t written = fwrite(out, 1, sdslen(out), fp);
+    rc = fclose(fp) == 0 && written == sdslen(out) ? 0 : -1;
+  }
+  if (rc != 0) {
+    log_error("replay::write_results failed in writing %s", path);
+  }
+  sdsfree(out);
+  END_ZONE;
+  return rc;
+}
+
+// Re-executes a session log against the index in the current directory,
+// num_passes times in one session, and reports latency percentiles split
+// into cold and warm evaluations. Returns 1 when a form failed.
+int run_replay(char const* log_path, char const* out_path, int num_passes) {
+  START_ZONE;
+  int rc = 0;
+  replay_results results = {.forms = (void*)0,
+                            .num_passes = num_passes < 1 ? 1 : num_passes};
+  if (!db_exists(".")) {
+    message_fatal(
+        "replay::run_replay failed because scribe db not found in the current "
+        "directory");
+    END_ZONE;
+    return -1;
+  }
+  char* log = read_file_to_str(log_path, (void*)0);
+  if (!log) {
+    log_fatal("replay::run_replay failed in reading %s", log_path);
+    END_ZONE;
+    return -1;
+  }
+  collect_forms(&results, log);
+  free(log);
+  int num_forms = (int)arrlen(results.forms);
+  results.samples_ns =
+      calloc((size_t)(num_forms * results.num_passes + 1), sizeof(uint64_t));
+  mark_cold_forms(&results);
+  lisp_init_vm();
+  bool own_cache = !cache_enabled() && cache_enable("./scribe_db") == 0;
+  for (int pass = 0; results.samples_ns && pass < results.num_passes;
+       pass += 1) {
+    run_pass(&results, pass);
+  }
+  if (own_cache) {
+    cache_terminate();
+  }
+  lisp_terminate();
+  print_results(stdout, &results);
+  if (out_path && write_results(out_path, &results) != 0) {
+    rc = 1;
+  }
+  if (results.num_errors > 0) {
+    rc = 1;
+  }
+  for (int i = 0; i < num_forms; i += 1) {
+    sdsfree(results.forms[i].text);
+  }
+  arrfree(results.forms);
+  free(results.samples_ns);
+  END_ZONE;
+  return rc;
+}
+
+#ifdef UNIT_TEST_REPLAY
+
+#include <unistd.h>
+
+#include "test_deps/utest.h"
+
+UTEST(replay, only_form_members_are_collected) {
+  replay_results results = {.forms = (void*)0};
+  collect_forms(&results,
+                "# recorded in the scribe tree\n"
+                "\n"
+                "{\"ts_ms\":1,\"recorded_us\":42,\"form\":\"(+ 1 2)\"}\n"
+                "{\"ts_ms\":2,\"form\":\"  \"}\n"
+                "{\"ts_ms\":3,\"form\":7}\n"
+                "not json\n"
+                "{\"form\":\"(string \\\"a\\\"\\n  \\\"b\\\")\"}\n");
+  ASSERT_EQ((int)arrlen(results.forms), 2);
+  ASSERT_STREQ("(+ 1 2)", results.forms[0].text);
+  ASSERT_EQ(results.forms[0].line, 3u);
+  ASSERT_EQ(results.forms[0].recorded_us, 42);
+  ASSERT_STREQ("(string \"a\"\n  \"b\")", results.forms[1].text);
+  ASSERT_EQ(results.forms[1].line, 7u);
+  ASSERT_EQ(results.forms[1].recorded_us, -1);
+  for (int i = 0; i < arrlen(results.forms); i += 1) {
+    sdsfree(results.forms[i].text);
+  }
+  arrfree(results.forms);
+}
+
+UTEST(replay, repeated_forms_are_warm) {
+  replay_results results = {.forms = (void*)0};
+  collect_forms(&results,
+                "{\"form\":\"(+ 1 2)\"}\n"
+                "{\"form\":\"(def x 1)\"}\n"
+                "{\"form\":\"(+ 1 2)\"}\n");
+  mark_cold_forms(&results);
+  ASSERT_EQ((int)arrlen(results.forms), 3);
+  ASSERT_TRUE(results.forms[0].cold);
+  ASSERT_TRUE(results.forms[1].cold);
+  ASSERT_FALSE(results.forms[2].cold);
+  for (int i = 0; i < arrlen(results.forms); i += 1) {
+    sdsfree(results.forms[i].text);
+  }
+  arrfree(results.forms);
+}
+
+// Feeds lines the way the repl does and reads back what was recorded.
+static replay_results record_lines(char const* const* lines, int num_lines) {
+  replay_results results = {.forms = (void*)0};
+  char path[] = "/tmp/scribe_replay_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return results;
+  }
+  close(fd);
+  replay_record_start(path);
+  for (int i = 0; i < num_lines; i += 1) {
+    if (!lines[i]) {
+      replay_record_discard();
+      continue;
+    }
+    replay_record_input(lines[i], strlen(lines[i]));
+    replay_record_prompt();
+  }
+  replay_record_stop();
+  char* log = read_file_to_str(path, (void*)0);
+  if (log) {
+    collect_forms(&results, log);
+  }
+  free(log);
+  unlink(path);
+  return results;
+}
+
+// A null line stands for Ctrl-C at the prompt.
+UTEST(replay, multi_line_forms_are_recorded_once) {
+  lisp_init_vm();
+  char const* lines[] = {"(def x\n", "  1)\n", "(+ 1 2) (+ 3 4)\n", "\n",
+                         "(]\n",     "(foo\n", (void*)0,          "(bar)\n"};
+  replay_results results = record_lines(lines, 8);
+  ASSERT_EQ((int)arrlen(results.forms), 3);
+  ASSERT_STREQ("(def x\n  1)", results.forms[0].text);
+  ASSERT_STREQ("(+ 1 2) (+ 3 4)", results.forms[1].text);
+  ASSERT_STREQ("(bar)", results.forms[2].text);
+  ASSERT_TRUE(results.forms[0].recorded_us >= 0);
+  for (int i = 0; i < arrlen(results.forms); i += 1) {
+    sdsfree(results.forms[i].text);
+  }
+  arrfree(results.forms);
+  lisp_terminate();
+}
+
+UTEST_MAIN();
+
+#endif
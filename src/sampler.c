@@ -0,0 +1,447 @@
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "sampler.h"
+
+#include <deps/stb_ds.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <link.h>
+#include <sched.h>
+#include <sds.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "indexer.h"
+#include "profile.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// The kernel rounds the interval up to its tick, usually 4ms.
+#define SAMPLER_INTERVAL_US 1000
+#define SAMPLER_MAX_FRAMES 64
+// A backtrace taken in the handler starts with the handler itself and the
+// signal trampoline of libc.
+#define SAMPLER_SKIPPED_FRAMES 2
+#define SAMPLER_NUM_SLOTS 8192
+#define SLOT_EMPTY 0
+#define SLOT_BUSY 1
+
+// Samples are aggregated per distinct stack while sampling, so a long
+// render needs as much memory as a short one. A slot is claimed by moving
+// its key from empty to busy, and published by storing the real key.
+typedef struct sample_slot sample_slot;
+struct sample_slot {
+  atomic_uint_fast64_t key;
+  atomic_uint_fast64_t count;
+  char const* label;
+  int num_frames;
+  void* frames[SAMPLER_MAX_FRAMES];
+};
+
+typedef struct elf_symbol elf_symbol;
+struct elf_symbol {
+  uintptr_t start;
+  uintptr_t end;
+  sds name;
+};
+
+typedef struct folded_entry folded_entry;
+struct folded_entry {
+  char* key;
+  uint64_t value;
+};
+
+static uint64_t stack_key(char const* label, void** frames, int num_frames);
+static bool same_stack(sample_slot const* slot, char const* label,
+                       void** frames, int num_frames);
+static void record_sample(sample_slot* table, char const* label,
+                          void** frames, int num_frames);
+static void handle_sample(int signal);
+static int compare_symbols(void const* a, void const* b);
+static elf_symbol* load_exe_symbols(uintptr_t* bias);
+static sds frame_name(sds out, elf_symbol* symbols, uintptr_t bias,
+                      uintptr_t pc);
+static int write_folded(char const* path, uint64_t* num_written);
+
+// The handler reaches the slots through active_slots and is counted in
+// num_in_handler while it does. sampler_stop clears the pointer before it
+// waits for the count to drop, so once it is zero no handler can still be
+// holding on to the slots, whatever thread it ran on.
+static sample_slot* slots = (void*)0;
+static _Atomic(sample_slot*) active_slots = (void*)0;
+static atomic_int num_in_handler;
+static atomic_uint_fast64_t num_dropped;
+static sds out_path = (void*)0;
+
+static uint64_t stack_key(char const* label, void** frames, int num_frames) {
+  uint64_t key = 14695981039346656037ull;
+  key = (key ^ (uintptr_t)label) * 1099511628211ull;
+  for (int i = 0; i < num_frames; i += 1) {
+    key = (key ^ (uintptr_t)frames[i]) * 1099511628211ull;
+  }
+  return key > SLOT_BUSY ? key : key + SLOT_BUSY + 1;
+}
+
+static bool same_stack(sample_slot const* slot, char const* label,
+                       void** frames, int num_frames) {
+  return slot->label == label && slot->num_frames == num_frames &&
+         memcmp(slot->frames, frames, sizeof(void*) * num_frames) == 0;
+}
+
+// Runs in the signal handler, so it only touches the preallocated slots and
+// atomics. A slot another thread is still filling in is skipped, the same
+// stack then takes a second slot and the two are merged when writing.
+static void record_sample(sample_slot* table, char const* label,
+                          void** frames, int num_frames) {
+  uint64_t key = stack_key(label, frames, num_frames);
+  for (int probe = 0; probe < SAMPLER_NUM_SLOTS; probe += 1) {
+    sample_slot* slot = &table[(key + probe) & (SAMPLER_NUM_SLOTS - 1)];
+    uint_fast64_t seen =
+        atomic_load_explicit(&slot->key, memory_order_acquire);
+    if (seen == SLOT_EMPTY) {
+      if (atomic_compare_exchange_strong_explicit(
+              &slot->key, &seen, SLOT_BUSY, memory_order_acquire,
+              memory_order_acquire)) {
+        slot->label = label;
+        slot->num_frames = num_frames;
+        memcpy(slot->frames, frames, sizeof(void*) * num_frames);
+        atomic_store_explicit(&slot->count, 1, memory_order_relaxed);
+        atomic_store_explicit(&slot->key, key, memory_order_release);
+        return;
+      }
+    }
+    if (seen == key && same_stack(slot, label, frames, num_frames)) {
+      atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed);
+      return;
+    }
+  }
+  atomic_fetch_add_explicit(&num_dropped, 1, memory_order_relaxed);
+}
+
+// backtrace is not on the async-signal-safe list. Its first call loads
+// libgcc, which sampler_start takes care of. After that the unwinder finds
+// the unwind tables through _dl_find_object on glibc 2.35 and later, which
+// is lock free. Older glibc goes through dl_iterate_phdr instead, which
+// takes the loader lock, so a sample landing in a thread that holds it,
+// in dlopen or another unwind, deadlocks that thread. sampler_start warns
+// when built against such a glibc.
+static void handle_sample(int signal) {
+  (void)signal;
+  int saved_errno = errno;
+  atomic_fetch_add(&num_in_handler, 1);
+  sample_slot* table = atomic_load(&active_slots);
+  if (table) {
+    void* frames[SAMPLER_SKIPPED_FRAMES + SAMPLER_MAX_FRAMES];
+    int num_frames =
+        backtrace(frames, SAMPLER_SKIPPED_FRAMES + SAMPLER_MAX_FRAMES);
+    if (num_frames > SAMPLER_SKIPPED_FRAMES) {
+      record_sample(table, profile_label(), frames + SAMPLER_SKIPPED_FRAMES,
+                    num_frames - SAMPLER_SKIPPED_FRAMES);
+    }
+  }
+  atomic_fetch_sub(&num_in_handler, 1);
+  errno = saved_errno;
+}
+
+static int compare_symbols(void const* a, void const* b) {
+  uintptr_t start_a = ((elf_symbol const*)a)->start;
+  uintptr_t start_b = ((elf_symbol const*)b)->start;
+  return start_a < start_b ? -1 : start_a > start_b;
+}
+
+// dladdr only knows the exported symbols, so the functions of scribe and of
+// the libraries linked into it are looked up in the symbol table of the
+// executable itself. The load bias comes from where sampler_start ended up.
+static elf_symbol* load_exe_symbols(uintptr_t* bias) {
+  START_ZONE;
+  elf_symbol* symbols = (void*)0;
+  unsigned int size = 0;
+  char* image = read_file_to_str("/proc/self/exe", &size);
+  if (!image) {
+    END_ZONE;
+    return (void*)0;
+  }
+  ElfW(Ehdr) const* header = (void*)image;
+  if (size < sizeof(ElfW(Ehdr)) || memcmp(header->e_ident, ELFMAG, SELFMAG) ||
+      header->e_shoff + header->e_shnum * sizeof(ElfW(Shdr)) > size) {
+    log_warn("sampler::load_exe_symbols could not read the executable");
+    goto end;
+  }
+  ElfW(Shdr) const* sections = (void*)(image + header->e_shoff);
+  for (int i = 0; i < header->e_shnum; i += 1) {
+    if (sections[i].sh_type != SHT_SYMTAB ||
+        sections[i].sh_link >= header->e_shnum) {
+      continue;
+    }
+    ElfW(Sym) const* syms = (void*)(image + sections[i].sh_offset);
+    size_t num_syms = sections[i].sh_size / sizeof(ElfW(Sym));
+    char const* names = image + sections[sections[i].sh_link].sh_offset;
+    for (size_t s = 0; s < num_syms; s += 1) {
+      if (ELF64_ST_TYPE(syms[s].st_info) != STT_FUNC ||
+          syms[s].st_size == 0 || syms[s].st_shndx == SHN_UNDEF) {
+        continue;
+      }
+      elf_symbol symbol = {.start = syms[s].st_value,
+                           .end = syms[s].st_value + syms[s].st_size,
+                           .name = sdsnew(names + syms[s].st_name)};
+      if (strcmp(symbol.name, "sampler_start") == 0) {
+        *bias = (uintptr_t)&sampler_start - symbol.start;
+      }
+      arrput(symbols, symbol);
+    }
+  }
+  qsort(symbols, arrlen(symbols), sizeof(elf_symbol), compare_symbols);
+end:
+  free(image);
+  END_ZONE;
+  return symbols;
+}
+
+static sds frame_name(sds out, elf_symbol* symbols, uintptr_t bias,
+                      uintptr_t pc) {
+  uintptr_t address = pc - bias;
+  int low = 0;
+  int high = (int)arrlen(symbols) - 1;
+  while (low <= high) {
+    int mid = low + (high - low) / 2;
+    if (address < symbols[mid].start) {
+      high = mid - 1;
+    } else if (address >= symbols[mid].end) {
+      low = mid + 1;
+    } else {
+      return sdscatsds(out, symbols[mid].name);
+    }
+  }
+  Dl_info info = {0};
+  if (dladdr((void*)pc, &info) && info.dli_sname) {
+    return sdscat(out, info.dli_sname);
+  }
+  if (info.dli_fname) {
+    char const* base = strrchr(info.dli_fname, '/');
+    return sdscatprintf(out, "[%s]", base ? base + 1 : info.dli_fname);
+  }
+  return sdscat(out, "[unknown]");
+}
+
+// One line per stack, root first and led by the phase the sample was taken
+// in, ready for flamegraph.pl or speedscope.
+static int write_folded(char const* path, uint64_t* num_written) {
+  START_ZONE;
+  int rc = 0;
+  uintptr_t bias = 0;
+  elf_symbol* symbols = load_exe_symbols(&bias);
+  folded_entry* folded = (void*)0;
+  sh_new_strdup(folded);
+  sds line = sdsempty();
+  for (int i = 0; i < SAMPLER_NUM_SLOTS; i += 1) {
+    sample_slot* slot = &slots[i];
+    if (atomic_load(&slot->key) <= SLOT_BUSY) {
+      continue;
+    }
+    sdsclear(line);
+    line = sdscatprintf(line, "[%s]",
+                        slot->label ? slot->label : "other");
+    for (int f = slot->num_frames - 1; f >= 0; f -= 1) {
+      // Apart from the interrupted one, frames hold return addresses which
+      // can already belong to the next function.
+      uintptr_t pc = (uintptr_t)slot->frames[f] - (f > 0 ? 1 : 0);
+      line = sdscat(line, ";");
+      line = frame_name(line, symbols, bias, pc);
+    }
+    uint64_t count = shget(folded, line) + atomic_load(&slot->count);
+    shput(folded, line, count);
+  }
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    log_error("sampler::write_folded failed in opening %s", path);
+    rc = -1;
+    goto end;
+  }
+  *num_written = 0;
+  for (int i = 0; i < shlen(folded); i += 1) {
+    fprintf(out, "%s %llu\n", folded[i].key,
+            (unsigned long long)folded[i].value);
+    *num_written += folded[i].value;
+  }
+  if (fclose(out) != 0) {
+    log_error("sampler::write_folded failed in writing %s", path);
+    rc = -1;
+  }
+end:
+  sdsfree(line);
+  shfree(folded);
+  for (int i = 0; i < arrlen(symbols); i += 1) {
+    sdsfree(symbols[i].name);
+  }
+  arrfree(symbols);
+  END_ZONE;
+  return rc;
+}
+
+// Samples the whole process on CPU time, whichever thread is running takes
+// the signal. Interrupted system calls are restarted.
+int sampler_start(char const* path) {
+  START_ZONE;
+  slots = calloc(SAMPLER_NUM_SLOTS, sizeof(sample_slot));
+  if (!slots) {
+    message_fatal("sampler::sampler_start failed in allocating memory");
+    goto error_end;
+  }
+  out_path = sdsnew(path);
+#if defined(__GLIBC__) && \
+    (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 35))
+  log_warn(
+      "sampler::sampler_start unwinding takes the loader lock before glibc "
+      "2.35, a thread interrupted while holding it can deadlock");
+#endif
+  void* warm_up[1];
+  backtrace(warm_up, 1);
+  atomic_store(&active_slots, slots);
+  struct sigaction action = {0};
+  action.sa_handler = handle_sample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, (void*)0) != 0) {
+    log_error("sampler::sampler_start failed in installing handler: %s",
+              strerror(errno));
+    goto error_end;
+  }
+  struct itimerval timer = {
+      .it_interval = {.tv_usec = SAMPLER_INTERVAL_US},
+      .it_value = {.tv_usec = SAMPLER_INTERVAL_US}};
+  if (setitimer(ITIMER_PROF, &timer, (void*)0) != 0) {
+    log_error("sampler::sampler_start failed in starting timer: %s",
+              strerror(errno));
+    goto error_end;
+  }
+  END_ZONE;
+  return 0;
+error_end:
+  signal(SIGPROF, SIG_IGN);
+  atomic_store(&active_slots, (void*)0);
+  while (atomic_load(&num_in_handler) > 0) {
+    sched_yield();
+  }
+  free(slots);
+  slots = (void*)0;
+  sdsfree(out_path);
+  out_path = (void*)0;
+  END_ZONE;
+  return -1;
+}
+
+int sampler_stop(void) {
+  START_ZONE;
+  if (!slots) {
+    END_ZONE;
+    return 0;
+  }
+  struct itimerval timer = {0};
+  setitimer(ITIMER_PROF, &timer, (void*)0);
+  // A signal still pending would kill the process under the default action.
+  // Handlers already running on other threads are waited for before the
+  // slots are read and freed.
+  signal(SIGPROF, SIG_IGN);
+  atomic_store(&active_slots, (void*)0);
+  while (atomic_load(&num_in_handler) > 0) {
+    sched_yield();
+  }
+  uint64_t num_written = 0;
+  int rc = write_folded(out_path, &num_written);
+  if (rc == 0) {
+    fprintf(stderr, "scribe: %llu cpu samples written to %s",
+            (unsigned long long)num_written, out_path);
+    uint64_t dropped = atomic_load(&num_dropped);
+    if (dropped > 0) {
+      fprintf(stderr, ", %llu dropped", (unsigned long long)dropped);
+    }
+    fprintf(stderr, "\n");
+  }
+  free(slots);
+  slots = (void*)0;
+  sdsfree(out_path);
+  out_path = (void*)0;
+  END_ZONE;
+  return rc;
+}
+
+#ifdef UNIT_TEST_SAMPLER
+
+#include <pthread.h>
+#include <time.h>
+
+#include "test_deps/utest.h"
+
+static __attribute__((noinline)) double spin_in_render(void) {
+  char const* outer = profile_enter("render");
+  volatile double sum = 0;
+  for (long i = 0; i < 200000000; i += 1) {
+    sum += (double)i * 0.5;
+  }
+  profile_leave(outer);
+  return sum;
+}
+
+UTEST(sampler, folded_stacks) {
+  char const* path = "/tmp/scribe_test_sampler.folded";
+  ASSERT_EQ(sampler_start(path), 0);
+  spin_in_render();
+  ASSERT_EQ(sampler_stop(), 0);
+  unsigned int size = 0;
+  char* folded = read_file_to_str(path, &size);
+  ASSERT_TRUE(folded != (void*)0);
+  ASSERT_TRUE(strstr(folded, "[render];") != (void*)0);
+  ASSERT_TRUE(strstr(folded, ";spin_in_render") != (void*)0);
+  free(folded);
+  remove(path);
+}
+
+static atomic_bool spinning;
+
+static void* spin_until_stopped(void* arg) {
+  (void)arg;
+  volatile double sum = 0;
+  for (long i = 0; atomic_load(&spinning); i += 1) {
+    sum += (double)i * 0.5;
+  }
+  return (void*)0;
+}
+
+// Samples keep landing on the other threads while the slots are torn down.
+UTEST(sampler, stop_while_other_threads_run) {
+  char const* path = "/tmp/scribe_test_sampler_threads.folded";
+  for (int round = 0; round < 3; round += 1) {
+    pthread_t threads[4];
+    atomic_store(&spinning, true);
+    for (int i = 0; i < 4; i += 1) {
+      ASSERT_EQ(pthread_create(&threads[i], (void*)0, spin_until_stopped,
+                               (void*)0),
+                0);
+    }
+    ASSERT_EQ(sampler_start(path), 0);
+    struct timespec pause = {.tv_nsec = 100 * 1000 * 1000};
+    nanosleep(&pause, (void*)0);
+    ASSERT_EQ(sampler_stop(), 0);
+    ASSERT_EQ(atomic_load(&num_in_handler), 0);
+    atomic_store(&spinning, false);
+    for (int i = 0; i < 4; i += 1) {
+      pthread_join(threads[i], (void*)0);
+    }
+  }
+  remove(path);
+}
+
+UTEST_MAIN();
+
+#endif
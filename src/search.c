@@ -0,0 +1,556 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "search.h"
+
+#include <deps/stb_ds.h>
+#include <janet.h>
+#include <lmdb.h>
+#include <pthread.h>
+#include <sds.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tree_sitter/api.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "db.h"
+#include "lisp.h"
+#include "query.h"
+#include "trace.h"
+#include "tree_sitter.h"
+#include "ts_alloc.h"
+
+INIT_TRACE;
+
+TSLanguage* tree_sitter_c();
+
+typedef struct search_file search_file;
+struct search_file {
+  sds path;
+  sds name;
+};
+
+typedef struct search_match search_match;
+struct search_match {
+  search_file* file;
+  uint32_t start_byte;
+  uint32_t end_byte;
+  uint32_t start_line;
+  uint32_t end_line;
+  sds text;
+};
+
+// Matches are handed from the workers to the caller through a bounded
+// queue, so a slow consumer holds the workers back instead of piling up
+// results.
+enum { SEARCH_QUEUE_SIZE = 256 };
+
+typedef struct search_queue search_queue;
+struct search_queue {
+  search_match items[SEARCH_QUEUE_SIZE];
+  int head;
+  int count;
+  int producers;
+  bool cancelled;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+typedef struct search_run search_run;
+struct search_run {
+  sds pattern;
+  search_file* files;
+  atomic_int next;
+  MDB_env* env;
+  pthread_t* threads;
+  search_queue queue;
+  int64_t limit;
+  int64_t delivered;
+  query_budget budget;
+};
+
+static void queue_init(search_queue* queue, int producers);
+static bool queue_push(search_queue* queue, search_match match);
+static bool queue_pop(search_queue* queue, search_match* match);
+static void queue_producer_done(search_queue* queue);
+static void queue_cancel(search_queue* queue);
+static void queue_terminate(search_queue* queue);
+static void free_match(search_match match);
+static bool search_file_src(search_run* run, MDB_txn* txn, TSParser* parser,
+                            TSQuery* query, TSQueryCursor* cursor,
+                            search_file* file);
+static void* search_worker(void* arg);
+static int collect_files(search_run* run, char const* path_prefix);
+static int start_search(search_run* run, JanetString pattern,
+                        char const* path_prefix, int num_workers,
+                        int64_t limit, query_budget budget);
+static void stop_search(search_run* run);
+static int search_run_gc(void* data, size_t len);
+
+static const JanetAbstractType search_run_type = {
+    "scribe/search", search_run_gc, JANET_ATEND_GC};
+
+static void queue_init(search_queue* queue, int producers) {
+  queue->head = 0;
+  queue->count = 0;
+  queue->producers = producers;
+  queue->cancelled = false;
+  pthread_mutex_init(&queue->lock, (void*)0);
+  pthread_cond_init(&queue->not_empty, (void*)0);
+  pthread_cond_init(&queue->not_full, (void*)0);
+}
+
+// Returns false once the consumer has gone away, the match is then dropped.
+static bool queue_push(search_queue* queue, search_match match) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == SEARCH_QUEUE_SIZE && !queue->cancelled) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  if (queue->cancelled) {
+    pthread_mutex_unlock(&queue->lock);
+    free_match(match);
+    return false;
+  }
+  int tail = (queue->head + queue->count) % SEARCH_QUEUE_SIZE;
+  queue->items[tail] = match;
+  queue->count += 1;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+  return true;
+}
+
+// Blocks until a match is available, returns false once every producer is
+// done and the queue is drained.
+static bool queue_pop(search_queue* queue, search_match* match) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && queue->producers > 0) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  if (queue->count == 0) {
+    pthread_mutex_unlock(&queue->lock);
+    return false;
+  }
+  *match = queue->items[queue->head];
+  queue->head = (queue->head + 1) % SEARCH_QUEUE_SIZE;
+  queue->count -= 1;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return true;
+}
+
+static void queue_producer_done(search_queue* queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->producers -= 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void queue_cancel(search_queue* queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->cancelled = true;
+  pthread_cond_broadcast(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void queue_terminate(search_queue* queue) {
+  search_match match = {0};
+  while (queue->count > 0) {
+    match = queue->items[queue->head];
+    queue->head = (queue->head + 1) % SEARCH_QUEUE_SIZE;
+    queue->count -= 1;
+    free_match(match);
+  }
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+}
+
+static void free_match(search_match match) {
+  sdsfree(match.text);
+}
+
+// Pushes every match in one file, returns false once the search was
+// cancelled.
+static bool search_file_src(search_run* run, MDB_txn* txn, TSParser* parser,
+                            TSQuery* query, TSQueryCursor* cursor,
+                            search_file* file) {
+  START_ZONE;
+  MDB_dbi db_handle = db_get_handle(txn, file->path, false);
+  if (db_handle == 0) {
+    END_ZONE;
+    return true;
+  }
+  sds src = db_get(txn, db_handle, file->name);
+  if (!src) {
+    END_ZONE;
+    return true;
+  }
+  TSTree* tree = parse_string(parser, src);
+  if (!tree) {
+    sdsfree(src);
+    END_ZONE;
+    return true;
+  }
+  bool running = true;
+  budget_apply_cursor(cursor);
+  ts_query_cursor_exec(cursor, query, ts_tree_root_node(tree));
+  TSQueryMatch match = {0};
+  while (running && budget_check() == BUDGET_OK &&
+         ts_query_cursor_next_match(cursor, &match)) {
+    if (match.capture_count == 0) {
+      continue;
+    }
+    TSNode node = match.captures->node;
+    uint32_t start_byte = ts_node_start_byte(node);
+    uint32_t end_byte = ts_node_end_byte(node);
+    search_match found = {
+        .file = file,
+        .start_byte = start_byte,
+        .end_byte = end_byte,
+        .start_line = ts_node_start_point(node).row + 1,
+        .end_line = ts_node_end_point(node).row + 1,
+        .text = sdsnewlen(src + start_byte, end_byte - start_byte)};
+    running = queue_push(&run->queue, found);
+  }
+  ts_tree_delete(tree);
+  sdsfree(src);
+  END_ZONE;
+  return running;
+}
+
+// Workers only share the environment and the file list. Each has its own
+// read transaction, parser, query and cursor, and a file is parsed exactly
+// once per search so its tree is dropped as soon as it is searched. The
+// timeout applies to every file on its own, a file that runs out of time is
+// skipped and the search goes on.
+static void* search_worker(void* arg) {
+  search_run* run = (search_run*)arg;
+  int num_files = (int)arrlen(run->files);
+  MDB_txn* txn = db_txn_init(run->env, true);
+  TSParser* parser = create_parser(tree_sitter_c());
+  TSQuery* query = create_query(tree_sitter_c(), run->pattern);
+  TSQueryCursor* cursor = ts_query_cursor_new();
+  if (!txn || !parser || !query) {
+    message_error("search::search_worker failed in setting up");
+    goto end;
+  }
+  while (true) {
+    int i = atomic_fetch_add(&run->next, 1);
+    if (i >= num_files) {
+      break;
+    }
+    search_file* file = &run->files[i];
+    query_budget budget = run->budget;
+    budget_begin(&budget);
+    bool running = search_file_src(run, txn, parser, query, cursor, file);
+    budget_status status = budget_end();
+    if (status == BUDGET_TIMED_OUT) {
+      log_error("search::search_worker skipped %s/%s: %s", file->path,
+                file->name, budget_status_text(status));
+    }
+    if (!running || status == BUDGET_CANCELLED) {
+      break;
+    }
+  }
+end:
+  ts_query_cursor_delete(cursor);
+  ts_query_delete(query);
+  ts_parser_delete(parser);
+  if (txn) {
+    db_txn_terminate(txn, false);
+  }
+  // Search workers never start a VM, so lisp_terminate is not there to give
+  // the blocks their parses cached back.
+  ts_alloc_release();
+  queue_producer_done(&run->queue);
+  return (void*)0;
+}
+
+static int collect_files(search_run* run, char const* path_prefix) {
+  START_ZONE;
+  size_t prefix_len = path_prefix ? strlen(path_prefix) : 0;
+  MDB_txn* txn = db_txn_init(run->env, true);
+  if (!txn) {
+    message_fatal("search::collect_files failed in creating transaction");
+    END_ZONE;
+    return -1;
+  }
+  MDB_dbi paths_handle = db_get_handle(txn, "paths", false);
+  MDB_cursor* paths = paths_handle ? db_cursor_init(txn, paths_handle)
+                                   : (void*)0;
+  if (!paths) {
+    message_fatal("search::collect_files failed in listing paths");
+    db_txn_terminate(txn, false);
+    END_ZONE;
+    return -1;
+  }
+  sds path = (void*)0;
+  while ((path = db_cursor_next_key(paths, false))) {
+    MDB_dbi db_handle = db_get_handle(txn, path, false);
+    MDB_cursor* names = db_handle ? db_cursor_init(txn, db_handle) : (void*)0;
+    if (!names || strncmp(path, path_prefix ? path_prefix : "", prefix_len)) {
+      db_cursor_terminate(names);
+      sdsfree(path);
+      continue;
+    }
+    sds name = (void*)0;
+    while ((name = db_cursor_next_key(names, true))) {
+      search_file file = {.path = sdsdup(path), .name = name};
+      arrput(run->files, file);
+    }
+    db_cursor_terminate(names);
+    sdsfree(path);
+  }
+  db_cursor_terminate(paths);
+  db_txn_terminate(txn, false);
+  END_ZONE;
+  return 0;
+}
+
+// Stops the workers early when the caller hit its limit or dropped the
+// search, and joins them.
+static void stop_search(search_run* run) {
+  START_ZONE;
+  if (!run->threads) {
+    END_ZONE;
+    return;
+  }
+  queue_cancel(&run->queue);
+  for (int i = 0; i < arrlen(run->threads); i += 1) {
+    pthread_join(run->threads[i], (void*)0);
+  }
+  arrfree(run->threads);
+  run->threads = (void*)0;
+  END_ZONE;
+}
+
+static int search_run_gc(void* data, size_t len) {
+  (void)len;
+  search_run* run = (search_run*)data;
+  if (!run->env) {
+    return 0;
+  }
+  stop_search(run);
+  queue_terminate(&run->queue);
+  for (int i = 0; i < arrlen(run->files); i += 1) {
+    sdsfree(run->files[i].path);
+    sdsfree(run->files[i].name);
+  }
+  arrfree(run->files);
+  sdsfree(run->pattern);
+  db_env_terminate(run->env);
+  return 0;
+}
+
+// Fills run in place, the workers keep pointers into it. On failure run is
+// left zeroed so collecting it is a no-op.
+static int start_search(search_run* run, JanetString pattern,
+                        char const* path_prefix, int num_workers,
+                        int64_t limit, query_budget budget) {
+  START_ZONE;
+  *run = (search_run){.limit = limit, .budget = budget};
+  atomic_init(&run->next, 0);
+  run->pattern = sdsnewlen(pattern, janet_string_length(pattern));
+  TSQuery* query = create_query(tree_sitter_c(), run->pattern);
+  if (!query) {
+    goto error_end;
+  }
+  ts_query_delete(query);
+  run->env = db_env_init("./scribe_db", false, 100);
+  if (!run->env) {
+    message_fatal("search::start_search failed in creating db environment");
+    goto error_end;
+  }
+  if (collect_files(run, path_prefix) != 0) {
+    goto error_end;
+  }
+  if (num_workers <= 0) {
+    num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_workers > arrlen(run->files)) {
+    num_workers = (int)arrlen(run->files);
+  }
+  queue_init(&run->queue, num_workers);
+  for (int i = 0; i < num_workers; i += 1) {
+    pthread_t thread;
+    if (pthread_create(&thread, (void*)0, search_worker, run) != 0) {
+      message_error("search::start_search failed in creating worker");
+      queue_producer_done(&run->queue);
+      continue;
+    }
+    arrput(run->threads, thread);
+  }
+  END_ZONE;
+  return 0;
+error_end:
+  for (int i = 0; i < arrlen(run->files); i += 1) {
+    sdsfree(run->files[i].path);
+    sdsfree(run->files[i].name);
+  }
+  arrfree(run->files);
+  db_env_terminate(run->env);
+  sdsfree(run->pattern);
+  *run = (search_run){0};
+  END_ZONE;
+  return -1;
+}
+
+static Janet cfun_search_start(int32_t argc, Janet* argv) {
+  janet_arity(argc, 1, 5);
+  if (!db_exists(".")) {
+    janet_panicf("scribe db not found in the current directory");
+  }
+  JanetString pattern = janet_getstring(argv, 0);
+  char const* path_prefix = (char const*)janet_optcstring(argv, argc, 1, "");
+  int64_t limit = janet_optinteger64(argv, argc, 2, 0);
+  int num_workers = (int)janet_optnat(argv, argc, 3, 0);
+  query_budget budget = budget_from_options(argv, argc, 4);
+  search_run* run =
+      (search_run*)janet_abstract(&search_run_type, sizeof(search_run));
+  if (start_search(run, pattern, path_prefix, num_workers, limit, budget) !=
+      0) {
+    janet_panicf("failed in starting the search");
+  }
+  return janet_wrap_abstract(run);
+}
+
+static Janet cfun_search_next(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  search_run* run = janet_getabstract(argv, 0, &search_run_type);
+  if (!run->env) {
+    return janet_wrap_nil();
+  }
+  search_match match = {0};
+  if (budget_cancelled() || (run->limit > 0 && run->delivered >= run->limit) ||
+      !queue_pop(&run->queue, &match)) {
+    stop_search(run);
+    if (budget_cancelled()) {
+      janet_panicf("%s", budget_status_text(BUDGET_CANCELLED));
+    }
+    return janet_wrap_nil();
+  }
+  run->delivered += 1;
+  JanetKV* found = janet_struct_begin(7);
+  janet_struct_put(found, janet_ckeywordv("path"),
+                   janet_cstringv(match.file->path));
+  janet_struct_put(found, janet_ckeywordv("name"),
+                   janet_cstringv(match.file->name));
+  janet_struct_put(found, janet_ckeywordv("start-byte"),
+                   janet_wrap_number(match.start_byte));
+  janet_struct_put(found, janet_ckeywordv("end-byte"),
+                   janet_wrap_number(match.end_byte));
+  janet_struct_put(found, janet_ckeywordv("start-line"),
+                   janet_wrap_number(match.start_line));
+  janet_struct_put(found, janet_ckeywordv("end-line"),
+                   janet_wrap_number(match.end_line));
+  janet_struct_put(found, janet_ckeywordv("text"),
+                   janet_stringv((uint8_t*)match.text, sdslen(match.text)));
+  free_match(match);
+  return janet_wrap_struct(janet_struct_end(found));
+}
+
+static const JanetReg search_cfuns[] = {
+    {"search-start", cfun_search_start,
+     "(c/search-start pattern &opt path-prefix limit workers opts)\n\nStart "
+     "running a tree-sitter pattern over every indexed file on a pool of "
+     "workers, see c/search-all. opts are the same as for "
+     "c/tree-sitter-query, the timeout applies to each file."},
+    {"search-next", cfun_search_next,
+     "(c/search-next search)\n\nNext match of a search, as a struct with "
+     ":path, :name, the span and :text. nil once the search is done or hit "
+     "its limit."},
+    {(void*)0, (void*)0, (void*)0},
+};
+
+void register_search_module(JanetTable* env) {
+  lisp_register_module(env, "c", search_cfuns);
+}
+
+#ifdef UNIT_TEST_SEARCH
+
+#include "test_deps/test_db.h"
+#include "test_deps/utest.h"
+
+// src/a.c holds three functions and lib/b.c one.
+static int index_test_files(void) {
+  if (test_db_put("project", "name", "search") != 0 ||
+      test_db_put("paths", "src", "") != 0 ||
+      test_db_put("paths", "lib", "") != 0 ||
+      test_db_put("src", "a.c",
+                  "int a(void) { return 1; }\n"
+                  "int b(void) { return 2; }\n"
+                  "int c(void) { return 3; }\n") != 0 ||
+      test_db_put("lib", "b.c", "int d(void) { return 4; }\n") != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static void free_files(search_run* run) {
+  for (int i = 0; i < arrlen(run->files); i += 1) {
+    sdsfree(run->files[i].path);
+    sdsfree(run->files[i].name);
+  }
+  arrfree(run->files);
+}
+
+UTEST(search, collect_files_keeps_prefix) {
+  test_db db;
+  ASSERT_TRUE(test_db_enter(&db));
+  ASSERT_EQ(index_test_files(), 0);
+  search_run run = {.env = db_env_init("./scribe_db", false, 100)};
+  ASSERT_EQ(collect_files(&run, "src"), 0);
+  ASSERT_EQ((int)arrlen(run.files), 1);
+  ASSERT_STREQ("src", run.files[0].path);
+  ASSERT_STREQ("a.c", run.files[0].name);
+  free_files(&run);
+  ASSERT_EQ(collect_files(&run, (void*)0), 0);
+  ASSERT_EQ((int)arrlen(run.files), 2);
+  free_files(&run);
+  db_env_terminate(run.env);
+  test_db_leave(&db);
+}
+
+UTEST(search, next_stops_at_limit) {
+  test_db db;
+  ASSERT_TRUE(test_db_enter(&db));
+  ASSERT_EQ(index_test_files(), 0);
+  lisp_init_vm();
+  JanetTable* env = lisp_init_env();
+  register_search_module(env);
+  Janet found = janet_wrap_nil();
+  ASSERT_EQ(lisp_execute_script(
+                env,
+                "(def s (c/search-start \"(function_definition) @f\" \"src\" "
+                "2 2))"
+                "(def found @[])"
+                "(while (def m (c/search-next s)) (array/push found m))"
+                "[(length found) (get-in found [0 :path]) (c/search-next s)]",
+                &found),
+            0);
+  JanetTuple result = janet_unwrap_tuple(found);
+  ASSERT_EQ(janet_unwrap_integer(result[0]), 2);
+  ASSERT_STREQ("src", (char const*)janet_unwrap_string(result[1]));
+  ASSERT_TRUE(janet_checktype(result[2], JANET_NIL));
+  ASSERT_EQ(lisp_execute_script(
+                env,
+                "(def s (c/search-start \"(function_definition) @f\"))"
+                "(var n 0)"
+                "(while (c/search-next s) (++ n))"
+                "n",
+                &found),
+            0);
+  ASSERT_EQ(janet_unwrap_integer(found), 4);
+  lisp_terminate();
+  test_db_leave(&db);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -0,0 +1,544 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "server.h"
+
+#include <deps/stb_ds.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sds.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "image.h"
+#include "json.h"
+#include "lisp.h"
+#include "query.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// Connections belong to the accepting thread, which polls all of them and
+// hands one request line at a time to the workers. A connection has at most
+// one request out with a worker, so its responses come back in the order
+// the requests were sent, while idle connections cost no worker at all.
+typedef struct server_connection server_connection;
+struct server_connection {
+  int fd;
+  sds input;
+  bool busy;
+  bool failed;
+  bool hung_up;
+};
+
+typedef struct server_job server_job;
+struct server_job {
+  server_connection* connection;
+  sds line;
+};
+
+// Workers take jobs off the queue and poke wake_fds[1] when a connection
+// they answered is free again.
+typedef struct server_pool server_pool;
+struct server_pool {
+  server_connection** connections;
+  server_job* jobs;
+  bool stopping;
+  int wake_fds[2];
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+};
+
+static uint64_t clock_us(void);
+static int write_all(int fd, char const* data, size_t len);
+static bool next_job(server_pool* pool, server_job* job);
+static void* server_worker(void* arg);
+static bool dispatch_request(server_pool* pool, server_connection* connection);
+static bool read_requests(server_connection* connection);
+static void close_connection(server_connection* connection);
+static void poll_connections(server_pool* pool, int listen_fd);
+static void handle_stop(int signal);
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static uint64_t clock_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// Evaluates the query of one request line in a fresh env over the warm
+// image, through this thread's session cache. The snapshot is moved forward
+// first, so a re-index done by another process shows up on the next request.
+sds server_handle_request(char const* line, size_t len) {
+  START_ZONE;
+  uint64_t start_us = clock_us();
+  // Like the repl prompt, nothing is live between two requests, so scratch
+  // memory left behind by a query that raised is dropped here.
+  cache_refresh();
+  scratch_reset();
+  bool id_is_string = false;
+  bool query_is_string = false;
+  sds id = json_get_member(line, len, "id", &id_is_string);
+  sds query = json_get_member(line, len, "query", &query_is_string);
+  sds response = sdsnew("{\"id\":");
+  if (!id) {
+    response = sdscat(response, "null");
+  } else if (id_is_string) {
+    response = json_cat_string(response, id, sdslen(id));
+  } else {
+    response = sdscatsds(response, id);
+  }
+  if (!query || !query_is_string) {
+    response = sdscat(response,
+                      ",\"ok\":false,\"error\":\"expected a query string\"");
+    goto end;
+  }
+  bool ok = false;
+  sds text = evaluate_query_text(query, &ok);
+  response = sdscat(response, ok ? ",\"ok\":true,\"value\":"
+                                 : ",\"ok\":false,\"error\":");
+  response = json_cat_string(response, text, sdslen(text));
+  sdsfree(text);
+end:
+  response = sdscatfmt(response, ",\"elapsed_us\":%U}\n",
+                       (uint64_t)(clock_us() - start_us));
+  sdsfree(id);
+  sdsfree(query);
+  END_ZONE;
+  return response;
+}
+
+static int write_all(int fd, char const* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static bool next_job(server_pool* pool, server_job* job) {
+  bool found = false;
+  pthread_mutex_lock(&pool->lock);
+  while (arrlen(pool->jobs) == 0 && !pool->stopping) {
+    pthread_cond_wait(&pool->ready, &pool->lock);
+  }
+  if (!pool->stopping) {
+    *job = pool->jobs[0];
+    arrdel(pool->jobs, 0);
+    found = true;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return found;
+}
+
+// Every worker keeps its own VM with the image loaded and its own session
+// cache, so sources, trees and queries stay warm across requests and
+// connections without being shared between threads.
+static void* server_worker(void* arg) {
+  server_pool* pool = (server_pool*)arg;
+  lisp_init_vm();
+  cache_enable("./scribe_db");
+  image_env();
+  server_job job = {0};
+  while (next_job(pool, &job)) {
+    server_connection* connection = job.connection;
+    sds response = server_handle_request(job.line, sdslen(job.line));
+    int rc = write_all(connection->fd, response, sdslen(response));
+    sdsfree(response);
+    sdsfree(job.line);
+    pthread_mutex_lock(&pool->lock);
+    connection->failed = rc != 0;
+    connection->busy = false;
+    pthread_mutex_unlock(&pool->lock);
+    ssize_t written = write(pool->wake_fds[1], "", 1);
+    (void)written;
+  }
+  cache_terminate();
+  lisp_terminate();
+  return (void*)0;
+}
+
+// Requests are JSON objects one per line, {"id": ..., "query": "..."}, and
+// every request gets one line back in the same order. Called with the
+// connection free, the next complete line, if any, goes to a worker.
+static bool dispatch_request(server_pool* pool, server_connection* connection) {
+  char* eol = memchr(connection->input, '\n', sdslen(connection->input));
+  if (!eol) {
+    return false;
+  }
+  size_t line_len = (size_t)(eol - connection->input);
+  server_job job = {.connection = connection,
+                    .line = sdsnewlen(connection->input, line_len)};
+  sdsrange(connection->input, (ssize_t)line_len + 1, -1);
+  pthread_mutex_lock(&pool->lock);
+  connection->busy = true;
+  arrput(pool->jobs, job);
+  pthread_cond_signal(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+  return true;
+}
+
+// Returns false once the client hung up or the read failed.
+static bool read_requests(server_connection* connection) {
+  char chunk[4096];
+  ssize_t n = read(connection->fd, chunk, sizeof(chunk));
+  if (n < 0 && errno == EINTR) {
+    return true;
+  }
+  if (n <= 0) {
+    return false;
+  }
+  connection->input = sdscatlen(connection->input, chunk, (size_t)n);
+  return true;
+}
+
+static void close_connection(server_connection* connection) {
+  close(connection->fd);
+  sdsfree(connection->input);
+  free(connection);
+}
+
+// Slot 0 is the listening socket, slot 1 the wake pipe and the rest are the
+// connections in order. A busy connection is left out of the poll, its next
+// request waits in its input until the worker is done with this one. A
+// client that hung up still gets the answers to the lines it sent before.
+static void poll_connections(server_pool* pool, int listen_fd) {
+  START_ZONE;
+  struct pollfd* fds = (void*)0;
+  while (!stop_requested) {
+    int num_connections = (int)arrlen(pool->connections);
+    arrsetlen(fds, 2 + num_connections);
+    fds[0] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+    fds[1] = (struct pollfd){.fd = pool->wake_fds[0], .events = POLLIN};
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < num_connections; i += 1) {
+      server_connection* connection = pool->connections[i];
+      bool idle = !connection->busy && !connection->hung_up;
+      fds[i + 2] = (struct pollfd){.fd = idle ? connection->fd : -1,
+                                   .events = POLLIN};
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (poll(fds, (nfds_t)arrlen(fds), -1) < 0) {
+      if (errno != EINTR) {
+        log_error("server::poll_connections failed in polling: %s",
+                  strerror(errno));
+      }
+      continue;
+    }
+    if (fds[1].revents & POLLIN) {
+      char drained[64];
+      ssize_t n = read(pool->wake_fds[0], drained, sizeof(drained));
+      (void)n;
+    }
+    // Connections freed by a worker since the last round are looked at
+    // whether or not their socket has anything new.
+    for (int i = (int)arrlen(pool->connections) - 1; i >= 0; i -= 1) {
+      server_connection* connection = pool->connections[i];
+      pthread_mutex_lock(&pool->lock);
+      bool busy = connection->busy;
+      pthread_mutex_unlock(&pool->lock);
+      if (busy) {
+        continue;
+      }
+      if (!connection->failed && !connection->hung_up &&
+          (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) {
+        connection->hung_up = !read_requests(connection);
+      }
+      if (connection->failed ||
+          (!dispatch_request(pool, connection) && connection->hung_up)) {
+        close_connection(connection);
+        arrdel(pool->connections, i);
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, (void*)0, (void*)0);
+      if (fd < 0) {
+        if (errno != EINTR) {
+          log_error("server::poll_connections failed in accepting: %s",
+                    strerror(errno));
+        }
+        continue;
+      }
+      server_connection* connection = calloc(1, sizeof(server_connection));
+      connection->fd = fd;
+      connection->input = sdsempty();
+      arrput(pool->connections, connection);
+    }
+  }
+  arrfree(fds);
+  END_ZONE;
+}
+
+static void handle_stop(int signal) {
+  (void)signal;
+  stop_requested = 1;
+}
+
+int serve(char const* socket_path, int num_workers) {
+  START_ZONE;
+  int rc = -1;
+  int listen_fd = -1;
+  bool bound = false;
+  pthread_t* threads = (void*)0;
+  server_pool pool = {.stopping = false, .wake_fds = {-1, -1}};
+  pthread_mutex_init(&pool.lock, (void*)0);
+  pthread_cond_init(&pool.ready, (void*)0);
+  if (!db_exists(".")) {
+    message_fatal(
+        "server::serve failed because scribe db not found in the current "
+        "directory");
+    goto end;
+  }
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    log_fatal("server::serve socket path is too long: %s", socket_path);
+    goto end;
+  }
+  strcpy(address.sun_path, socket_path);
+  // A socket left behind by a previous run is replaced, anything else at
+  // that path is not touched.
+  struct stat info;
+  if (stat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(socket_path);
+  }
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listen_fd, 64) != 0) {
+    log_fatal("server::serve failed in listening on %s: %s", socket_path,
+              strerror(errno));
+    goto end;
+  }
+  bound = true;
+  if (pipe(pool.wake_fds) != 0 ||
+      fcntl(pool.wake_fds[1], F_SETFL, O_NONBLOCK) != 0) {
+    log_fatal("server::serve failed in creating the wake pipe: %s",
+              strerror(errno));
+    goto end;
+  }
+  // Only the polling thread sees the stop signals, so poll is the call they
+  // interrupt.
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, (void*)0);
+  if (num_workers <= 0) {
+    num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  for (int i = 0; i < num_workers; i += 1) {
+    pthread_t thread;
+    if (pthread_create(&thread, (void*)0, server_worker, &pool) != 0) {
+      message_error("server::serve failed in creating worker");
+      break;
+    }
+    arrput(threads, thread);
+  }
+  struct sigaction action = {0};
+  action.sa_handler = handle_stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, (void*)0);
+  sigaction(SIGTERM, &action, (void*)0);
+  pthread_sigmask(SIG_UNBLOCK, &stop_signals, (void*)0);
+  if (arrlen(threads) == 0) {
+    goto end;
+  }
+  fprintf(stderr, "scribe: serving on %s with %d workers\n", socket_path,
+          (int)arrlen(threads));
+  poll_connections(&pool, listen_fd);
+  rc = 0;
+end:
+  // Clients still connected are cut off, the workers finish the request
+  // they are on and exit.
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = true;
+  for (int i = 0; i < arrlen(pool.connections); i += 1) {
+    shutdown(pool.connections[i]->fd, SHUT_RDWR);
+  }
+  pthread_cond_broadcast(&pool.ready);
+  pthread_mutex_unlock(&pool.lock);
+  for (int i = 0; i < arrlen(threads); i += 1) {
+    pthread_join(threads[i], (void*)0);
+  }
+  for (int i = 0; i < arrlen(pool.jobs); i += 1) {
+    sdsfree(pool.jobs[i].line);
+  }
+  for (int i = 0; i < arrlen(pool.connections); i += 1) {
+    close_connection(pool.connections[i]);
+  }
+  arrfree(pool.jobs);
+  arrfree(pool.connections);
+  arrfree(threads);
+  for (int i = 0; i < 2; i += 1) {
+    if (pool.wake_fds[i] >= 0) {
+      close(pool.wake_fds[i]);
+    }
+  }
+  if (listen_fd >= 0) {
+    close(listen_fd);
+  }
+  if (bound) {
+    unlink(socket_path);
+  }
+  pthread_cond_destroy(&pool.ready);
+  pthread_mutex_destroy(&pool.lock);
+  END_ZONE;
+  return rc;
+}
+
+#ifdef UNIT_TEST_SERVER
+
+#include <sys/time.h>
+
+#include "test_deps/test_db.h"
+#include "test_deps/utest.h"
+
+typedef struct serve_args serve_args;
+struct serve_args {
+  char const* socket_path;
+  int num_workers;
+  int rc;
+};
+
+static void* serve_thread(void* arg) {
+  serve_args* args = (serve_args*)arg;
+  args->rc = serve(args->socket_path, args->num_workers);
+  return (void*)0;
+}
+
+// Retries until the server is listening, a response that never comes fails
+// the read instead of hanging the test.
+static int connect_client(char const* socket_path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  strcpy(address.sun_path, socket_path);
+  for (int attempt = 0; attempt < 500; attempt += 1) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+      struct timeval timeout = {.tv_sec = 10};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      return fd;
+    }
+    close(fd);
+    nanosleep(&(struct timespec){.tv_nsec = 10000000}, (void*)0);
+  }
+  return -1;
+}
+
+static sds read_response(int fd) {
+  sds line = sdsempty();
+  char c = 0;
+  while (read(fd, &c, 1) == 1 && c != '\n') {
+    line = sdscatlen(line, &c, 1);
+  }
+  return line;
+}
+
+static bool response_starts_with(sds response, char const* prefix) {
+  return strncmp(response, prefix, strlen(prefix)) == 0;
+}
+
+static sds handle(char const* line) {
+  return server_handle_request(line, strlen(line));
+}
+
+UTEST(server, query_is_evaluated) {
+  sds response = handle("{\"id\":1,\"query\":\"(+ 1 2)\"}");
+  ASSERT_TRUE(response_starts_with(
+      response, "{\"id\":1,\"ok\":true,\"value\":\"3\",\"elapsed_us\":"));
+  ASSERT_EQ(response[sdslen(response) - 1], '\n');
+  sdsfree(response);
+  response = handle("{\"id\":2,\"query\":\"(error \\\"boom\\\")\"}");
+  ASSERT_TRUE(response_starts_with(
+      response, "{\"id\":2,\"ok\":false,\"error\":\"boom\","));
+  sdsfree(response);
+}
+
+UTEST(server, query_must_be_a_string) {
+  sds response = handle("{\"id\":3}");
+  ASSERT_TRUE(response_starts_with(
+      response,
+      "{\"id\":3,\"ok\":false,\"error\":\"expected a query string\","));
+  sdsfree(response);
+  response = handle("{\"id\":4,\"query\":5}");
+  ASSERT_TRUE(response_starts_with(
+      response,
+      "{\"id\":4,\"ok\":false,\"error\":\"expected a query string\","));
+  sdsfree(response);
+}
+
+UTEST(server, id_is_echoed_as_sent) {
+  sds response = handle("{\"id\":\"a\\\"b\",\"query\":\"1\"}");
+  ASSERT_TRUE(
+      response_starts_with(response, "{\"id\":\"a\\\"b\",\"ok\":true,"));
+  sdsfree(response);
+  response = handle("{\"id\":12.5,\"query\":\"1\"}");
+  ASSERT_TRUE(response_starts_with(response, "{\"id\":12.5,\"ok\":true,"));
+  sdsfree(response);
+  response = handle("{\"query\":\"1\"}");
+  ASSERT_TRUE(response_starts_with(response, "{\"id\":null,\"ok\":true,"));
+  sdsfree(response);
+}
+
+UTEST(server, idle_connections_hold_no_worker) {
+  test_db db;
+  ASSERT_TRUE(test_db_enter(&db));
+  serve_args args = {.socket_path = "scribe.sock", .num_workers = 1};
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, (void*)0, serve_thread, &args), 0);
+  int first = connect_client(args.socket_path);
+  ASSERT_TRUE(first >= 0);
+  char const* request = "{\"id\":1,\"query\":\"(+ 1 2)\"}\n";
+  ASSERT_EQ(write_all(first, request, strlen(request)), 0);
+  sds response = read_response(first);
+  ASSERT_TRUE(response_starts_with(response, "{\"id\":1,\"ok\":true,"));
+  sdsfree(response);
+  // The first client stays connected and idle, a single worker still
+  // answers the second.
+  int second = connect_client(args.socket_path);
+  ASSERT_TRUE(second >= 0);
+  request = "{\"id\":2,\"query\":\"2\"}\n{\"id\":3,\"query\":\"3\"}\n";
+  ASSERT_EQ(write_all(second, request, strlen(request)), 0);
+  response = read_response(second);
+  ASSERT_TRUE(response_starts_with(response, "{\"id\":2,\"ok\":true,"));
+  sdsfree(response);
+  response = read_response(second);
+  ASSERT_TRUE(response_starts_with(response, "{\"id\":3,\"ok\":true,"));
+  sdsfree(response);
+  close(second);
+  request = "{\"id\":4,\"query\":\"4\"}\n";
+  ASSERT_EQ(write_all(first, request, strlen(request)), 0);
+  response = read_response(first);
+  ASSERT_TRUE(response_starts_with(response, "{\"id\":4,\"ok\":true,"));
+  sdsfree(response);
+  close(first);
+  pthread_kill(thread, SIGTERM);
+  pthread_join(thread, (void*)0);
+  ASSERT_EQ(args.rc, 0);
+  test_db_leave(&db);
+}
+
+UTEST_MAIN();
+
+#endif
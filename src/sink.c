@@ -0,0 +1,216 @@
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sds.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+INIT_TRACE;
+
+// Writes are staged in a page aligned buffer and handed to the kernel in
+// SINK_BUFFER_SIZE chunks, writes at least that large bypass the buffer.
+#define SINK_BUFFER_SIZE (1 << 16)
+#define SINK_BUFFER_ALIGN 4096
+
+static int write_all(int fd, char const* data, size_t len);
+static output_sink* sink_new(sink_kind kind);
+
+static int write_all(int fd, char const* data, size_t len) {
+  START_ZONE;
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("sink::write_all failed in writing: %s", strerror(errno));
+      END_ZONE;
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  END_ZONE;
+  return 0;
+}
+
+static output_sink* sink_new(sink_kind kind) {
+  output_sink* sink = calloc(1, sizeof(output_sink));
+  if (!sink) {
+    message_fatal("sink::sink_new out of memory");
+    return (void*)0;
+  }
+  sink->kind = kind;
+  sink->fd = -1;
+  return sink;
+}
+
+output_sink* sink_fd_init(int fd) {
+  START_ZONE;
+  output_sink* sink = sink_new(SINK_FD);
+  if (!sink) {
+    goto error_end;
+  }
+  sink->fd = fd;
+  if (posix_memalign((void**)&sink->buffer, SINK_BUFFER_ALIGN,
+                     SINK_BUFFER_SIZE) != 0) {
+    message_fatal("sink::sink_fd_init failed in allocating buffer");
+    goto error_end;
+  }
+  END_ZONE;
+  return sink;
+error_end:
+  free(sink);
+  END_ZONE;
+  return (void*)0;
+}
+
+output_sink* sink_file_init(char const* path) {
+  START_ZONE;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  if (fd < 0) {
+    log_error("sink::sink_file_init failed in opening %s: %s", path,
+              strerror(errno));
+    END_ZONE;
+    return (void*)0;
+  }
+  output_sink* sink = sink_fd_init(fd);
+  if (!sink) {
+    close(fd);
+    END_ZONE;
+    return (void*)0;
+  }
+  sink->owns_fd = true;
+  END_ZONE;
+  return sink;
+}
+
+output_sink* sink_sds_init(void) {
+  START_ZONE;
+  output_sink* sink = sink_new(SINK_SDS);
+  if (sink) {
+    sink->str = sdsempty();
+  }
+  END_ZONE;
+  return sink;
+}
+
+int sink_write(output_sink* sink, char const* data, size_t len) {
+  START_ZONE;
+  if (sink->kind == SINK_SDS) {
+    sds str = sdscatlen(sink->str, data, len);
+    if (!str) {
+      message_fatal("sink::sink_write failed in appending to SDS string");
+      END_ZONE;
+      return -1;
+    }
+    sink->str = str;
+    sink->written += len;
+    END_ZONE;
+    return 0;
+  }
+  if (sink->buffered + len > SINK_BUFFER_SIZE) {
+    if (sink->buffered > 0) {
+      size_t fill = SINK_BUFFER_SIZE - sink->buffered;
+      memcpy(sink->buffer + sink->buffered, data, fill);
+      if (write_all(sink->fd, sink->buffer, SINK_BUFFER_SIZE) != 0) {
+        END_ZONE;
+        return -1;
+      }
+      data += fill;
+      len -= fill;
+      sink->written += fill;
+      sink->buffered = 0;
+    }
+    size_t direct = len - (len % SINK_BUFFER_SIZE);
+    if (direct > 0) {
+      if (write_all(sink->fd, data, direct) != 0) {
+        END_ZONE;
+        return -1;
+      }
+      data += direct;
+      len -= direct;
+      sink->written += direct;
+    }
+  }
+  memcpy(sink->buffer + sink->buffered, data, len);
+  sink->buffered += len;
+  sink->written += len;
+  END_ZONE;
+  return 0;
+}
+
+int sink_flush(output_sink* sink) {
+  START_ZONE;
+  if (sink->kind == SINK_SDS || sink->buffered == 0) {
+    END_ZONE;
+    return 0;
+  }
+  int rc = write_all(sink->fd, sink->buffer, sink->buffered);
+  sink->buffered = 0;
+  END_ZONE;
+  return rc;
+}
+
+int sink_terminate(output_sink* sink) {
+  START_ZONE;
+  if (!sink) {
+    END_ZONE;
+    return 0;
+  }
+  int rc = sink_flush(sink);
+  if (sink->owns_fd && close(sink->fd) != 0) {
+    message_error("sink::sink_terminate failed in closing file");
+    rc = -1;
+  }
+  free(sink->buffer);
+  sdsfree(sink->str);
+  free(sink);
+  END_ZONE;
+  return rc;
+}
+
+#ifdef UNIT_TEST_SINK
+
+#include <stdio.h>
+
+#include "test_deps/utest.h"
+
+UTEST(sink, sds_sink) {
+  output_sink* sink = sink_sds_init();
+  ASSERT_EQ(sink_write(sink, "100% ", 5), 0);
+  ASSERT_EQ(sink_write(sink, "verbatim", 8), 0);
+  ASSERT_STREQ(sink->str, "100% verbatim");
+  ASSERT_EQ(sink->written, 13u);
+  sink_terminate(sink);
+}
+
+UTEST(sink, file_sink_large_writes) {
+  char path[] = "/tmp/scribe_sink_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(fd, -1);
+  output_sink* sink = sink_fd_init(fd);
+  sds chunk = sdsgrowzero(sdsempty(), 3 * SINK_BUFFER_SIZE + 17);
+  memset(chunk, 'x', sdslen(chunk));
+  ASSERT_EQ(sink_write(sink, "head", 4), 0);
+  ASSERT_EQ(sink_write(sink, chunk, sdslen(chunk)), 0);
+  ASSERT_EQ(sink_write(sink, "tail", 4), 0);
+  ASSERT_EQ(sink_flush(sink), 0);
+  ASSERT_EQ((size_t)lseek(fd, 0, SEEK_END), sdslen(chunk) + 8);
+  sink_terminate(sink);
+  close(fd);
+  unlink(path);
+  sdsfree(chunk);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -1,12 +1,17 @@
 #include "substitute.h"
 
+#include <deps/stb_ds.h>
 #include <janet.h>
 #include <md4c.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "arena.h"
 #include "db.h"
+#include "hash.h"
 #include "lisp.h"
+#include "profile.h"
 #include "query.h"
 #include "trace.h"
 
@@ -16,63 +21,32 @@ static int render_verbatim(MD_CHAR* text, md_substitute_data* data);
 static int render_verbatim_sds(sds text, md_substitute_data* data);
 static int render_verbatim_len(MD_CHAR* text, MD_SIZE size,
                                md_substitute_data* data);
-static int render_h_block(MD_BLOCK_H_DETAIL* detail, md_substitute_data* data);
-static void render_open_ol_block(MD_BLOCK_OL_DETAIL* detail,
-                                 md_substitute_data* data);
-static void render_closed_ol_block(MD_BLOCK_OL_DETAIL* detail,
-                                   md_substitute_data* data);
-static int render_li_block(MD_BLOCK_LI_DETAIL* detail,
-                           md_substitute_data* data);
-static int render_open_a_span(MD_SPAN_A_DETAIL* detail,
-                              md_substitute_data* data);
-static int render_closed_a_span(MD_SPAN_A_DETAIL* detail,
-                                md_substitute_data* data);
-static int render_open_img_span(MD_SPAN_IMG_DETAIL* detail,
-                                md_substitute_data* data);
-static int render_closed_img_span(MD_SPAN_IMG_DETAIL* detail,
-                                  md_substitute_data* data);
-static int render_block_quote(md_substitute_data* data);
-static sds code_block_lang(MD_BLOCK_CODE_DETAIL* detail);
-static int accumulate_code_text(MD_CHAR* text, MD_SIZE size,
-                                md_substitute_data* data);
-static int process_scribe_code_block(MD_BLOCK_CODE_DETAIL* detail,
-                                     md_substitute_data* data);
-static int process_code_block(MD_BLOCK_CODE_DETAIL* detail,
-                              md_substitute_data* data);
-static int enter_block_callback(MD_BLOCKTYPE type, void* detail,
-                                void* userdata);
-static int leave_block_callback(MD_BLOCKTYPE type, void* detail,
-                                void* userdata);
-static int enter_span_callback(MD_SPANTYPE type, void* detail, void* userdata);
-static int leave_span_callback(MD_SPANTYPE type, void* detail, void* userdata);
-static int text_callback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size,
-                         void* userdata);
-static void debug_log_callback(const char* msg, void* userdata);
+static int persist_query_result(md_substitute_data* data, sds result);
+static int process_scribe_code_block(md_substitute_data* data);
+static MD_SIZE fence_length(const MD_CHAR* line, MD_SIZE size, MD_CHAR* fence);
+static bool is_closing_fence(const MD_CHAR* line, MD_SIZE size,
+                             MD_CHAR fence, MD_SIZE length);
+static bool is_scribe_info(const MD_CHAR* info, MD_SIZE size);
 
 static int render_verbatim(MD_CHAR* text, md_substitute_data* data) {
   START_ZONE;
-  sds str = sdscat(data->output, text);
-  if (!str) {
-    message_fatal(
-        "substitute::render_verbatim failed in appending to SDS string\n");
+  if (sink_write(data->output, text, strlen(text)) != 0) {
+    message_fatal("substitute::render_verbatim failed in writing output\n");
     END_ZONE;
     return -1;
   }
-  data->output = str;
   END_ZONE;
   return 0;
 }
 
 static int render_verbatim_sds(sds text, md_substitute_data* data) {
   START_ZONE;
-  sds str = sdscatsds(data->output, text);
-  if (!str) {
+  if (sink_write(data->output, text, sdslen(text)) != 0) {
     message_fatal(
-        "substitute::render_verbatim_sds failed in appending to SDS string\n");
+        "substitute::render_verbatim_sds failed in writing output\n");
     END_ZONE;
     return -1;
   }
-  data->output = str;
   END_ZONE;
   return 0;
 }
@@ -80,537 +54,313 @@ static int render_verbatim_sds(sds text, md_substitute_data* data) {
 static int render_verbatim_len(MD_CHAR* text, MD_SIZE size,
                                md_substitute_data* data) {
   START_ZONE;
-  sds str = sdscatlen(data->output, text, size);
-  if (!str) {
+  if (sink_write(data->output, text, size) != 0) {
     message_fatal(
-        "substitute::render_verbatim_len failed in appending to SDS string\n");
+        "substitute::render_verbatim_len failed in writing output\n");
     END_ZONE;
     return -1;
   }
-  data->output = str;
   END_ZONE;
   return 0;
 }
 
-static int render_h_block(MD_BLOCK_H_DETAIL* detail, md_substitute_data* data) {
+static int persist_query_result(md_substitute_data* data, sds result) {
   START_ZONE;
-  sds to_render = sdsempty();
-  for (size_t i = 0; i < detail->level; i += 1) {
-    to_render = sdscat(to_render, "#");
-  }
-  to_render = sdscat(to_render, " ");
-  if (!to_render) {
+  int rc = 0;
+  MDB_env* db_env = (void*)0;
+  MDB_txn* txn = (void*)0;
+  sds key = query_key(data->code_text, sdslen(data->code_text));
+  sds sub_key = sdsempty();
+  sds result_hash = hash_to_hex(hash_bytes(result, sdslen(result)));
+  db_env = db_env_init("./scribe_db", false, 100);
+  if (!db_env) {
     message_fatal(
-        "substitute::render_h_block failed in appending to SDS string\n");
-    sdsfree(to_render);
-    END_ZONE;
-    return -1;
+        "substitute::persist_query_result failed in creating db environment");
+    goto error_end;
   }
-  int rc = render_verbatim_sds(to_render, data);
-  sdsfree(to_render);
-  END_ZONE;
-  return rc;
-}
-
-static void render_open_ol_block(MD_BLOCK_OL_DETAIL* detail,
-                                 md_substitute_data* data) {
-  START_ZONE;
-  data->is_ordered_list = true;
-  data->current_index = detail->start;
-  END_ZONE;
-}
-
-static void render_closed_ol_block(MD_BLOCK_OL_DETAIL* detail,
-                                   md_substitute_data* data) {
-  START_ZONE;
-  data->is_ordered_list = false;
-  data->current_index = 0;
-  END_ZONE;
-}
-
-static int render_li_block(MD_BLOCK_LI_DETAIL* detail,
-                           md_substitute_data* data) {
-  START_ZONE;
-  int rc;
-  sds to_render = sdsempty();
-  if (data->is_ordered_list) {
-    char current_index_str[1024];
-    snprintf(current_index_str, 1024, "%u", data->current_index);
-    to_render = sdscatfmt(to_render, "%s. ", current_index_str);
-    if (!to_render) {
-      message_fatal(
-          "substitute::render_li_block failed in appending to SDS string\n");
-      goto error_end;
-    }
-    rc = render_verbatim_sds(to_render, data);
-    data->current_index += 1;
-  } else {
-    rc = render_verbatim("- ", data);
+  txn = db_txn_init(db_env, false);
+  if (!txn) {
+    message_fatal(
+        "substitute::persist_query_result failed in creating transaction");
+    goto error_end;
   }
-  sdsfree(to_render);
-  END_ZONE;
-  return rc;
-error_end:
-  sdsfree(to_render);
-  END_ZONE;
-  return -1;
-}
-
-static int render_open_a_span(MD_SPAN_A_DETAIL* detail,
-                              md_substitute_data* data) {
-  START_ZONE;
-  int rc = render_verbatim("[", data);
-  END_ZONE;
-  return rc;
-}
-
-static int render_closed_a_span(MD_SPAN_A_DETAIL* detail,
-                                md_substitute_data* data) {
-  START_ZONE;
-  int rc = render_verbatim("](", data);
-  if (rc == -1) {
+  MDB_dbi db_handle = db_get_handle(txn, "query", true);
+  if (db_handle == 0) {
+    message_fatal(
+        "substitute::persist_query_result failed in creating db handle for "
+        "name: query");
     goto error_end;
   }
-  rc = render_verbatim_len(detail->href.text, detail->href.size, data);
-  if (rc == -1) {
+  int db_rc = db_interactive_put(txn, db_handle, key, result);
+  if (db_rc < 0) {
+    log_fatal("substitute::persist_query_result failed in putting key: %s",
+              key);
     goto error_end;
   }
-  if (detail->title.text) {
-    rc = render_verbatim(" \"", data);
-    if (rc == -1) {
-      goto error_end;
-    }
-    rc = render_verbatim_len(detail->title.text, detail->title.size, data);
-    if (rc == -1) {
-      goto error_end;
-    }
-    rc = render_verbatim("\"", data);
-    if (rc == -1) {
-      goto error_end;
-    }
+  if (db_rc == 2) {
+    log_fatal(
+        "substitute::persist_query_result db drift detected, fix to "
+        "continue");
+    goto error_end;
   }
-  rc = render_verbatim(")", data);
-  END_ZONE;
-  return rc;
-error_end:
-  END_ZONE;
-  return -1;
-}
-
-static int render_open_img_span(MD_SPAN_IMG_DETAIL* detail,
-                                md_substitute_data* data) {
-  START_ZONE;
-  int rc = render_verbatim("![", data);
-  END_ZONE;
-  return rc;
-}
-
-static int render_closed_img_span(MD_SPAN_IMG_DETAIL* detail,
-                                  md_substitute_data* data) {
-  START_ZONE;
-  int rc = render_verbatim("](", data);
-  if (rc == -1) {
+  sub_key = sdscatfmt(sub_key, "%S::%s", key, "code");
+  rc = db_put(txn, db_handle, sub_key, data->code_text);
+  if (rc != 0 && rc != MDB_KEYEXIST) {
+    log_fatal("substitute::persist_query_result failed in putting key: %s",
+              sub_key);
     goto error_end;
   }
-  rc = render_verbatim_len(detail->src.text, detail->src.size, data);
-  if (rc == -1) {
+  sdsclear(sub_key);
+  sub_key = sdscatfmt(sub_key, "%S::%s", key, "result_hash");
+  rc = db_replace(txn, db_handle, sub_key, result_hash);
+  if (rc != 0) {
+    log_fatal("substitute::persist_query_result failed in putting key: %s",
+              sub_key);
     goto error_end;
   }
-  if (detail->title.text) {
-    rc = render_verbatim(" \"", data);
-    if (rc == -1) {
+  if (data->doc_path && data->block_line != 0) {
+    MDB_dbi locations_handle = db_get_handle(txn, "query_locations", true);
+    if (locations_handle == 0) {
+      message_fatal(
+          "substitute::persist_query_result failed in creating db handle for "
+          "name: query_locations");
       goto error_end;
     }
-    rc = render_verbatim_len(detail->title.text, detail->title.size, data);
-    if (rc == -1) {
-      goto error_end;
-    }
-    rc = render_verbatim("\"", data);
-    if (rc == -1) {
+    sdsclear(sub_key);
+    sub_key = sdscatfmt(sub_key, "%s:%u", data->doc_path, data->block_line);
+    rc = db_replace(txn, locations_handle, sub_key, key);
+    if (rc != 0) {
+      log_fatal("substitute::persist_query_result failed in putting key: %s",
+                sub_key);
       goto error_end;
     }
   }
-  rc = render_verbatim(")", data);
+  rc = db_txn_terminate(txn, true);
+  txn = (void*)0;
+  if (rc != 0) {
+    goto error_end;
+  }
+  db_env_terminate(db_env);
+  sdsfree(key);
+  sdsfree(sub_key);
+  sdsfree(result_hash);
   END_ZONE;
-  return rc;
+  return 0;
 error_end:
+  db_txn_terminate(txn, false);
+  db_env_terminate(db_env);
+  sdsfree(key);
+  sdsfree(sub_key);
+  sdsfree(result_hash);
   END_ZONE;
   return -1;
 }
 
-static int render_block_quote(md_substitute_data* data) {
-  START_ZONE;
-  int rc = render_verbatim(">", data);
-  END_ZONE;
-  return rc;
-}
-
-static sds code_block_lang(MD_BLOCK_CODE_DETAIL* detail) {
-  START_ZONE;
-  size_t initlen = (size_t)(detail->lang.size);
-  sds lang = sdsnewlen(detail->lang.text, initlen);
-  END_ZONE;
-  return lang;
-}
-
-static int accumulate_code_text(MD_CHAR* text, MD_SIZE size,
-                                md_substitute_data* data) {
-  START_ZONE;
-  sds str = sdscatlen(data->code_text, text, size);
-  if (!str) {
-    message_fatal(
-        "substitute::accumulate_code_text failed in appending to SDS string\n");
-    END_ZONE;
-    return -1;
-  }
-  data->code_text = str;
-  END_ZONE;
-  return 0;
-}
-
-static int process_scribe_code_block(MD_BLOCK_CODE_DETAIL* detail,
-                                     md_substitute_data* data) {
+static int process_scribe_code_block(md_substitute_data* data) {
   START_ZONE;
-  MDB_env* db_env = db_env_init("./scribe_db", false, 100);
-  if (!db_env) {
-    message_fatal(
-        "substitute::process_scribe_code_block failed in creating db "
-        "environment");
-    goto error_end;
-  }
-  MDB_txn* txn = db_txn_init(db_env, false);
-  if (!txn) {
-    message_fatal(
-        "substitute::process_scribe_code_block failed in creating transaction");
-    goto error_end;
-  }
-  MDB_dbi db_handle = db_get_handle(txn, "query", true);
-  if (db_handle == 0) {
+  int rc = 0;
+  sds result = (void*)0;
+  sds lang = get_language();
+  if (!lang) {
     message_fatal(
-        "substitute::process_scribe_code_block failed in creating db handle "
-        "for name: query");
+        "substitute::process_scribe_code_block failed in getting language");
     goto error_end;
   }
-  sds lang = get_language();
-  JanetTable* env = lisp_init_env();
-  register_modules(env);
-  Janet out = {0};
-  int rc = lisp_execute_script(env, data->code_text, &out);
-  JanetString jstr = janet_getstring(&out, 0);
-  if (rc != 0) {
+  result = evaluate_query(data->code_text);
+  if (!result) {
     message_fatal(
         "substitute::process_scribe_code_block failed in code execution");
-    goto end;
-  }
-  int db_rc = db_interactive_put(txn, db_handle, data->code_text, jstr);
-  if (db_rc < 0) {
-    log_fatal("substitute::process_scribe_code_block failed in putting key: %s",
-              data->code_text);
     goto error_end;
   }
-  if (db_rc == 2) {
-    log_fatal(
-        "substitute::process_scribe_code_block db drift detected, fix to "
-        "continue");
-    rc = -1;
-    goto end;
+  rc = persist_query_result(data, result);
+  if (rc == -1) {
+    goto error_end;
   }
   rc = render_verbatim("```", data);
   if (rc == -1) {
-    goto end;
+    goto error_end;
   }
   rc = render_verbatim_sds(lang, data);
   if (rc == -1) {
-    goto end;
+    goto error_end;
   }
   rc = render_verbatim("\n", data);
   if (rc == -1) {
-    goto end;
+    goto error_end;
   }
-  rc = render_verbatim(jstr, data);
+  rc = render_verbatim_sds(result, data);
   if (rc == -1) {
-    goto end;
+    goto error_end;
   }
   rc = render_verbatim("\n```", data);
   if (rc == -1) {
-    goto end;
+    goto error_end;
   }
-error_end:
+  sdsfree(lang);
+  sdsfree(result);
   END_ZONE;
-  return -1;
-end:
+  return 0;
+error_end:
   sdsfree(lang);
-  lisp_terminate();
+  sdsfree(result);
   END_ZONE;
-  return rc;
+  return -1;
 }
 
-static int process_code_block(MD_BLOCK_CODE_DETAIL* detail,
-                              md_substitute_data* data) {
-  START_ZONE;
-  int rc = 0;
-  sds lang = code_block_lang(detail);
-  sds scribe_lang = sdsnew("scribe");
-  if (sdscmp(scribe_lang, lang) == 0) {
-    rc = process_scribe_code_block(detail, data);
-    goto end;
+// Returns the length of the fence opening this line, or 0 if it is not a
+// fence. Like CommonMark, at most three spaces of indentation are allowed.
+static MD_SIZE fence_length(const MD_CHAR* line, MD_SIZE size, MD_CHAR* fence) {
+  MD_SIZE i = 0;
+  while (i < size && i < 3 && line[i] == ' ') {
+    i += 1;
   }
-  rc = render_verbatim("```", data);
-  if (rc == -1) {
-    goto end;
-  }
-  rc = render_verbatim_sds(lang, data);
-  if (rc == -1) {
-    goto end;
+  if (i == size || (line[i] != '`' && line[i] != '~')) {
+    return 0;
   }
-  rc = render_verbatim("\n", data);
-  if (rc == -1) {
-    goto end;
+  MD_CHAR c = line[i];
+  MD_SIZE start = i;
+  while (i < size && line[i] == c) {
+    i += 1;
   }
-  rc = render_verbatim_sds(data->code_text, data);
-  if (rc == -1) {
-    goto end;
+  if (i - start < 3) {
+    return 0;
   }
-  rc = render_verbatim("```\n", data);
-  if (rc == -1) {
-    goto end;
+  if (c == '`' && memchr(line + i, '`', size - i)) {
+    return 0;
   }
-end:
-  sdsfree(lang);
-  sdsfree(scribe_lang);
-  END_ZONE;
-  return rc;
+  *fence = c;
+  return i - start;
 }
 
-static int enter_block_callback(MD_BLOCKTYPE type, void* detail,
-                                void* userdata) {
-  md_substitute_data* d = (md_substitute_data*)userdata;
-  switch (type) {
-    case MD_BLOCK_HTML:  // noop
-      break;
-    case MD_BLOCK_DOC:  // noop
-      break;
-    case MD_BLOCK_QUOTE:
-      if (render_block_quote(d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_UL:  // noop
-      break;
-    case MD_BLOCK_OL:
-      render_open_ol_block((MD_BLOCK_OL_DETAIL*)detail, d);
-      break;
-    case MD_BLOCK_LI:
-      if (render_li_block((MD_BLOCK_LI_DETAIL*)detail, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_HR:  // noop
-      break;
-    case MD_BLOCK_H:
-      if (render_h_block((MD_BLOCK_H_DETAIL*)detail, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_CODE:
-      sdsclear(d->code_text);
-      break;
-    case MD_BLOCK_P:  // noop
-      break;
-    case MD_BLOCK_TABLE:  // noop
-      break;
-    case MD_BLOCK_THEAD:  // noop
-      break;
-    case MD_BLOCK_TBODY:  // noop
-      break;
-    case MD_BLOCK_TR:  // noop
-      break;
-    case MD_BLOCK_TH:  // noop
-      break;
-    case MD_BLOCK_TD:  // noop
-      break;
+static bool is_closing_fence(const MD_CHAR* line, MD_SIZE size,
+                             MD_CHAR fence, MD_SIZE length) {
+  MD_CHAR c = 0;
+  MD_SIZE closing_length = fence_length(line, size, &c);
+  if (closing_length < length || c != fence) {
+    return false;
   }
-  return 0;
-}
-
-static int leave_block_callback(MD_BLOCKTYPE type, void* detail,
-                                void* userdata) {
-  md_substitute_data* d = (md_substitute_data*)userdata;
-  switch (type) {
-    case MD_BLOCK_HTML:
-      if (render_verbatim("\n", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_DOC:  // noop
-      break;
-    case MD_BLOCK_QUOTE:
-      if (render_verbatim("\n", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_UL:
-      if (render_verbatim("\n", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_OL:
-      render_closed_ol_block((MD_BLOCK_OL_DETAIL*)detail, d);
-      break;
-    case MD_BLOCK_LI:
-      if (render_verbatim("\n", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_HR:  // noop
-      break;
-    case MD_BLOCK_H:
-      if (render_verbatim("\n\n", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_CODE:
-      if (process_code_block((MD_BLOCK_CODE_DETAIL*)detail, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_P:
-      if (render_verbatim("\n\n", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_BLOCK_TABLE:  // noop
-      break;
-    case MD_BLOCK_THEAD:  // noop
-      break;
-    case MD_BLOCK_TBODY:  // noop
-      break;
-    case MD_BLOCK_TR:  // noop
-      break;
-    case MD_BLOCK_TH:  // noop
-      break;
-    case MD_BLOCK_TD:  // noop
-      break;
+  MD_SIZE i = 0;
+  while (line[i] == ' ') {
+    i += 1;
   }
-  return 0;
-}
-
-static int enter_span_callback(MD_SPANTYPE type, void* detail, void* userdata) {
-  md_substitute_data* d = (md_substitute_data*)userdata;
-  switch (type) {
-    case MD_SPAN_EM:
-      if (render_verbatim("*", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_STRONG:
-      if (render_verbatim("**", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_A:
-      if (render_open_a_span((MD_SPAN_A_DETAIL*)detail, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_IMG:
-      if (render_open_img_span((MD_SPAN_IMG_DETAIL*)detail, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_CODE:
-      break;
-    case MD_SPAN_DEL:  // noop
-      break;
-    case MD_SPAN_LATEXMATH:  // noop
-      break;
-    case MD_SPAN_LATEXMATH_DISPLAY:  // noop
-      break;
-    case MD_SPAN_WIKILINK:  // noop
-      break;
-    case MD_SPAN_U:  // noop
-      break;
+  for (i += closing_length; i < size; i += 1) {
+    if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+      return false;
+    }
   }
-  return 0;
+  return true;
 }
 
-static int leave_span_callback(MD_SPANTYPE type, void* detail, void* userdata) {
-  md_substitute_data* d = (md_substitute_data*)userdata;
-  switch (type) {
-    case MD_SPAN_EM:
-      if (render_verbatim("*", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_STRONG:
-      if (render_verbatim("**", d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_A:
-      if (render_closed_a_span((MD_SPAN_A_DETAIL*)detail, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_IMG:
-      if (render_closed_img_span((MD_SPAN_IMG_DETAIL*)detail, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_SPAN_CODE:
-      break;
-    case MD_SPAN_DEL:  // noop
-      break;
-    case MD_SPAN_LATEXMATH:  // noop
-      break;
-    case MD_SPAN_LATEXMATH_DISPLAY:  // noop
-      break;
-    case MD_SPAN_WIKILINK:  // noop
-      break;
-    case MD_SPAN_U:  // noop
-      break;
+static bool is_scribe_info(const MD_CHAR* info, MD_SIZE size) {
+  MD_SIZE i = 0;
+  while (i < size && (info[i] == ' ' || info[i] == '\t')) {
+    i += 1;
   }
-  return 0;
+  MD_SIZE start = i;
+  while (i < size && info[i] != ' ' && info[i] != '\t' && info[i] != '\r') {
+    i += 1;
+  }
+  return (i - start) == 6 && memcmp(info + start, "scribe", 6) == 0;
 }
 
-static int text_callback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size,
-                         void* userdata) {
-  md_substitute_data* d = (md_substitute_data*)userdata;
-  switch (type) {
-    case MD_TEXT_CODE:
-      if (accumulate_code_text(text, size, d) == -1) {
-        return -1;
-      }
-      break;
-    case MD_TEXT_BR:
-      if (render_verbatim("  \n", d) == -1) {
-        return -1;
+scribe_block* find_scribe_blocks(const MD_CHAR* input, MD_SIZE input_size) {
+  START_ZONE;
+  scribe_block* blocks = (void*)0;
+  bool in_fence = false;
+  bool in_scribe = false;
+  MD_CHAR fence = 0;
+  MD_SIZE length = 0;
+  scribe_block block = {0};
+  unsigned int line_num = 0;
+  MD_OFFSET offset = 0;
+  while (offset < input_size) {
+    line_num += 1;
+    const MD_CHAR* line = input + offset;
+    const MD_CHAR* eol = memchr(line, '\n', input_size - offset);
+    MD_SIZE size = eol ? (MD_SIZE)(eol - line) : input_size - offset;
+    MD_OFFSET next = offset + size + (eol ? 1 : 0);
+    if (!in_fence) {
+      MD_SIZE l = fence_length(line, size, &fence);
+      if (l != 0) {
+        in_fence = true;
+        length = l;
+        MD_SIZE info = 0;
+        while (line[info] == ' ') {
+          info += 1;
+        }
+        info += l;
+        in_scribe = is_scribe_info(line + info, size - info);
+        block.start = offset;
+        block.code_start = next;
+        block.line = line_num;
       }
-      break;
-    default:
-      if (render_verbatim_len(text, size, d) == -1) {
-        return -1;
+    } else if (is_closing_fence(line, size, fence, length)) {
+      if (in_scribe) {
+        block.code_size = offset - block.code_start;
+        block.end = offset + size;
+        arrput(blocks, block);
       }
-      break;
+      in_fence = false;
+      in_scribe = false;
+    }
+    offset = next;
   }
-  return 0;
+  if (in_scribe) {
+    block.code_size = input_size - block.code_start;
+    block.end = input_size;
+    arrput(blocks, block);
+  }
+  END_ZONE;
+  return blocks;
 }
 
-static void debug_log_callback(const char* msg, void* userdata) {}
-
-int md_substitute(const MD_CHAR* input, MD_SIZE input_size,
-                  md_substitute_data* data) {
-  MD_PARSER parser = {0,
-                      0,
-                      enter_block_callback,
-                      leave_block_callback,
-                      enter_span_callback,
-                      leave_span_callback,
-                      text_callback,
-                      debug_log_callback,
-                      (void*)0};
-
-  return md_parse(input, input_size, &parser, data);
+int md_splice(const MD_CHAR* input, MD_SIZE input_size,
+              md_substitute_data* data) {
+  START_ZONE;
+  char const* outer_label = profile_enter("render");
+  int rc = 0;
+  MD_OFFSET copied = 0;
+  scribe_block* blocks = find_scribe_blocks(input, input_size);
+  for (int i = 0; i < arrlen(blocks); i += 1) {
+    scribe_block block = blocks[i];
+    rc = render_verbatim_len(input + copied, block.start - copied, data);
+    if (rc == -1) {
+      goto end;
+    }
+    sds code_text =
+        sdscpylen(data->code_text, input + block.code_start, block.code_size);
+    if (!code_text) {
+      message_fatal("substitute::md_splice failed in copying code text");
+      rc = -1;
+      goto end;
+    }
+    data->code_text = code_text;
+    data->block_line = block.line;
+    rc = sink_flush(data->output);
+    if (rc == -1) {
+      goto end;
+    }
+    // Scratch memory of the block, the query included, is released in one
+    // step when the block is done.
+    arena_mark scratch = scratch_begin();
+    profile_block_begin(data->doc_path, block.line);
+    rc = process_scribe_code_block(data);
+    profile_block_end();
+    scratch_end(scratch);
+    if (rc == -1) {
+      log_fatal("substitute::md_splice failed in block at line: %u",
+                block.line);
+      goto end;
+    }
+    copied = block.end;
+  }
+  data->block_line = 0;
+  rc = render_verbatim_len(input + copied, input_size - copied, data);
+end:
+  arrfree(blocks);
+  profile_leave(outer_label);
+  END_ZONE;
+  return rc;
 }
 
 #ifdef UNIT_TEST_SUBSTITUTE
@@ -619,19 +369,23 @@ int md_substitute(const MD_CHAR* input, MD_SIZE input_size,
 
 #include "test_deps/utest.h"
 
-UTEST(substitute, sample_test) {
-  md_substitute_data d = {.code_text = sdsempty(),
-                          .output = sdsempty(),
-                          .is_ordered_list = false,
-                          .current_index = 0};
+UTEST(substitute, find_scribe_blocks) {
   char const* input =
-      "this is a code block.\n\n```scribe\n(core/list-paths)\n```";
-  md_substitute(input, strlen(input), &d);
-  log_trace("input --\n%s", input);
-  log_trace("output --\n%s", d.output);
-  sdsfree(d.code_text);
-  sdsfree(d.output);
-  ASSERT_TRUE(true);
+      "# title\n\n```scribe\n(core/list-paths)\n```\n\n"
+      "````md\n```scribe\n(ignored)\n```\n````\n"
+      "  ~~~ scribe extra\n(core/list-files \"./src\")\n~~~~\ntail";
+  scribe_block* blocks = find_scribe_blocks(input, strlen(input));
+  ASSERT_EQ(arrlen(blocks), 2);
+  ASSERT_EQ(blocks[0].line, 3u);
+  ASSERT_EQ(blocks[0].start, 9u);
+  ASSERT_STRNEQ(input + blocks[0].code_start, "(core/list-paths)\n",
+                blocks[0].code_size);
+  ASSERT_STRNEQ(input + blocks[0].end, "\n\n````md", 8);
+  ASSERT_EQ(blocks[1].line, 12u);
+  ASSERT_STRNEQ(input + blocks[1].code_start,
+                "(core/list-files \"./src\")\n", blocks[1].code_size);
+  ASSERT_STREQ(input + blocks[1].end, "\ntail");
+  arrfree(blocks);
 }
 
 UTEST_MAIN();
@@ -0,0 +1,328 @@
+#include "syntax_tree.h"
+
+#include <janet.h>
+#include <sds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tree_sitter/api.h>
+
+#include "budget.h"
+#include "cache.h"
+#include "lisp.h"
+#include "profile.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// A parsed source as seen from Janet. The tree is a copy of whatever the
+// cache handed out, so it outlives the session entries it came from, and
+// the source is kept next to it so nodes can slice their text.
+typedef struct syntax_tree syntax_tree;
+struct syntax_tree {
+  TSTree* tree;
+  sds src;
+};
+
+// Nodes point into their tree and keep it alive through the gc mark.
+typedef struct syntax_node syntax_node;
+struct syntax_node {
+  TSNode node;
+  syntax_tree* tree;
+};
+
+static int syntax_tree_gc(void* data, size_t len);
+static void syntax_tree_tostring(void* p, JanetBuffer* buffer);
+static int syntax_node_mark(void* data, size_t len);
+static int syntax_node_get(void* data, Janet key, Janet* out);
+static void syntax_node_tostring(void* p, JanetBuffer* buffer);
+static int syntax_node_compare(void* lhs, void* rhs);
+static int32_t syntax_node_hash(void* p, size_t len);
+static Janet wrap_node(syntax_tree* tree, TSNode node);
+
+static const JanetAbstractType syntax_tree_type = {
+    "scribe/tree", syntax_tree_gc, (void*)0, (void*)0,
+    (void*)0,      (void*)0,       (void*)0, syntax_tree_tostring,
+    JANET_ATEND_TOSTRING};
+
+static const JanetAbstractType syntax_node_type = {"scribe/node",
+                                                   (void*)0,
+                                                   syntax_node_mark,
+                                                   syntax_node_get,
+                                                   (void*)0,
+                                                   (void*)0,
+                                                   (void*)0,
+                                                   syntax_node_tostring,
+                                                   syntax_node_compare,
+                                                   syntax_node_hash,
+                                                   JANET_ATEND_HASH};
+
+static int syntax_tree_gc(void* data, size_t len) {
+  (void)len;
+  syntax_tree* tree = (syntax_tree*)data;
+  ts_tree_delete(tree->tree);
+  sdsfree(tree->src);
+  return 0;
+}
+
+static void syntax_tree_tostring(void* p, JanetBuffer* buffer) {
+  syntax_tree* tree = (syntax_tree*)p;
+  janet_buffer_push_cstring(buffer,
+                            ts_node_type(ts_tree_root_node(tree->tree)));
+}
+
+static int syntax_node_mark(void* data, size_t len) {
+  (void)len;
+  syntax_node* node = (syntax_node*)data;
+  janet_mark(janet_wrap_abstract(node->tree));
+  return 0;
+}
+
+static int syntax_node_get(void* data, Janet key, Janet* out) {
+  syntax_node* node = (syntax_node*)data;
+  if (!janet_checktype(key, JANET_KEYWORD)) {
+    return 0;
+  }
+  JanetKeyword field = janet_unwrap_keyword(key);
+  if (janet_cstrcmp(field, "type") == 0) {
+    *out = janet_cstringv(ts_node_type(node->node));
+  } else if (janet_cstrcmp(field, "named") == 0) {
+    *out = janet_wrap_boolean(ts_node_is_named(node->node));
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static void syntax_node_tostring(void* p, JanetBuffer* buffer) {
+  syntax_node* node = (syntax_node*)p;
+  janet_formatb(buffer, "%s %d-%d", ts_node_type(node->node),
+                ts_node_start_byte(node->node), ts_node_end_byte(node->node));
+}
+
+// Two wrappers are equal when they wrap the same node of the same tree, so
+// (= node (node/parent child)) holds across calls.
+static int syntax_node_compare(void* lhs, void* rhs) {
+  syntax_node* a = (syntax_node*)lhs;
+  syntax_node* b = (syntax_node*)rhs;
+  if (a->tree != b->tree) {
+    return (uintptr_t)a->tree < (uintptr_t)b->tree ? -1 : 1;
+  }
+  if (ts_node_eq(a->node, b->node)) {
+    return 0;
+  }
+  uint32_t a_start = ts_node_start_byte(a->node);
+  uint32_t b_start = ts_node_start_byte(b->node);
+  if (a_start != b_start) {
+    return a_start < b_start ? -1 : 1;
+  }
+  return (uintptr_t)a->node.id < (uintptr_t)b->node.id ? -1 : 1;
+}
+
+static int32_t syntax_node_hash(void* p, size_t len) {
+  (void)len;
+  syntax_node* node = (syntax_node*)p;
+  uintptr_t id = (uintptr_t)node->node.id ^ (uintptr_t)node->tree;
+  return (int32_t)(id ^ (id >> 32));
+}
+
+static Janet wrap_node(syntax_tree* tree, TSNode node) {
+  if (ts_node_is_null(node)) {
+    return janet_wrap_nil();
+  }
+  syntax_node* wrapped =
+      (syntax_node*)janet_abstract(&syntax_node_type, sizeof(syntax_node));
+  wrapped->node = node;
+  wrapped->tree = tree;
+  return janet_wrap_abstract(wrapped);
+}
+
+// Takes ownership of both the tree and the source.
+Janet syntax_tree_wrap(TSTree* tree, sds src) {
+  START_ZONE;
+  syntax_tree* wrapped =
+      (syntax_tree*)janet_abstract(&syntax_tree_type, sizeof(syntax_tree));
+  wrapped->tree = tree;
+  wrapped->src = src;
+  END_ZONE;
+  return janet_wrap_abstract(wrapped);
+}
+
+static Janet cfun_node_root(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  syntax_tree* tree = janet_getabstract(argv, 0, &syntax_tree_type);
+  return wrap_node(tree, ts_tree_root_node(tree->tree));
+}
+
+static Janet cfun_node_type(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  return janet_cstringv(ts_node_type(node->node));
+}
+
+static Janet cfun_node_children(int32_t argc, Janet* argv) {
+  janet_arity(argc, 1, 2);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  bool named = janet_optboolean(argv, argc, 1, false);
+  uint32_t count = named ? ts_node_named_child_count(node->node)
+                         : ts_node_child_count(node->node);
+  JanetArray* children = janet_array(count);
+  for (uint32_t i = 0; i < count; i += 1) {
+    TSNode child = named ? ts_node_named_child(node->node, i)
+                         : ts_node_child(node->node, i);
+    janet_array_push(children, wrap_node(node->tree, child));
+  }
+  return janet_wrap_array(children);
+}
+
+static Janet cfun_node_parent(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  return wrap_node(node->tree, ts_node_parent(node->node));
+}
+
+static Janet cfun_node_named_child(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 2);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  int32_t index = janet_getnat(argv, 1);
+  return wrap_node(node->tree, ts_node_named_child(node->node, index));
+}
+
+static Janet cfun_node_field(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 2);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  JanetByteView field = janet_getbytes(argv, 1);
+  TSNode child = ts_node_child_by_field_name(
+      node->node, (char const*)field.bytes, field.len);
+  return wrap_node(node->tree, child);
+}
+
+static Janet cfun_node_text(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  uint32_t start_byte = ts_node_start_byte(node->node);
+  uint32_t end_byte = ts_node_end_byte(node->node);
+  return janet_stringv((uint8_t*)node->tree->src + start_byte,
+                       end_byte - start_byte);
+}
+
+// Lines are 1-based to line up with core/src-slice, columns are byte
+// offsets into the line.
+static Janet cfun_node_range(int32_t argc, Janet* argv) {
+  janet_fixarity(argc, 1);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  TSPoint start = ts_node_start_point(node->node);
+  TSPoint end = ts_node_end_point(node->node);
+  JanetKV* range = janet_struct_begin(6);
+  janet_struct_put(range, janet_ckeywordv("start-byte"),
+                   janet_wrap_number(ts_node_start_byte(node->node)));
+  janet_struct_put(range, janet_ckeywordv("end-byte"),
+                   janet_wrap_number(ts_node_end_byte(node->node)));
+  janet_struct_put(range, janet_ckeywordv("start-line"),
+                   janet_wrap_number(start.row + 1));
+  janet_struct_put(range, janet_ckeywordv("start-column"),
+                   janet_wrap_number(start.column));
+  janet_struct_put(range, janet_ckeywordv("end-line"),
+                   janet_wrap_number(end.row + 1));
+  janet_struct_put(range, janet_ckeywordv("end-column"),
+                   janet_wrap_number(end.column));
+  return janet_wrap_struct(janet_struct_end(range));
+}
+
+// Runs a query under node against the tree it came from, nothing is parsed
+// again and the compiled query is shared through the session cache.
+static Janet cfun_node_query(int32_t argc, Janet* argv) {
+  janet_arity(argc, 2, 3);
+  syntax_node* node = janet_getabstract(argv, 0, &syntax_node_type);
+  JanetString query_string = janet_getstring(argv, 1);
+  query_budget budget = budget_from_options(argv, argc, 2);
+  sds query_sds = sdsnewlen(query_string, janet_string_length(query_string));
+  TSLanguage* lang = (TSLanguage*)ts_tree_language(node->tree->tree);
+  TSQuery* query = cache_acquire_query(lang, query_sds);
+  sdsfree(query_sds);
+  if (!query) {
+    janet_panicf("failed in creating query");
+  }
+  budget_begin(&budget);
+  TSQueryCursor* cursor = ts_query_cursor_new();
+  budget_apply_cursor(cursor);
+  ts_query_cursor_exec(cursor, query, node->node);
+  JanetArray* captures = janet_array(0);
+  TSQueryMatch match = {0};
+  uint64_t scanned = 0;
+  while (budget_check() == BUDGET_OK &&
+         ts_query_cursor_next_match(cursor, &match)) {
+    scanned += 1;
+    for (uint16_t i = 0; i < match.capture_count; i += 1) {
+      janet_array_push(captures,
+                       wrap_node(node->tree, match.captures[i].node));
+    }
+  }
+  profile_add_matches(scanned, (uint64_t)captures->count);
+  ts_query_cursor_delete(cursor);
+  cache_release_query(query);
+  budget_status status = budget_end();
+  if (status != BUDGET_OK) {
+    janet_panicf("%s", budget_status_text(status));
+  }
+  return janet_wrap_array(captures);
+}
+
+static const JanetReg node_cfuns[] = {
+    {"root", cfun_node_root, "(node/root tree)\n\nRoot node of a parsed tree."},
+    {"type", cfun_node_type, "(node/type node)\n\nGrammar type of node."},
+    {"children", cfun_node_children,
+     "(node/children node &opt named)\n\nChildren of node, only the named "
+     "ones when named is true."},
+    {"parent", cfun_node_parent,
+     "(node/parent node)\n\nParent of node, nil at the root."},
+    {"named-child", cfun_node_named_child,
+     "(node/named-child node index)\n\nNamed child of node at index, nil when "
+     "out of range."},
+    {"field", cfun_node_field,
+     "(node/field node name)\n\nChild of node under the grammar field name, "
+     "nil when absent."},
+    {"text", cfun_node_text, "(node/text node)\n\nSource text of node."},
+    {"range", cfun_node_range,
+     "(node/range node)\n\nByte offsets, lines and columns spanned by node."},
+    {"query", cfun_node_query,
+     "(node/query node query &opt opts)\n\nRun a tree-sitter query under "
+     "node and return the captured nodes. opts are the same as for "
+     "c/tree-sitter-query."},
+    {(void*)0, (void*)0, (void*)0},
+};
+
+void register_node_module(JanetTable* env) {
+  lisp_register_module(env, "node", node_cfuns);
+}
+
+#ifdef UNIT_TEST_SYNTAX_TREE
+
+#include "test_deps/utest.h"
+#include "tree_sitter.h"
+
+TSLanguage* tree_sitter_c();
+
+UTEST(syntax_tree, navigate) {
+  lisp_init_vm();
+  sds src = sdsnew("int add(int a, int b) { return a + b; }\n");
+  TSParser* parser = create_parser(tree_sitter_c());
+  Janet tree = syntax_tree_wrap(parse_string(parser, src), src);
+  ts_parser_delete(parser);
+  Janet root = cfun_node_root(1, &tree);
+  Janet def_args[2] = {root, janet_wrap_integer(0)};
+  Janet def = cfun_node_named_child(2, def_args);
+  ASSERT_STREQ("function_definition",
+               (char const*)janet_unwrap_string(cfun_node_type(1, &def)));
+  Janet decl_args[2] = {def, janet_cstringv("declarator")};
+  Janet decl = cfun_node_field(2, decl_args);
+  Janet name_args[2] = {decl, janet_wrap_integer(0)};
+  Janet name = cfun_node_named_child(2, name_args);
+  ASSERT_STREQ("add",
+               (char const*)janet_unwrap_string(cfun_node_text(1, &name)));
+  ASSERT_TRUE(janet_equals(decl, cfun_node_parent(1, &name)));
+  lisp_terminate();
+}
+
+UTEST_MAIN();
+
+#endif
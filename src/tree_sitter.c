@@ -3,12 +3,39 @@
 #include <deps/stb_ds.h>
 #include <sds.h>
 #include <stdbool.h>
+#include <string.h>
 #include <tree_sitter/api.h>
 
+#include "arena.h"
+#include "budget.h"
+#include "metrics.h"
+#include "profile.h"
 #include "trace.h"
+#include "ts_alloc.h"
 
 INIT_TRACE;
 
+static void warn_match_limit(TSQueryCursor* cursor);
+static void record_parse_allocations(ts_alloc_stats before);
+
+// Matches dropped because of the match limit are not an error, the query
+// still returns everything it found.
+static void warn_match_limit(TSQueryCursor* cursor) {
+  if (ts_query_cursor_did_exceed_match_limit(cursor)) {
+    message_warn("tree_sitter::query exceeded the match limit, some matches "
+                 "were dropped");
+  }
+}
+
+// Only what the parse itself allocated is counted, the pool totals of the
+// thread are diffed around it.
+static void record_parse_allocations(ts_alloc_stats before) {
+  ts_alloc_stats after = ts_alloc_thread_stats();
+  metrics_add(METRIC_PARSE_ALLOCATIONS, after.allocations - before.allocations);
+  metrics_add(METRIC_PARSE_ALLOCATED_BYTES, after.bytes - before.bytes);
+  metrics_add(METRIC_PARSE_POOL_REUSES, after.reuses - before.reuses);
+}
+
 TSParser* create_parser(TSLanguage* lang) {
   START_ZONE;
   TSParser* parser = ts_parser_new();
@@ -26,148 +53,194 @@ error_end:
 }
 
 TSTree* parse_string(TSParser* parser, sds src) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_PARSE);
+  budget_apply_parser(parser);
+  ts_alloc_stats before = ts_alloc_thread_stats();
   TSTree* tree = ts_parser_parse_string(parser, (void*)0, src, sdslen(src));
+  record_parse_allocations(before);
   if (!tree) {
+    // A parse stopped by the budget would otherwise resume on the next call.
+    ts_parser_reset(parser);
+    budget_status status = budget_check();
+    if (status != BUDGET_OK) {
+      log_error("tree_sitter::parse_string stopped parsing: %s",
+                budget_status_text(status));
+      goto error_end;
+    }
     log_fatal("tree_sitter::parse_string failed in parsing src: %s", src);
     goto error_end;
   }
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_PARSE);
   return tree;
 error_end:
   ts_tree_delete(tree);
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_PARSE);
   return (void*)0;
 }
 
-sds* query_tree(sds src, TSLanguage* lang, TSTree* tree, sds query_string) {
-  START_ZONE;
-  sds* s_arr = (void*)0;
-  TSQueryCursor* cursor = (void*)0;
-  TSQuery* query = (void*)0;
-  TSNode root_node = ts_tree_root_node(tree);
+TSQuery* create_query(TSLanguage* lang, sds query_string) {
+  START_PHASE_ZONE(PROFILE_QUERY_COMPILE);
   TSQueryError err = {0};
   uint32_t err_offset = 0;
-  query =
+  TSQuery* query =
       ts_query_new(lang, query_string, sdslen(query_string), &err_offset, &err);
+  metrics_add(METRIC_QUERY_COMPILES, 1);
   if (!query) {
     switch (err) {
       case TSQueryErrorSyntax:
         log_fatal(
-            "tree_sitter::query_tree syntax error in query: %s at byte offset: "
-            "%u",
+            "tree_sitter::create_query syntax error in query: %s at byte "
+            "offset: %u",
             query_string, err_offset);
         break;
       default:
-        message_fatal("tree_sitter::query_tree failed in creating query");
+        message_fatal("tree_sitter::create_query failed in creating query");
         break;
     }
-    goto error_end;
   }
-  cursor = ts_query_cursor_new();
+  END_PHASE_ZONE(PROFILE_QUERY_COMPILE);
+  return query;
+}
+
+// The captures are copied into the scratch arena, the caller frees only the
+// array.
+sds* query_tree(sds src, TSQuery* query, TSTree* tree) {
+  START_PHASE_ZONE(PROFILE_QUERY);
+  sds* s_arr = (void*)0;
+  TSNode root_node = ts_tree_root_node(tree);
+  TSQueryCursor* cursor = ts_query_cursor_new();
   if (!cursor) {
     message_fatal("tree_sitter::query_tree failed in creating cursor");
     goto error_end;
   }
+  budget_apply_cursor(cursor);
   ts_query_cursor_exec(cursor, query, root_node);
   TSQueryMatch match = {0};
   bool matches_remain = false;
+  uint64_t scanned = 0;
   do {
-    matches_remain = ts_query_cursor_next_match(cursor, &match);
+    matches_remain = budget_check() == BUDGET_OK &&
+                     ts_query_cursor_next_match(cursor, &match);
+    scanned += matches_remain;
     if (matches_remain && (match.capture_count != 0)) {
-      sds captured_src = sdscatsds(sdsempty(), src);
       TSNode captured_node = match.captures->node;
       uint32_t start_byte = ts_node_start_byte(captured_node);
       uint32_t end_byte = ts_node_end_byte(captured_node);
-      sdsrange(captured_src, start_byte, end_byte - 1);
+      sds captured_src = arena_sdsnewlen(scratch_arena(), src + start_byte,
+                                         end_byte - start_byte);
+      profile_add_bytes(PROFILE_QUERY, end_byte - start_byte);
       arrput(s_arr, captured_src);
     }
   } while (matches_remain);
-  ts_query_delete(query);
+  profile_add_matches(scanned, arrlen(s_arr));
+  warn_match_limit(cursor);
   ts_query_cursor_delete(cursor);
-  END_ZONE;
+  if (budget_check() != BUDGET_OK) {
+    arrfree(s_arr);
+    goto error_end;
+  }
+  END_PHASE_ZONE(PROFILE_QUERY);
   return s_arr;
 error_end:
-  ts_query_delete(query);
-  ts_query_cursor_delete(cursor);
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_QUERY);
   return (void*)0;
 }
 
-sds query_filter_tree(sds src, TSLanguage* lang, TSTree* tree, sds query_string,
+sds query_filter_tree(sds src, TSQuery* query, TSTree* tree,
                       char const* filter_string, int filter_index) {
-  START_ZONE;
+  START_PHASE_ZONE(PROFILE_QUERY);
   sds return_src = (void*)0;
-  sds filter_src = (void*)0;
-  sds filter_string_sds = sdsnew(filter_string);
-  TSQueryCursor* cursor = (void*)0;
-  TSQuery* query = (void*)0;
+  size_t filter_len = strlen(filter_string);
   TSNode root_node = ts_tree_root_node(tree);
-  TSQueryError err = {0};
-  uint32_t err_offset = 0;
-  query =
-      ts_query_new(lang, query_string, sdslen(query_string), &err_offset, &err);
-  if (!query) {
-    switch (err) {
-      case TSQueryErrorSyntax:
-        log_fatal(
-            "tree_sitter::query_filter_tree syntax error in query: %s at byte "
-            "offset: "
-            "%u",
-            query_string, err_offset);
-        break;
-      default:
-        message_fatal(
-            "tree_sitter::query_filter_tree failed in creating query");
-        break;
-    }
-    goto error_end;
-  }
-  cursor = ts_query_cursor_new();
+  TSQueryCursor* cursor = ts_query_cursor_new();
   if (!cursor) {
     message_fatal("tree_sitter::query_filter_tree failed in creating cursor");
     goto error_end;
   }
+  budget_apply_cursor(cursor);
   ts_query_cursor_exec(cursor, query, root_node);
   TSQueryMatch match = {0};
   bool matches_remain = false;
+  uint64_t scanned = 0;
   do {
-    matches_remain = ts_query_cursor_next_match(cursor, &match);
+    matches_remain = budget_check() == BUDGET_OK &&
+                     ts_query_cursor_next_match(cursor, &match);
+    scanned += matches_remain;
     if (matches_remain && (match.capture_count == 2)) {
-      filter_src = sdscatsds(sdsempty(), src);
+      // The filter capture is compared in place, only the match is copied.
       TSNode filter_node = match.captures[filter_index].node;
       uint32_t f_start_byte = ts_node_start_byte(filter_node);
       uint32_t f_end_byte = ts_node_end_byte(filter_node);
-      sdsrange(filter_src, f_start_byte, f_end_byte - 1);
-      if (sdscmp(filter_src, filter_string_sds) == 0) {
-        return_src = sdscatsds(sdsempty(), src);
+      if ((f_end_byte - f_start_byte == filter_len) &&
+          memcmp(src + f_start_byte, filter_string, filter_len) == 0) {
         TSNode return_node = match.captures[!filter_index].node;
         uint32_t r_start_byte = ts_node_start_byte(return_node);
         uint32_t r_end_byte = ts_node_end_byte(return_node);
-        sdsrange(return_src, r_start_byte, r_end_byte - 1);
+        return_src = sdsnewlen(src + r_start_byte, r_end_byte - r_start_byte);
+        profile_add_bytes(PROFILE_QUERY, r_end_byte - r_start_byte);
         break;
       }
     }
   } while (matches_remain);
-  sdsfree(filter_src);
-  sdsfree(filter_string_sds);
-  ts_query_delete(query);
+  profile_add_matches(scanned, return_src != (void*)0);
+  warn_match_limit(cursor);
   ts_query_cursor_delete(cursor);
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_QUERY);
   return return_src;
 error_end:
-  ts_query_delete(query);
-  ts_query_cursor_delete(cursor);
-  END_ZONE;
+  END_PHASE_ZONE(PROFILE_QUERY);
   return (void*)0;
 }
 
+// Walks the whole tree, this tree-sitter does not keep descendant counts.
+uint64_t tree_node_count(TSTree* tree) {
+  START_ZONE;
+  TSTreeCursor cursor = ts_tree_cursor_new(ts_tree_root_node(tree));
+  uint64_t count = 1;
+  bool done = false;
+  while (!done) {
+    if (ts_tree_cursor_goto_first_child(&cursor) ||
+        ts_tree_cursor_goto_next_sibling(&cursor)) {
+      count += 1;
+      continue;
+    }
+    // Climb back up until a parent has a next sibling, or the root is hit.
+    while (true) {
+      if (!ts_tree_cursor_goto_parent(&cursor)) {
+        done = true;
+        break;
+      }
+      if (ts_tree_cursor_goto_next_sibling(&cursor)) {
+        count += 1;
+        break;
+      }
+    }
+  }
+  ts_tree_cursor_delete(&cursor);
+  END_ZONE;
+  return count;
+}
+
 #ifdef UNIT_TEST_TREE_SITTER
 
 #include "test_deps/utest.h"
 
 UTEST(tree_sitter, sample_test) { ASSERT_TRUE(true); }
 
+TSLanguage* tree_sitter_c();
+
+UTEST(tree_sitter, node_count) {
+  TSParser* parser = create_parser(tree_sitter_c());
+  sds src = sdsnew("int x;");
+  TSTree* tree = parse_string(parser, src);
+  ASSERT_TRUE(tree != (void*)0);
+  // translation_unit, declaration, primitive_type, identifier and ;
+  ASSERT_EQ(tree_node_count(tree), (uint64_t)5);
+  ts_tree_delete(tree);
+  ts_parser_delete(parser);
+  sdsfree(src);
+}
+
 UTEST_MAIN();
 
 #endif
@@ -0,0 +1,240 @@
+#include "ts_alloc.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "trace.h"
+
+INIT_TRACE;
+
+// Size classes are powers of two from 16 bytes to 4 KiB, which covers
+// subtrees, stack nodes and the small arrays tree-sitter keeps growing.
+// Bigger blocks go straight to the heap.
+#define TS_POOL_MIN_SHIFT 4
+#define TS_POOL_NUM_CLASSES 9
+#define TS_POOL_OVERSIZED TS_POOL_NUM_CLASSES
+// Freed blocks past this many bytes per thread are given back to the heap,
+// where they are accounted under HEAP_TREE_SITTER along with the cached ones.
+#define TS_POOL_MAX_CACHED_BYTES (32 * 1024 * 1024)
+
+typedef struct block_header block_header;
+struct block_header {
+  _Alignas(16) uint32_t size_class;
+};
+
+typedef struct free_block free_block;
+struct free_block {
+  free_block* next;
+};
+
+typedef struct thread_pool thread_pool;
+struct thread_pool {
+  free_block* free_lists[TS_POOL_NUM_CLASSES];
+  size_t cached_bytes;
+  ts_alloc_stats stats;
+};
+
+static size_t class_size(uint32_t size_class);
+static uint32_t size_class_of(size_t size);
+static void out_of_memory(size_t size);
+static void release_blocks(void);
+static void release_at_exit(void* unused);
+static void create_exit_key(void);
+
+// Every thread frees into and allocates from its own lists, so parsers on
+// different threads never contend on a lock. A block freed on another thread
+// than the one that allocated it simply joins the lists of the freeing one.
+static _Thread_local thread_pool pool = {0};
+
+// Threads that never start a VM, or that janet starts for ev/thread, do not
+// go through lisp_terminate, so the first block a thread caches also arms a
+// destructor that hands its lists back when the thread exits.
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local bool exit_armed = false;
+
+static void create_exit_key(void) {
+  pthread_key_create(&exit_key, release_at_exit);
+}
+
+static void release_at_exit(void* unused) {
+  (void)unused;
+  release_blocks();
+}
+
+static size_t class_size(uint32_t size_class) {
+  return (size_t)1 << (TS_POOL_MIN_SHIFT + size_class);
+}
+
+static uint32_t size_class_of(size_t size) {
+  uint32_t size_class = 0;
+  while (size_class < TS_POOL_NUM_CLASSES && size > class_size(size_class)) {
+    size_class += 1;
+  }
+  return size_class;
+}
+
+// tree-sitter has no way to recover from a failed allocation either, its
+// default allocator exits as well.
+static void out_of_memory(size_t size) {
+  log_fatal("ts_alloc::scribe_ts_calloc failed in allocating %zu bytes", size);
+  exit(1);
+}
+
+void* scribe_ts_malloc(size_t size) {
+  uint32_t size_class = size_class_of(size);
+  pool.stats.allocations += 1;
+  pool.stats.bytes += size;
+  block_header* header = (void*)0;
+  if (size_class < TS_POOL_NUM_CLASSES && pool.free_lists[size_class]) {
+    free_block* block = pool.free_lists[size_class];
+    pool.free_lists[size_class] = block->next;
+    pool.cached_bytes -= class_size(size_class);
+    pool.stats.reuses += 1;
+    header = (block_header*)block - 1;
+  } else {
+    size_t payload =
+        size_class < TS_POOL_NUM_CLASSES ? class_size(size_class) : size;
+    header = heap_malloc(HEAP_TREE_SITTER, sizeof(block_header) + payload);
+  }
+  header->size_class = size_class;
+  return header + 1;
+}
+
+void* scribe_ts_calloc(size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) {
+    out_of_memory(SIZE_MAX);
+  }
+  void* buffer = scribe_ts_malloc(count * size);
+  memset(buffer, 0, count * size);
+  return buffer;
+}
+
+// Growing within a size class is free, which is most of the array growth
+// during a parse.
+void* scribe_ts_realloc(void* buffer, size_t size) {
+  if (!buffer) {
+    return scribe_ts_malloc(size);
+  }
+  block_header* header = (block_header*)buffer - 1;
+  if (header->size_class == TS_POOL_OVERSIZED) {
+    pool.stats.allocations += 1;
+    pool.stats.bytes += size;
+    header = heap_realloc(HEAP_TREE_SITTER, header,
+                          sizeof(block_header) + size);
+    return header + 1;
+  }
+  if (size <= class_size(header->size_class)) {
+    return buffer;
+  }
+  void* moved = scribe_ts_malloc(size);
+  memcpy(moved, buffer, class_size(header->size_class));
+  scribe_ts_free(buffer);
+  return moved;
+}
+
+void scribe_ts_free(void* buffer) {
+  if (!buffer) {
+    return;
+  }
+  block_header* header = (block_header*)buffer - 1;
+  uint32_t size_class = header->size_class;
+  if (size_class == TS_POOL_OVERSIZED ||
+      pool.cached_bytes + class_size(size_class) > TS_POOL_MAX_CACHED_BYTES) {
+    heap_free(HEAP_TREE_SITTER, header);
+    return;
+  }
+  if (!exit_armed) {
+    pthread_once(&exit_key_once, create_exit_key);
+    pthread_setspecific(exit_key, &pool);
+    exit_armed = true;
+  }
+  free_block* block = buffer;
+  block->next = pool.free_lists[size_class];
+  pool.free_lists[size_class] = block;
+  pool.cached_bytes += class_size(size_class);
+}
+
+// Totals for the calling thread since it started, callers diff two of them.
+ts_alloc_stats ts_alloc_thread_stats(void) { return pool.stats; }
+
+// Gives the cached blocks of the calling thread back to the heap.
+void ts_alloc_release(void) {
+  START_ZONE;
+  release_blocks();
+  END_ZONE;
+}
+
+// No zone here, the destructor runs while the thread is being torn down.
+static void release_blocks(void) {
+  for (uint32_t i = 0; i < TS_POOL_NUM_CLASSES; i += 1) {
+    free_block* block = pool.free_lists[i];
+    while (block) {
+      free_block* next = block->next;
+      heap_free(HEAP_TREE_SITTER, (block_header*)block - 1);
+      block = next;
+    }
+    pool.free_lists[i] = (void*)0;
+  }
+  pool.cached_bytes = 0;
+}
+
+#ifdef UNIT_TEST_TS_ALLOC
+
+#include "test_deps/utest.h"
+
+UTEST(ts_alloc, freed_blocks_are_reused) {
+  void* first = scribe_ts_malloc(40);
+  ASSERT_TRUE(((uintptr_t)first % 16) == 0);
+  scribe_ts_free(first);
+  ts_alloc_stats before = ts_alloc_thread_stats();
+  void* second = scribe_ts_malloc(64);
+  ASSERT_TRUE(second == first);
+  ts_alloc_stats after = ts_alloc_thread_stats();
+  ASSERT_EQ(after.allocations - before.allocations, (size_t)1);
+  ASSERT_EQ(after.bytes - before.bytes, (size_t)64);
+  ASSERT_EQ(after.reuses - before.reuses, (size_t)1);
+  scribe_ts_free(second);
+  ts_alloc_release();
+}
+
+UTEST(ts_alloc, realloc_keeps_contents) {
+  char* buffer = scribe_ts_calloc(4, 4);
+  for (int i = 0; i < 16; i += 1) {
+    ASSERT_EQ(buffer[i], 0);
+  }
+  memcpy(buffer, "scribe", 7);
+  ASSERT_TRUE(scribe_ts_realloc(buffer, 12) == buffer);
+  buffer = scribe_ts_realloc(buffer, 1000);
+  ASSERT_STREQ(buffer, "scribe");
+  buffer = scribe_ts_realloc(buffer, 100000);
+  ASSERT_STREQ(buffer, "scribe");
+  buffer = scribe_ts_realloc(buffer, 200000);
+  ASSERT_STREQ(buffer, "scribe");
+  scribe_ts_free(buffer);
+  scribe_ts_free((void*)0);
+  ts_alloc_release();
+}
+
+static void* cache_one_block(void* unused) {
+  (void)unused;
+  scribe_ts_free(scribe_ts_malloc(100));
+  return (void*)0;
+}
+
+UTEST(ts_alloc, exiting_thread_gives_blocks_back) {
+  heap_enable();
+  size_t before = heap_tag_stats(HEAP_TREE_SITTER).live_bytes;
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, (void*)0, cache_one_block, (void*)0), 0);
+  ASSERT_EQ(pthread_join(thread, (void*)0), 0);
+  ASSERT_EQ(heap_tag_stats(HEAP_TREE_SITTER).live_bytes, before);
+}
+
+UTEST_MAIN();
+
+#endif
@@ -151,7 +151,8 @@ struct JanetVM {
 
     /* If this flag is true, suspend on function calls and backwards jumps.
      * When this occurs, this flag will be reset to 0. */
-    int auto_suspend;
+    /* scribe: set from a signal handler, volatile so tight loops reload it. */
+    volatile int auto_suspend;
 
     /* The current running fiber on the current thread.
      * Set and unset by janet_run. */
@@ -9267,7 +9268,8 @@ void janet_ev_default_threaded_callback(JanetEVGenericMessage return_value) {
         case JANET_EV_TCTAG_STRING:
         case JANET_EV_TCTAG_STRINGF:
             janet_schedule(return_value.fiber, janet_cstringv((const char *) return_value.argp));
-            if (return_value.tag == JANET_EV_TCTAG_STRINGF) janet_free(return_value.argp);
+            /* scribe: STRINGF payloads come from malloc/strdup, not janet_malloc. */
+            if (return_value.tag == JANET_EV_TCTAG_STRINGF) free(return_value.argp);
             break;
         case JANET_EV_TCTAG_KEYWORD:
             janet_schedule(return_value.fiber, janet_ckeywordv((const char *) return_value.argp));
@@ -9275,7 +9277,8 @@ void janet_ev_default_threaded_callback(JanetEVGenericMessage return_value) {
         case JANET_EV_TCTAG_ERR_STRING:
         case JANET_EV_TCTAG_ERR_STRINGF:
             janet_cancel(return_value.fiber, janet_cstringv((const char *) return_value.argp));
-            if (return_value.tag == JANET_EV_TCTAG_STRINGF) janet_free(return_value.argp);
+            /* scribe: ev/thread strdups the error text, free it with free. */
+            if (return_value.tag == JANET_EV_TCTAG_ERR_STRINGF) free(return_value.argp);
             break;
         case JANET_EV_TCTAG_ERR_KEYWORD:
             janet_cancel(return_value.fiber, janet_ckeywordv((const char *) return_value.argp));
@@ -16891,7 +16894,8 @@ JANET_CORE_FN(os_spawn,
 /* Runs in a separate thread */
 static JanetEVGenericMessage os_shell_subr(JanetEVGenericMessage args) {
     int stat = system((const char *) args.argp);
-    janet_free(args.argp);
+    /* scribe: argp comes from strdup, not janet_malloc. */
+    free(args.argp);
     if (args.argi) {
         args.tag = JANET_EV_TCTAG_INTEGER;
     } else {
@@ -17752,7 +17756,8 @@ JANET_CORE_FN(os_realpath,
 #endif
     if (NULL == dest) janet_panicf("%s: %s", strerror(errno), src);
     Janet ret = janet_cstringv(dest);
-    janet_free(dest);
+    /* scribe: realpath allocates with malloc, not janet_malloc. */
+    free(dest);
     return ret;
 #endif
 }
@@ -28160,46 +28165,58 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in) {
     stack[E] = stack[A];
     vm_pcnext();
 
-    VM_OP(JOP_JUMP)
-    pc += DS;
-    vm_maybe_auto_suspend(DS < 0);
-    vm_next();
+    /* scribe: the offset is read before pc moves, afterwards DS and ES
+     * decode the instruction jumped to and backward jumps never suspend. */
+    VM_OP(JOP_JUMP) {
+        int32_t offset = DS;
+        pc += offset;
+        vm_maybe_auto_suspend(offset < 0);
+        vm_next();
+    }
 
-    VM_OP(JOP_JUMP_IF)
-    if (janet_truthy(stack[A])) {
-        pc += ES;
-        vm_maybe_auto_suspend(ES < 0);
-    } else {
-        pc++;
+    VM_OP(JOP_JUMP_IF) {
+        int32_t offset = ES;
+        if (janet_truthy(stack[A])) {
+            pc += offset;
+            vm_maybe_auto_suspend(offset < 0);
+        } else {
+            pc++;
+        }
+        vm_next();
     }
-    vm_next();
 
-    VM_OP(JOP_JUMP_IF_NOT)
-    if (janet_truthy(stack[A])) {
-        pc++;
-    } else {
-        pc += ES;
-        vm_maybe_auto_suspend(ES < 0);
+    VM_OP(JOP_JUMP_IF_NOT) {
+        int32_t offset = ES;
+        if (janet_truthy(stack[A])) {
+            pc++;
+        } else {
+            pc += offset;
+            vm_maybe_auto_suspend(offset < 0);
+        }
+        vm_next();
     }
-    vm_next();
 
-    VM_OP(JOP_JUMP_IF_NIL)
-    if (janet_checktype(stack[A], JANET_NIL)) {
-        pc += ES;
-        vm_maybe_auto_suspend(ES < 0);
-    } else {
-        pc++;
+    VM_OP(JOP_JUMP_IF_NIL) {
+        int32_t offset = ES;
+        if (janet_checktype(stack[A], JANET_NIL)) {
+            pc += offset;
+            vm_maybe_auto_suspend(offset < 0);
+        } else {
+            pc++;
+        }
+        vm_next();
     }
-    vm_next();
 
-    VM_OP(JOP_JUMP_IF_NOT_NIL)
-    if (janet_checktype(stack[A], JANET_NIL)) {
-        pc++;
-    } else {
-        pc += ES;
-        vm_maybe_auto_suspend(ES < 0);
+    VM_OP(JOP_JUMP_IF_NOT_NIL) {
+        int32_t offset = ES;
+        if (janet_checktype(stack[A], JANET_NIL)) {
+            pc++;
+        } else {
+            pc += offset;
+            vm_maybe_auto_suspend(offset < 0);
+        }
+        vm_next();
     }
-    vm_next();
 
     VM_OP(JOP_LESS_THAN)
     vm_compop( <);
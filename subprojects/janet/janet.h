@@ -74,11 +74,12 @@
 /* #define JANET_NO_INTERPRETER_INTERRUPT */
 
 /* Custom vm allocator support */
-/* #include <mimalloc.h> */
-/* #define janet_malloc(X) mi_malloc((X)) */
-/* #define janet_realloc(X, Y) mi_realloc((X), (Y)) */
-/* #define janet_calloc(X, Y) mi_calloc((X), (Y)) */
-/* #define janet_free(X) mi_free((X)) */
+/* scribe accounts janet memory under HEAP_JANET, see include/heap.h. */
+#include <heap.h>
+#define janet_malloc(X) heap_malloc(HEAP_JANET, (X))
+#define janet_realloc(X, Y) heap_realloc(HEAP_JANET, (X), (Y))
+#define janet_calloc(X, Y) heap_calloc(HEAP_JANET, (X), (Y))
+#define janet_free(X) heap_free(HEAP_JANET, (X))
 
 /* Main client settings, does not affect library code */
 /* #define JANET_SIMPLE_GETLINE */
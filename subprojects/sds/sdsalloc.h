@@ -37,6 +37,8 @@
  * the include of your alternate allocator if needed (not needed in order
  * to use the default libc allocator). */
 
-#define s_malloc malloc
-#define s_realloc realloc
-#define s_free free
+/* scribe accounts sds memory under HEAP_SDS, see include/heap.h. */
+#include "heap.h"
+#define s_malloc(size) heap_malloc(HEAP_SDS, (size))
+#define s_realloc(ptr, size) heap_realloc(HEAP_SDS, (ptr), (size))
+#define s_free(ptr) heap_free(HEAP_SDS, (ptr))